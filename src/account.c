@@ -47,6 +47,59 @@
 #include "account.h"
 #include "protocol.h"
 
+/**
+ * \var g_hash_seed
+ * \brief Seed of the hash function used by the account index.
+ */
+static uint32_t g_hash_seed = 0;
+
+/**
+ * \var g_username_index
+ * \brief Accounts indexed by username.
+ */
+static struct hash_table g_username_index;
+
+void account_set_hash_seed(uint32_t seed)
+{
+  g_hash_seed = seed;
+}
+
+/**
+ * \brief Hash a username.
+ *
+ * Only the part of the username kept in an account_desc is hashed.
+ * \param username username
+ * \return hash
+ */
+static uint32_t account_username_hash(const char* username)
+{
+  size_t len = strlen(username);
+
+  if(len > sizeof(((struct account_desc*)NULL)->username) - 1)
+  {
+    len = sizeof(((struct account_desc*)NULL)->username) - 1;
+  }
+
+  return hash_bytes(username, len, g_hash_seed);
+}
+
+/**
+ * \brief Remove an account from the index.
+ *
+ * When all accounts are removed, memory of the index is released.
+ * \param desc account descriptor
+ */
+static void account_desc_unindex(struct account_desc* desc)
+{
+  hash_table_remove(&g_username_index, &desc->node);
+  desc->owner = NULL;
+
+  if(g_username_index.count == 0)
+  {
+    hash_table_free(&g_username_index);
+  }
+}
+
 struct account_desc* account_desc_new(const char* username,
     const char* password, const char* realm, enum account_state state)
 {
@@ -71,11 +124,24 @@ struct account_desc* account_desc_new(const char* username,
   /* set state */
   ret->state = state;
   ret->allocations = 0;
+  memset(&ret->bucket_up, 0x00, sizeof(struct token_bucket));
+  memset(&ret->bucket_down, 0x00, sizeof(struct token_bucket));
   ret->is_tmp = 0;
+  ret->reloaded = 0;
+  ret->owner = NULL;
+  list_head_init(&ret->list);
+  hash_node_init(&ret->node);
 
   turn_calculate_authentication_key(username, realm, password, ret->key,
       sizeof(ret->key));
 
+  if(crypto_hmac_sha1_key_init(&ret->hmac_key, ret->key,
+        sizeof(ret->key)) == -1)
+  {
+    free(ret);
+    return NULL;
+  }
+
   return ret;
 }
 
@@ -93,14 +159,22 @@ void account_desc_set_state(struct account_desc* desc, enum account_state state)
 struct account_desc* account_list_find(struct list_head* list,
     const char* username, const char* realm)
 {
+  uint32_t hash = account_username_hash(username);
+  struct list_head* bucket = hash_table_bucket(&g_username_index, hash);
   struct list_head* get = NULL;
-  struct list_head* n = NULL;
 
-  list_head_iterate_safe(list, get, n)
+  if(!bucket)
   {
-    struct account_desc* tmp = list_head_get(get, struct account_desc, list);
+    return NULL;
+  }
+
+  list_head_iterate(bucket, get)
+  {
+    struct account_desc* tmp = list_head_get(get, struct account_desc,
+        node.list);
 
-    if(!strncmp(tmp->username, username, sizeof(tmp->username) - 1))
+    if(tmp->node.hash == hash && tmp->owner == list &&
+       !strncmp(tmp->username, username, sizeof(tmp->username) - 1))
     {
       /* if realm is specified, try a match otherwise the peer is found */
       if(!realm || !strncmp(tmp->realm, realm, sizeof(tmp->realm) - 1))
@@ -123,6 +197,7 @@ void account_list_free(struct list_head* list)
   {
     struct account_desc* tmp = list_head_get(get, struct account_desc, list);
     list_head_remove(list, &tmp->list);
+    account_desc_unindex(tmp);
     account_desc_free(&tmp);
   }
 }
@@ -130,11 +205,61 @@ void account_list_free(struct list_head* list)
 void account_list_add(struct list_head* list, struct account_desc* desc)
 {
   list_head_add(list, &desc->list);
+  desc->owner = list;
+  hash_table_add(&g_username_index, &desc->node,
+      account_username_hash(desc->username));
 }
 
 void account_list_remove(struct list_head* list, struct account_desc* desc)
 {
   list_head_remove(list, &desc->list);
+  account_desc_unindex(desc);
+}
+
+void account_list_merge(struct list_head* list, struct list_head* reload,
+    struct list_head* removed)
+{
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+
+  /* update the accounts still present and add the new ones */
+  list_head_iterate_safe(reload, get, n)
+  {
+    struct account_desc* tmp = list_head_get(get, struct account_desc, list);
+    struct account_desc* found = account_list_find(list, tmp->username,
+        tmp->realm);
+
+    list_head_remove(reload, &tmp->list);
+
+    if(found)
+    {
+      memcpy(found->key, tmp->key, sizeof(found->key));
+      found->hmac_key = tmp->hmac_key;
+      found->state = tmp->state;
+      found->is_tmp = tmp->is_tmp;
+      found->reloaded = 1;
+      account_desc_free(&tmp);
+      continue;
+    }
+
+    tmp->reloaded = 1;
+    account_list_add(list, tmp);
+  }
+
+  /* the accounts not marked are not in the new list */
+  list_head_iterate_safe(list, get, n)
+  {
+    struct account_desc* tmp = list_head_get(get, struct account_desc, list);
+
+    if(tmp->reloaded)
+    {
+      tmp->reloaded = 0;
+      continue;
+    }
+
+    account_list_remove(list, tmp);
+    list_head_add(removed, &tmp->list);
+  }
 }
 
 int account_parse_file(struct list_head* list, const char* file)
@@ -221,7 +346,7 @@ int account_parse_file(struct list_head* list, const char* file)
       desc = account_desc_new(login, password, realm, state);
       if(desc)
       {
-        account_list_add(list, desc);
+        list_head_add(list, &desc->list);
       }
     }
 
@@ -43,7 +43,12 @@
 #include <config.h>
 #endif
 
+#include <stdint.h>
+
 #include "list.h"
+#include "hash_table.h"
+#include "token_bucket.h"
+#include "util_crypto.h"
 
 /**
  * \enum account_state
@@ -65,10 +70,18 @@ struct account_desc
   char username[514]; /**< Username */
   char realm[256]; /**< Realm */
   unsigned char key[16]; /**< MD5 hash */
+  struct crypto_hmac_sha1_key hmac_key; /**< Precomputed HMAC-SHA1 key */
   enum account_state state; /**< Access state */
   size_t allocations; /**< Number of allocations used */
+  struct token_bucket bucket_up; /**< Bandwidth limit of data received from
+                                   peers (all allocations) */
+  struct token_bucket bucket_down; /**< Bandwidth limit of data received from
+                                     client (all allocations) */
   int is_tmp; /**< If account is a temporary account */
+  int reloaded; /**< If account has been found by account_list_merge() */
   struct list_head list; /**< For list management */
+  struct list_head* owner; /**< List which contains the account */
+  struct hash_node node; /**< For username index */
 };
 
 /**
@@ -97,8 +110,18 @@ void account_desc_free(struct account_desc** desc);
  */
 void account_desc_set_state(struct account_desc* desc, enum account_state state);
 
+/**
+ * \brief Set the seed of the hash function used by the account index.
+ *
+ * It has to be called before any account is added to a list.
+ * \param seed random seed
+ */
+void account_set_hash_seed(uint32_t seed);
+
 /**
  * \brief Find a account with specified username and realm from a list.
+ *
+ * Accounts are indexed by username so that realm can be omitted.
  * \param list list of accounts
  * \param username
  * \param realm realm
@@ -127,11 +150,28 @@ void account_list_add(struct list_head* list, struct account_desc* desc);
  */
 void account_list_remove(struct list_head* list, struct account_desc* desc);
 
+/**
+ * \brief Merge a list of reloaded accounts in a list.
+ *
+ * Accounts of list which are also in reload are updated (key, state) and keep
+ * their descriptor since allocations use its bandwidth limits, new accounts
+ * are moved to list and accounts of list which are not in reload are moved
+ * to removed. It runs in linear time, reload is empty after the call.
+ * \param list list of accounts
+ * \param reload list of accounts filled by account_parse_file()
+ * \param removed list to put removed accounts in (caller has to free them)
+ */
+void account_list_merge(struct list_head* list, struct list_head* reload,
+    struct list_head* removed);
+
 /**
  * \brief Parse account file and fill up a list.
  *
  * Each lines of file MUST be: login:password:domain.org:state
  * In other words, the value is separated with a ':'
+ *
+ * Accounts are not indexed so that a file can be parsed by another thread,
+ * use account_list_merge() to add them to the list of the server.
  * \param list list of accounts
  * \param file account file
  * \return 0 if success, -1 if error
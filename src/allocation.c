@@ -48,7 +48,433 @@
 #include <netinet/in.h>
 
 #include "allocation.h"
-#include "turnserver.h"
+
+/**
+ * \var g_timer_wheel
+ * \brief Timer wheel used for the expiration of allocation objects.
+ */
+static struct timer_wheel* g_timer_wheel = NULL;
+
+/**
+ * \var g_pools
+ * \brief Pools of allocation objects (indexed by enum allocation_pool_type).
+ */
+static struct pool g_pools[ALLOCATION_POOL_MAX] =
+{
+  POOL_INITIALIZER("allocation", sizeof(struct allocation_desc)),
+  POOL_INITIALIZER("permission", sizeof(struct allocation_permission)),
+  POOL_INITIALIZER("channel", sizeof(struct allocation_channel)),
+  POOL_INITIALIZER("tcp_relay", sizeof(struct allocation_tcp_relay)),
+  POOL_INITIALIZER("token", sizeof(struct allocation_token))
+};
+
+/**
+ * \brief Arm or stop the expiration timer of an object.
+ * \param entry timer
+ * \param lifetime lifetime in seconds, 0 to stop the timer
+ */
+static void allocation_timer_set(struct timer_entry* entry, uint32_t lifetime)
+{
+  if(!g_timer_wheel)
+  {
+    return;
+  }
+
+  if(lifetime == 0)
+  {
+    timer_wheel_del(g_timer_wheel, entry);
+  }
+  else
+  {
+    timer_wheel_add(g_timer_wheel, entry, (uint64_t)lifetime * 1000);
+  }
+}
+
+/**
+ * \brief Stop the expiration timer of an object.
+ * \param entry timer
+ */
+static void allocation_timer_del(struct timer_entry* entry)
+{
+  if(g_timer_wheel)
+  {
+    timer_wheel_del(g_timer_wheel, entry);
+  }
+}
+
+void allocation_set_timer_wheel(struct timer_wheel* wheel)
+{
+  g_timer_wheel = wheel;
+}
+
+/**
+ * \var g_hash_seed
+ * \brief Seed of the hash function used by allocation indexes.
+ */
+static uint32_t g_hash_seed = 0;
+
+/**
+ * \var g_tuple_index
+ * \brief Allocations indexed by 5-tuple.
+ */
+static struct hash_table g_tuple_index;
+
+/**
+ * \var g_relayed_index
+ * \brief Allocations indexed by relayed address.
+ */
+static struct hash_table g_relayed_index;
+
+/**
+ * \var g_id_index
+ * \brief Allocations indexed by transaction ID of the Allocate request.
+ */
+static struct hash_table g_id_index;
+
+/**
+ * \var g_username_index
+ * \brief Allocations indexed by username and realm.
+ */
+static struct hash_table g_username_index;
+
+void allocation_set_hash_seed(uint32_t seed)
+{
+  g_hash_seed = seed;
+}
+
+int allocation_pool_reserve(enum allocation_pool_type type, size_t nb)
+{
+  return pool_reserve(&g_pools[type], nb);
+}
+
+const struct pool* allocation_pool_get(enum allocation_pool_type type)
+{
+  return &g_pools[type];
+}
+
+void allocation_pool_cleanup(void)
+{
+  size_t i = 0;
+
+  for(i = 0 ; i < ALLOCATION_POOL_MAX ; i++)
+  {
+    pool_destroy(&g_pools[i]);
+  }
+}
+
+/**
+ * \brief Compute the compact key of a transport address.
+ * \param key key to fill
+ * \param addr address and port
+ */
+static void allocation_addr_key_set(struct allocation_addr_key* key,
+    const struct sockaddr* addr)
+{
+  memset(key, 0x00, sizeof(struct allocation_addr_key));
+
+  if(addr->sa_family == AF_INET)
+  {
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+
+    key->family = AF_INET;
+    key->port = addr4->sin_port;
+    memcpy(key->addr, &addr4->sin_addr, 4);
+  }
+  else if(addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+
+    key->port = addr6->sin6_port;
+
+    if(IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+    {
+      key->family = AF_INET;
+      memcpy(key->addr, &addr6->sin6_addr.s6_addr[12], 4);
+    }
+    else
+    {
+      key->family = AF_INET6;
+      memcpy(key->addr, &addr6->sin6_addr, 16);
+    }
+  }
+}
+
+/**
+ * \brief Hash a 5-tuple.
+ * \param transport_protocol transport protocol
+ * \param server_key key of server address
+ * \param client_key key of client address
+ * \return hash
+ */
+static uint32_t allocation_tuple_hash(int transport_protocol,
+    const struct allocation_addr_key* server_key,
+    const struct allocation_addr_key* client_key)
+{
+  uint32_t hash = g_hash_seed ^ (uint32_t)transport_protocol;
+
+  hash = hash_bytes(client_key, sizeof(struct allocation_addr_key), hash);
+  return hash_bytes(server_key, sizeof(struct allocation_addr_key), hash);
+}
+
+/**
+ * \brief Hash a username and a realm.
+ * \param username username
+ * \param realm realm
+ * \return hash
+ */
+static uint32_t allocation_username_hash(const char* username,
+    const char* realm)
+{
+  uint32_t hash = hash_bytes(realm, strlen(realm), g_hash_seed);
+
+  return hash_bytes(username, strlen(username), hash);
+}
+
+/**
+ * \brief Remove an allocation from the indexes.
+ *
+ * When all allocations are removed, memory of the indexes is released.
+ * \param desc allocation descriptor
+ */
+static void allocation_desc_unindex(struct allocation_desc* desc)
+{
+  hash_table_remove(&g_tuple_index, &desc->tuple_node);
+  hash_table_remove(&g_relayed_index, &desc->relayed_node);
+  hash_table_remove(&g_id_index, &desc->id_node);
+  hash_table_remove(&g_username_index, &desc->username_node);
+  desc->owner = NULL;
+
+  if(g_tuple_index.count == 0 && g_relayed_index.count == 0 &&
+      g_id_index.count == 0 && g_username_index.count == 0)
+  {
+    hash_table_free(&g_tuple_index);
+    hash_table_free(&g_relayed_index);
+    hash_table_free(&g_id_index);
+    hash_table_free(&g_username_index);
+  }
+}
+
+/**
+ * \brief Compute the compact key of a peer.
+ * \param key key to fill
+ * \param family address family (IPv4 or IPv6)
+ * \param peer_addr network address
+ * \param peer_port port (0 for permissions)
+ */
+static void allocation_peer_key_set(struct allocation_addr_key* key,
+    int family, const uint8_t* peer_addr, uint16_t peer_port)
+{
+  static const uint8_t v4mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff,
+    0xff};
+
+  memset(key, 0x00, sizeof(struct allocation_addr_key));
+  key->port = peer_port;
+
+  if(family == AF_INET6 && memcmp(peer_addr, v4mapped, 12) != 0)
+  {
+    key->family = AF_INET6;
+    memcpy(key->addr, peer_addr, 16);
+  }
+  else
+  {
+    /* IPv4 or IPv4-mapped IPv6 address */
+    key->family = AF_INET;
+    memcpy(key->addr, family == AF_INET6 ? peer_addr + 12 : peer_addr, 4);
+  }
+}
+
+/**
+ * \brief Find an object in a peer table.
+ * \param table peer table
+ * \param key key to look for
+ * \param hash hash of the key
+ * \return key of the object found or NULL if not found
+ */
+static struct allocation_addr_key* allocation_peer_table_find(
+    const struct allocation_peer_table* table,
+    const struct allocation_addr_key* key, uint32_t hash)
+{
+  uint32_t i = 0;
+
+  if(!table->count)
+  {
+    return NULL;
+  }
+
+  /* there is always an empty slot */
+  for(i = hash & (table->size - 1) ; table->slots[i].key ;
+      i = (i + 1) & (table->size - 1))
+  {
+    if(table->slots[i].hash == hash &&
+       !memcmp(table->slots[i].key, key, sizeof(struct allocation_addr_key)))
+    {
+      return table->slots[i].key;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * \brief Put an object in the slots of a peer table.
+ * \param slots slots
+ * \param size number of slots
+ * \param key key of the object
+ * \param hash hash of the key
+ */
+static void allocation_peer_table_insert(struct allocation_peer_slot* slots,
+    uint32_t size, struct allocation_addr_key* key, uint32_t hash)
+{
+  uint32_t i = hash & (size - 1);
+
+  while(slots[i].key)
+  {
+    i = (i + 1) & (size - 1);
+  }
+
+  slots[i].hash = hash;
+  slots[i].key = key;
+}
+
+/**
+ * \brief Add an object in a peer table.
+ * \param table peer table
+ * \param key key of the object
+ * \param hash hash of the key
+ * \return 0 if success, -1 if memory cannot be allocated
+ */
+static int allocation_peer_table_add(struct allocation_peer_table* table,
+    struct allocation_addr_key* key, uint32_t hash)
+{
+  /* keep load factor under 1/2 */
+  if((table->count + 1) * 2 > table->size)
+  {
+    uint32_t size = table->size ? table->size * 2 : 8;
+    struct allocation_peer_slot* slots = NULL;
+    uint32_t i = 0;
+
+    if(!(slots = calloc(size, sizeof(struct allocation_peer_slot))))
+    {
+      return -1;
+    }
+
+    for(i = 0 ; i < table->size ; i++)
+    {
+      if(table->slots[i].key)
+      {
+        allocation_peer_table_insert(slots, size, table->slots[i].key,
+            table->slots[i].hash);
+      }
+    }
+
+    free(table->slots);
+    table->slots = slots;
+    table->size = size;
+  }
+
+  allocation_peer_table_insert(table->slots, table->size, key, hash);
+  table->count++;
+  return 0;
+}
+
+/**
+ * \brief Remove an object from a peer table.
+ * \param table peer table
+ * \param key key of the object (the one given to allocation_peer_table_add)
+ * \param hash hash of the key
+ */
+static void allocation_peer_table_remove(struct allocation_peer_table* table,
+    const struct allocation_addr_key* key, uint32_t hash)
+{
+  uint32_t mask = table->size - 1;
+  uint32_t i = 0;
+  uint32_t j = 0;
+
+  if(!table->count)
+  {
+    return;
+  }
+
+  for(i = hash & mask ; table->slots[i].key != key ; i = (i + 1) & mask)
+  {
+    if(!table->slots[i].key)
+    {
+      /* not in the table */
+      return;
+    }
+  }
+
+  /* shift back the following objects of the cluster so that no tombstone is
+   * needed
+   */
+  for(j = (i + 1) & mask ; table->slots[j].key ; j = (j + 1) & mask)
+  {
+    uint32_t home = table->slots[j].hash & mask;
+
+    /* move it if its home slot is not between the hole and it */
+    if(((j - home) & mask) >= ((j - i) & mask))
+    {
+      table->slots[i] = table->slots[j];
+      i = j;
+    }
+  }
+
+  table->slots[i].key = NULL;
+  table->slots[i].hash = 0;
+  table->count--;
+}
+
+/**
+ * \brief Free the slots of a peer table.
+ * \param table peer table
+ */
+static void allocation_peer_table_free(struct allocation_peer_table* table)
+{
+  free(table->slots);
+  table->slots = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+/**
+ * \brief Get the slot of the channel table for a channel number.
+ * \param desc allocation descriptor
+ * \param channel channel number
+ * \param create allocate the page if it does not exist
+ * \return slot or NULL if channel number is not valid or page does not exist
+ */
+static struct allocation_channel** allocation_desc_channel_slot(
+    struct allocation_desc* desc, uint16_t channel, int create)
+{
+  size_t index = 0;
+  size_t page = 0;
+
+  if(channel < ALLOCATION_CHANNEL_MIN || channel > ALLOCATION_CHANNEL_MAX)
+  {
+    return NULL;
+  }
+
+  index = channel - ALLOCATION_CHANNEL_MIN;
+  page = index >> ALLOCATION_CHANNEL_PAGE_BITS;
+
+  if(!desc->channels[page])
+  {
+    if(!create)
+    {
+      return NULL;
+    }
+
+    desc->channels[page] = calloc(ALLOCATION_CHANNEL_PAGE_SIZE,
+        sizeof(struct allocation_channel*));
+
+    if(!desc->channels[page])
+    {
+      return NULL;
+    }
+  }
+
+  return &desc->channels[page][index & (ALLOCATION_CHANNEL_PAGE_SIZE - 1)];
+}
 
 struct allocation_desc* allocation_desc_new(const uint8_t* id,
     uint8_t transport_protocol, const char* username, const unsigned char* key,
@@ -58,7 +484,6 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
 {
   struct allocation_desc* ret = NULL;
   size_t len_username = 0;
-  struct sigevent event;
 
   if(username)
   {
@@ -71,7 +496,7 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
     return NULL;
   }
 
-  if(!(ret = malloc(sizeof(struct allocation_desc))))
+  if(!(ret = pool_alloc(&g_pools[ALLOCATION_POOL_DESC])))
   {
     return NULL;
   }
@@ -83,7 +508,7 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
   ret->username = malloc(len_username + 1);
   if(!ret->username)
   {
-    free(ret);
+    pool_free(&g_pools[ALLOCATION_POOL_DESC], ret);
     return NULL;
   }
 
@@ -91,6 +516,13 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
   ret->username[len_username] = 0x00;
   /* 16 = MD5 length */
   memcpy(ret->key, key, 16);
+
+  if(crypto_hmac_sha1_key_init(&ret->hmac_key, key, 16) == -1)
+  {
+    free(ret->username);
+    pool_free(&g_pools[ALLOCATION_POOL_DESC], ret);
+    return NULL;
+  }
   /* see protocol.c for nonce length */
   memcpy(ret->nonce, nonce, 24);
   strncpy(ret->realm, realm, sizeof(ret->realm) - 1);
@@ -104,16 +536,26 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
   /* copy relayed address */
   memcpy(&ret->relayed_addr, relayed_addr, addr_size);
 
+  /* keys for lookups, allocation is indexed when added to a list */
+  allocation_addr_key_set(&ret->client_key, client_addr);
+  allocation_addr_key_set(&ret->server_key, server_addr);
+  allocation_addr_key_set(&ret->relayed_key, relayed_addr);
+  ret->owner = NULL;
+  hash_node_init(&ret->tuple_node);
+  hash_node_init(&ret->relayed_node);
+  hash_node_init(&ret->id_node);
+  hash_node_init(&ret->username_node);
+
   ret->relayed_transport_protocol = IPPROTO_UDP;
 
   /* by default, this will be set by caller */
   ret->relayed_tls = 0;
   ret->relayed_dtls = 0;
 
-  /* tocken bucket initialization */
-  ret->bucket_capacity = 0;
-  ret->bucket_tokenup = 0;
-  ret->bucket_tokendown = 0;
+  /* no bandwidth limit, this will be set by caller */
+  memset(&ret->bucket_up, 0x00, sizeof(struct token_bucket));
+  memset(&ret->bucket_down, 0x00, sizeof(struct token_bucket));
+  ret->paced_until = 0;
 
   /* list of permissions */
   list_head_init(&ret->peers_permissions);
@@ -121,31 +563,27 @@ struct allocation_desc* allocation_desc_new(const uint8_t* id,
   /* list of channels */
   list_head_init(&ret->peers_channels);
 
+  /* channel and peer tables are allocated on demand */
+  memset(ret->channels, 0x00, sizeof(ret->channels));
+  memset(&ret->channels_peers, 0x00, sizeof(struct allocation_peer_table));
+  memset(&ret->permissions, 0x00, sizeof(struct allocation_peer_table));
+
   /* list of TCP relays */
   list_head_init(&ret->tcp_relays);
 
   /* linked lists, second ones used when timer has expired */
   list_head_init(&ret->list);
   list_head_init(&ret->list2);
+  list_head_init(&ret->list_paced);
 
   /* timer */
-  memset(&event, 0x00, sizeof(struct sigevent));
-  event.sigev_value.sival_ptr = ret;
-  event.sigev_notify = SIGEV_SIGNAL;
-  event.sigev_signo = SIGRT_EXPIRE_ALLOCATION;
-
-  memset(&ret->expire_timer, 0x00, sizeof(timer_t));
-  if(timer_create(CLOCK_REALTIME, &event, &ret->expire_timer) == -1)
-  {
-    free(ret->username);
-    free(ret);
-    return NULL;
-  }
+  timer_entry_init(&ret->expire_timer, ALLOCATION_EXPIRE_ALLOCATION, ret);
 
   allocation_desc_set_timer(ret, lifetime);
 
   /* sockets */
   ret->relayed_sock = -1;
+  ret->relayed_df = -1;
   ret->relayed_sock_tcp = -1;
   ret->tuple_sock = -1;
 
@@ -157,9 +595,13 @@ void allocation_desc_free(struct allocation_desc** desc)
   struct allocation_desc* ret = *desc;
   struct list_head* get = NULL;
   struct list_head* n = NULL;
+  size_t i = 0;
 
   /* delete the timer */
-  timer_delete(ret->expire_timer);
+  allocation_timer_del(&ret->expire_timer);
+
+  /* it may have been removed from its list without the indexes */
+  allocation_desc_unindex(ret);
 
   free(ret->username);
 
@@ -168,20 +610,20 @@ void allocation_desc_free(struct allocation_desc** desc)
   {
     struct allocation_channel* tmp = list_head_get(get, struct allocation_channel,
         list);
-    timer_delete(tmp->expire_timer);
+    allocation_timer_del(&tmp->expire_timer);
     list_head_remove(&tmp->list, &tmp->list);
     list_head_remove(&tmp->list2, &tmp->list2);
-    free(tmp);
+    pool_free(&g_pools[ALLOCATION_POOL_CHANNEL], tmp);
   }
 
   list_head_iterate_safe(&ret->peers_permissions, get, n)
   {
     struct allocation_permission* tmp = list_head_get(get,
         struct allocation_permission, list);
-    timer_delete(tmp->expire_timer);
+    allocation_timer_del(&tmp->expire_timer);
     list_head_remove(&tmp->list, &tmp->list);
     list_head_remove(&tmp->list2, &tmp->list2);
-    free(tmp);
+    pool_free(&g_pools[ALLOCATION_POOL_PERMISSION], tmp);
   }
 
   list_head_iterate_safe(&ret->tcp_relays, get, n)
@@ -191,6 +633,14 @@ void allocation_desc_free(struct allocation_desc** desc)
     allocation_tcp_relay_list_remove(&ret->tcp_relays, tmp);
   }
 
+  for(i = 0 ; i < ALLOCATION_CHANNEL_PAGES ; i++)
+  {
+    free(ret->channels[i]);
+  }
+
+  allocation_peer_table_free(&ret->channels_peers);
+  allocation_peer_table_free(&ret->permissions);
+
   if(ret->relayed_sock > 0)
   {
     close(ret->relayed_sock);
@@ -208,136 +658,82 @@ void allocation_desc_free(struct allocation_desc** desc)
   /* the tuple sock is closed by the user-defined application */
   ret->tuple_sock = -1;
 
-  free(*desc);
+  pool_free(&g_pools[ALLOCATION_POOL_DESC], *desc);
   *desc = NULL;
 }
 
 void allocation_desc_set_timer(struct allocation_desc* desc, uint32_t lifetime)
 {
-  struct itimerspec expire;
-  struct itimerspec old;
-
-  /* timer */
-  expire.it_value.tv_sec = (long)lifetime;
-  expire.it_value.tv_nsec = 0;
-  expire.it_interval.tv_sec = 0; /* no interval */
-  expire.it_interval.tv_nsec = 0;
-  memset(&old, 0x00, sizeof(struct itimerspec));
-
-  /* (re)-init bandwidth quota stuff */
-  gettimeofday(&desc->last_timeup, NULL);
-  gettimeofday(&desc->last_timedown, NULL);
-
   /* set the timer */
-  if(timer_settime(desc->expire_timer, 0, &expire, &old) == -1)
+  allocation_timer_set(&desc->expire_timer, lifetime);
+}
+
+uint32_t allocation_desc_get_timer(const struct allocation_desc* desc)
+{
+  if(!g_timer_wheel)
   {
-    return;
+    return 0;
   }
+
+  return timer_wheel_remaining(g_timer_wheel, &desc->expire_timer) / 1000;
 }
 
 struct allocation_permission* allocation_desc_find_permission(
     struct allocation_desc* desc, int family, const uint8_t* peer_addr)
 {
-  struct list_head* get = NULL;
-  struct list_head* n = NULL;
+  struct allocation_addr_key key;
 
-  list_head_iterate_safe(&desc->peers_permissions, get, n)
-  {
-    struct allocation_permission* tmp = list_head_get(get,
-        struct allocation_permission, list);
-
-    /* check only the network address (not the port) */
-    if(tmp->family != family)
-    {
-      continue;
-    }
-
-    if(tmp->family == family && !memcmp(tmp->peer_addr, peer_addr,
-          family == AF_INET ? 4 : 16))
-    {
-      return tmp;
-    }
-  }
-  /* not found */
-  return NULL;
+  /* check only the network address (not the port) */
+  allocation_peer_key_set(&key, family, peer_addr, 0);
+  return (struct allocation_permission*)allocation_peer_table_find(
+      &desc->permissions, &key,
+      hash_bytes(&key, sizeof(struct allocation_addr_key), g_hash_seed));
 }
 
 struct allocation_permission* allocation_desc_find_permission_sockaddr(
     struct allocation_desc* desc, const struct sockaddr* addr)
 {
-  struct list_head* get = NULL;
-  struct list_head* n = NULL;
+  struct allocation_addr_key key;
 
-  list_head_iterate_safe(&desc->peers_permissions, get, n)
+  if(addr->sa_family != AF_INET && addr->sa_family != AF_INET6)
   {
-    struct allocation_permission* tmp = list_head_get(get,
-        struct allocation_permission, list);
-
-    /* check only the network address (not the port) */
-    if(tmp->family != addr->sa_family)
-    {
-      continue;
-    }
-
-    switch(tmp->family)
-    {
-      case AF_INET:
-        {
-          struct in_addr* a = &((struct sockaddr_in*)addr)->sin_addr;
-
-          if(!memcmp(a, tmp->peer_addr, 4))
-          {
-            return tmp;
-          }
-        }
-        break;
-      case AF_INET6:
-        {
-          struct in6_addr* a = &((struct sockaddr_in6*)addr)->sin6_addr;
-
-          if(!memcmp(a, tmp->peer_addr, 16))
-          {
-            return tmp;
-          }
-        }
-        break;
-      default:
-        return NULL;
-        break;
-    }
+    return NULL;
   }
 
-  /* not found */
-  return NULL;
+  /* check only the network address (not the port) */
+  allocation_addr_key_set(&key, addr);
+  key.port = 0;
+  return (struct allocation_permission*)allocation_peer_table_find(
+      &desc->permissions, &key,
+      hash_bytes(&key, sizeof(struct allocation_addr_key), g_hash_seed));
 }
 
 int allocation_desc_add_permission(struct allocation_desc* desc,
     uint32_t lifetime, int family, const uint8_t* peer_addr)
 {
   struct allocation_permission* ret = NULL;
-  struct sigevent event;
 
-  if(!(ret = malloc(sizeof(struct allocation_permission))))
+  if(!(ret = pool_alloc(&g_pools[ALLOCATION_POOL_PERMISSION])))
   {
     return -1;
   }
 
   ret->family = family;
   memcpy(&ret->peer_addr, peer_addr, family == AF_INET ? 4 : 16);
+  allocation_peer_key_set(&ret->key, family, peer_addr, 0);
+  ret->desc = desc;
 
-  /* timer */
-  memset(&event, 0x00, sizeof(struct sigevent));
-  event.sigev_value.sival_ptr = ret;
-  event.sigev_notify = SIGEV_SIGNAL;
-  event.sigev_signo = SIGRT_EXPIRE_PERMISSION;
-
-  memset(&ret->expire_timer, 0x00, sizeof(timer_t));
-  if(timer_create(CLOCK_REALTIME, &event, &ret->expire_timer) == -1)
+  if(allocation_peer_table_add(&desc->permissions, &ret->key,
+        hash_bytes(&ret->key, sizeof(struct allocation_addr_key),
+          g_hash_seed)) == -1)
   {
-    free(ret);
+    pool_free(&g_pools[ALLOCATION_POOL_PERMISSION], ret);
     return -1;
   }
 
+  /* timer */
+  timer_entry_init(&ret->expire_timer, ALLOCATION_EXPIRE_PERMISSION, ret);
+
   allocation_permission_set_timer(ret, lifetime);
 
   /* add to the list */
@@ -346,34 +742,46 @@ int allocation_desc_add_permission(struct allocation_desc* desc,
   return 0;
 }
 
+void allocation_permission_free(struct allocation_permission** permission)
+{
+  struct allocation_permission* ret = *permission;
+
+  allocation_timer_del(&ret->expire_timer);
+  allocation_peer_table_remove(&ret->desc->permissions, &ret->key,
+      hash_bytes(&ret->key, sizeof(struct allocation_addr_key), g_hash_seed));
+  list_head_remove(&ret->list, &ret->list);
+  pool_free(&g_pools[ALLOCATION_POOL_PERMISSION], ret);
+  *permission = NULL;
+}
+
 uint32_t allocation_desc_find_channel(struct allocation_desc* desc, int family,
     const uint8_t* peer_addr, uint16_t peer_port)
 {
-  struct list_head* get = NULL;
-  struct list_head* n = NULL;
+  struct allocation_addr_key key;
+  struct allocation_channel* channel = NULL;
 
-  list_head_iterate_safe(&desc->peers_channels, get, n)
-  {
-    struct allocation_channel* tmp = list_head_get(get, struct allocation_channel,
-        list);
-
-    if(tmp->family == family && !memcmp(&tmp->peer_addr, peer_addr,
-          family == AF_INET ? 4 : 16) && tmp->peer_port == peer_port)
-    {
-      return tmp->channel_number;
-    }
-  }
+  allocation_peer_key_set(&key, family, peer_addr, peer_port);
+  channel = (struct allocation_channel*)allocation_peer_table_find(
+      &desc->channels_peers, &key,
+      hash_bytes(&key, sizeof(struct allocation_addr_key), g_hash_seed));
 
-  /* not found */
-  return 0;
+  return channel ? channel->channel_number : 0;
 }
 
 struct allocation_channel* allocation_desc_find_channel_number(
     struct allocation_desc* desc, uint16_t channel)
 {
+  struct allocation_channel** slot = NULL;
   struct list_head* get = NULL;
   struct list_head* n = NULL;
 
+  if(channel >= ALLOCATION_CHANNEL_MIN && channel <= ALLOCATION_CHANNEL_MAX)
+  {
+    slot = allocation_desc_channel_slot(desc, channel, 0);
+    return slot ? *slot : NULL;
+  }
+
+  /* invalid channel numbers are not in the table */
   list_head_iterate_safe(&desc->peers_channels, get, n)
   {
     struct allocation_channel* tmp = list_head_get(get, struct allocation_channel,
@@ -393,9 +801,9 @@ int allocation_desc_add_channel(struct allocation_desc* desc, uint16_t channel,
     uint32_t lifetime, int family, const uint8_t* peer_addr, uint16_t peer_port)
 {
   struct allocation_channel* ret = NULL;
-  struct sigevent event;
+  struct allocation_channel** slot = NULL;
 
-  if(!(ret = malloc(sizeof(struct allocation_channel))))
+  if(!(ret = pool_alloc(&g_pools[ALLOCATION_POOL_CHANNEL])))
   {
     return -1;
   }
@@ -404,20 +812,53 @@ int allocation_desc_add_channel(struct allocation_desc* desc, uint16_t channel,
   memcpy(&ret->peer_addr, peer_addr, family == AF_INET ? 4 : 16);
   ret->peer_port = peer_port;
   ret->channel_number = channel;
+  allocation_peer_key_set(&ret->key, family, peer_addr, peer_port);
 
-  /* timer */
-  memset(&event, 0x00, sizeof(struct sigevent));
-  event.sigev_value.sival_ptr = ret;
-  event.sigev_notify = SIGEV_SIGNAL;
-  event.sigev_signo = SIGRT_EXPIRE_CHANNEL;
+  /* build the peer address once, ChannelData are sent directly to it */
+  memset(&ret->peer_saddr, 0x00, sizeof(struct sockaddr_storage));
+  if(family == AF_INET)
+  {
+    struct sockaddr_in* sin = (struct sockaddr_in*)&ret->peer_saddr;
 
-  memset(&ret->expire_timer, 0x00, sizeof(timer_t));
-  if(timer_create(CLOCK_REALTIME, &event, &ret->expire_timer) == -1)
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_addr, peer_addr, 4);
+    sin->sin_port = htons(peer_port);
+    ret->peer_saddr_size = sizeof(struct sockaddr_in);
+  }
+  else
   {
-    free(ret);
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&ret->peer_saddr;
+
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_addr, peer_addr, 16);
+    sin6->sin6_port = htons(peer_port);
+#ifdef SIN6_LEN
+    sin6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+    ret->peer_saddr_size = sizeof(struct sockaddr_in6);
+  }
+  ret->desc = desc;
+
+  slot = allocation_desc_channel_slot(desc, channel, 1);
+
+  if((!slot && channel >= ALLOCATION_CHANNEL_MIN &&
+        channel <= ALLOCATION_CHANNEL_MAX) ||
+      allocation_peer_table_add(&desc->channels_peers, &ret->key,
+        hash_bytes(&ret->key, sizeof(struct allocation_addr_key),
+          g_hash_seed)) == -1)
+  {
+    pool_free(&g_pools[ALLOCATION_POOL_CHANNEL], ret);
     return -1;
   }
 
+  if(slot && !*slot)
+  {
+    *slot = ret;
+  }
+
+  /* timer */
+  timer_entry_init(&ret->expire_timer, ALLOCATION_EXPIRE_CHANNEL, ret);
+
   allocation_channel_set_timer(ret, lifetime);
 
   /* add to the list */
@@ -426,44 +867,36 @@ int allocation_desc_add_channel(struct allocation_desc* desc, uint16_t channel,
   return 0;
 }
 
-void allocation_channel_set_timer(struct allocation_channel* channel,
-    uint32_t lifetime)
+void allocation_channel_free(struct allocation_channel** channel)
 {
-  struct itimerspec expire;
-  struct itimerspec old;
+  struct allocation_channel* ret = *channel;
+  struct allocation_channel** slot = NULL;
 
-  /* timer */
-  expire.it_value.tv_sec = (long)lifetime;
-  expire.it_value.tv_nsec = 0;
-  expire.it_interval.tv_sec = 0; /* no interval */
-  expire.it_interval.tv_nsec = 0;
-  memset(&old, 0x00, sizeof(struct itimerspec));
+  allocation_timer_del(&ret->expire_timer);
 
-  /* set the timer */
-  if(timer_settime(channel->expire_timer, 0, &expire, &old) == -1)
+  slot = allocation_desc_channel_slot(ret->desc, ret->channel_number, 0);
+  if(slot && *slot == ret)
   {
-    return;
+    *slot = NULL;
   }
+
+  allocation_peer_table_remove(&ret->desc->channels_peers, &ret->key,
+      hash_bytes(&ret->key, sizeof(struct allocation_addr_key), g_hash_seed));
+  list_head_remove(&ret->list, &ret->list);
+  pool_free(&g_pools[ALLOCATION_POOL_CHANNEL], ret);
+  *channel = NULL;
 }
 
-void allocation_permission_set_timer(struct allocation_permission* permission,
+void allocation_channel_set_timer(struct allocation_channel* channel,
     uint32_t lifetime)
 {
-  struct itimerspec expire;
-  struct itimerspec old;
-
-  /* timer */
-  expire.it_value.tv_sec = (long)lifetime;
-  expire.it_value.tv_nsec = 0;
-  expire.it_interval.tv_sec = 0; /* no interval */
-  expire.it_interval.tv_nsec = 0;
-  memset(&old, 0x00, sizeof(struct itimerspec));
+  allocation_timer_set(&channel->expire_timer, lifetime);
+}
 
-  /* set the timer */
-  if(timer_settime(permission->expire_timer, 0, &expire, &old) == -1)
-  {
-    return;
-  }
+void allocation_permission_set_timer(struct allocation_permission* permission,
+    uint32_t lifetime)
+{
+  allocation_timer_set(&permission->expire_timer, lifetime);
 }
 
 void allocation_list_free(struct list_head* list)
@@ -482,6 +915,19 @@ void allocation_list_free(struct list_head* list)
 void allocation_list_add(struct list_head* list, struct allocation_desc* desc)
 {
   list_head_add_tail(list, &desc->list);
+  desc->owner = list;
+
+  /* failures to grow the indexes only make lookups slower */
+  hash_table_add(&g_tuple_index, &desc->tuple_node,
+      allocation_tuple_hash(desc->tuple.transport_protocol, &desc->server_key,
+        &desc->client_key));
+  hash_table_add(&g_relayed_index, &desc->relayed_node,
+      hash_bytes(&desc->relayed_key, sizeof(struct allocation_addr_key),
+        g_hash_seed));
+  hash_table_add(&g_id_index, &desc->id_node,
+      hash_bytes(desc->transaction_id, 12, g_hash_seed));
+  hash_table_add(&g_username_index, &desc->username_node,
+      allocation_username_hash(desc->username, desc->realm));
 }
 
 void allocation_list_remove(struct list_head* list,
@@ -494,13 +940,22 @@ void allocation_list_remove(struct list_head* list,
 struct allocation_desc* allocation_list_find_username(struct list_head* list,
     const char* username, const char* realm)
 {
+  uint32_t hash = allocation_username_hash(username, realm);
+  struct list_head* bucket = hash_table_bucket(&g_username_index, hash);
   struct list_head* get = NULL;
-  struct list_head* n = NULL;
 
-  list_head_iterate_safe(list, get, n)
+  if(!bucket)
   {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
-    if(!strcmp(tmp->username, username) && !strcmp(tmp->realm, realm))
+    return NULL;
+  }
+
+  list_head_iterate(bucket, get)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        username_node.list);
+
+    if(tmp->username_node.hash == hash && tmp->owner == list &&
+       !strcmp(tmp->username, username) && !strcmp(tmp->realm, realm))
     {
       return tmp;
     }
@@ -513,13 +968,22 @@ struct allocation_desc* allocation_list_find_username(struct list_head* list,
 struct allocation_desc* allocation_list_find_id(struct list_head* list,
     const uint8_t* id)
 {
+  uint32_t hash = hash_bytes(id, 12, g_hash_seed);
+  struct list_head* bucket = hash_table_bucket(&g_id_index, hash);
   struct list_head* get = NULL;
-  struct list_head* n = NULL;
 
-  list_head_iterate_safe(list, get, n)
+  if(!bucket)
   {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
-    if(!memcmp(tmp->transaction_id, id, 12))
+    return NULL;
+  }
+
+  list_head_iterate(bucket, get)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        id_node.list);
+
+    if(tmp->id_node.hash == hash && tmp->owner == list &&
+       !memcmp(tmp->transaction_id, id, 12))
     {
       return tmp;
     }
@@ -533,16 +997,35 @@ struct allocation_desc* allocation_list_find_tuple(struct list_head* list,
     int transport_protocol, const struct sockaddr* server_addr,
     const struct sockaddr* client_addr, socklen_t addr_size)
 {
+  struct allocation_addr_key server_key;
+  struct allocation_addr_key client_key;
+  struct list_head* bucket = NULL;
   struct list_head* get = NULL;
-  struct list_head* n = NULL;
+  uint32_t hash = 0;
 
-  list_head_iterate_safe(list, get, n)
+  /* keys do not depend on the size */
+  (void)addr_size;
+
+  allocation_addr_key_set(&server_key, server_addr);
+  allocation_addr_key_set(&client_key, client_addr);
+  hash = allocation_tuple_hash(transport_protocol, &server_key, &client_key);
+
+  if(!(bucket = hash_table_bucket(&g_tuple_index, hash)))
   {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+    return NULL;
+  }
 
-    if(tmp->tuple.transport_protocol == transport_protocol &&
-       !memcmp(&tmp->tuple.server_addr, server_addr, addr_size) &&
-       !memcmp(&tmp->tuple.client_addr, client_addr, addr_size))
+  list_head_iterate(bucket, get)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        tuple_node.list);
+
+    if(tmp->tuple_node.hash == hash && tmp->owner == list &&
+       tmp->tuple.transport_protocol == transport_protocol &&
+       !memcmp(&tmp->client_key, &client_key,
+         sizeof(struct allocation_addr_key)) &&
+       !memcmp(&tmp->server_key, &server_key,
+         sizeof(struct allocation_addr_key)))
     {
       return tmp;
     }
@@ -555,14 +1038,31 @@ struct allocation_desc* allocation_list_find_tuple(struct list_head* list,
 struct allocation_desc* allocation_list_find_relayed(struct list_head* list,
     const struct sockaddr* relayed_addr, socklen_t addr_size)
 {
+  struct allocation_addr_key relayed_key;
+  struct list_head* bucket = NULL;
   struct list_head* get = NULL;
-  struct list_head* n = NULL;
+  uint32_t hash = 0;
 
-  list_head_iterate_safe(list, get, n)
+  /* key does not depend on the size */
+  (void)addr_size;
+
+  allocation_addr_key_set(&relayed_key, relayed_addr);
+  hash = hash_bytes(&relayed_key, sizeof(struct allocation_addr_key),
+      g_hash_seed);
+
+  if(!(bucket = hash_table_bucket(&g_relayed_index, hash)))
   {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+    return NULL;
+  }
+
+  list_head_iterate(bucket, get)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        relayed_node.list);
 
-    if(!memcmp(&tmp->relayed_addr, relayed_addr, addr_size))
+    if(tmp->relayed_node.hash == hash && tmp->owner == list &&
+       !memcmp(&tmp->relayed_key, &relayed_key,
+         sizeof(struct allocation_addr_key)))
     {
       return tmp;
     }
@@ -577,9 +1077,8 @@ int allocation_desc_add_tcp_relay(struct allocation_desc* desc, uint32_t id,
     uint32_t timeout, size_t buffer_size, uint8_t* connect_msg_id)
 {
   struct allocation_tcp_relay* ret = NULL;
-  struct sigevent event;
 
-  if(!(ret = malloc(sizeof(struct allocation_tcp_relay))))
+  if(!(ret = pool_alloc(&g_pools[ALLOCATION_POOL_TCP_RELAY])))
   {
     return -1;
   }
@@ -608,7 +1107,7 @@ int allocation_desc_add_tcp_relay(struct allocation_desc* desc, uint32_t id,
   {
     if(!(ret->buf = malloc(sizeof(char) * buffer_size)))
     {
-      free(ret);
+      pool_free(&g_pools[ALLOCATION_POOL_TCP_RELAY], ret);
       return -1;
     }
   }
@@ -627,17 +1126,7 @@ int allocation_desc_add_tcp_relay(struct allocation_desc* desc, uint32_t id,
   ret->client_sock = -1;
 
   /* timer */
-  memset(&event, 0x00, sizeof(struct sigevent));
-  event.sigev_value.sival_ptr = ret;
-  event.sigev_notify = SIGEV_SIGNAL;
-  event.sigev_signo = SIGRT_EXPIRE_TCP_RELAY;
-
-  memset(&ret->expire_timer, 0x00, sizeof(timer_t));
-  if(timer_create(CLOCK_REALTIME, &event, &ret->expire_timer) == -1)
-  {
-    free(ret);
-    return -1;
-  }
+  timer_entry_init(&ret->expire_timer, ALLOCATION_EXPIRE_TCP_RELAY, ret);
 
   allocation_tcp_relay_set_timer(ret, timeout);
 
@@ -665,14 +1154,14 @@ void allocation_tcp_relay_list_remove(struct list_head* list,
   }
 
   /* stop timer */
-  timer_delete(relay->expire_timer);
+  allocation_timer_del(&relay->expire_timer);
 
   if(relay->buf)
   {
     free(relay->buf);
   }
 
-  free(relay);
+  pool_free(&g_pools[ALLOCATION_POOL_TCP_RELAY], relay);
 }
 
 struct allocation_tcp_relay* allocation_desc_find_tcp_relay_id(
@@ -726,30 +1215,15 @@ struct allocation_tcp_relay* allocation_desc_find_tcp_relay_addr(
 void allocation_tcp_relay_set_timer(struct allocation_tcp_relay* relay,
     uint32_t timeout)
 {
-  struct itimerspec expire;
-  struct itimerspec old;
-
-  /* start timer */
-  expire.it_value.tv_sec = (long)timeout;
-  expire.it_value.tv_nsec = 0;
-  expire.it_interval.tv_sec = 0; /* no interval */
-  expire.it_interval.tv_nsec = 0;
-  memset(&old, 0x00, sizeof(struct itimerspec));
-
-  /* set the timer */
-  if(timer_settime(relay->expire_timer, 0, &expire, &old) == -1)
-  {
-    return;
-  }
+  allocation_timer_set(&relay->expire_timer, timeout);
 }
 
 struct allocation_token* allocation_token_new(uint8_t* id, int sock,
     uint32_t lifetime)
 {
   struct allocation_token* ret = NULL;
-  struct sigevent event;
 
-  if(!(ret = malloc(sizeof(struct allocation_token))))
+  if(!(ret = pool_alloc(&g_pools[ALLOCATION_POOL_TOKEN])))
   {
     return NULL;
   }
@@ -757,16 +1231,7 @@ struct allocation_token* allocation_token_new(uint8_t* id, int sock,
   memcpy(ret->id, id, 8);
   ret->sock = sock;
 
-  memset(&event, 0x00, sizeof(struct sigevent));
-  event.sigev_value.sival_ptr = ret;
-  event.sigev_notify = SIGEV_SIGNAL;
-  event.sigev_signo = SIGRT_EXPIRE_TOKEN;
-
-  if(timer_create(CLOCK_REALTIME, &event, &ret->expire_timer) == -1)
-  {
-    free(ret);
-    return NULL;
-  }
+  timer_entry_init(&ret->expire_timer, ALLOCATION_EXPIRE_TOKEN, ret);
 
   allocation_token_set_timer(ret, lifetime);
 
@@ -778,29 +1243,17 @@ struct allocation_token* allocation_token_new(uint8_t* id, int sock,
 
 void allocation_token_free(struct allocation_token** token)
 {
-  timer_delete((*token)->expire_timer);
+  allocation_timer_del(&(*token)->expire_timer);
   list_head_remove(&(*token)->list, &(*token)->list);
   list_head_remove(&(*token)->list2, &(*token)->list2);
-  free(*token);
+  pool_free(&g_pools[ALLOCATION_POOL_TOKEN], *token);
   *token = NULL;
 }
 
 void allocation_token_set_timer(struct allocation_token* token,
     uint32_t lifetime)
 {
-  struct itimerspec expire;
-  struct itimerspec old;
-
-  expire.it_value.tv_sec = (long)lifetime;
-  expire.it_value.tv_nsec = 0;
-  expire.it_interval.tv_sec = 0; /* no interval */
-  expire.it_interval.tv_nsec = 0;
-  memset(&old, 0x00, sizeof(struct itimerspec));
-
-  if(timer_settime(token->expire_timer, 0, &expire, &old) == -1)
-  {
-    return;
-  }
+  allocation_timer_set(&token->expire_timer, lifetime);
 }
 
 void allocation_token_list_add(struct list_head* list,
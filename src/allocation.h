@@ -51,6 +51,39 @@
 #include <sys/time.h>
 
 #include "list.h"
+#include "hash_table.h"
+#include "pool.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+#include "util_crypto.h"
+
+/**
+ * \enum allocation_timer_type
+ * \brief Kind of object an expire timer belongs to.
+ */
+enum allocation_timer_type
+{
+  ALLOCATION_EXPIRE_ALLOCATION, /**< Allocation descriptor */
+  ALLOCATION_EXPIRE_PERMISSION, /**< Permission */
+  ALLOCATION_EXPIRE_CHANNEL, /**< Channel */
+  ALLOCATION_EXPIRE_TOKEN, /**< Allocation token */
+  ALLOCATION_EXPIRE_TCP_RELAY, /**< TCP relay (no ConnectionBind received) */
+  ALLOCATION_EXPIRE_DTLS_CLIENT /**< Idle DTLS client on a connected socket */
+};
+
+/**
+ * \enum allocation_pool_type
+ * \brief Pools of allocation objects.
+ */
+enum allocation_pool_type
+{
+  ALLOCATION_POOL_DESC, /**< Allocation descriptors */
+  ALLOCATION_POOL_PERMISSION, /**< Permissions */
+  ALLOCATION_POOL_CHANNEL, /**< Channels */
+  ALLOCATION_POOL_TCP_RELAY, /**< TCP relays */
+  ALLOCATION_POOL_TOKEN, /**< Allocation tokens */
+  ALLOCATION_POOL_MAX /**< Number of pools */
+};
 
 /**
  * \struct allocation_token
@@ -60,7 +93,7 @@ struct allocation_token
 {
   uint8_t id[8]; /**< Token ID */
   int sock; /**< The opened socket */
-  timer_t expire_timer; /**< Expire timer */
+  struct timer_entry expire_timer; /**< Expire timer */
   struct list_head list; /**< For list management */
   struct list_head list2; /**< For list management (expired list) */
 };
@@ -76,15 +109,89 @@ struct allocation_tuple
   struct sockaddr_storage server_addr; /**< Server address */
 };
 
+/**
+ * \struct allocation_addr_key
+ * \brief Compact key of a transport address used for lookups.
+ *
+ * IPv4-mapped IPv6 addresses are stored as IPv4 ones and unused bytes are
+ * zeroed so that keys can be compared with memcmp().
+ */
+struct allocation_addr_key
+{
+  uint16_t family; /**< Address family (AF_INET or AF_INET6) */
+  uint16_t port; /**< Port (network byte order) */
+  uint8_t addr[16]; /**< Address (IPv4 uses the first four bytes) */
+};
+
+/**
+ * \def ALLOCATION_CHANNEL_MIN
+ * \brief Lowest channel number.
+ */
+#define ALLOCATION_CHANNEL_MIN 0x4000
+
+/**
+ * \def ALLOCATION_CHANNEL_MAX
+ * \brief Highest channel number.
+ */
+#define ALLOCATION_CHANNEL_MAX 0x7FFF
+
+/**
+ * \def ALLOCATION_CHANNEL_PAGE_BITS
+ * \brief Number of bits of the channel number used to index a page of the
+ * channel table.
+ */
+#define ALLOCATION_CHANNEL_PAGE_BITS 8
+
+/**
+ * \def ALLOCATION_CHANNEL_PAGE_SIZE
+ * \brief Number of channels in a page of the channel table.
+ */
+#define ALLOCATION_CHANNEL_PAGE_SIZE (1 << ALLOCATION_CHANNEL_PAGE_BITS)
+
+/**
+ * \def ALLOCATION_CHANNEL_PAGES
+ * \brief Number of pages of the channel table.
+ */
+#define ALLOCATION_CHANNEL_PAGES \
+  ((ALLOCATION_CHANNEL_MAX - ALLOCATION_CHANNEL_MIN + 1) / \
+   ALLOCATION_CHANNEL_PAGE_SIZE)
+
+/**
+ * \struct allocation_peer_slot
+ * \brief Slot of a peer table.
+ */
+struct allocation_peer_slot
+{
+  uint32_t hash; /**< Hash of the key */
+  struct allocation_addr_key* key; /**< Key (first member of the object) */
+};
+
+/**
+ * \struct allocation_peer_table
+ * \brief Open addressing hash table of permissions or channels of an
+ * allocation (linear probing).
+ */
+struct allocation_peer_table
+{
+  struct allocation_peer_slot* slots; /**< Slots (allocated on demand) */
+  uint32_t size; /**< Number of slots (power of two) */
+  uint32_t count; /**< Number of objects */
+};
+
+struct allocation_desc;
+
 /**
  * \struct allocation_permission
  * \brief Network address permission.
  */
 struct allocation_permission
 {
+  struct allocation_addr_key key; /**< Key of peer address (port is 0), MUST
+                                    be the first member */
+  struct allocation_desc* desc; /**< Allocation of the permission */
   int family; /**< Address family */
   uint8_t peer_addr[16]; /**< Peer address */
-  timer_t expire_timer; /**< Expire timer */
+  struct timer_entry expire_timer; /**< Expire timer */
   struct list_head list; /**< For list management */
   struct list_head list2; /**< For list management (expired list) */
 };
@@ -95,11 +202,16 @@ struct allocation_permission
  */
 struct allocation_channel
 {
+  struct allocation_addr_key key; /**< Key of peer address and port, MUST be
+                                    the first member */
+  struct allocation_desc* desc; /**< Allocation of the channel */
   int family; /**< Address family */
   uint8_t peer_addr[16]; /**< Peer address */
   uint16_t peer_port; /**< Peer port */
   uint16_t channel_number; /**< Channel bound to this peer */
-  timer_t expire_timer; /**< Expire timer */
+  struct sockaddr_storage peer_saddr; /**< Peer address ready to send to */
+  socklen_t peer_saddr_size; /**< Size of peer_saddr */
+  struct timer_entry expire_timer; /**< Expire timer */
   struct list_head list; /**< For list management */
   struct list_head list2; /**< For list management (expired list) */
 };
@@ -116,7 +228,7 @@ struct allocation_tcp_relay
   uint16_t peer_port; /**< Peer port */
   int peer_sock; /**< Peer data connection (server <-> peer) */
   int client_sock; /**< Client data connection (client <-> server) */
-  timer_t expire_timer; /**< Expire timer */
+  struct timer_entry expire_timer; /**< Expire timer */
   int new; /**< If the connection is newly initiated */
   int ready; /**< If remote peer is connected (i.e. connect() has succeed
                before timeout) */
@@ -140,6 +252,7 @@ struct allocation_desc
 {
   char* username; /**< Username of client */
   unsigned char key[16]; /**< MD5 hash over username, realm and password */
+  struct crypto_hmac_sha1_key hmac_key; /**< Precomputed HMAC-SHA1 key */
   char realm[256]; /**< Realm of user */
   unsigned char nonce[48]; /**< Nonce of user */
   int relayed_transport_protocol; /**< Relayed transport protocol used */
@@ -147,8 +260,16 @@ struct allocation_desc
   struct allocation_tuple tuple; /**< 5-tuple */
   struct list_head peers_channels; /**< List of channel to peer bindings */
   struct list_head peers_permissions; /**< List of peers permissions */
+  struct allocation_channel** channels[ALLOCATION_CHANNEL_PAGES];
+  /**< Channels indexed by number (pages allocated on demand) */
+  struct allocation_peer_table channels_peers; /**< Channels indexed by peer
+                                                 address and port */
+  struct allocation_peer_table permissions; /**< Permissions indexed by peer
+                                              address */
   struct list_head tcp_relays; /**< TCP relays information */
   int relayed_sock; /**< Socket for the allocated transport address */
+  int relayed_df; /**< DF behavior (IP_MTU_DISCOVER) of the relayed socket,
+                    -1 if not set */
   int relayed_sock_tcp; /**< Socket for the allocated transport address to
                           contact TCP peer (RFC6062). It is set to -1 if Connect
                           request succeed */
@@ -157,19 +278,65 @@ struct allocation_desc
   int tuple_sock; /**< Socket for the connection between the TURN server and the
                     TURN client */
   uint8_t transaction_id[12]; /**< Transaction ID of the Allocate Request */
-  timer_t expire_timer; /**< Expire timer */
-  unsigned long bucket_capacity; /**< Capacity of token bucket */
-  unsigned long bucket_tokenup; /**< Number of tokens available for upload */
-  unsigned long bucket_tokendown; /**< Number of tokens available for
-                                    download */
-  struct timeval last_timeup ; /**< Last time of bandwidth limit checking for
-                                 upload */
-  struct timeval last_timedown ; /**< Last time of bandwidth limit checking for
-                                   download */
+  struct timer_entry expire_timer; /**< Expire timer */
+  struct token_bucket bucket_up; /**< Bandwidth limit of data received from
+                                   peers */
+  struct token_bucket bucket_down; /**< Bandwidth limit of data received from
+                                     client */
+  uint64_t paced_until; /**< Time (ms) before the relayed socket is read again
+                          (bandwidth pacing), 0 if not paced */
+  struct allocation_addr_key relayed_key; /**< Key of relayed address */
+  struct allocation_addr_key client_key; /**< Key of client address */
+  struct allocation_addr_key server_key; /**< Key of server address */
+  struct list_head* owner; /**< List which contains the allocation */
+  struct hash_node tuple_node; /**< For 5-tuple index */
+  struct hash_node relayed_node; /**< For relayed address index */
+  struct hash_node id_node; /**< For transaction ID index */
+  struct hash_node username_node; /**< For username index */
   struct list_head list; /**< For list management */
   struct list_head list2; /**< For list management (expired list) */
+  struct list_head list_paced; /**< For list management (paced list) */
 };
 
+/**
+ * \brief Set the seed of the hash function used to index allocations.
+ *
+ * Must be called before any allocation is added to a list.
+ * \param seed random value
+ */
+void allocation_set_hash_seed(uint32_t seed);
+
+/**
+ * \brief Preallocate objects of a pool.
+ * \param type pool
+ * \param nb number of objects that can be created without allocating memory
+ * \return 0 if success, -1 otherwise
+ */
+int allocation_pool_reserve(enum allocation_pool_type type, size_t nb);
+
+/**
+ * \brief Get a pool of allocation objects (for statistics).
+ * \param type pool
+ * \return pool
+ */
+const struct pool* allocation_pool_get(enum allocation_pool_type type);
+
+/**
+ * \brief Release the memory of the pools.
+ *
+ * Must be called when all allocation objects have been freed.
+ */
+void allocation_pool_cleanup(void);
+
+/**
+ * \brief Set the timer wheel used to expire allocation objects.
+ *
+ * Must be called before any object is created. If no wheel is set, objects
+ * never expire.
+ * \param wheel timer wheel
+ */
+void allocation_set_timer_wheel(struct timer_wheel* wheel);
+
 /**
  * \brief Create a new allocation descriptor.
  * \param id transaction ID of the Allocate request
@@ -204,6 +371,13 @@ void allocation_desc_free(struct allocation_desc** desc);
  */
 void allocation_desc_set_timer(struct allocation_desc* desc, uint32_t lifetime);
 
+/**
+ * \brief Get the remaining lifetime of an allocation descriptor.
+ * \param desc allocation descriptor
+ * \return remaining lifetime in seconds
+ */
+uint32_t allocation_desc_get_timer(const struct allocation_desc* desc);
+
 /**
  * \brief Find if a peer (network address only) has a permissions installed.
  * \param desc allocation descriptor
@@ -234,6 +408,13 @@ struct allocation_permission* allocation_desc_find_permission_sockaddr(
 int allocation_desc_add_permission(struct allocation_desc* desc,
     uint32_t lifetime, int family, const uint8_t* peer_addr);
 
+/**
+ * \brief Remove a permission from its allocation and free it.
+ * \param permission pointer on pointer allocated by
+ * allocation_desc_add_permission
+ */
+void allocation_permission_free(struct allocation_permission** permission);
+
 /**
  * \brief Find if a peer (transport address) has a channel bound.
  * \param desc allocation descriptor
@@ -267,6 +448,12 @@ int allocation_desc_add_channel(struct allocation_desc* desc, uint16_t channel,
     uint32_t lifetime, int family, const uint8_t* peer_addr,
     uint16_t peer_port);
 
+/**
+ * \brief Remove a channel from its allocation and free it.
+ * \param channel pointer on pointer allocated by allocation_desc_add_channel
+ */
+void allocation_channel_free(struct allocation_channel** channel);
+
 /**
  * \brief Add a TCP relay.
  * \param desc allocation descriptor
@@ -348,6 +535,9 @@ void allocation_list_free(struct list_head* list);
 
 /**
  * \brief Add an allocation to a list.
+ *
+ * The allocation is also indexed by 5-tuple, relayed address, transaction ID
+ * and username so that lookups do not walk the list.
  * \param list list of allocations
  * \param desc allocation descriptor to add
  */
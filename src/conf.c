@@ -83,16 +83,21 @@ static cfg_opt_t g_opts[]=
 {
   CFG_STR("listen_address", NULL, CFGF_LIST),
   CFG_STR("listen_addressv6", NULL, CFGF_LIST),
+  CFG_STR("relay_address", NULL, CFGF_LIST),
+  CFG_STR("relay_addressv6", NULL, CFGF_LIST),
+  CFG_STR("relay_address_policy", "least_loaded", CFGF_NONE),
   CFG_INT("udp_port", 3478, CFGF_NONE),
   CFG_INT("tcp_port", 3478, CFGF_NONE),
   CFG_INT("tls_port", 5349, CFGF_NONE),
   CFG_BOOL("tls", cfg_false, CFGF_NONE),
   CFG_BOOL("dtls", cfg_false, CFGF_NONE),
+  CFG_BOOL("dtls_connected_sockets", cfg_false, CFGF_NONE),
   CFG_INT("max_port", 65535, CFGF_NONE),
   CFG_INT("min_port", 49152, CFGF_NONE),
   CFG_BOOL("turn_tcp", cfg_false, CFGF_NONE),
   CFG_BOOL("tcp_buffer_userspace", cfg_true, CFGF_NONE),
   CFG_INT("tcp_buffer_size", 1500, CFGF_NONE),
+  CFG_BOOL("ktls", cfg_false, CFGF_NONE),
   CFG_INT("restricted_bandwidth", 10, CFGF_NONE),
   CFG_BOOL("daemon", cfg_false, CFGF_NONE),
   CFG_STR("unpriv_user", NULL, CFGF_NONE),
@@ -103,12 +108,22 @@ static cfg_opt_t g_opts[]=
   CFG_STR("ca_file", NULL, CFGF_NONE),
   CFG_STR("cert_file", NULL, CFGF_NONE),
   CFG_STR("private_key_file", NULL, CFGF_NONE),
+  CFG_INT("tls_session_cache_size", 1024, CFGF_NONE),
+  CFG_INT("tls_session_timeout", 300, CFGF_NONE),
+  CFG_STR("tls_ticket_key_file", NULL, CFGF_NONE),
+  CFG_INT("tls_handshake_threads", 0, CFGF_NONE),
   CFG_STR("realm", "domain.org", CFGF_NONE),
   CFG_STR("account_method", "file", CFGF_NONE),
   CFG_STR("account_file", "users.txt", CFGF_NONE),
   CFG_SEC("denied_address", g_denied_address_opts, CFGF_MULTI),
   CFG_INT("bandwidth_per_allocation", 0, CFGF_NONE),
+  CFG_INT("bandwidth_per_account", 0, CFGF_NONE),
+  CFG_INT("bandwidth_total", 0, CFGF_NONE),
+  CFG_BOOL("bandwidth_pacing", cfg_false, CFGF_NONE),
   CFG_BOOL("mod_tmpuser", cfg_false, CFGF_NONE),
+  CFG_STR("event_backend", "epoll", CFGF_NONE),
+  CFG_INT("workers", 1, CFGF_NONE),
+  CFG_INT("udp_batch_size", 32, CFGF_NONE),
   /* the following attributes are not used for the moment */
   CFG_STR("account_db_login", "anonymous", CFGF_NONE),
   CFG_STR("account_db_password", "anonymous", CFGF_NONE),
@@ -168,6 +183,29 @@ int turnserver_cfg_parse(const char* file, struct list_head* denied_address_list
     }
   }
 
+  /* check relay addresses */
+  nb = cfg_size(g_cfg, "relay_address");
+  for(i = 0 ; i < nb ; i++)
+  {
+    struct sockaddr_storage addr;
+    char* str = cfg_getnstr(g_cfg, "relay_address", i);
+    if(inet_pton(AF_INET, str, &addr) != 1)
+    {
+      return -2;
+    }
+  }
+
+  nb = cfg_size(g_cfg, "relay_addressv6");
+  for(i = 0 ; i < nb ; i++)
+  {
+    struct sockaddr_storage addr;
+    char* str = cfg_getnstr(g_cfg, "relay_addressv6", i);
+    if(inet_pton(AF_INET6, str, &addr) != 1)
+    {
+      return -2;
+    }
+  }
+
   /* add the denied address */
   nb = cfg_size(g_cfg, "denied_address");
   for(i = 0 ; i < nb ; i++)
@@ -209,7 +247,7 @@ int turnserver_cfg_parse(const char* file, struct list_head* denied_address_list
     else
     {
       /* mask check */
-      if(mask > 24)
+      if(mask > 32)
       {
         free(denied);
         return -2;
@@ -224,6 +262,26 @@ int turnserver_cfg_parse(const char* file, struct list_head* denied_address_list
   return 0;
 }
 
+char* turnserver_cfg_reload_nonce_key(const char* file)
+{
+  cfg_t* cfg = cfg_init(g_opts, CFGF_NONE);
+  char* ret = NULL;
+
+  if(!cfg)
+  {
+    return NULL;
+  }
+
+  /* only the nonce key can be changed without restart */
+  if(cfg_parse(cfg, file) == CFG_SUCCESS && cfg_getstr(cfg, "nonce_key"))
+  {
+    ret = strdup(cfg_getstr(cfg, "nonce_key"));
+  }
+
+  cfg_free(cfg);
+  return ret;
+}
+
 void turnserver_cfg_print(void)
 {
   fprintf(stdin, "Configuration:\n");
@@ -271,6 +329,29 @@ char* turnserver_cfg_listen_addressv6(void)
   }
 }
 
+char* turnserver_cfg_listen_address_lookup(int family, const void* addr)
+{
+  const char* name = (family == AF_INET6) ? "listen_addressv6" :
+    "listen_address";
+  size_t len = (family == AF_INET6) ? sizeof(struct in6_addr) :
+    sizeof(struct in_addr);
+  size_t nb = cfg_size(g_cfg, name);
+  size_t i = 0;
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    char* str = cfg_getnstr(g_cfg, name, i);
+    struct in6_addr tmp;
+
+    if(inet_pton(family, str, &tmp) == 1 && !memcmp(&tmp, addr, len))
+    {
+      return str;
+    }
+  }
+
+  return NULL;
+}
+
 uint16_t turnserver_cfg_udp_port(void)
 {
   return cfg_getint(g_cfg, "udp_port");
@@ -336,7 +417,7 @@ char* turnserver_cfg_unpriv_user(void)
   return cfg_getstr(g_cfg, "unpriv_user");
 }
 
-uint16_t turnserver_cfg_max_client(void)
+uint32_t turnserver_cfg_max_client(void)
 {
   return cfg_getint(g_cfg, "max_client");
 }
@@ -420,3 +501,80 @@ int turnserver_cfg_mod_tmpuser(void)
 {
   return cfg_getbool(g_cfg, "mod_tmpuser");
 }
+
+char* turnserver_cfg_event_backend(void)
+{
+  return cfg_getstr(g_cfg, "event_backend");
+}
+
+uint16_t turnserver_cfg_workers(void)
+{
+  return cfg_getint(g_cfg, "workers");
+}
+
+uint16_t turnserver_cfg_udp_batch_size(void)
+{
+  return cfg_getint(g_cfg, "udp_batch_size");
+}
+
+int turnserver_cfg_ktls(void)
+{
+  return cfg_getbool(g_cfg, "ktls");
+}
+
+uint32_t turnserver_cfg_bandwidth_per_account(void)
+{
+  return cfg_getint(g_cfg, "bandwidth_per_account");
+}
+
+uint32_t turnserver_cfg_bandwidth_total(void)
+{
+  return cfg_getint(g_cfg, "bandwidth_total");
+}
+
+int turnserver_cfg_bandwidth_pacing(void)
+{
+  return cfg_getbool(g_cfg, "bandwidth_pacing");
+}
+
+size_t turnserver_cfg_relay_address_nb(int family)
+{
+  return cfg_size(g_cfg, family == AF_INET6 ? "relay_addressv6" :
+      "relay_address");
+}
+
+char* turnserver_cfg_relay_address(int family, size_t index)
+{
+  return cfg_getnstr(g_cfg, family == AF_INET6 ? "relay_addressv6" :
+      "relay_address", index);
+}
+
+char* turnserver_cfg_relay_address_policy(void)
+{
+  return cfg_getstr(g_cfg, "relay_address_policy");
+}
+
+int turnserver_cfg_dtls_connected_sockets(void)
+{
+  return cfg_getbool(g_cfg, "dtls_connected_sockets");
+}
+
+uint32_t turnserver_cfg_tls_session_cache_size(void)
+{
+  return cfg_getint(g_cfg, "tls_session_cache_size");
+}
+
+uint32_t turnserver_cfg_tls_session_timeout(void)
+{
+  return cfg_getint(g_cfg, "tls_session_timeout");
+}
+
+char* turnserver_cfg_tls_ticket_key_file(void)
+{
+  return cfg_getstr(g_cfg, "tls_ticket_key_file");
+}
+
+uint32_t turnserver_cfg_tls_handshake_threads(void)
+{
+  return cfg_getint(g_cfg, "tls_handshake_threads");
+}
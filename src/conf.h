@@ -43,6 +43,7 @@
 #include <config.h>
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "list.h"
@@ -65,7 +66,7 @@ struct turnserver_cfg
   int dtls; /**< DTLS socket support (not in TURN standard) */
   int daemon; /**< Daemon state */
   char realm[256]; /**< Realm */
-  uint16_t max_client; /**< Max simultanous client */
+  uint32_t max_client; /**< Max simultanous client */
   uint16_t max_relay_per_username; /**< Max relay per username */
   uint32_t allocation_lifetime; /**< Lifetime the server will maintain a binding (in seconds) */
   char nonce_key[255]; /**< Private key used to generate nonce */
@@ -89,6 +90,16 @@ struct turnserver_cfg
  */
 int turnserver_cfg_parse(const char* file, struct list_head* denied_address_list);
 
+/**
+ * \brief Parse the configuration file again to get the nonce key.
+ *
+ * The configuration in use is not modified.
+ * \param file the file name
+ * \return nonce key (to free) or NULL if the file cannot be parsed or has no
+ * nonce key
+ */
+char* turnserver_cfg_reload_nonce_key(const char* file);
+
 /**
  * \brief Print the options.
  */
@@ -121,6 +132,14 @@ char* turnserver_cfg_listen_address(void);
  */
 char* turnserver_cfg_listen_addressv6(void);
 
+/**
+ * \brief Get the configured listening address equal to an address.
+ * \param family AF_INET for IPv4 or AF_INET6 for IPv6
+ * \param addr address (struct in_addr or struct in6_addr)
+ * \return listening address or NULL if addr is not configured
+ */
+char* turnserver_cfg_listen_address_lookup(int family, const void* addr);
+
 /**
  * \brief Get the UDP listening port.
  * \return UDP port
@@ -211,7 +230,7 @@ char* turnserver_cfg_unpriv_user(void);
  * \brief Get the maximum number of simulanous client.
  * \return max client
  */
-uint16_t turnserver_cfg_max_client(void);
+uint32_t turnserver_cfg_max_client(void);
 
 /**
  * \brief Get the maximum number of relay per username.
@@ -317,5 +336,102 @@ uint16_t turnserver_cfg_account_db_port(void);
  */
 int turnserver_cfg_mod_tmpuser(void);
 
+/**
+ * \brief Get the event notification backend used by the main loop.
+ * \return "epoll" or "select"
+ */
+char* turnserver_cfg_event_backend(void);
+
+/**
+ * \brief Get the number of worker processes.
+ * \return number of worker processes
+ */
+uint16_t turnserver_cfg_workers(void);
+
+/**
+ * \brief Get the maximum number of UDP datagrams received or sent at once.
+ * \return batch size
+ */
+uint16_t turnserver_cfg_udp_batch_size(void);
+
+/**
+ * \brief Returns whether or not kernel TLS offload is requested.
+ * \return 1 if kernel TLS is requested, 0 otherwise
+ */
+int turnserver_cfg_ktls(void);
+
+/**
+ * \brief Get the bandwidth limit shared by the allocations of an account.
+ * \return bandwidth limit in KBytes/s (0 means disabled)
+ */
+uint32_t turnserver_cfg_bandwidth_per_account(void);
+
+/**
+ * \brief Get the bandwidth limit of the server.
+ * \return bandwidth limit in KBytes/s (0 means disabled)
+ */
+uint32_t turnserver_cfg_bandwidth_total(void);
+
+/**
+ * \brief Returns whether or not traffic from peers which exceeds a bandwidth
+ * limit is delayed rather than dropped.
+ * \return 1 if pacing is enabled, 0 otherwise
+ */
+int turnserver_cfg_bandwidth_pacing(void);
+
+/**
+ * \brief Get the number of relay addresses of a family.
+ * \param family AF_INET for IPv4 or AF_INET6 for IPv6
+ * \return number of relay addresses (0 means that relayed addresses are taken
+ * from the listening ones)
+ */
+size_t turnserver_cfg_relay_address_nb(int family);
+
+/**
+ * \brief Get a relay address.
+ * \param family AF_INET for IPv4 or AF_INET6 for IPv6
+ * \param index index of the address (less than
+ * turnserver_cfg_relay_address_nb(family))
+ * \return relay address
+ */
+char* turnserver_cfg_relay_address(int family, size_t index);
+
+/**
+ * \brief Get how allocations are spread across the relay addresses.
+ * \return "least_loaded" or "hash"
+ */
+char* turnserver_cfg_relay_address_policy(void);
+
+/**
+ * \brief Returns whether or not each DTLS client gets its own connected UDP
+ * socket once its handshake is done.
+ * \return 1 if connected sockets are used, 0 otherwise
+ */
+int turnserver_cfg_dtls_connected_sockets(void);
+
+/**
+ * \brief Get the maximum number of TLS/DTLS sessions cached per process.
+ * \return number of sessions (0 disables the session ID cache)
+ */
+uint32_t turnserver_cfg_tls_session_cache_size(void);
+
+/**
+ * \brief Get the lifetime of a resumable TLS/DTLS session.
+ * \return lifetime in seconds
+ */
+uint32_t turnserver_cfg_tls_session_timeout(void);
+
+/**
+ * \brief Get the file of the TLS/DTLS session ticket keys.
+ * \return pathname or NULL if not set
+ */
+char* turnserver_cfg_tls_ticket_key_file(void);
+
+/**
+ * \brief Get the number of threads which run the TLS/DTLS handshakes.
+ * \return number of threads (0 if handshakes are run by the event loop)
+ */
+uint32_t turnserver_cfg_tls_handshake_threads(void);
+
 #endif /* CONF_H */
 
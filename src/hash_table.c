@@ -0,0 +1,227 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file hash_table.c
+ * \brief Hash table with chaining.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_table.h"
+
+/**
+ * \brief Change the number of buckets of a table.
+ * \param table hash table
+ * \param size new number of buckets (power of two)
+ * \return 0 if success, -1 if memory cannot be allocated
+ */
+static int hash_table_resize(struct hash_table* table, size_t size)
+{
+  struct list_head* buckets = NULL;
+  size_t i = 0;
+
+  if(!(buckets = malloc(size * sizeof(struct list_head))))
+  {
+    return -1;
+  }
+
+  for(i = 0 ; i < size ; i++)
+  {
+    list_head_init(&buckets[i]);
+  }
+
+  /* move nodes, hash is kept in each node so keys are not needed */
+  for(i = 0 ; i < table->size ; i++)
+  {
+    struct list_head* get = NULL;
+    struct list_head* n = NULL;
+
+    list_head_iterate_safe(&table->buckets[i], get, n)
+    {
+      struct hash_node* node = list_head_get(get, struct hash_node, list);
+
+      list_head_remove(&table->buckets[i], &node->list);
+      list_head_add_tail(&buckets[node->hash & (size - 1)], &node->list);
+    }
+  }
+
+  free(table->buckets);
+  table->buckets = buckets;
+  table->size = size;
+  return 0;
+}
+
+void hash_node_init(struct hash_node* node)
+{
+  node->hash = 0;
+  list_head_init(&node->list);
+}
+
+int hash_node_is_linked(const struct hash_node* node)
+{
+  return node->list.next != &node->list;
+}
+
+int hash_table_add(struct hash_table* table, struct hash_node* node,
+    uint32_t hash)
+{
+  int ret = 0;
+
+  if(!table->buckets)
+  {
+    if(hash_table_resize(table, HASH_TABLE_MIN_SIZE) == -1)
+    {
+      return -1;
+    }
+  }
+  else if(table->count >= table->size)
+  {
+    /* keep the old buckets if memory is missing */
+    ret = hash_table_resize(table, table->size * 2);
+  }
+
+  node->hash = hash;
+  list_head_add_tail(&table->buckets[hash & (table->size - 1)], &node->list);
+  table->count++;
+  return ret;
+}
+
+void hash_table_remove(struct hash_table* table, struct hash_node* node)
+{
+  if(hash_node_is_linked(node))
+  {
+    list_head_remove(&node->list, &node->list);
+    table->count--;
+  }
+}
+
+struct list_head* hash_table_bucket(const struct hash_table* table,
+    uint32_t hash)
+{
+  if(!table->buckets)
+  {
+    return NULL;
+  }
+
+  return &table->buckets[hash & (table->size - 1)];
+}
+
+void hash_table_free(struct hash_table* table)
+{
+  size_t i = 0;
+
+  for(i = 0 ; i < table->size ; i++)
+  {
+    struct list_head* get = NULL;
+    struct list_head* n = NULL;
+
+    list_head_iterate_safe(&table->buckets[i], get, n)
+    {
+      list_head_remove(&table->buckets[i], get);
+    }
+  }
+
+  free(table->buckets);
+  table->buckets = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+/**
+ * \brief Rotate left a 32 bit value.
+ * \param x value
+ * \param r number of bits
+ * \return rotated value
+ */
+static inline uint32_t hash_rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+uint32_t hash_bytes(const void* data, size_t len, uint32_t seed)
+{
+  const uint8_t* p = data;
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+  uint32_t h = seed;
+  uint32_t k = 0;
+  size_t i = 0;
+
+  for(i = 0 ; i + 4 <= len ; i += 4)
+  {
+    k = (uint32_t)p[i] | ((uint32_t)p[i + 1] << 8) |
+      ((uint32_t)p[i + 2] << 16) | ((uint32_t)p[i + 3] << 24);
+    k *= c1;
+    k = hash_rotl32(k, 15);
+    k *= c2;
+    h ^= k;
+    h = hash_rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  /* remaining bytes */
+  k = 0;
+  switch(len & 3)
+  {
+    case 3:
+      k ^= (uint32_t)p[i + 2] << 16;
+      /* fallthrough */
+    case 2:
+      k ^= (uint32_t)p[i + 1] << 8;
+      /* fallthrough */
+    case 1:
+      k ^= p[i];
+      k *= c1;
+      k = hash_rotl32(k, 15);
+      k *= c2;
+      h ^= k;
+      break;
+    default:
+      break;
+  }
+
+  /* finalization */
+  h ^= (uint32_t)len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
@@ -0,0 +1,151 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file hash_table.h
+ * \brief Hash table with chaining.
+ *
+ * Nodes are embedded in the objects stored (like list_head) so that adding or
+ * removing an object does not allocate memory. The table only indexes the
+ * objects, looking up a key and comparing it is done by the caller with the
+ * bucket returned by hash_table_bucket().
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/**
+ * \def HASH_TABLE_MIN_SIZE
+ * \brief Number of buckets allocated for the first node.
+ */
+#define HASH_TABLE_MIN_SIZE 64
+
+/**
+ * \struct hash_node
+ * \brief Node of a hash table (embedded in the object indexed).
+ */
+struct hash_node
+{
+  uint32_t hash; /**< Hash of the key of the object */
+  struct list_head list; /**< For list management (bucket) */
+};
+
+/**
+ * \struct hash_table
+ * \brief Hash table.
+ *
+ * A table filled with zeros is a valid empty table, buckets are allocated
+ * when the first node is added.
+ */
+struct hash_table
+{
+  struct list_head* buckets; /**< Buckets */
+  size_t size; /**< Number of buckets (power of two) */
+  size_t count; /**< Number of nodes */
+};
+
+/**
+ * \brief Initialize a node.
+ * \param node node
+ */
+void hash_node_init(struct hash_node* node);
+
+/**
+ * \brief Returns whether or not a node is in a table.
+ * \param node node
+ * \return 1 if node is in a table, 0 otherwise
+ */
+int hash_node_is_linked(const struct hash_node* node);
+
+/**
+ * \brief Add a node in a table.
+ *
+ * The table grows when it contains more nodes than buckets. If memory cannot
+ * be allocated for the growth, the node is still added.
+ * \param table hash table
+ * \param node node to add
+ * \param hash hash of the key of the object
+ * \return 0 if success, -1 if buckets cannot be allocated
+ */
+int hash_table_add(struct hash_table* table, struct hash_node* node,
+    uint32_t hash);
+
+/**
+ * \brief Remove a node from a table (nothing is done if it is not linked).
+ * \param table hash table
+ * \param node node to remove
+ */
+void hash_table_remove(struct hash_table* table, struct hash_node* node);
+
+/**
+ * \brief Get the bucket where nodes of a hash are stored.
+ *
+ * Iterate it with list_head_iterate() and get the nodes with
+ * list_head_get(get, type, member.list).
+ * \param table hash table
+ * \param hash hash of the key
+ * \return bucket or NULL if table is empty
+ */
+struct list_head* hash_table_bucket(const struct hash_table* table,
+    uint32_t hash);
+
+/**
+ * \brief Free the buckets of a table.
+ *
+ * The nodes are not freed, the table is then empty.
+ * \param table hash table
+ */
+void hash_table_free(struct hash_table* table);
+
+/**
+ * \brief Hash data.
+ *
+ * It uses MurmurHash3 (32 bit), a random seed makes the distribution
+ * unpredictable for remote users.
+ * \param data data to hash
+ * \param len length of data
+ * \param seed seed (or hash of the previous part of the key)
+ * \return hash
+ */
+uint32_t hash_bytes(const void* data, size_t len, uint32_t seed);
+
+#endif /* HASH_TABLE_H */
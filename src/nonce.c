@@ -0,0 +1,315 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file nonce.c
+ * \brief Stateless NONCE generation and verification.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "nonce.h"
+#include "hash_table.h"
+
+/**
+ * \def NONCE_MAC_LEN
+ * \brief Length of the truncated MAC (binary).
+ */
+#define NONCE_MAC_LEN 8
+
+/**
+ * \brief Convert binary data to lower case hexadecimal characters.
+ * \param data data
+ * \param len length of data
+ * \param out output buffer (at least 2 * len bytes)
+ */
+static void nonce_to_hex(const uint8_t* data, size_t len, uint8_t* out)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t i = 0;
+
+  for(i = 0 ; i < len ; i++)
+  {
+    out[2 * i] = hex[data[i] >> 4];
+    out[2 * i + 1] = hex[data[i] & 0x0f];
+  }
+}
+
+/**
+ * \brief Convert hexadecimal characters to binary data.
+ * \param in hexadecimal characters (2 * len bytes)
+ * \param len length of data
+ * \param data output buffer
+ * \return 0 if success, -1 if in contains a non hexadecimal character
+ */
+static int nonce_from_hex(const uint8_t* in, size_t len, uint8_t* data)
+{
+  size_t i = 0;
+
+  for(i = 0 ; i < 2 * len ; i++)
+  {
+    uint8_t c = in[i];
+    uint8_t v = 0;
+
+    if(c >= '0' && c <= '9')
+    {
+      v = c - '0';
+    }
+    else if(c >= 'a' && c <= 'f')
+    {
+      v = c - 'a' + 10;
+    }
+    else
+    {
+      return -1;
+    }
+
+    data[i / 2] = (i & 1) ? (data[i / 2] | v) : (uint8_t)(v << 4);
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Initialize a nonce key.
+ *
+ * fingerprint = HMAC-SHA1(nonce key, "nonce key id"), the key ID is its first
+ * byte.
+ * \param nkey key to initialize
+ * \param key nonce key
+ * \param key_len length of key
+ * \return 0 if success, -1 otherwise
+ */
+static int nonce_key_init(struct nonce_key* nkey, const unsigned char* key,
+    size_t key_len)
+{
+  static const char label[] = "nonce key id";
+
+  nkey->valid = 0;
+
+  if(crypto_hmac_sha1_key_init(&nkey->hkey, key, key_len) == -1 ||
+     crypto_hmac_sha1_key_generate(nkey->fingerprint,
+       (const unsigned char*)label, sizeof(label) - 1, &nkey->hkey) == -1)
+  {
+    return -1;
+  }
+
+  nkey->id = nkey->fingerprint[0];
+  nkey->valid = 1;
+
+  return 0;
+}
+
+/**
+ * \brief Compute the MAC of a nonce.
+ * \param nkey key
+ * \param expire expiration time of the nonce
+ * \param mac buffer that will be filled with the truncated MAC
+ * \return 0 if success, -1 otherwise
+ */
+static int nonce_mac(const struct nonce_key* nkey, uint32_t expire,
+    uint8_t* mac)
+{
+  uint8_t data[6];
+  uint8_t hash[20];
+
+  data[0] = NONCE_VERSION;
+  data[1] = nkey->id;
+  data[2] = expire >> 24;
+  data[3] = (expire >> 16) & 0xff;
+  data[4] = (expire >> 8) & 0xff;
+  data[5] = expire & 0xff;
+
+  if(crypto_hmac_sha1_key_generate(hash, data, sizeof(data),
+        &nkey->hkey) == -1)
+  {
+    return -1;
+  }
+
+  memcpy(mac, hash, NONCE_MAC_LEN);
+  return 0;
+}
+
+/**
+ * \brief Verify the MAC of a nonce with a key.
+ * \param nkey key
+ * \param id key ID of the nonce
+ * \param expire expiration time of the nonce
+ * \param mac MAC of the nonce
+ * \return 0 if nonce has been generated with nkey, -1 otherwise
+ */
+static int nonce_mac_verify(const struct nonce_key* nkey, uint8_t id,
+    uint32_t expire, const uint8_t* mac)
+{
+  uint8_t mac2[NONCE_MAC_LEN];
+
+  if(!nkey->valid || nkey->id != id || nonce_mac(nkey, expire, mac2) == -1)
+  {
+    return -1;
+  }
+
+  return CRYPTO_memcmp(mac, mac2, NONCE_MAC_LEN) ? -1 : 0;
+}
+
+int nonce_ctx_init(struct nonce_ctx* ctx, const unsigned char* key,
+    size_t key_len, uint32_t lifetime, uint32_t seed)
+{
+  memset(ctx, 0x00, sizeof(struct nonce_ctx));
+
+  if(nonce_key_init(&ctx->current, key, key_len) == -1)
+  {
+    return -1;
+  }
+
+  ctx->lifetime = lifetime;
+  ctx->seed = seed;
+  ctx->last_time = (time_t)-1;
+
+  return 0;
+}
+
+int nonce_ctx_set_key(struct nonce_ctx* ctx, const unsigned char* key,
+    size_t key_len)
+{
+  struct nonce_key nkey;
+
+  if(nonce_key_init(&nkey, key, key_len) == -1)
+  {
+    return -1;
+  }
+
+  if(ctx->current.valid && !memcmp(nkey.fingerprint, ctx->current.fingerprint,
+        sizeof(nkey.fingerprint)))
+  {
+    /* same key */
+    return 0;
+  }
+
+  ctx->previous = ctx->current;
+  ctx->current = nkey;
+
+  /* the cache may contain nonces of the key just dropped */
+  memset(ctx->cache, 0x00, sizeof(ctx->cache));
+  ctx->last_time = (time_t)-1;
+
+  return 1;
+}
+
+int nonce_generate(struct nonce_ctx* ctx, time_t now, uint8_t* nonce,
+    size_t len)
+{
+  uint32_t expire = (uint32_t)now + ctx->lifetime;
+  uint8_t bin[5 + NONCE_MAC_LEN];
+
+  if(len < NONCE_LEN)
+  {
+    return -1;
+  }
+
+  /* all nonces generated in the same second are identical */
+  if(now != ctx->last_time)
+  {
+    bin[0] = ctx->current.id;
+    bin[1] = expire >> 24;
+    bin[2] = (expire >> 16) & 0xff;
+    bin[3] = (expire >> 8) & 0xff;
+    bin[4] = expire & 0xff;
+
+    if(nonce_mac(&ctx->current, expire, bin + 5) == -1)
+    {
+      return -1;
+    }
+
+    ctx->last_nonce[0] = NONCE_VERSION;
+    nonce_to_hex(bin, sizeof(bin), ctx->last_nonce + 1);
+    ctx->last_time = now;
+  }
+
+  memcpy(nonce, ctx->last_nonce, NONCE_LEN);
+  return NONCE_LEN;
+}
+
+int nonce_verify(struct nonce_ctx* ctx, time_t now, const uint8_t* nonce,
+    size_t len, const struct sockaddr* saddr, socklen_t saddr_size)
+{
+  struct nonce_cache_entry* entry = NULL;
+  uint8_t bin[5 + NONCE_MAC_LEN];
+  uint32_t expire = 0;
+
+  if(len != NONCE_LEN || nonce[0] != NONCE_VERSION ||
+     nonce_from_hex(nonce + 1, sizeof(bin), bin) == -1)
+  {
+    return -1;
+  }
+
+  expire = ((uint32_t)bin[1] << 24) | ((uint32_t)bin[2] << 16) |
+    ((uint32_t)bin[3] << 8) | bin[4];
+
+  if((uint32_t)now > expire || expire < ctx->lifetime)
+  {
+    /* stale */
+    return -1;
+  }
+
+  /* the MAC has already been verified for this nonce */
+  entry = &ctx->cache[hash_bytes(saddr, saddr_size, ctx->seed) &
+    (NONCE_CACHE_SIZE - 1)];
+
+  if(entry->expire == expire && !memcmp(entry->nonce, nonce, NONCE_LEN))
+  {
+    ctx->cache_hits++;
+    return 0;
+  }
+
+  ctx->verified++;
+
+  /* key selected by the key ID */
+  if(nonce_mac_verify(&ctx->current, bin[0], expire, bin + 5) == -1 &&
+     nonce_mac_verify(&ctx->previous, bin[0], expire, bin + 5) == -1)
+  {
+    return -1;
+  }
+
+  memcpy(entry->nonce, nonce, NONCE_LEN);
+  entry->expire = expire;
+
+  return 0;
+}
+
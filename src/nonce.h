@@ -0,0 +1,176 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file nonce.h
+ * \brief Stateless NONCE generation and verification.
+ *
+ * A nonce is a printable string (RFC5389 NONCE attribute):
+ * version (1 character) | key ID (2 hexadecimal characters) |
+ * expiration time (8 hexadecimal characters) | MAC (16 hexadecimal characters).
+ *
+ * The MAC is HMAC-SHA1 truncated to 64 bits over the version, the key ID and
+ * the binary expiration time. The key ID is derived from the nonce key so
+ * that all processes agree on it without sharing any state. When the nonce
+ * key is changed, the previous one is kept to verify the outstanding nonces
+ * until they expire. Nonces already verified are kept in a small cache
+ * indexed by client address so that the next requests of a client do not
+ * compute the MAC again.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef NONCE_H
+#define NONCE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "util_crypto.h"
+
+/**
+ * \def NONCE_VERSION
+ * \brief Version of the nonce format (first character of a nonce).
+ */
+#define NONCE_VERSION '2'
+
+/**
+ * \def NONCE_LEN
+ * \brief Length of a nonce.
+ */
+#define NONCE_LEN 27
+
+/**
+ * \def NONCE_CACHE_SIZE
+ * \brief Number of entries of the verified nonces cache (power of 2).
+ */
+#define NONCE_CACHE_SIZE 1024
+
+/**
+ * \struct nonce_key
+ * \brief Key which authenticates nonces.
+ */
+struct nonce_key
+{
+  int valid; /**< If key is set */
+  uint8_t id; /**< Key ID (first byte of fingerprint) */
+  uint8_t fingerprint[20]; /**< HMAC of a constant string with the key */
+  struct crypto_hmac_sha1_key hkey; /**< Precomputed HMAC key */
+};
+
+/**
+ * \struct nonce_cache_entry
+ * \brief Nonce already verified.
+ */
+struct nonce_cache_entry
+{
+  uint8_t nonce[NONCE_LEN]; /**< Nonce */
+  uint32_t expire; /**< Expiration time of the nonce */
+};
+
+/**
+ * \struct nonce_ctx
+ * \brief Nonce generation and verification context.
+ */
+struct nonce_ctx
+{
+  struct nonce_key current; /**< Key of the generated nonces */
+  struct nonce_key previous; /**< Key replaced by nonce_ctx_set_key() */
+  uint32_t lifetime; /**< Lifetime of a nonce in seconds */
+  time_t last_time; /**< Time of the last generated nonce */
+  uint8_t last_nonce[NONCE_LEN]; /**< Last generated nonce */
+  uint32_t seed; /**< Seed to index the cache */
+  struct nonce_cache_entry cache[NONCE_CACHE_SIZE]; /**< Verified nonces */
+  unsigned long verified; /**< Number of MAC verified */
+  unsigned long cache_hits; /**< Number of nonces found in cache */
+};
+
+/**
+ * \brief Initialize a nonce context.
+ * \param ctx context to initialize
+ * \param key nonce key
+ * \param key_len length of key
+ * \param lifetime lifetime of a nonce in seconds
+ * \param seed random value to index the cache
+ * \return 0 if success, -1 otherwise
+ */
+int nonce_ctx_init(struct nonce_ctx* ctx, const unsigned char* key,
+    size_t key_len, uint32_t lifetime, uint32_t seed);
+
+/**
+ * \brief Change the nonce key.
+ *
+ * New nonces are authenticated with key, the nonces generated with the
+ * current key remain valid until they expire, those of the previous key are
+ * refused.
+ * \param ctx context
+ * \param key new nonce key
+ * \param key_len length of key
+ * \return 1 if key has changed, 0 if it is the current key, -1 if error
+ */
+int nonce_ctx_set_key(struct nonce_ctx* ctx, const unsigned char* key,
+    size_t key_len);
+
+/**
+ * \brief Generate a nonce.
+ * \param ctx context
+ * \param now current time
+ * \param nonce buffer that will be filled with the nonce
+ * \param len length of nonce, at least NONCE_LEN
+ * \return length of the nonce if success, -1 otherwise
+ */
+int nonce_generate(struct nonce_ctx* ctx, time_t now, uint8_t* nonce,
+    size_t len);
+
+/**
+ * \brief Verify a nonce received from a client.
+ * \param ctx context
+ * \param now current time
+ * \param nonce nonce
+ * \param len length of nonce
+ * \param saddr client address (used to index the cache)
+ * \param saddr_size sizeof saddr
+ * \return 0 if nonce is valid, -1 if it is stale or has not been generated by
+ * this server
+ */
+int nonce_verify(struct nonce_ctx* ctx, time_t now, const uint8_t* nonce,
+    size_t len, const struct sockaddr* saddr, socklen_t saddr_size);
+
+#endif /* NONCE_H */
+
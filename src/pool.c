@@ -0,0 +1,220 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file pool.c
+ * \brief Fixed-size object pool.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+/**
+ * \def POOL_ALIGN
+ * \brief Alignment of the objects (power of two).
+ */
+#define POOL_ALIGN 16
+
+/**
+ * \struct pool_slab
+ * \brief Header of a block of objects.
+ */
+struct pool_slab
+{
+  struct pool_slab* next; /**< Next block */
+};
+
+/**
+ * \struct pool_object
+ * \brief Free object, the link is stored in the object itself.
+ */
+struct pool_object
+{
+  struct pool_object* next; /**< Next free object */
+};
+
+/**
+ * \brief Round up a size to the alignment of the objects.
+ * \param size size
+ * \return size rounded up
+ */
+static size_t pool_align(size_t size)
+{
+  return (size + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1);
+}
+
+/**
+ * \brief Get the space used by an object in a slab.
+ * \param pool pool
+ * \return size of an object in a slab
+ */
+static size_t pool_stride(const struct pool* pool)
+{
+  size_t size = pool->object_size;
+
+  if(size < sizeof(struct pool_object))
+  {
+    size = sizeof(struct pool_object);
+  }
+
+  return pool_align(size);
+}
+
+/**
+ * \brief Add a slab of objects to a pool.
+ *
+ * Objects are put in the free list in address order so that objects
+ * allocated in a row are contiguous.
+ * \param pool pool
+ * \param nb number of objects
+ * \return 0 if success, -1 otherwise
+ */
+static int pool_grow(struct pool* pool, size_t nb)
+{
+  size_t stride = pool_stride(pool);
+  size_t header = pool_align(sizeof(struct pool_slab));
+  struct pool_slab* slab = NULL;
+  char* objects = NULL;
+  size_t i = nb;
+
+  if(nb == 0 || nb > (SIZE_MAX - header) / stride)
+  {
+    return -1;
+  }
+
+  if(!(slab = malloc(header + nb * stride)))
+  {
+    return -1;
+  }
+
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  objects = (char*)slab + header;
+
+  while(i > 0)
+  {
+    struct pool_object* obj = NULL;
+
+    i--;
+    obj = (struct pool_object*)(objects + i * stride);
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+  }
+
+  pool->total += nb;
+  return 0;
+}
+
+void pool_init(struct pool* pool, const char* name, size_t object_size,
+    size_t slab_objects)
+{
+  pool->name = name;
+  pool->object_size = object_size;
+  pool->slab_objects = slab_objects ? slab_objects : POOL_SLAB_OBJECTS;
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+  pool->used = 0;
+  pool->total = 0;
+  pool->high_water = 0;
+}
+
+int pool_reserve(struct pool* pool, size_t nb)
+{
+  if(nb <= pool->total - pool->used)
+  {
+    return 0;
+  }
+
+  return pool_grow(pool, nb - (pool->total - pool->used));
+}
+
+void* pool_alloc(struct pool* pool)
+{
+  struct pool_object* obj = NULL;
+
+  if(!pool->free_list && pool_grow(pool, pool->slab_objects) == -1)
+  {
+    return NULL;
+  }
+
+  obj = pool->free_list;
+  pool->free_list = obj->next;
+
+  pool->used++;
+  if(pool->used > pool->high_water)
+  {
+    pool->high_water = pool->used;
+  }
+
+  return obj;
+}
+
+void pool_free(struct pool* pool, void* object)
+{
+  struct pool_object* obj = object;
+
+  if(!obj)
+  {
+    return;
+  }
+
+  obj->next = pool->free_list;
+  pool->free_list = obj;
+  pool->used--;
+}
+
+void pool_destroy(struct pool* pool)
+{
+  struct pool_slab* slab = pool->slabs;
+
+  while(slab)
+  {
+    struct pool_slab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+  pool->used = 0;
+  pool->total = 0;
+  pool->high_water = 0;
+}
+
@@ -0,0 +1,133 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file pool.h
+ * \brief Fixed-size object pool.
+ *
+ * Objects are carved out of large blocks (slabs) and recycled through a free
+ * list, so allocating or releasing an object does not call malloc() or
+ * free(). Slabs are kept until the pool is destroyed. A pool can be filled in
+ * advance with pool_reserve() and keeps track of its occupancy and high-water
+ * mark.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+
+/**
+ * \def POOL_SLAB_OBJECTS
+ * \brief Default number of objects added when a pool is empty.
+ */
+#define POOL_SLAB_OBJECTS 32
+
+/**
+ * \def POOL_INITIALIZER
+ * \brief Static initializer for a pool.
+ * \param name name of the pool (for statistics)
+ * \param size size of an object
+ */
+#define POOL_INITIALIZER(name, size) \
+  {(name), (size), POOL_SLAB_OBJECTS, NULL, NULL, 0, 0, 0}
+
+/**
+ * \struct pool
+ * \brief Pool of fixed-size objects.
+ *
+ * A zeroed pool is not valid, use pool_init() or POOL_INITIALIZER.
+ */
+struct pool
+{
+  const char* name; /**< Name of the pool */
+  size_t object_size; /**< Size of an object */
+  size_t slab_objects; /**< Number of objects added when the pool is empty */
+  void* free_list; /**< Free objects */
+  void* slabs; /**< Blocks of memory allocated */
+  size_t used; /**< Number of objects in use */
+  size_t total; /**< Number of objects (used and free) */
+  size_t high_water; /**< Highest number of objects in use */
+};
+
+/**
+ * \brief Initialize a pool.
+ * \param pool pool to initialize
+ * \param name name of the pool (for statistics), it is not copied
+ * \param object_size size of an object
+ * \param slab_objects number of objects added when the pool is empty, 0 for
+ * POOL_SLAB_OBJECTS
+ */
+void pool_init(struct pool* pool, const char* name, size_t object_size,
+    size_t slab_objects);
+
+/**
+ * \brief Make sure a pool can provide at least nb objects without allocating
+ * memory.
+ * \param pool pool
+ * \param nb number of objects
+ * \return 0 if success, -1 otherwise
+ */
+int pool_reserve(struct pool* pool, size_t nb);
+
+/**
+ * \brief Get an object from a pool.
+ *
+ * The content of the object is undefined.
+ * \param pool pool
+ * \return pointer on an object or NULL if out of memory
+ */
+void* pool_alloc(struct pool* pool);
+
+/**
+ * \brief Give back an object to its pool.
+ * \param pool pool the object comes from
+ * \param object object, NULL is allowed
+ */
+void pool_free(struct pool* pool, void* object);
+
+/**
+ * \brief Release the memory of a pool.
+ *
+ * All objects that come from the pool become invalid. The pool can be used
+ * again after.
+ * \param pool pool
+ */
+void pool_destroy(struct pool* pool);
+
+#endif /* POOL_H */
+
@@ -0,0 +1,221 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file port_alloc.c
+ * \brief Relayed port allocator.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "port_alloc.h"
+
+/**
+ * \def PORT_ALLOC_EVEN_MASK
+ * \brief Bits of even ports in a word.
+ */
+#define PORT_ALLOC_EVEN_MASK 0x55555555U
+
+/**
+ * \brief Get the index of the lowest set bit.
+ * \param x word (not 0)
+ * \return index of the bit
+ */
+static unsigned int port_alloc_ctz(uint32_t x)
+{
+#if defined(__GNUC__)
+  return (unsigned int)__builtin_ctz(x);
+#else
+  unsigned int n = 0;
+
+  while(!(x & 1))
+  {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+/**
+ * \brief Test if a port is in the range of an allocator.
+ * \param pa allocator
+ * \param port port
+ * \return 1 if in range, 0 otherwise
+ */
+static int port_alloc_in_range(const struct port_alloc* pa, uint16_t port)
+{
+  return pa->bits && port >= pa->min_port && port <= pa->max_port;
+}
+
+int port_alloc_init(struct port_alloc* pa, uint16_t min_port,
+    uint16_t max_port)
+{
+  size_t i = 0;
+  size_t end = 0;
+
+  pa->bits = NULL;
+  pa->words = 0;
+  pa->cursor = 0;
+  pa->available = 0;
+
+  if(min_port > max_port)
+  {
+    return -1;
+  }
+
+  pa->base = min_port & ~31U;
+  pa->min_port = min_port;
+  pa->max_port = max_port;
+  pa->words = ((size_t)max_port - pa->base) / 32 + 1;
+
+  /* bits out of the range are set so they are never allocated */
+  pa->bits = malloc(pa->words * sizeof(uint32_t));
+  if(!pa->bits)
+  {
+    pa->words = 0;
+    return -1;
+  }
+
+  for(i = 0 ; i < pa->words ; i++)
+  {
+    pa->bits[i] = 0;
+  }
+
+  for(i = pa->base ; i < min_port ; i++)
+  {
+    pa->bits[(i - pa->base) / 32] |= 1U << ((i - pa->base) % 32);
+  }
+
+  end = pa->base + pa->words * 32;
+  for(i = (size_t)max_port + 1 ; i < end ; i++)
+  {
+    pa->bits[(i - pa->base) / 32] |= 1U << ((i - pa->base) % 32);
+  }
+
+  pa->available = (size_t)max_port - min_port + 1;
+  return 0;
+}
+
+void port_alloc_destroy(struct port_alloc* pa)
+{
+  free(pa->bits);
+  pa->bits = NULL;
+  pa->words = 0;
+  pa->available = 0;
+}
+
+uint16_t port_alloc_get(struct port_alloc* pa, int flags)
+{
+  size_t i = 0;
+  size_t needed = (flags & PORT_ALLOC_PAIR) ? 2 : 1;
+
+  if(pa->available < needed)
+  {
+    return 0;
+  }
+
+  for(i = 0 ; i < pa->words ; i++)
+  {
+    size_t idx = (pa->cursor + i) % pa->words;
+    uint32_t x = ~pa->bits[idx];
+    unsigned int bit = 0;
+
+    if(flags & PORT_ALLOC_PAIR)
+    {
+      /* even bit free and the next one too */
+      x &= (x >> 1) & PORT_ALLOC_EVEN_MASK;
+    }
+    else if(flags & PORT_ALLOC_EVEN)
+    {
+      x &= PORT_ALLOC_EVEN_MASK;
+    }
+
+    if(!x)
+    {
+      continue;
+    }
+
+    bit = port_alloc_ctz(x);
+    pa->bits[idx] |= (needed == 2 ? 3U : 1U) << bit;
+    pa->available -= needed;
+    pa->cursor = idx;
+    return (uint16_t)(pa->base + idx * 32 + bit);
+  }
+
+  return 0;
+}
+
+int port_alloc_take(struct port_alloc* pa, uint16_t port)
+{
+  size_t off = port - pa->base;
+  uint32_t mask = 0;
+
+  if(!port_alloc_in_range(pa, port))
+  {
+    return -1;
+  }
+
+  mask = 1U << (off % 32);
+  if(pa->bits[off / 32] & mask)
+  {
+    return -1;
+  }
+
+  pa->bits[off / 32] |= mask;
+  pa->available--;
+  return 0;
+}
+
+void port_alloc_release(struct port_alloc* pa, uint16_t port)
+{
+  size_t off = port - pa->base;
+  uint32_t mask = 0;
+
+  if(!port_alloc_in_range(pa, port))
+  {
+    return;
+  }
+
+  mask = 1U << (off % 32);
+  if(pa->bits[off / 32] & mask)
+  {
+    pa->bits[off / 32] &= ~mask;
+    pa->available++;
+  }
+}
+
@@ -0,0 +1,138 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file port_alloc.h
+ * \brief Relayed port allocator.
+ *
+ * Used and reserved ports of a range are tracked in a bitmap. Bits are
+ * aligned so that the parity of a bit is the one of its port, a free even
+ * port or a free pair (even port and the next one) is found in a word with a
+ * mask. The search starts at the word of the last allocation so consecutive
+ * allocations do not scan the used ports again.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef PORT_ALLOC_H
+#define PORT_ALLOC_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \def PORT_ALLOC_EVEN
+ * \brief Allocate an even port.
+ */
+#define PORT_ALLOC_EVEN 0x01
+
+/**
+ * \def PORT_ALLOC_PAIR
+ * \brief Allocate an even port and reserve the next one (EVEN-PORT with R
+ * bit).
+ */
+#define PORT_ALLOC_PAIR 0x02
+
+/**
+ * \struct port_alloc
+ * \brief Port allocator.
+ */
+struct port_alloc
+{
+  uint32_t* bits; /**< Bitmap, a set bit is a used or reserved port */
+  size_t words; /**< Number of words of bits */
+  size_t cursor; /**< Word where next search starts */
+  size_t available; /**< Number of free ports */
+  uint16_t base; /**< Port of the first bit */
+  uint16_t min_port; /**< First port of the range */
+  uint16_t max_port; /**< Last port of the range */
+};
+
+/**
+ * \brief Initialize an allocator.
+ * \param pa allocator
+ * \param min_port first port of the range
+ * \param max_port last port of the range
+ * \return 0 if success, -1 otherwise
+ */
+int port_alloc_init(struct port_alloc* pa, uint16_t min_port,
+    uint16_t max_port);
+
+/**
+ * \brief Release the memory of an allocator.
+ * \param pa allocator
+ */
+void port_alloc_destroy(struct port_alloc* pa);
+
+/**
+ * \brief Allocate a free port.
+ *
+ * With PORT_ALLOC_PAIR, the returned port is even and the next one is
+ * reserved too, both are released separately.
+ * \param pa allocator
+ * \param flags 0, PORT_ALLOC_EVEN or PORT_ALLOC_PAIR
+ * \return port or 0 if the range is exhausted
+ */
+uint16_t port_alloc_get(struct port_alloc* pa, int flags);
+
+/**
+ * \brief Mark a given port as used.
+ * \param pa allocator
+ * \param port port
+ * \return 0 if success, -1 if port is out of range or already used
+ */
+int port_alloc_take(struct port_alloc* pa, uint16_t port);
+
+/**
+ * \brief Release a port.
+ *
+ * Ports out of range or not used are ignored.
+ * \param pa allocator
+ * \param port port
+ */
+void port_alloc_release(struct port_alloc* pa, uint16_t port);
+
+/**
+ * \brief Get the number of free ports.
+ * \param pa allocator
+ * \return number of free ports
+ */
+static inline size_t port_alloc_available(const struct port_alloc* pa)
+{
+  return pa->available;
+}
+
+#endif /* PORT_ALLOC_H */
+
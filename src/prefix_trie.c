@@ -0,0 +1,294 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file prefix_trie.c
+ * \brief Prefix trie to match IPv4/IPv6 addresses and ports against a set of
+ * network prefixes.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "prefix_trie.h"
+
+/**
+ * \brief Get a nibble of an address.
+ * \param addr address
+ * \param index index of the nibble (0 is the most significant)
+ * \return nibble
+ */
+static inline unsigned int prefix_trie_nibble(const uint8_t* addr,
+    size_t index)
+{
+  uint8_t b = addr[index / 2];
+
+  return (index % 2) ? (b & 0x0f) : (b >> 4);
+}
+
+/**
+ * \brief Allocate a new node.
+ * \param trie prefix trie
+ * \return index of the node or 0 if memory allocation failed
+ */
+static uint32_t prefix_trie_node_new(struct prefix_trie* trie)
+{
+  if(trie->nodes_nb == trie->nodes_size)
+  {
+    size_t size = trie->nodes_size * 2;
+    struct prefix_trie_node* nodes = realloc(trie->nodes,
+        size * sizeof(struct prefix_trie_node));
+
+    if(!nodes)
+    {
+      return 0;
+    }
+
+    trie->nodes = nodes;
+    trie->nodes_size = size;
+  }
+
+  memset(&trie->nodes[trie->nodes_nb], 0x00, sizeof(struct prefix_trie_node));
+  return (uint32_t)trie->nodes_nb++;
+}
+
+/**
+ * \brief Add a port entry to a node.
+ * \param trie prefix trie
+ * \param node index of the node
+ * \param slots slots covered by the prefix
+ * \param port port
+ * \return 0 if success, -1 if memory allocation failed
+ */
+static int prefix_trie_port_add(struct prefix_trie* trie, uint32_t node,
+    uint16_t slots, uint16_t port)
+{
+  struct prefix_trie_port* entry = NULL;
+  uint32_t i = 0;
+
+  /* merge with an existing entry for the same port */
+  for(i = trie->nodes[node].ports ; i ; i = trie->ports[i].next)
+  {
+    if(trie->ports[i].port == port)
+    {
+      trie->ports[i].slots |= slots;
+      trie->nodes[node].match_port |= slots;
+      return 0;
+    }
+  }
+
+  if(trie->ports_nb == trie->ports_size)
+  {
+    size_t size = trie->ports_size * 2;
+    struct prefix_trie_port* ports = realloc(trie->ports,
+        size * sizeof(struct prefix_trie_port));
+
+    if(!ports)
+    {
+      return -1;
+    }
+
+    trie->ports = ports;
+    trie->ports_size = size;
+  }
+
+  entry = &trie->ports[trie->ports_nb];
+  entry->port = port;
+  entry->slots = slots;
+  entry->next = trie->nodes[node].ports;
+  trie->nodes[node].ports = (uint32_t)trie->ports_nb++;
+  trie->nodes[node].match_port |= slots;
+  return 0;
+}
+
+struct prefix_trie* prefix_trie_new(void)
+{
+  struct prefix_trie* ret = NULL;
+
+  if(!(ret = malloc(sizeof(struct prefix_trie))))
+  {
+    return NULL;
+  }
+
+  ret->nodes_size = 16;
+  ret->ports_size = 4;
+  ret->nodes = malloc(ret->nodes_size * sizeof(struct prefix_trie_node));
+  ret->ports = malloc(ret->ports_size * sizeof(struct prefix_trie_port));
+
+  if(!ret->nodes || !ret->ports)
+  {
+    free(ret->nodes);
+    free(ret->ports);
+    free(ret);
+    return NULL;
+  }
+
+  /* roots for IPv4 and IPv6 */
+  memset(ret->nodes, 0x00, 2 * sizeof(struct prefix_trie_node));
+  ret->nodes_nb = 2;
+
+  /* entry 0 means end of list */
+  memset(ret->ports, 0x00, sizeof(struct prefix_trie_port));
+  ret->ports_nb = 1;
+  return ret;
+}
+
+void prefix_trie_free(struct prefix_trie** trie)
+{
+  struct prefix_trie* ret = *trie;
+
+  free(ret->nodes);
+  free(ret->ports);
+  free(ret);
+  *trie = NULL;
+}
+
+int prefix_trie_add(struct prefix_trie* trie, int family, const uint8_t* addr,
+    uint8_t prefixlen, uint16_t port)
+{
+  uint32_t node = 0;
+  size_t depth = 0;
+  size_t i = 0;
+  unsigned int bits = 0;
+  unsigned int first = 0;
+  uint16_t slots = 0;
+
+  if((family == AF_INET && prefixlen > 32) ||
+     (family == AF_INET6 && prefixlen > 128) ||
+     (family != AF_INET && family != AF_INET6))
+  {
+    return -1;
+  }
+
+  node = (family == AF_INET) ? 0 : 1;
+
+  /* node where the prefix ends and number of its bits in this node */
+  depth = prefixlen ? (prefixlen - 1) / PREFIX_TRIE_STRIDE : 0;
+  bits = prefixlen - depth * PREFIX_TRIE_STRIDE;
+
+  for(i = 0 ; i < depth ; i++)
+  {
+    unsigned int nibble = prefix_trie_nibble(addr, i);
+    uint32_t child = trie->nodes[node].children[nibble];
+
+    if(!child)
+    {
+      if(!(child = prefix_trie_node_new(trie)))
+      {
+        return -1;
+      }
+      trie->nodes[node].children[nibble] = child;
+    }
+
+    node = child;
+  }
+
+  /* slots covered by the remaining bits of the prefix */
+  first = bits ? prefix_trie_nibble(addr, depth) &
+    ~((1U << (PREFIX_TRIE_STRIDE - bits)) - 1) : 0;
+
+  for(i = 0 ; i < (1U << (PREFIX_TRIE_STRIDE - bits)) ; i++)
+  {
+    slots |= (uint16_t)(1U << (first + i));
+  }
+
+  if(port == 0)
+  {
+    trie->nodes[node].match |= slots;
+    return 0;
+  }
+
+  return prefix_trie_port_add(trie, node, slots, port);
+}
+
+int prefix_trie_match(const struct prefix_trie* trie, const uint8_t* addr,
+    size_t addrlen, uint16_t port)
+{
+  uint32_t node = 0;
+  size_t nibbles = 0;
+  size_t i = 0;
+
+  if(addrlen == 4)
+  {
+    node = 0;
+  }
+  else if(addrlen == 16)
+  {
+    node = 1;
+  }
+  else
+  {
+    return 0;
+  }
+
+  nibbles = addrlen * 2;
+
+  for(i = 0 ; i < nibbles ; i++)
+  {
+    const struct prefix_trie_node* n = &trie->nodes[node];
+    unsigned int nibble = prefix_trie_nibble(addr, i);
+    uint16_t bit = (uint16_t)(1U << nibble);
+
+    if(n->match & bit)
+    {
+      return 1;
+    }
+
+    if(n->match_port & bit)
+    {
+      uint32_t j = 0;
+
+      for(j = n->ports ; j ; j = trie->ports[j].next)
+      {
+        if(trie->ports[j].port == port && (trie->ports[j].slots & bit))
+        {
+          return 1;
+        }
+      }
+    }
+
+    if(!(node = n->children[nibble]))
+    {
+      break;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file prefix_trie.h
+ * \brief Prefix trie to match IPv4/IPv6 addresses and ports against a set of
+ * network prefixes.
+ *
+ * It is a multibit trie which consumes four bits of the address per node.
+ * A prefix is stored in the node where it ends by marking all the slots it
+ * covers, so matching an address visits at most one node per nibble and
+ * stops at the first matching prefix. Nodes are stored in one array and
+ * linked by index to keep the structure compact.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef PREFIX_TRIE_H
+#define PREFIX_TRIE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * \def PREFIX_TRIE_STRIDE
+ * \brief Number of bits of the address consumed by a node.
+ */
+#define PREFIX_TRIE_STRIDE 4
+
+/**
+ * \def PREFIX_TRIE_SLOTS
+ * \brief Number of slots of a node.
+ */
+#define PREFIX_TRIE_SLOTS (1 << PREFIX_TRIE_STRIDE)
+
+/**
+ * \struct prefix_trie_node
+ * \brief Node of the prefix trie.
+ */
+struct prefix_trie_node
+{
+  uint32_t children[PREFIX_TRIE_SLOTS]; /**< Index of child nodes (0 if
+                                          none) */
+  uint16_t match; /**< Slots covered by a prefix for all ports */
+  uint16_t match_port; /**< Slots covered by a prefix for some ports */
+  uint32_t ports; /**< First port entry of the node (0 if none) */
+};
+
+/**
+ * \struct prefix_trie_port
+ * \brief Port-specific entry of a node.
+ */
+struct prefix_trie_port
+{
+  uint16_t port; /**< Port */
+  uint16_t slots; /**< Slots covered by the prefix */
+  uint32_t next; /**< Next port entry of the node (0 if none) */
+};
+
+/**
+ * \struct prefix_trie
+ * \brief Prefix trie for IPv4 and IPv6 addresses.
+ *
+ * Node 0 is the root for IPv4 and node 1 the root for IPv6. Port entry 0 is
+ * not used.
+ */
+struct prefix_trie
+{
+  struct prefix_trie_node* nodes; /**< Nodes */
+  size_t nodes_nb; /**< Number of nodes used */
+  size_t nodes_size; /**< Number of nodes allocated */
+  struct prefix_trie_port* ports; /**< Port entries */
+  size_t ports_nb; /**< Number of port entries used */
+  size_t ports_size; /**< Number of port entries allocated */
+};
+
+/**
+ * \brief Create a new empty prefix trie.
+ * \return pointer on prefix_trie or NULL if memory allocation failed
+ */
+struct prefix_trie* prefix_trie_new(void);
+
+/**
+ * \brief Free a prefix trie.
+ * \param trie pointer on pointer allocated by prefix_trie_new
+ */
+void prefix_trie_free(struct prefix_trie** trie);
+
+/**
+ * \brief Add a prefix.
+ * \param trie prefix trie
+ * \param family address family (AF_INET or AF_INET6)
+ * \param addr network address (4 or 16 bytes)
+ * \param prefixlen length of the prefix in bits
+ * \param port port which matches (0 for all ports)
+ * \return 0 if success, -1 otherwise
+ */
+int prefix_trie_add(struct prefix_trie* trie, int family, const uint8_t* addr,
+    uint8_t prefixlen, uint16_t port);
+
+/**
+ * \brief Check if an address and port match one of the prefixes.
+ * \param trie prefix trie
+ * \param addr IPv4/IPv6 address to check
+ * \param addrlen sizeof the address (IPv4 = 4, IPv6 = 16)
+ * \param port port to check
+ * \return 1 if address matches, 0 otherwise
+ */
+int prefix_trie_match(const struct prefix_trie* trie, const uint8_t* addr,
+    size_t addrlen, uint16_t port);
+
+#endif /* PREFIX_TRIE_H */
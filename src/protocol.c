@@ -46,6 +46,7 @@
 #include <openssl/sha.h>
 #include <openssl/md5.h>
 #include <openssl/hmac.h>
+#include <openssl/crypto.h>
 
 #include "util_sys.h"
 #include "util_net.h"
@@ -58,174 +59,598 @@ extern "C"
 #endif
 
 /**
- * \brief Helper function to create MAPPED-ADDRESS like.
- * \param type type
- * \param address network address
- * \param iov vector
- * \return pointer on turn_attr_hdr or NULL if problem
+ * \brief Reserve an attribute at the end of the message being built.
+ *
+ * The attribute header is written, the padding is zeroed and the message
+ * length is updated. If the builder has no buffer (see
+ * turn_attr_builder_init()), one is allocated for the attribute.
+ * \param builder builder
+ * \param type attribute type
+ * \param len length of the value (without padding)
+ * \return pointer on the value or NULL if there is not enough room
  */
-static struct turn_attr_hdr* turn_attr_address_create(uint16_t type, const struct sockaddr* address, struct iovec* iov)
+static uint8_t* turn_msg_builder_reserve(struct turn_msg_builder* builder,
+    uint16_t type, size_t len)
 {
-  /* MAPPED-ADDRESS are the same as ALTERNATE-ADDRESS */
-  struct turn_attr_mapped_address* ret = NULL;
-  size_t len = 0;
-  uint8_t* ptr = NULL; /* pointer on the address (IPv4 or IPv6) */
-  uint8_t family = 0;
-  uint16_t port = 0;
+  struct turn_attr_hdr* attr = NULL;
+  size_t real_len = len;
+  size_t total = 0;
 
-  switch(address->sa_family)
+  if(len > 0xFFFF)
   {
-    case AF_INET:
-      ptr = (uint8_t*)&((struct sockaddr_in*)address)->sin_addr;
-      port = ntohs(((struct sockaddr_in*)address)->sin_port);
-      family = STUN_ATTR_FAMILY_IPV4;
-      len = 4;
-      break;
-    case AF_INET6:
-      if(IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)address)->sin6_addr))
-      {
-        ptr = &((struct sockaddr_in6*)address)->sin6_addr.s6_addr[12];
-        port = ((struct sockaddr_in6*)&address)->sin6_port;
-        family = STUN_ATTR_FAMILY_IPV4;
-        len = 4;
-      }
-      else
-      {
-        ptr = (uint8_t*)&((struct sockaddr_in6*)address)->sin6_addr;
-        port = ntohs(((struct sockaddr_in6*)address)->sin6_port);
-        family = STUN_ATTR_FAMILY_IPV6;
-        len = 16;
-        break;
-      }
-    default:
+    return NULL;
+  }
+
+  /* real_len, attribute header size and padding must be a multiple of four */
+  if(real_len % 4)
+  {
+    real_len += (4 - (real_len % 4));
+  }
+
+  total = sizeof(struct turn_attr_hdr) + real_len;
+
+  if(!builder->buf)
+  {
+    if(!(builder->buf = malloc(total)))
+    {
       return NULL;
-      break;
+    }
+    builder->size = total;
   }
 
-  if(!(ret = malloc(sizeof(struct turn_attr_mapped_address) + len)))
+  if(builder->size - builder->len < total)
   {
     return NULL;
   }
 
-  ret->turn_attr_type = htons(type);
-  /* reserved (1)  + family (1) + port (2) + address (variable) */
-  ret->turn_attr_len = htons(4 + len);
-  ret->turn_attr_reserved = 0;
-  ret->turn_attr_family = family;
-  ret->turn_attr_port = htons(port);
-  memcpy(ret->turn_attr_address, ptr, len);
+  if(builder->hdr &&
+     builder->len + total - sizeof(struct turn_msg_hdr) > 0xFFFF)
+  {
+    /* message length would overflow */
+    return NULL;
+  }
 
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_mapped_address) + len;
+  attr = (struct turn_attr_hdr*)(builder->buf + builder->len);
+  attr->turn_attr_type = htons(type);
+  attr->turn_attr_len = htons(len);
+  memset(attr->turn_attr_value + len, 0x00, real_len - len);
+
+  builder->len += total;
 
-  return (struct turn_attr_hdr*)ret;
+  if(builder->hdr)
+  {
+    builder->hdr->turn_msg_len = htons(builder->len -
+        sizeof(struct turn_msg_hdr));
+  }
+
+  return attr->turn_attr_value;
 }
 
 /**
- * \brief Helper function to create XOR-MAPPED-ADDRESS like.
+ * \brief Initialize a builder for a single attribute allocated with malloc().
+ *
+ * Used by the turn_attr_*_create() functions which give each attribute in its
+ * own chunk of memory.
+ * \param builder builder
+ */
+static void turn_attr_builder_init(struct turn_msg_builder* builder)
+{
+  builder->buf = NULL;
+  builder->size = 0;
+  builder->len = 0;
+  builder->hdr = NULL;
+}
+
+/**
+ * \brief Give the attribute built to the caller.
+ * \param builder builder initialized with turn_attr_builder_init()
+ * \param ret result of the turn_msg_builder_add_*() function
+ * \param iov vector
+ * \return pointer on turn_attr_hdr or NULL if problem
+ */
+static struct turn_attr_hdr* turn_attr_builder_finish(
+    struct turn_msg_builder* builder, int ret, struct iovec* iov)
+{
+  if(ret == -1)
+  {
+    free(builder->buf);
+    return NULL;
+  }
+
+  iov->iov_base = builder->buf;
+  iov->iov_len = builder->len;
+
+  return (struct turn_attr_hdr*)builder->buf;
+}
+
+/**
+ * \brief Get the STUN family, the network address and the port of a socket
+ * address.
+ *
+ * IPv4-mapped IPv6 addresses are given as IPv4 ones.
+ * \param address socket address
+ * \param family STUN family will be filled in
+ * \param addr network address will be filled in (16 bytes)
+ * \param port port will be filled in (host order)
+ * \return length of the network address (4 or 16) or 0 if family is not
+ * supported
+ */
+static size_t turn_sockaddr_get(const struct sockaddr* address,
+    uint8_t* family, uint8_t* addr, uint16_t* port)
+{
+  const struct sockaddr_in* sin = (const struct sockaddr_in*)address;
+  const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)address;
+
+  switch(address->sa_family)
+  {
+    case AF_INET:
+      memcpy(addr, &sin->sin_addr, 4);
+      *port = ntohs(sin->sin_port);
+      *family = STUN_ATTR_FAMILY_IPV4;
+      return 4;
+    case AF_INET6:
+      *port = ntohs(sin6->sin6_port);
+
+      if(IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+      {
+        memcpy(addr, &sin6->sin6_addr.s6_addr[12], 4);
+        *family = STUN_ATTR_FAMILY_IPV4;
+        return 4;
+      }
+
+      memcpy(addr, &sin6->sin6_addr, 16);
+      *family = STUN_ATTR_FAMILY_IPV6;
+      return 16;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * \brief Add a XOR-MAPPED-ADDRESS like attribute with the given cookie and
+ * transaction ID.
+ * \param builder builder
  * \param type type
  * \param address network address
  * \param cookie magic cookie
  * \param id 96 bit transaction ID
- * \param iov vector
- * \return pointer on turn_attr_hdr or NULL if problem
+ * \return 0 if success, -1 otherwise
  */
-static struct turn_attr_hdr* turn_attr_xor_address_create(uint16_t type,
-    const struct sockaddr* address, uint32_t cookie, const uint8_t* id,
-    struct iovec* iov)
+static int turn_msg_builder_add_xor_address_id(
+    struct turn_msg_builder* builder, uint16_t type,
+    const struct sockaddr* address, uint32_t cookie, const uint8_t* id)
 {
   /* XOR-MAPPED-ADDRESS are the same as XOR-PEER-ADDRESS and
    * XOR-RELAYED-ADDRESS
    */
-  struct turn_attr_xor_mapped_address* ret = NULL;
+  struct turn_attr_xor_mapped_address* attr = NULL;
+  uint8_t addr[16];
+  uint8_t* value = NULL;
+  uint8_t family = 0;
+  uint16_t port = 0;
   size_t len = 0;
-  uint8_t* ptr = NULL; /* pointer on the address (IPv4 or IPv6) */
-  uint8_t* p = (uint8_t*)&cookie;
   size_t i = 0;
-  struct sockaddr_storage storage;
-  uint16_t port = 0;
-  uint8_t family = 0;
-  uint16_t msb_cookie = 0;
 
-  switch(address->sa_family)
+  if(!(len = turn_sockaddr_get(address, &family, addr, &port)))
   {
-    case AF_INET:
-      memcpy(&storage, address, sizeof(struct sockaddr_in));
-      ptr = (uint8_t*)&((struct sockaddr_in*)&storage)->sin_addr;
-      port = ntohs(((struct sockaddr_in*)&storage)->sin_port);
-      family = STUN_ATTR_FAMILY_IPV4;
-      len = 4;
-      break;
-    case AF_INET6:
-      if(IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)address)->sin6_addr))
-      {
-        ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
-        memcpy(&((struct sockaddr_in*)&storage)->sin_addr,
-            &((struct sockaddr_in6*)address)->sin6_addr.s6_addr[12], 4);
-        ptr = (uint8_t*)&((struct sockaddr_in*)&storage)->sin_addr;
-        ((struct sockaddr_in*)&storage)->sin_port =
-          ((struct sockaddr_in6*)address)->sin6_port;
-        memset(((struct sockaddr_in*)&storage)->sin_zero, 0x00,
-            sizeof(((struct sockaddr_in*)&storage)->sin_zero));
-        port = ntohs(((struct sockaddr_in*)&storage)->sin_port);
-        family = STUN_ATTR_FAMILY_IPV4;
-        len = 4;
-      }
-      else
-      {
-        memcpy(&storage, address, sizeof(struct sockaddr_in6));
-        ptr = (uint8_t*)&((struct sockaddr_in6*)&storage)->sin6_addr;
-        port = ntohs(((struct sockaddr_in6*)&storage)->sin6_port);
-        family = STUN_ATTR_FAMILY_IPV6;
-        len = 16;
-      }
-      break;
-    default:
-      return NULL;
-      break;
+    return -1;
   }
 
-  if(!(ret = malloc(sizeof(struct turn_attr_xor_mapped_address) + len)))
+  /* reserved (1)  + family (1) + port (2) + address (variable) */
+  if(!(value = turn_msg_builder_reserve(builder, type, 4 + len)))
   {
-    return NULL;
+    return -1;
   }
 
   /* XOR the address and port */
+  cookie = htonl(cookie);
 
   /* host order port XOR most-significant 16 bits of the cookie */
-  cookie = htonl(cookie);
-  msb_cookie = ((uint8_t*)&cookie)[0] << 8 | ((uint8_t*)&cookie)[1];
-  port ^= msb_cookie;
+  port ^= ((uint8_t*)&cookie)[0] << 8 | ((uint8_t*)&cookie)[1];
 
   /* IPv4/IPv6 XOR cookie (just the first four bytes of IPv6 address) */
   for(i = 0 ; i < 4 ; i++)
   {
-    ptr[i] ^= p[i];
+    addr[i] ^= ((uint8_t*)&cookie)[i];
   }
 
   /* end of IPv6 address XOR transaction ID */
   for(i = 4 ; i < len ; i++)
   {
-    ptr[i] ^= id[i - 4];
+    addr[i] ^= id[i - 4];
+  }
+
+  attr = (struct turn_attr_xor_mapped_address*)(value -
+      sizeof(struct turn_attr_hdr));
+  attr->turn_attr_reserved = 0;
+  attr->turn_attr_family = family;
+  attr->turn_attr_port = htons(port);
+  memcpy(attr->turn_attr_address, addr, len);
+
+  return 0;
+}
+
+/**
+ * \brief Add an attribute which value is a padded string (or opaque data).
+ * \param builder builder
+ * \param type type
+ * \param data value
+ * \param len length of the value
+ * \param max_len maximum length allowed for the value
+ * \return 0 if success, -1 otherwise
+ */
+static int turn_msg_builder_add_string(struct turn_msg_builder* builder,
+    uint16_t type, const void* data, size_t len, size_t max_len)
+{
+  uint8_t* value = NULL;
+
+  if(len > max_len || !(value = turn_msg_builder_reserve(builder, type, len)))
+  {
+    return -1;
+  }
+
+  memcpy(value, data, len);
+  return 0;
+}
+
+int turn_msg_builder_init(struct turn_msg_builder* builder, void* buf,
+    size_t size, uint16_t type, const uint8_t* id)
+{
+  struct turn_msg_hdr* hdr = buf;
+
+  if(size < sizeof(struct turn_msg_hdr))
+  {
+    return -1;
+  }
+
+  hdr->turn_msg_type = htons(type);
+  hdr->turn_msg_len = 0;
+  hdr->turn_msg_cookie = htonl(STUN_MAGIC_COOKIE);
+  memcpy(hdr->turn_msg_id, id, 12);
+
+  builder->buf = buf;
+  builder->size = size;
+  builder->len = sizeof(struct turn_msg_hdr);
+  builder->hdr = hdr;
+
+  return 0;
+}
+
+int turn_msg_builder_add_attr(struct turn_msg_builder* builder,
+    uint16_t type, const void* data, size_t len)
+{
+  return turn_msg_builder_add_string(builder, type, data, len, 0xFFFF);
+}
+
+int turn_msg_builder_add_address(struct turn_msg_builder* builder,
+    uint16_t type, const struct sockaddr* address)
+{
+  /* MAPPED-ADDRESS are the same as ALTERNATE-ADDRESS */
+  struct turn_attr_mapped_address* attr = NULL;
+  uint8_t addr[16];
+  uint8_t* value = NULL;
+  uint8_t family = 0;
+  uint16_t port = 0;
+  size_t len = 0;
+
+  if(!(len = turn_sockaddr_get(address, &family, addr, &port)))
+  {
+    return -1;
   }
 
-  ret->turn_attr_type = htons(type);
   /* reserved (1)  + family (1) + port (2) + address (variable) */
-  ret->turn_attr_len = htons(4 + len);
-  ret->turn_attr_reserved = 0;
-  ret->turn_attr_family = family;
-  ret->turn_attr_port = htons(port);
-  memcpy(ret->turn_attr_address, ptr, len);
+  if(!(value = turn_msg_builder_reserve(builder, type, 4 + len)))
+  {
+    return -1;
+  }
 
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_xor_mapped_address) + len;
+  attr = (struct turn_attr_mapped_address*)(value -
+      sizeof(struct turn_attr_hdr));
+  attr->turn_attr_reserved = 0;
+  attr->turn_attr_family = family;
+  attr->turn_attr_port = htons(port);
+  memcpy(attr->turn_attr_address, addr, len);
+
+  return 0;
+}
+
+int turn_msg_builder_add_xor_address(struct turn_msg_builder* builder,
+    uint16_t type, const struct sockaddr* address)
+{
+  if(!builder->hdr)
+  {
+    return -1;
+  }
+
+  return turn_msg_builder_add_xor_address_id(builder, type, address,
+      STUN_MAGIC_COOKIE, builder->hdr->turn_msg_id);
+}
+
+int turn_msg_builder_add_username(struct turn_msg_builder* builder,
+    const char* username, size_t len)
+{
+  /* MUST be less than 513 bytes */
+  return turn_msg_builder_add_string(builder, STUN_ATTR_USERNAME, username,
+      len, 512);
+}
+
+int turn_msg_builder_add_error(struct turn_msg_builder* builder,
+    uint16_t code, const char* reason, size_t len)
+{
+  uint8_t class = code / 100;
+  uint8_t number = code % 100;
+  size_t real_len = len;
+  uint8_t* value = NULL;
+
+  /* reason can be as long as 763 bytes */
+  if(len > 763)
+  {
+    return -1;
+  }
+
+  /* class MUST be between 3 and 6 */
+  if(class < 3 || class > 6)
+  {
+    return -1;
+  }
+
+  /* reason is padded to a multiple of four */
+  if(real_len % 4)
+  {
+    real_len += (4 - (real_len % 4));
+  }
+
+  /* 21 bit reserved + 3 bit class + 8 bit number + reason */
+  if(!(value = turn_msg_builder_reserve(builder, STUN_ATTR_ERROR_CODE,
+          4 + real_len)))
+  {
+    return -1;
+  }
+
+  value[0] = 0;
+  value[1] = 0;
+  value[2] = class;
+  value[3] = number;
+
+  /* even if strlen(reason) < len, strncpy will add extra-zero
+   * also no need to add final NULL character since length is known (TLV)
+   */
+  strncpy((char*)value + 4, reason, real_len);
+
+  return 0;
+}
+
+int turn_msg_builder_add_unknown_attributes(struct turn_msg_builder* builder,
+    const uint16_t* unknown_attributes, size_t attr_size)
+{
+  uint8_t* value = NULL;
+  uint16_t attr = 0;
+  size_t i = 0;
+
+  /* each attribute has 2 bytes length */
+  if(!(value = turn_msg_builder_reserve(builder, STUN_ATTR_UNKNOWN_ATTRIBUTES,
+          attr_size * 2)))
+  {
+    return -1;
+  }
 
-  return (struct turn_attr_hdr*)ret;
+  for(i = 0 ; i < attr_size ; i++)
+  {
+    attr = htons(unknown_attributes[i]);
+    memcpy(value + i * 2, &attr, 2);
+  }
+
+  if(attr_size % 2)
+  {
+    /* padding repeats the last attribute value */
+    memcpy(value + attr_size * 2, &attr, 2);
+  }
+
+  return 0;
+}
+
+int turn_msg_builder_add_realm(struct turn_msg_builder* builder,
+    const char* realm, size_t len)
+{
+  /* realm can be as long as 763 bytes */
+  return turn_msg_builder_add_string(builder, STUN_ATTR_REALM, realm, len,
+      763);
+}
+
+int turn_msg_builder_add_nonce(struct turn_msg_builder* builder,
+    const uint8_t* nonce, size_t len)
+{
+  /* nonce can be as long as 763 bytes */
+  return turn_msg_builder_add_string(builder, STUN_ATTR_NONCE, nonce, len,
+      763);
+}
+
+int turn_msg_builder_add_software(struct turn_msg_builder* builder,
+    const char* software, size_t len)
+{
+  /* software can be as long as 763 bytes */
+  return turn_msg_builder_add_string(builder, STUN_ATTR_SOFTWARE, software,
+      len, 763);
+}
+
+int turn_msg_builder_add_channel_number(struct turn_msg_builder* builder,
+    uint16_t number)
+{
+  uint8_t* value = NULL;
+
+  if(!(value = turn_msg_builder_reserve(builder, TURN_ATTR_CHANNEL_NUMBER, 4)))
+  {
+    return -1;
+  }
+
+  /* number (2) + RFFU (2) */
+  number = htons(number);
+  memcpy(value, &number, 2);
+  value[2] = 0;
+  value[3] = 0;
+
+  return 0;
+}
+
+int turn_msg_builder_add_lifetime(struct turn_msg_builder* builder,
+    uint32_t lifetime)
+{
+  uint8_t* value = NULL;
+
+  if(!(value = turn_msg_builder_reserve(builder, TURN_ATTR_LIFETIME, 4)))
+  {
+    return -1;
+  }
+
+  lifetime = htonl(lifetime);
+  memcpy(value, &lifetime, 4);
+
+  return 0;
+}
+
+int turn_msg_builder_add_data(struct turn_msg_builder* builder,
+    const void* data, size_t len)
+{
+  return turn_msg_builder_add_string(builder, TURN_ATTR_DATA, data, len,
+      0xFFFF);
+}
+
+int turn_msg_builder_add_even_port(struct turn_msg_builder* builder,
+    uint8_t flags)
+{
+  uint8_t* value = NULL;
+
+  /* flags (1) + reserved (3) */
+  if(!(value = turn_msg_builder_reserve(builder, TURN_ATTR_EVEN_PORT, 4)))
+  {
+    return -1;
+  }
+
+  value[0] = flags;
+  return 0;
+}
+
+int turn_msg_builder_add_requested_transport(struct turn_msg_builder* builder,
+    uint8_t protocol)
+{
+  uint8_t* value = NULL;
+
+  /* protocol (1) + reserved (3) */
+  if(!(value = turn_msg_builder_reserve(builder, TURN_ATTR_REQUESTED_TRANSPORT,
+          4)))
+  {
+    return -1;
+  }
+
+  value[0] = protocol;
+  value[1] = 0;
+  value[2] = 0;
+  value[3] = 0;
+  return 0;
+}
+
+int turn_msg_builder_add_dont_fragment(struct turn_msg_builder* builder)
+{
+  return turn_msg_builder_reserve(builder, TURN_ATTR_DONT_FRAGMENT, 0) ? 0 :
+    -1;
+}
+
+int turn_msg_builder_add_reservation_token(struct turn_msg_builder* builder,
+    const uint8_t* token)
+{
+  return turn_msg_builder_add_string(builder, TURN_ATTR_RESERVATION_TOKEN,
+      token, 8, 8);
+}
+
+int turn_msg_builder_add_requested_address_family(
+    struct turn_msg_builder* builder, uint8_t family)
+{
+  uint8_t* value = NULL;
+
+  /* family (1) + reserved (3) */
+  if(!(value = turn_msg_builder_reserve(builder,
+          TURN_ATTR_REQUESTED_ADDRESS_FAMILY, 4)))
+  {
+    return -1;
+  }
+
+  value[0] = family;
+  value[1] = 0;
+  value[2] = 0;
+  value[3] = 0;
+  return 0;
+}
+
+int turn_msg_builder_add_connection_id(struct turn_msg_builder* builder,
+    uint32_t id)
+{
+  /* ID is opaque and already in network order */
+  return turn_msg_builder_add_string(builder, TURN_ATTR_CONNECTION_ID, &id, 4,
+      4);
+}
+
+int turn_msg_builder_add_message_integrity(struct turn_msg_builder* builder,
+    const unsigned char* key, size_t key_len)
+{
+  uint8_t* value = NULL;
+
+  if(!builder->hdr || !(value = turn_msg_builder_reserve(builder,
+          STUN_ATTR_MESSAGE_INTEGRITY, 20)))
+  {
+    return -1;
+  }
+
+  /* length includes MESSAGE-INTEGRITY but the HMAC does not take into account
+   * the attribute itself
+   */
+  turn_calculate_integrity_hmac(builder->buf,
+      builder->len - sizeof(struct turn_attr_message_integrity), key, key_len,
+      value);
+
+  return 0;
+}
+
+int turn_msg_builder_add_message_integrity_key(
+    struct turn_msg_builder* builder, const struct crypto_hmac_sha1_key* hkey)
+{
+  uint8_t* value = NULL;
+
+  if(!builder->hdr || !(value = turn_msg_builder_reserve(builder,
+          STUN_ATTR_MESSAGE_INTEGRITY, 20)))
+  {
+    return -1;
+  }
+
+  return crypto_hmac_sha1_key_generate(value, builder->buf,
+      builder->len - sizeof(struct turn_attr_message_integrity), hkey);
+}
+
+int turn_msg_builder_add_fingerprint(struct turn_msg_builder* builder)
+{
+  uint8_t* value = NULL;
+  uint32_t crc = 0;
+
+  if(!builder->hdr || !(value = turn_msg_builder_reserve(builder,
+          STUN_ATTR_FINGERPRINT, 4)))
+  {
+    return -1;
+  }
+
+  /* length includes FINGERPRINT but the CRC does not take into account the
+   * attribute itself
+   */
+  crc = crypto_crc32_generate(builder->buf,
+      builder->len - sizeof(struct turn_attr_fingerprint), 0);
+  crc = htonl(crc ^ STUN_FINGERPRINT_XOR_VALUE);
+  memcpy(value, &crc, 4);
+
+  return 0;
 }
 
 struct turn_msg_hdr* turn_msg_create(uint16_t type, uint16_t len,
     const uint8_t* id, struct iovec* iov)
 {
+  struct turn_msg_builder builder;
   struct turn_msg_hdr* ret = NULL;
 
   if((ret = malloc(sizeof(struct turn_msg_hdr))) == NULL)
@@ -233,10 +658,8 @@ struct turn_msg_hdr* turn_msg_create(uint16_t type, uint16_t len,
     return NULL;
   }
 
-  ret->turn_msg_type = htons(type);
+  turn_msg_builder_init(&builder, ret, sizeof(struct turn_msg_hdr), type, id);
   ret->turn_msg_len = htons(len);
-  ret->turn_msg_cookie = htonl(STUN_MAGIC_COOKIE);
-  memcpy(ret->turn_msg_id, id, 12);
 
   iov->iov_base = ret;
   iov->iov_len = sizeof(struct turn_msg_hdr);
@@ -247,21 +670,11 @@ struct turn_msg_hdr* turn_msg_create(uint16_t type, uint16_t len,
 struct turn_attr_hdr* turn_attr_create(uint16_t type, uint16_t len,
     struct iovec* iov, const void* data)
 {
-  struct turn_attr_hdr* ret = NULL;
-
-  if((ret = malloc(sizeof(struct turn_attr_hdr) + len)) == NULL)
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(type);
-  ret->turn_attr_len = htons(len);
-  memcpy(ret->turn_attr_value, data, len);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_hdr) + len;
+  struct turn_msg_builder builder;
 
-  return ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_attr(&builder, type, data, len), iov);
 }
 
 /* STUN messages */
@@ -403,324 +816,148 @@ struct turn_msg_hdr* turn_msg_connectionbind_response_create(uint16_t len,
 struct turn_msg_hdr* turn_msg_connectionbind_error_create(uint16_t len,
     const uint8_t* id, struct iovec* iov)
 {
-  return turn_msg_create((TURN_METHOD_CONNECTIONBIND | STUN_ERROR_RESP), len, id, iov);
-}
-
-struct turn_msg_hdr* turn_msg_connectionattempt_indication_create(uint16_t len,
-    const uint8_t* id, struct iovec* iov)
-{
-    return turn_msg_create((TURN_METHOD_CONNECTIONATTEMPT | STUN_INDICATION), len, id, iov);
-}
-/* STUN attributes */
-
-struct turn_attr_hdr* turn_attr_mapped_address_create(
-    const struct sockaddr* address, struct iovec* iov)
-{
-  return turn_attr_address_create(STUN_ATTR_MAPPED_ADDRESS, address, iov);
-}
-
-struct turn_attr_hdr* turn_attr_username_create(const char* username,
-    size_t len, struct iovec* iov)
-{
-  struct turn_attr_username* ret = NULL;
-  size_t real_len = len;
-
-  /* MUST be less than 513 bytes */
-  if(len >= 513)
-  {
-    return NULL;
-  }
-
-  /* real_len, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_username) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_USERNAME);
-  ret->turn_attr_len = htons(len);
-  memset(ret->turn_attr_username, 0x00, real_len);
-  memcpy(ret->turn_attr_username, username, len);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_username) + real_len;
-
-  return (struct turn_attr_hdr*)ret;
-}
-
-struct turn_attr_hdr* turn_attr_message_integrity_create(const uint8_t* hmac,
-    struct iovec* iov)
-{
-  struct turn_attr_message_integrity* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_message_integrity))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_MESSAGE_INTEGRITY);
-  ret->turn_attr_len = htons(20);
-
-  if(hmac)
-  {
-    memcpy(ret->turn_attr_hmac, hmac, 20);
-  }
-  else
-  {
-    memset(ret->turn_attr_hmac, 0x00, 20);
-  }
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_message_integrity);
-
-  return (struct turn_attr_hdr*)ret;
-}
-
-struct turn_attr_hdr* turn_attr_error_create(uint16_t code, const char* reason,
-    size_t len, struct iovec* iov)
-{
-  struct turn_attr_error_code* ret = NULL;
-  uint8_t class = code / 100;
-  uint8_t number = code % 100;
-  size_t real_len = len;
-
-  /* reason can be as long as 763 bytes */
-  if(len > 763)
-  {
-    return NULL;
-  }
-
-  /* class MUST be between 3 and 6 */
-  if(class < 3 || class > 6)
-  {
-    return NULL;
-  }
-
-  /* number MUST be between 0 and 99 */
-  if(number > 99)
-  {
-    return NULL;
-  }
-
-  /* real_len, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_error_code) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_ERROR_CODE);
-  ret->turn_attr_len = htons(4 + real_len);
+  return turn_msg_create((TURN_METHOD_CONNECTIONBIND | STUN_ERROR_RESP), len, id, iov);
+}
 
-  if(sys_is_little_endian())
-  {
-    ret->turn_attr_reserved_class = class << 16;
-  }
-  else /* big endian */
-  {
-    ret->turn_attr_reserved_class = class;
-  }
+struct turn_msg_hdr* turn_msg_connectionattempt_indication_create(uint16_t len,
+    const uint8_t* id, struct iovec* iov)
+{
+    return turn_msg_create((TURN_METHOD_CONNECTIONATTEMPT | STUN_INDICATION), len, id, iov);
+}
+/* STUN attributes */
 
-  ret->turn_attr_number = number;
+struct turn_attr_hdr* turn_attr_mapped_address_create(
+    const struct sockaddr* address, struct iovec* iov)
+{
+  struct turn_msg_builder builder;
 
-  /* even if strlen(reason) < len, strncpy will add extra-zero
-   * also no need to add final NULL character since length is known (TLV)
-   */
-  strncpy((char*)ret->turn_attr_reason, reason, real_len);
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_address(
+        &builder, STUN_ATTR_MAPPED_ADDRESS, address), iov);
+}
 
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_error_code) + real_len;
+struct turn_attr_hdr* turn_attr_username_create(const char* username,
+    size_t len, struct iovec* iov)
+{
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_username(
+        &builder, username, len), iov);
 }
 
-struct turn_attr_hdr* turn_attr_unknown_attributes_create(
-    const uint16_t* unknown_attributes, size_t attr_size, struct iovec* iov)
+struct turn_attr_hdr* turn_attr_message_integrity_create(const uint8_t* hmac,
+    struct iovec* iov)
 {
-  size_t len = 0;
-  size_t tmp_len = 0;
-  struct turn_attr_unknown_attribute* ret = NULL;
-  uint16_t* ptr = NULL;
-  size_t i = 0;
+  struct turn_msg_builder builder;
+  uint8_t* value = NULL;
 
-  /* length of the attributes MUST be a multiple of 4 bytes
-   * so it must be a pair number of attributes
-   */
-  len = attr_size + (attr_size % 2);
+  turn_attr_builder_init(&builder);
 
-  /* each attribute has 2 bytes length */
-  if(!(ret = malloc(sizeof(struct turn_attr_unknown_attribute) + (len * 2) )))
+  if((value = turn_msg_builder_reserve(&builder, STUN_ATTR_MESSAGE_INTEGRITY,
+          20)))
   {
-    return NULL;
+    if(hmac)
+    {
+      memcpy(value, hmac, 20);
+    }
+    else
+    {
+      memset(value, 0x00, 20);
+    }
   }
 
-  ret->turn_attr_type = htons(STUN_ATTR_UNKNOWN_ATTRIBUTES);
-  ret->turn_attr_len = htons(attr_size);
+  return turn_attr_builder_finish(&builder, value ? 0 : -1, iov);
+}
 
-  ptr = (uint16_t*)ret->turn_attr_attributes;
-  tmp_len = len;
+struct turn_attr_hdr* turn_attr_error_create(uint16_t code, const char* reason,
+    size_t len, struct iovec* iov)
+{
+  struct turn_msg_builder builder;
 
-  for(i = 0 ; i < attr_size ; i++)
-  {
-    *ptr = htons(unknown_attributes[i]);
-    tmp_len--;
-    ptr++;
-  }
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_error(
+        &builder, code, reason, len), iov);
+}
 
-  if(tmp_len)
-  {
-    /* take last attribute value */
-    i--;
-    *ptr = htons(unknown_attributes[i]);
-  }
+struct turn_attr_hdr* turn_attr_unknown_attributes_create(
+    const uint16_t* unknown_attributes, size_t attr_size, struct iovec* iov)
+{
+  struct turn_msg_builder builder;
 
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_unknown_attribute) + (len * 2);
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_unknown_attributes(&builder, unknown_attributes,
+        attr_size), iov);
 }
 
 struct turn_attr_hdr* turn_attr_realm_create(const char* realm, size_t len,
     struct iovec* iov)
 {
-  struct turn_attr_realm* ret = NULL;
-  size_t real_len = len;
-
-  /* realm can be as long as 763 bytes */
-  if(len > 763)
-  {
-    return NULL;
-  }
-
-  /* real_len, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_realm) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_REALM);
-  ret->turn_attr_len = htons(len);
-  memset(ret->turn_attr_realm, 0x00, real_len);
-  memcpy(ret->turn_attr_realm, realm, len);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_realm) + real_len;
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_realm(
+        &builder, realm, len), iov);
 }
 
 struct turn_attr_hdr* turn_attr_nonce_create(const uint8_t* nonce, size_t len,
     struct iovec* iov)
 {
-  struct turn_attr_nonce* ret = NULL;
-  size_t real_len = len;
-
-  /* nonce can be as long as 763 bytes */
-  if(len > 763)
-  {
-    return NULL;
-  }
-
-  /* real_len, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_nonce) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_NONCE);
-  ret->turn_attr_len = htons(len);
-  memset(ret->turn_attr_nonce, 0x00, real_len);
-  memcpy(ret->turn_attr_nonce, nonce, len);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_nonce) + real_len;
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_nonce(
+        &builder, nonce, len), iov);
 }
 
 struct turn_attr_hdr* turn_attr_xor_mapped_address_create(
     const struct sockaddr* address, uint32_t cookie, const uint8_t* id,
     struct iovec* iov)
 {
-  return turn_attr_xor_address_create(STUN_ATTR_XOR_MAPPED_ADDRESS, address, cookie, id, iov);
+  struct turn_msg_builder builder;
+
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_xor_address_id(&builder,
+        STUN_ATTR_XOR_MAPPED_ADDRESS, address, cookie, id), iov);
 }
 
 struct turn_attr_hdr* turn_attr_software_create(const char* software,
     size_t len, struct iovec* iov)
 {
-  struct turn_attr_software* ret = NULL;
-  size_t real_len = len;
-
-  /* reason can be as long as 763 bytes */
-  if(len > 763)
-  {
-    return NULL;
-  }
+  struct turn_msg_builder builder;
 
-  /* real_len, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_software) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(STUN_ATTR_SOFTWARE);
-  ret->turn_attr_len = htons(len);
-  memset(ret->turn_attr_software, 0x00, real_len);
-  memcpy(ret->turn_attr_software, software, len);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_software) + real_len;
-
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_software(
+        &builder, software, len), iov);
 }
 
 struct turn_attr_hdr* turn_attr_alternate_server_create(
     const struct sockaddr* address, struct iovec* iov)
 {
-  return turn_attr_address_create(STUN_ATTR_ALTERNATE_SERVER, address, iov);
+  struct turn_msg_builder builder;
+
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_address(
+        &builder, STUN_ATTR_ALTERNATE_SERVER, address), iov);
 }
 
 struct turn_attr_hdr* turn_attr_fingerprint_create(uint32_t fingerprint,
     struct iovec* iov)
 {
-  struct turn_attr_fingerprint* ret = NULL;
+  struct turn_msg_builder builder;
+  uint8_t* value = NULL;
+
+  turn_attr_builder_init(&builder);
 
-  if(!(ret = malloc(sizeof(struct turn_attr_fingerprint))))
+  if((value = turn_msg_builder_reserve(&builder, STUN_ATTR_FINGERPRINT, 4)))
   {
-    return NULL;
+    fingerprint = htonl(fingerprint);
+    memcpy(value, &fingerprint, 4);
   }
 
-  ret->turn_attr_type = htons(STUN_ATTR_FINGERPRINT);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_crc = htonl(fingerprint);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_fingerprint);
-
-  return (struct turn_attr_hdr*)ret;
+  return turn_attr_builder_finish(&builder, value ? 0 : -1, iov);
 }
 
 /* TURN attributes */
@@ -728,206 +965,114 @@ struct turn_attr_hdr* turn_attr_fingerprint_create(uint32_t fingerprint,
 struct turn_attr_hdr* turn_attr_channel_number_create(uint16_t number,
     struct iovec* iov)
 {
-  struct turn_attr_channel_number* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_channel_number))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_CHANNEL_NUMBER);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_number = htons(number);
-  ret->turn_attr_rffu = htons(0);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_channel_number);
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_channel_number(&builder, number), iov);
 }
 
 struct turn_attr_hdr* turn_attr_lifetime_create(uint32_t lifetime,
     struct iovec* iov)
 {
-  struct turn_attr_lifetime* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_lifetime))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_LIFETIME);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_lifetime = htonl(lifetime);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_lifetime);
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_lifetime(
+        &builder, lifetime), iov);
 }
 
 struct turn_attr_hdr* turn_attr_xor_peer_address_create(
     const struct sockaddr* address, uint32_t cookie, const uint8_t* id,
     struct iovec* iov)
 {
-  return turn_attr_xor_address_create(TURN_ATTR_XOR_PEER_ADDRESS, address, cookie, id, iov);
+  struct turn_msg_builder builder;
+
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_xor_address_id(&builder,
+        TURN_ATTR_XOR_PEER_ADDRESS, address, cookie, id), iov);
 }
 
 struct turn_attr_hdr* turn_attr_data_create(const void* data, size_t datalen,
     struct iovec* iov)
 {
-  struct turn_attr_data* ret = NULL;
-  size_t real_len = datalen;
-
-  /* datalen, attribute header size and padding must be a multiple of four */
-  if((real_len + 4) % 4)
-  {
-    real_len += (4 - (real_len % 4));
-  }
-
-  if(!(ret = malloc(sizeof(struct turn_attr_data) + real_len)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_DATA);
-  ret->turn_attr_len = htons(datalen);
-  memset(ret->turn_attr_data, 0x00, real_len);
-  memcpy(ret->turn_attr_data, data, datalen);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_data) + real_len;
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_data(
+        &builder, data, datalen), iov);
 }
 
 struct turn_attr_hdr* turn_attr_xor_relayed_address_create(
     const struct sockaddr* address, uint32_t cookie, const uint8_t* id,
     struct iovec* iov)
 {
-  return turn_attr_xor_address_create(TURN_ATTR_XOR_RELAYED_ADDRESS, address,
-      cookie, id, iov);
+  struct turn_msg_builder builder;
+
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_xor_address_id(&builder,
+        TURN_ATTR_XOR_RELAYED_ADDRESS, address, cookie, id), iov);
 }
 
 struct turn_attr_hdr* turn_attr_even_port_create(uint8_t flags,
     struct iovec* iov)
 {
-  struct turn_attr_even_port* ret = NULL;
-
-  /* attributes must be a multiple of four */
-  if(!(ret = malloc(sizeof(struct turn_attr_even_port) + 3)))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_EVEN_PORT);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_flags = flags;
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_even_port) + 3;
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder, turn_msg_builder_add_even_port(
+        &builder, flags), iov);
 }
 
 struct turn_attr_hdr* turn_attr_requested_transport_create(uint8_t protocol,
     struct iovec* iov)
 {
-  struct turn_attr_requested_transport* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_requested_transport))))
-  {
-    return NULL;
-  }
+  struct turn_msg_builder builder;
 
-  ret->turn_attr_type = htons(TURN_ATTR_REQUESTED_TRANSPORT);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_protocol = protocol;
-  ret->turn_attr_reserved = 0;
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_requested_transport);
-
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_requested_transport(&builder, protocol), iov);
 }
 
 struct turn_attr_hdr* turn_attr_dont_fragment_create(struct iovec* iov)
 {
-  struct turn_attr_dont_fragment* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_dont_fragment))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_DONT_FRAGMENT);
-  ret->turn_attr_len = htons(0);
+  struct turn_msg_builder builder;
 
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_dont_fragment);
-
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_dont_fragment(&builder), iov);
 }
 
 struct turn_attr_hdr* turn_attr_reservation_token_create(const uint8_t* token,
     struct iovec* iov)
 {
-  struct turn_attr_reservation_token* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_reservation_token))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_RESERVATION_TOKEN);
-  ret->turn_attr_len = htons(8);
-  memcpy(ret->turn_attr_token, token, 8);
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_reservation_token);
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_reservation_token(&builder, token), iov);
 }
 
 struct turn_attr_hdr* turn_attr_requested_address_family_create(uint8_t family,
     struct iovec* iov)
 {
-  struct turn_attr_requested_address_family* ret = NULL;
-
-  if(!(ret = malloc(sizeof(struct turn_attr_requested_address_family))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_REQUESTED_ADDRESS_FAMILY);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_family = family;
-  ret->turn_attr_reserved = 0;
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_requested_address_family);
+  struct turn_msg_builder builder;
 
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_requested_address_family(&builder, family), iov);
 }
 
 struct turn_attr_hdr* turn_attr_connection_id_create(uint32_t id,
     struct iovec* iov)
 {
-  struct turn_attr_connection_id* ret = NULL;
+  struct turn_msg_builder builder;
 
-  if(!(ret = malloc(sizeof(struct turn_attr_connection_id))))
-  {
-    return NULL;
-  }
-
-  ret->turn_attr_type = htons(TURN_ATTR_CONNECTION_ID);
-  ret->turn_attr_len = htons(4);
-  ret->turn_attr_id = id;
-
-  iov->iov_base = ret;
-  iov->iov_len = sizeof(struct turn_attr_connection_id);
-
-  return (struct turn_attr_hdr*)ret;
+  turn_attr_builder_init(&builder);
+  return turn_attr_builder_finish(&builder,
+      turn_msg_builder_add_connection_id(&builder, id), iov);
 }
 
 struct turn_msg_hdr* turn_error_response_400(int method, const uint8_t* id,
@@ -1407,33 +1552,11 @@ int turn_tls_send(struct tls_peer* peer, const struct sockaddr* addr,
     socklen_t addr_size, size_t total_len, const struct iovec* iov,
     size_t iovlen)
 {
-  char* buf = NULL;
-  char* p = NULL;
-  size_t i = 0;
-  ssize_t nb = -1;
-
-  buf = malloc(total_len);
-  if(!buf)
-  {
-    return -1;
-  }
-
-  p = buf;
-
-  /* convert the iovec into raw buffer
-   * cannot send iovec with libssl.
+  /* libssl cannot send an iovec, tls_peer_writev() coalesces it in a buffer
+   * of the remote peer
    */
-  for(i = 0 ; i < iovlen ; i++)
-  {
-    memcpy(p, iov[i].iov_base, iov[i].iov_len);
-    p += iov[i].iov_len;
-  }
-
-  nb = tls_peer_write(peer, buf, total_len, addr, addr_size);
-
-  free(buf);
-
-  return nb;
+  (void)total_len;
+  return tls_peer_writev(peer, iov, iovlen, addr, addr_size);
 }
 
 int turn_send_message(int transport_protocol, int sock, struct tls_peer* speer,
@@ -1454,6 +1577,24 @@ int turn_send_message(int transport_protocol, int sock, struct tls_peer* speer,
   }
 }
 
+int turn_send_buffer(int transport_protocol, int sock, struct tls_peer* speer,
+    const struct sockaddr* addr, socklen_t addr_size, const void* buf,
+    size_t len)
+{
+  if(speer) /* TLS */
+  {
+    return tls_peer_write(speer, (const char*)buf, len, addr, addr_size);
+  }
+  else if(transport_protocol == IPPROTO_UDP)
+  {
+    return sendto(sock, buf, len, 0, addr, addr_size);
+  }
+  else /* TCP */
+  {
+    return send(sock, buf, len, 0);
+  }
+}
+
 int turn_generate_transaction_id(uint8_t* id)
 {
   /* 96 bit transaction ID */
@@ -1484,130 +1625,110 @@ int turn_calculate_authentication_key(const char* username, const char* realm,
 int turn_calculate_integrity_hmac(const unsigned char* buf, size_t len,
     const unsigned char* key, size_t key_len, unsigned char* integrity)
 {
-  HMAC_CTX ctx;
-  unsigned int md_len = SHA_DIGEST_LENGTH;
-
-  /* MESSAGE-INTEGRITY uses HMAC-SHA1 */
-  HMAC_CTX_init(&ctx);
-  HMAC_Init(&ctx, key, key_len, EVP_sha1());
-  HMAC_Update(&ctx, buf, len);
-  HMAC_Final(&ctx, integrity, &md_len); /* HMAC-SHA1 is 20 bytes length */
+  struct iovec iov;
 
-  HMAC_CTX_cleanup(&ctx);
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
 
-  return 0;
+  return turn_calculate_integrity_hmac_iov(&iov, 1, key, key_len, integrity);
 }
 
 int turn_calculate_integrity_hmac_iov(const struct iovec* iov, size_t iovlen,
     const unsigned char* key, size_t key_len, unsigned char* integrity)
 {
-  HMAC_CTX ctx;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  HMAC_CTX ctx_storage;
+  HMAC_CTX* ctx = &ctx_storage;
+#else
+  HMAC_CTX* ctx = NULL;
+#endif
   unsigned int md_len = SHA_DIGEST_LENGTH;
   size_t i = 0;
+  int ret = 0;
 
   /* MESSAGE-INTEGRITY uses HMAC-SHA1 */
-  HMAC_CTX_init(&ctx);
-  HMAC_Init(&ctx, key, key_len, EVP_sha1());
-
-  for(i = 0 ; i < iovlen ; i++)
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  HMAC_CTX_init(ctx);
+#else
+  if(!(ctx = HMAC_CTX_new()))
   {
-    HMAC_Update(&ctx, iov[i].iov_base, iov[i].iov_len);
+    return -1;
   }
-  HMAC_Final(&ctx, integrity, &md_len); /* HMAC-SHA1 is 20 bytes length */
-
-  HMAC_CTX_cleanup(&ctx);
-
-  return 0;
-}
-
-int turn_generate_nonce(uint8_t* nonce, size_t len, uint8_t* key,
-    size_t key_len)
-{
-  time_t t;
-  char c = ':';
-  MD5_CTX ctx;
-  unsigned char md_buf[MD5_DIGEST_LENGTH];
+#endif
 
-  if(len < (16 + MD5_DIGEST_LENGTH))
+  if(!HMAC_Init_ex(ctx, key, key_len, EVP_sha1(), NULL))
   {
-    return -1;
+    ret = -1;
   }
 
-  MD5_Init(&ctx);
-
-  /* timestamp */
-  t = time(NULL);
-
-  /* add expire period */
-  t += TURN_DEFAULT_NONCE_LIFETIME;
-
-  t = (time_t)htonl((uint32_t)t);
-  sys_convert_to_hex((unsigned char*)&t, sizeof(time_t), nonce, sizeof(time_t) * 2);
-
-  if(sizeof(time_t) == 4) /* 32 bit */
+  for(i = 0 ; ret == 0 && i < iovlen ; i++)
   {
-    memset(nonce + 8, 0x30, 8);
+    if(!HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len))
+    {
+      ret = -1;
+    }
   }
 
-  MD5_Update(&ctx, nonce, 16); /* time */
-  MD5_Update(&ctx, &c, 1);
-  MD5_Update(&ctx, key, key_len);
-  MD5_Final(md_buf, &ctx);
+  /* HMAC-SHA1 is 20 bytes length */
+  if(ret == 0 && !HMAC_Final(ctx, integrity, &md_len))
+  {
+    ret = -1;
+  }
 
-  /* add MD5 at the end of the nonce */
-  sys_convert_to_hex(md_buf, MD5_DIGEST_LENGTH, nonce + 16, len - 16);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  HMAC_CTX_cleanup(ctx);
+#else
+  HMAC_CTX_free(ctx);
+#endif
 
-  return 0;
+  return ret;
 }
 
-int turn_nonce_is_stale(uint8_t* nonce, size_t len, unsigned char* key,
-    size_t key_len)
+int turn_verify_integrity(const unsigned char* buf, size_t len,
+    const struct crypto_hmac_sha1_key* hkey, const uint8_t* hmac)
 {
-  uint32_t ct = 0;
-  uint64_t ct64 = 0;
-  time_t t = 0;
-  unsigned char c = ':';
-  MD5_CTX ctx;
-  unsigned char md_buf[MD5_DIGEST_LENGTH];
-  unsigned char md_txt[MD5_DIGEST_LENGTH * 2];
-
-  if(len != (16 + MD5_DIGEST_LENGTH * 2))
-  {
-    return 1; /* bad nonce length */
-  }
+  struct turn_msg_hdr hdr;
+  struct iovec iov[2];
+  uint8_t hash[20];
 
-  if(sizeof(time_t) == 4) /* 32 bits */
+  if(len < sizeof(struct turn_msg_hdr))
   {
-    sys_convert_to_uint32(nonce, sizeof(time_t) * 2, &ct);
-    memcpy(&t, &ct, 4);
-  }
-  else
-  {
-    sys_convert_to_uint64(nonce, sizeof(time_t) * 2, &ct64);
-    memcpy(&t, &ct64, 8);
+    return -1;
   }
 
-  MD5_Init(&ctx);
-  MD5_Update(&ctx, nonce, 16); /* time */
-  MD5_Update(&ctx, &c, 1);
-  MD5_Update(&ctx, key, key_len);
-  MD5_Final(md_buf, &ctx);
+  /* message length as if MESSAGE-INTEGRITY was the last attribute */
+  memcpy(&hdr, buf, sizeof(struct turn_msg_hdr));
+  hdr.turn_msg_len = htons(len - sizeof(struct turn_msg_hdr) +
+      sizeof(struct turn_attr_message_integrity));
 
-  sys_convert_to_hex(md_buf, MD5_DIGEST_LENGTH, md_txt, sizeof(md_txt));
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(struct turn_msg_hdr);
+  iov[1].iov_base = (void*)(buf + sizeof(struct turn_msg_hdr));
+  iov[1].iov_len = len - sizeof(struct turn_msg_hdr);
 
-  if(memcmp(md_txt, nonce + 16, (MD5_DIGEST_LENGTH * 2)) != 0)
+  if(crypto_hmac_sha1_key_generate_iov(hash, iov, 2, hkey) == -1 ||
+     CRYPTO_memcmp(hash, hmac, sizeof(hash)) != 0)
   {
-    /* MD5 hash mismatch */
-    return 1;
+    return -1;
   }
 
-  if(time(NULL) > t)
+  return 0;
+}
+
+size_t turn_verify_integrity_batch(struct turn_integrity_check* checks,
+    size_t nb)
+{
+  size_t valid = 0;
+  size_t i = 0;
+
+  for(i = 0 ; i < nb ; i++)
   {
-    /* nonce stale */
-    return 1;
+    checks[i].valid = (turn_verify_integrity(checks[i].buf, checks[i].len,
+          checks[i].hkey, checks[i].hmac) == 0);
+    valid += checks[i].valid;
   }
 
-  return 0;
+  return valid;
 }
 
 uint32_t turn_calculate_fingerprint(const struct iovec* iov, size_t iovlen)
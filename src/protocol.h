@@ -56,6 +56,7 @@
 
 #include "turn.h"
 #include "tls_peer.h"
+#include "util_crypto.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -102,6 +103,28 @@ struct turn_message
   size_t xor_peer_addr_overflow; /**< If set to 1, not all the XOR-PEER-ADDRESS given in request are in this structure */
 };
 
+/**
+ * \def TURN_MSG_BUILDER_SIZE
+ * \brief Size of a buffer large enough for the responses of the server.
+ */
+#define TURN_MSG_BUILDER_SIZE 2048
+
+/**
+ * \struct turn_msg_builder
+ * \brief Serialize a STUN/TURN message in a single buffer.
+ *
+ * Attributes are written one after the other behind the header and the
+ * message length (big endian) is kept up to date, so the buffer can be sent
+ * with one write.
+ */
+struct turn_msg_builder
+{
+  uint8_t* buf; /**< Buffer */
+  size_t size; /**< Size of the buffer */
+  size_t len; /**< Length of the message built so far */
+  struct turn_msg_hdr* hdr; /**< Message header (NULL for single attribute) */
+};
+
 /* STUN specific error message */
 
 /**
@@ -756,6 +779,225 @@ struct turn_attr_hdr* turn_attr_requested_address_family_create(uint8_t family,
 struct turn_attr_hdr* turn_attr_connection_id_create(uint32_t id,
     struct iovec* iov);
 
+/* message builder */
+
+/**
+ * \brief Initialize a builder and write the message header.
+ * \param builder builder
+ * \param buf buffer where the message is serialized
+ * \param size size of buf
+ * \param type message type (method and class)
+ * \param id 96 bit transaction ID
+ * \return 0 if success, -1 if buffer is too small
+ */
+int turn_msg_builder_init(struct turn_msg_builder* builder, void* buf,
+    size_t size, uint16_t type, const uint8_t* id);
+
+/**
+ * \brief Add an attribute.
+ * \param builder builder
+ * \param type attribute type
+ * \param data value
+ * \param len length of the value (padding is added)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_attr(struct turn_msg_builder* builder,
+    uint16_t type, const void* data, size_t len);
+
+/**
+ * \brief Add a MAPPED-ADDRESS like attribute (MAPPED-ADDRESS,
+ * ALTERNATE-SERVER).
+ * \param builder builder
+ * \param type attribute type
+ * \param address network address
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_address(struct turn_msg_builder* builder,
+    uint16_t type, const struct sockaddr* address);
+
+/**
+ * \brief Add a XOR-MAPPED-ADDRESS like attribute (XOR-MAPPED-ADDRESS,
+ * XOR-PEER-ADDRESS, XOR-RELAYED-ADDRESS).
+ *
+ * Address is XOR-ed with the magic cookie and the transaction ID of the
+ * message.
+ * \param builder builder
+ * \param type attribute type
+ * \param address network address
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_xor_address(struct turn_msg_builder* builder,
+    uint16_t type, const struct sockaddr* address);
+
+/**
+ * \brief Add an USERNAME attribute.
+ * \param builder builder
+ * \param username username
+ * \param len length of username (less than 513 bytes)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_username(struct turn_msg_builder* builder,
+    const char* username, size_t len);
+
+/**
+ * \brief Add an ERROR-CODE attribute.
+ * \param builder builder
+ * \param code error code (between 300 and 699)
+ * \param reason reason phrase
+ * \param len length of reason (less than 764 bytes)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_error(struct turn_msg_builder* builder,
+    uint16_t code, const char* reason, size_t len);
+
+/**
+ * \brief Add an UNKNOWN-ATTRIBUTES attribute.
+ * \param builder builder
+ * \param unknown_attributes array of unknown attributes
+ * \param attr_size number of elements in unknown_attributes
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_unknown_attributes(struct turn_msg_builder* builder,
+    const uint16_t* unknown_attributes, size_t attr_size);
+
+/**
+ * \brief Add a REALM attribute.
+ * \param builder builder
+ * \param realm realm
+ * \param len length of realm (less than 764 bytes)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_realm(struct turn_msg_builder* builder,
+    const char* realm, size_t len);
+
+/**
+ * \brief Add a NONCE attribute.
+ * \param builder builder
+ * \param nonce nonce
+ * \param len length of nonce (less than 764 bytes)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_nonce(struct turn_msg_builder* builder,
+    const uint8_t* nonce, size_t len);
+
+/**
+ * \brief Add a SOFTWARE attribute.
+ * \param builder builder
+ * \param software software description
+ * \param len length of software (less than 764 bytes)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_software(struct turn_msg_builder* builder,
+    const char* software, size_t len);
+
+/**
+ * \brief Add a CHANNEL-NUMBER attribute.
+ * \param builder builder
+ * \param number channel number
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_channel_number(struct turn_msg_builder* builder,
+    uint16_t number);
+
+/**
+ * \brief Add a LIFETIME attribute.
+ * \param builder builder
+ * \param lifetime lifetime in seconds
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_lifetime(struct turn_msg_builder* builder,
+    uint32_t lifetime);
+
+/**
+ * \brief Add a DATA attribute.
+ * \param builder builder
+ * \param data data
+ * \param len length of data
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_data(struct turn_msg_builder* builder,
+    const void* data, size_t len);
+
+/**
+ * \brief Add an EVEN-PORT attribute.
+ * \param builder builder
+ * \param flags flags (R flag)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_even_port(struct turn_msg_builder* builder,
+    uint8_t flags);
+
+/**
+ * \brief Add a REQUESTED-TRANSPORT attribute.
+ * \param builder builder
+ * \param protocol transport protocol (IPPROTO_UDP or IPPROTO_TCP)
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_requested_transport(struct turn_msg_builder* builder,
+    uint8_t protocol);
+
+/**
+ * \brief Add a DONT-FRAGMENT attribute.
+ * \param builder builder
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_dont_fragment(struct turn_msg_builder* builder);
+
+/**
+ * \brief Add a RESERVATION-TOKEN attribute.
+ * \param builder builder
+ * \param token 64 bit token
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_reservation_token(struct turn_msg_builder* builder,
+    const uint8_t* token);
+
+/**
+ * \brief Add a REQUESTED-ADDRESS-FAMILY attribute (RFC6156).
+ * \param builder builder
+ * \param family STUN family
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_requested_address_family(
+    struct turn_msg_builder* builder, uint8_t family);
+
+/**
+ * \brief Add a CONNECTION-ID attribute (RFC6062).
+ * \param builder builder
+ * \param id 32 bit ID
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_connection_id(struct turn_msg_builder* builder,
+    uint32_t id);
+
+/**
+ * \brief Add a MESSAGE-INTEGRITY attribute computed on the message built so
+ * far.
+ * \param builder builder
+ * \param key key
+ * \param key_len key length
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_message_integrity(struct turn_msg_builder* builder,
+    const unsigned char* key, size_t key_len);
+
+/**
+ * \brief Add a MESSAGE-INTEGRITY attribute computed on the message built so
+ * far with a precomputed key.
+ * \param builder builder
+ * \param hkey key initialized with crypto_hmac_sha1_key_init()
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_message_integrity_key(
+    struct turn_msg_builder* builder, const struct crypto_hmac_sha1_key* hkey);
+
+/**
+ * \brief Add a FINGERPRINT attribute computed on the message built so far.
+ * \param builder builder
+ * \return 0 if success, -1 otherwise
+ */
+int turn_msg_builder_add_fingerprint(struct turn_msg_builder* builder);
+
 /**
  * \brief Send TURN message (which may contains attributes) over UDP.
  * \param sock socket
@@ -807,6 +1049,21 @@ int turn_send_message(int transport_protocol, int sock, struct tls_peer* speer,
     const struct sockaddr* addr, socklen_t addr_size, size_t total_len,
     const struct iovec* iov, size_t iovlen);
 
+/**
+ * \brief Send a TURN message serialized in a buffer.
+ * \param transport_protocol transport protocol of the socket (TCP or UDP)
+ * \param sock socket descriptor
+ * \param speer TLS peer if send with TLS (could be NULL)
+ * \param addr destination address
+ * \param addr_size sizeof addr
+ * \param buf message
+ * \param len length of the message
+ * \return number of bytes sent or -1 if error
+ */
+int turn_send_buffer(int transport_protocol, int sock, struct tls_peer* speer,
+    const struct sockaddr* addr, socklen_t addr_size, const void* buf,
+    size_t len);
+
 /**
  * \brief Generate a 96 bit transaction ID.
  * \param id that will be filled with username value (MUST be 12 bytes length)
@@ -815,33 +1072,6 @@ int turn_send_message(int transport_protocol, int sock, struct tls_peer* speer,
  */
 int turn_generate_transaction_id(uint8_t* id);
 
-/**
- * \brief Generate a nonce value.
- *
- * nonce = 64-bit timestamp MD5(timestamp ":" key)
- *
- * When time_t is 4 bytes, the timestamp is padded with 0x30.
- *
- * \param nonce array that will be filled
- * \param len length of nonce
- * \param key key used
- * \param key_len key length
- * \return 0 if success, -1 otherwise
- */
-int turn_generate_nonce(uint8_t* nonce, size_t len, uint8_t* key,
-    size_t key_len);
-
-/**
- * \brief Check if nonce is stale.
- * \param nonce nonce
- * \param len length of nonce
- * \param key nonce key
- * \param key_len length of the key
- * \return 1 if nonce is stale, 0 otherwise
- */
-int turn_nonce_is_stale(uint8_t* nonce, size_t len, unsigned char* key,
-    size_t key_len);
-
 /**
  * \brief Calculate the MD5 key for long-term authentication.
  *
@@ -883,6 +1113,43 @@ int turn_calculate_integrity_hmac(const unsigned char* buf, size_t len,
 int turn_calculate_integrity_hmac_iov(const struct iovec* iov, size_t iovlen,
     const unsigned char* key, size_t key_len, unsigned char* integrity);
 
+/**
+ * \struct turn_integrity_check
+ * \brief MESSAGE-INTEGRITY verification of a received message.
+ */
+struct turn_integrity_check
+{
+  const unsigned char* buf; /**< Message (starts with the STUN header) */
+  size_t len; /**< Offset of MESSAGE-INTEGRITY attribute in buf */
+  const struct crypto_hmac_sha1_key* hkey; /**< Key of the account */
+  const uint8_t* hmac; /**< MESSAGE-INTEGRITY value received (20 bytes) */
+  int valid; /**< Set to 1 if the message is authentic, 0 otherwise */
+};
+
+/**
+ * \brief Verify the MESSAGE-INTEGRITY of a received message.
+ *
+ * The HMAC is computed as if the message ended with MESSAGE-INTEGRITY (the
+ * length of the STUN header is adjusted if FINGERPRINT follows), the message
+ * is not modified.
+ * \param buf message (starts with the STUN header)
+ * \param len offset of MESSAGE-INTEGRITY attribute in buf
+ * \param hkey key initialized with crypto_hmac_sha1_key_init()
+ * \param hmac MESSAGE-INTEGRITY value received (20 bytes)
+ * \return 0 if the message is authentic, -1 otherwise
+ */
+int turn_verify_integrity(const unsigned char* buf, size_t len,
+    const struct crypto_hmac_sha1_key* hkey, const uint8_t* hmac);
+
+/**
+ * \brief Verify the MESSAGE-INTEGRITY of several received messages.
+ * \param checks messages to verify, the valid field of each is set
+ * \param nb number of elements of checks
+ * \return number of authentic messages
+ */
+size_t turn_verify_integrity_batch(struct turn_integrity_check* checks,
+    size_t nb);
+
 /**
  * \brief Calculate the fingerprint using CRC-32 from ITU V.42.
  * \param iov vector which contains a message and attributes (without
@@ -0,0 +1,204 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file stream_buf.c
+ * \brief Growable buffer for stream reassembly (TURN over TCP).
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stream_buf.h"
+
+/**
+ * \brief Release the memory of a buffer.
+ * \param buf stream buffer
+ * \param pool pool of chunks
+ */
+static void stream_buf_release(struct stream_buf* buf, struct pool* pool)
+{
+  if(buf->size <= pool->object_size)
+  {
+    pool_free(pool, buf->data);
+  }
+  else
+  {
+    free(buf->data);
+  }
+
+  buf->data = NULL;
+  buf->size = 0;
+}
+
+char* stream_buf_reserve(struct stream_buf* buf, struct pool* pool,
+    size_t min, size_t* avail)
+{
+  size_t len = stream_buf_len(buf);
+
+  if(!buf->data)
+  {
+    size_t size = pool->object_size;
+    char* data = NULL;
+
+    if(min <= size)
+    {
+      data = pool_alloc(pool);
+    }
+    else
+    {
+      while(size < min)
+      {
+        size *= 2;
+      }
+
+      if(size > STREAM_BUF_MAX_SIZE)
+      {
+        size = STREAM_BUF_MAX_SIZE;
+      }
+
+      data = (size >= min) ? malloc(size) : NULL;
+    }
+
+    if(!data)
+    {
+      return NULL;
+    }
+
+    buf->data = data;
+    buf->size = size;
+    buf->start = 0;
+    buf->end = 0;
+  }
+  else if(buf->size - buf->end < min)
+  {
+    if(buf->size - len >= min)
+    {
+      /* only the bytes of the incomplete frame are moved */
+      memmove(buf->data, buf->data + buf->start, len);
+    }
+    else
+    {
+      size_t size = buf->size;
+      char* data = NULL;
+
+      while(size - len < min)
+      {
+        size *= 2;
+      }
+
+      if(size > STREAM_BUF_MAX_SIZE)
+      {
+        size = STREAM_BUF_MAX_SIZE;
+      }
+
+      if(size - len < min || !(data = malloc(size)))
+      {
+        return NULL;
+      }
+
+      memcpy(data, buf->data + buf->start, len);
+      stream_buf_release(buf, pool);
+      buf->data = data;
+      buf->size = size;
+    }
+
+    buf->start = 0;
+    buf->end = len;
+  }
+
+  if(avail)
+  {
+    *avail = buf->size - buf->end;
+  }
+
+  return buf->data + buf->end;
+}
+
+void stream_buf_commit(struct stream_buf* buf, size_t len)
+{
+  buf->end += len;
+}
+
+int stream_buf_append(struct stream_buf* buf, struct pool* pool,
+    const char* data, size_t len)
+{
+  char* space = stream_buf_reserve(buf, pool, len, NULL);
+
+  if(!space)
+  {
+    return -1;
+  }
+
+  memcpy(space, data, len);
+  stream_buf_commit(buf, len);
+  return 0;
+}
+
+void stream_buf_consume(struct stream_buf* buf, size_t len)
+{
+  buf->start += len;
+
+  if(buf->start >= buf->end)
+  {
+    /* empty, next data is received at the beginning */
+    buf->start = 0;
+    buf->end = 0;
+  }
+}
+
+void stream_buf_shrink(struct stream_buf* buf, struct pool* pool)
+{
+  if(buf->data && buf->start == buf->end)
+  {
+    stream_buf_release(buf, pool);
+    buf->start = 0;
+    buf->end = 0;
+  }
+}
+
+void stream_buf_free(struct stream_buf* buf, struct pool* pool)
+{
+  if(buf->data)
+  {
+    stream_buf_release(buf, pool);
+  }
+
+  buf->start = 0;
+  buf->end = 0;
+}
+
@@ -0,0 +1,159 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file stream_buf.h
+ * \brief Growable buffer for stream reassembly (TURN over TCP).
+ *
+ * Data is received directly in the free space at the end of the buffer and
+ * complete frames are parsed in place from the beginning. Bytes of an
+ * incomplete frame are moved to the beginning only when the free space is
+ * too small. The buffer starts with a chunk of a pool, grows when a frame
+ * needs it and is given back when it is empty, so an idle connection does
+ * not hold memory.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef STREAM_BUF_H
+#define STREAM_BUF_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+
+#include "pool.h"
+
+/**
+ * \def STREAM_BUF_CHUNK_SIZE
+ * \brief Size of the chunks of the pool used for small buffers.
+ */
+#define STREAM_BUF_CHUNK_SIZE 4096
+
+/**
+ * \def STREAM_BUF_MAX_SIZE
+ * \brief Maximum size of a buffer (largest STUN message or ChannelData with
+ * its header and padding).
+ */
+#define STREAM_BUF_MAX_SIZE (65536 + 4096)
+
+/**
+ * \struct stream_buf
+ * \brief Stream buffer.
+ *
+ * A zeroed stream_buf is an empty buffer.
+ */
+struct stream_buf
+{
+  char* data; /**< Memory (NULL if no memory is held) */
+  size_t size; /**< Size of data */
+  size_t start; /**< Offset of the first byte not processed */
+  size_t end; /**< Offset of the end of the data received */
+};
+
+/**
+ * \brief Get the data received and not processed.
+ * \param buf stream buffer
+ * \return pointer on data
+ */
+static inline char* stream_buf_data(const struct stream_buf* buf)
+{
+  return buf->data + buf->start;
+}
+
+/**
+ * \brief Get the number of bytes received and not processed.
+ * \param buf stream buffer
+ * \return number of bytes
+ */
+static inline size_t stream_buf_len(const struct stream_buf* buf)
+{
+  return buf->end - buf->start;
+}
+
+/**
+ * \brief Get free space at the end of a buffer.
+ *
+ * Pending data is moved to the beginning of the buffer or the buffer grows if
+ * needed.
+ * \param buf stream buffer
+ * \param pool pool of chunks (object size is the initial size of buffers)
+ * \param min minimum number of free bytes
+ * \param avail if not NULL, filled with the number of free bytes
+ * \return pointer on the free space or NULL if min bytes cannot be provided
+ * (out of memory or STREAM_BUF_MAX_SIZE exceeded)
+ */
+char* stream_buf_reserve(struct stream_buf* buf, struct pool* pool,
+    size_t min, size_t* avail);
+
+/**
+ * \brief Add bytes written in the free space to the data of a buffer.
+ * \param buf stream buffer
+ * \param len number of bytes
+ */
+void stream_buf_commit(struct stream_buf* buf, size_t len);
+
+/**
+ * \brief Append a copy of data to a buffer.
+ * \param buf stream buffer
+ * \param pool pool of chunks
+ * \param data data
+ * \param len length of data
+ * \return 0 if success, -1 otherwise
+ */
+int stream_buf_append(struct stream_buf* buf, struct pool* pool,
+    const char* data, size_t len);
+
+/**
+ * \brief Remove processed bytes from the beginning of a buffer.
+ * \param buf stream buffer
+ * \param len number of bytes
+ */
+void stream_buf_consume(struct stream_buf* buf, size_t len);
+
+/**
+ * \brief Give back the memory of a buffer if it is empty.
+ * \param buf stream buffer
+ * \param pool pool of chunks
+ */
+void stream_buf_shrink(struct stream_buf* buf, struct pool* pool);
+
+/**
+ * \brief Discard the data of a buffer and give back its memory.
+ * \param buf stream buffer
+ * \param pool pool of chunks
+ */
+void stream_buf_free(struct stream_buf* buf, struct pool* pool);
+
+#endif /* STREAM_BUF_H */
+
@@ -281,7 +281,7 @@ static int client_recv_message(int transport_protocol, int sock, struct tls_peer
   {
     nb = (transport_protocol == IPPROTO_TCP) ? tls_peer_tcp_read(speer, buffer, nb, buf, buflen,
         (struct sockaddr*)&saddr, saddr_size, speer->sock) : tls_peer_udp_read(speer, buffer, nb,
-        buf, buflen, (struct sockaddr*)&saddr, saddr_size);
+        buf, buflen, (struct sockaddr*)&saddr, saddr_size, NULL, 0);
 
     if(nb == -1)
     {
@@ -0,0 +1,276 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file timer_wheel.c
+ * \brief Hierarchical timing wheel.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "timer_wheel.h"
+
+/**
+ * \def TIMER_WHEEL_ROOT_MASK
+ * \brief Mask to get the slot of the first wheel.
+ */
+#define TIMER_WHEEL_ROOT_MASK (TIMER_WHEEL_ROOT_SIZE - 1)
+
+/**
+ * \def TIMER_WHEEL_LEVEL_MASK
+ * \brief Mask to get the slot of the other wheels.
+ */
+#define TIMER_WHEEL_LEVEL_MASK (TIMER_WHEEL_LEVEL_SIZE - 1)
+
+/**
+ * \brief Get the slot of a wheel for a tick.
+ * \param tick tick
+ * \param level wheel after the first one (0 for the second wheel)
+ * \return index of the slot
+ */
+static inline size_t timer_wheel_index(uint64_t tick, int level)
+{
+  return (size_t)((tick >> (TIMER_WHEEL_ROOT_BITS +
+          level * TIMER_WHEEL_LEVEL_BITS)) & TIMER_WHEEL_LEVEL_MASK);
+}
+
+/**
+ * \brief Put a timer in the slot that matches its expiration.
+ * \param wheel timer wheel
+ * \param entry timer
+ */
+static void timer_wheel_insert(struct timer_wheel* wheel,
+    struct timer_entry* entry)
+{
+  uint64_t delta = 0;
+  struct list_head* slot = NULL;
+
+  if(entry->expires < wheel->tick)
+  {
+    /* already expired, process it at next tick */
+    entry->expires = wheel->tick;
+  }
+
+  delta = entry->expires - wheel->tick;
+
+  if(delta > TIMER_WHEEL_MAX_TICKS)
+  {
+    delta = TIMER_WHEEL_MAX_TICKS;
+    entry->expires = wheel->tick + delta;
+  }
+
+  if(delta < TIMER_WHEEL_ROOT_SIZE)
+  {
+    slot = &wheel->root[entry->expires & TIMER_WHEEL_ROOT_MASK];
+  }
+  else
+  {
+    int level = 0;
+
+    /* find the first wheel that covers the expiration */
+    while(level < TIMER_WHEEL_LEVELS - 1 &&
+        delta >= (1UL << (TIMER_WHEEL_ROOT_BITS +
+            (level + 1) * TIMER_WHEEL_LEVEL_BITS)))
+    {
+      level++;
+    }
+
+    slot = &wheel->levels[level][timer_wheel_index(entry->expires, level)];
+  }
+
+  list_head_add_tail(slot, &entry->list);
+}
+
+/**
+ * \brief Move the timers of a slot to lower wheels.
+ * \param wheel timer wheel
+ * \param level wheel after the first one (0 for the second wheel)
+ * \return index of the slot
+ */
+static size_t timer_wheel_cascade(struct timer_wheel* wheel, int level)
+{
+  size_t index = timer_wheel_index(wheel->tick, level);
+  struct list_head* slot = &wheel->levels[level][index];
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+
+  list_head_iterate_safe(slot, get, n)
+  {
+    struct timer_entry* entry = list_head_get(get, struct timer_entry, list);
+
+    list_head_remove(slot, &entry->list);
+    timer_wheel_insert(wheel, entry);
+  }
+
+  return index;
+}
+
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now, uint64_t tick_ms,
+    timer_wheel_callback callback)
+{
+  size_t i = 0;
+  int level = 0;
+
+  wheel->tick_ms = tick_ms ? tick_ms : 1;
+  wheel->tick = now / wheel->tick_ms;
+  wheel->count = 0;
+  wheel->callback = callback;
+
+  for(i = 0 ; i < TIMER_WHEEL_ROOT_SIZE ; i++)
+  {
+    list_head_init(&wheel->root[i]);
+  }
+
+  for(level = 0 ; level < TIMER_WHEEL_LEVELS ; level++)
+  {
+    for(i = 0 ; i < TIMER_WHEEL_LEVEL_SIZE ; i++)
+    {
+      list_head_init(&wheel->levels[level][i]);
+    }
+  }
+}
+
+void timer_entry_init(struct timer_entry* entry, int type, void* data)
+{
+  entry->expires = 0;
+  entry->type = type;
+  entry->data = data;
+  list_head_init(&entry->list);
+}
+
+int timer_entry_is_pending(const struct timer_entry* entry)
+{
+  return entry->list.next != &entry->list;
+}
+
+void timer_wheel_add(struct timer_wheel* wheel, struct timer_entry* entry,
+    uint64_t timeout_ms)
+{
+  if(timer_entry_is_pending(entry))
+  {
+    list_head_remove(&entry->list, &entry->list);
+  }
+  else
+  {
+    wheel->count++;
+  }
+
+  /* round up so that the timer never expires too early */
+  entry->expires = wheel->tick +
+    (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  timer_wheel_insert(wheel, entry);
+}
+
+void timer_wheel_del(struct timer_wheel* wheel, struct timer_entry* entry)
+{
+  if(timer_entry_is_pending(entry))
+  {
+    list_head_remove(&entry->list, &entry->list);
+    wheel->count--;
+  }
+}
+
+uint64_t timer_wheel_remaining(const struct timer_wheel* wheel,
+    const struct timer_entry* entry)
+{
+  if(!timer_entry_is_pending(entry) || entry->expires <= wheel->tick)
+  {
+    return 0;
+  }
+
+  return (entry->expires - wheel->tick) * wheel->tick_ms;
+}
+
+size_t timer_wheel_run(struct timer_wheel* wheel, uint64_t now)
+{
+  uint64_t target = now / wheel->tick_ms;
+  size_t nb = 0;
+
+  while(wheel->tick <= target)
+  {
+    size_t index = (size_t)(wheel->tick & TIMER_WHEEL_ROOT_MASK);
+    struct list_head expired;
+
+    if(wheel->count == 0)
+    {
+      /* nothing to expire, jump to the target */
+      wheel->tick = target + 1;
+      break;
+    }
+
+    /* first wheel has done a round, refill it from the upper ones */
+    if(index == 0)
+    {
+      int level = 0;
+
+      while(level < TIMER_WHEEL_LEVELS &&
+          timer_wheel_cascade(wheel, level) == 0)
+      {
+        level++;
+      }
+    }
+
+    /* detach the slot so that callbacks can add timers safely */
+    list_head_init(&expired);
+
+    if(!list_head_is_empty(&wheel->root[index]))
+    {
+      expired.next = wheel->root[index].next;
+      expired.prev = wheel->root[index].prev;
+      expired.next->prev = &expired;
+      expired.prev->next = &expired;
+      list_head_init(&wheel->root[index]);
+    }
+
+    wheel->tick++;
+
+    while(!list_head_is_empty(&expired))
+    {
+      struct timer_entry* entry = list_head_get(expired.next,
+          struct timer_entry, list);
+
+      list_head_remove(&expired, &entry->list);
+      wheel->count--;
+      nb++;
+
+      if(wheel->callback)
+      {
+        wheel->callback(entry);
+      }
+    }
+  }
+
+  return nb;
+}
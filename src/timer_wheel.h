@@ -0,0 +1,192 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file timer_wheel.h
+ * \brief Hierarchical timing wheel.
+ *
+ * Timers are stored in the slots of several wheels according to their
+ * expiration tick. Adding or removing a timer is O(1) and expired timers are
+ * processed in batch by timer_wheel_run(), which is called by the event loop.
+ * Timers farther than the first wheel are moved (cascaded) to a lower wheel
+ * when their time comes closer.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/**
+ * \def TIMER_WHEEL_ROOT_BITS
+ * \brief Number of bits of the tick used to index the first wheel.
+ */
+#define TIMER_WHEEL_ROOT_BITS 8
+
+/**
+ * \def TIMER_WHEEL_ROOT_SIZE
+ * \brief Number of slots of the first wheel.
+ */
+#define TIMER_WHEEL_ROOT_SIZE (1 << TIMER_WHEEL_ROOT_BITS)
+
+/**
+ * \def TIMER_WHEEL_LEVEL_BITS
+ * \brief Number of bits of the tick used to index the other wheels.
+ */
+#define TIMER_WHEEL_LEVEL_BITS 6
+
+/**
+ * \def TIMER_WHEEL_LEVEL_SIZE
+ * \brief Number of slots of the other wheels.
+ */
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+
+/**
+ * \def TIMER_WHEEL_LEVELS
+ * \brief Number of wheels after the first one.
+ */
+#define TIMER_WHEEL_LEVELS 3
+
+/**
+ * \def TIMER_WHEEL_MAX_TICKS
+ * \brief Maximum number of ticks before expiration, longer timeouts are
+ * truncated.
+ */
+#define TIMER_WHEEL_MAX_TICKS \
+  ((1UL << (TIMER_WHEEL_ROOT_BITS + \
+            TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS)) - 1)
+
+struct timer_entry;
+
+/**
+ * \typedef timer_wheel_callback
+ * \brief Function called when a timer expires.
+ *
+ * The timer is no longer pending when it is called, so it can be added again.
+ */
+typedef void (*timer_wheel_callback)(struct timer_entry* entry);
+
+/**
+ * \struct timer_entry
+ * \brief Timer (embedded in the object which expires).
+ */
+struct timer_entry
+{
+  uint64_t expires; /**< Tick of expiration */
+  int type; /**< Type of the object (user-defined) */
+  void* data; /**< Object which expires */
+  struct list_head list; /**< For list management (wheel slot) */
+};
+
+/**
+ * \struct timer_wheel
+ * \brief Hierarchical timing wheel.
+ */
+struct timer_wheel
+{
+  uint64_t tick; /**< Next tick to process */
+  uint64_t tick_ms; /**< Duration of a tick in milliseconds */
+  size_t count; /**< Number of pending timers */
+  timer_wheel_callback callback; /**< Function called for expired timers */
+  struct list_head root[TIMER_WHEEL_ROOT_SIZE]; /**< First wheel */
+  struct list_head levels[TIMER_WHEEL_LEVELS][TIMER_WHEEL_LEVEL_SIZE];
+  /**< Other wheels */
+};
+
+/**
+ * \brief Initialize a timer wheel.
+ * \param wheel timer wheel
+ * \param now current time in milliseconds (monotonic clock)
+ * \param tick_ms duration of a tick in milliseconds (at least 1)
+ * \param callback function called for expired timers
+ */
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now, uint64_t tick_ms,
+    timer_wheel_callback callback);
+
+/**
+ * \brief Initialize a timer.
+ * \param entry timer
+ * \param type type of the object (user-defined)
+ * \param data object which expires
+ */
+void timer_entry_init(struct timer_entry* entry, int type, void* data);
+
+/**
+ * \brief Returns whether or not a timer is pending.
+ * \param entry timer
+ * \return 1 if timer is pending, 0 otherwise
+ */
+int timer_entry_is_pending(const struct timer_entry* entry);
+
+/**
+ * \brief Add a timer or change its expiration.
+ * \param wheel timer wheel
+ * \param entry timer
+ * \param timeout_ms timeout in milliseconds from the last processed tick
+ */
+void timer_wheel_add(struct timer_wheel* wheel, struct timer_entry* entry,
+    uint64_t timeout_ms);
+
+/**
+ * \brief Remove a timer (nothing is done if it is not pending).
+ * \param wheel timer wheel
+ * \param entry timer
+ */
+void timer_wheel_del(struct timer_wheel* wheel, struct timer_entry* entry);
+
+/**
+ * \brief Get the remaining time before a timer expires.
+ * \param wheel timer wheel
+ * \param entry timer
+ * \return remaining time in milliseconds, 0 if not pending
+ */
+uint64_t timer_wheel_remaining(const struct timer_wheel* wheel,
+    const struct timer_entry* entry);
+
+/**
+ * \brief Process the timers which have expired.
+ * \param wheel timer wheel
+ * \param now current time in milliseconds (monotonic clock)
+ * \return number of expired timers
+ */
+size_t timer_wheel_run(struct timer_wheel* wheel, uint64_t now);
+
+#endif /* TIMER_WHEEL_H */
+
@@ -62,9 +62,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #if !defined(_WIN32) && !defined(_WIN64)
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -80,10 +84,22 @@
 #include <openssl/pem.h>
 #include <openssl/pkcs7.h>
 #include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
 
 #include "util_net.h"
 #include "tls_peer.h"
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS) && \
+  !defined(OPENSSL_NO_KTLS)
+/**
+ * \def TLS_PEER_KTLS
+ * \brief libssl can give the TLS records to send to the kernel (OpenSSL 3.0
+ * and later built with kernel TLS).
+ */
+#define TLS_PEER_KTLS 1
+#endif
+
 #ifdef __cplusplus
 extern "C"
 { /* } */
@@ -93,6 +109,44 @@ extern "C"
  * projects
  */
 
+/**
+ * \struct ssl_peer_key
+ * \brief Compact key of a remote peer address.
+ */
+struct ssl_peer_key
+{
+  uint16_t family; /**< Address family (AF_INET for IPv4-mapped). */
+  uint16_t port; /**< Port (network byte order). */
+  uint8_t addr[16]; /**< Address. */
+};
+
+/**
+ * \enum ssl_peer_handshake_state
+ * \brief Who owns a remote peer whose handshake is done by the handshake
+ * threads.
+ */
+enum ssl_peer_handshake_state
+{
+  HANDSHAKE_INLINE = 0, /**< Event loop (handshake threads not used). */
+  HANDSHAKE_WAITING, /**< Handshake threads, waits for records. */
+  HANDSHAKE_QUEUED, /**< Handshake threads, waits for a thread. */
+  HANDSHAKE_RUNNING, /**< Handshake threads, a thread runs the handshake. */
+  HANDSHAKE_FINISHED, /**< Waits to be given back to the event loop. */
+  HANDSHAKE_ABANDONED /**< Removed while running, freed by the event loop
+                        once the thread has left it. */
+};
+
+/**
+ * \struct ssl_peer_record
+ * \brief Data received from a remote peer and not given to OpenSSL yet.
+ */
+struct ssl_peer_record
+{
+  struct list_head list; /**< For list management. */
+  size_t len; /**< Length of data. */
+  char data[]; /**< Data (one datagram for DTLS). */
+};
+
 /**
  * \struct ssl_peer
  * \brief Describes a SSL peer client.
@@ -101,10 +155,112 @@ struct ssl_peer
 {
   SSL* ssl; /**< The remote peer. */
   int handshake_complete; /**< State of the handshake. */
+  struct tls_peer* peer; /**< (D)TLS peer it belongs to. */
+  enum ssl_peer_handshake_state hs_state; /**< Owner during the handshake. */
+  int hs_error; /**< If the handshake has failed in a thread. */
+  struct list_head records; /**< Records received during the handshake. */
+  struct list_head hs_list; /**< For the handshake queues. */
   struct sockaddr_storage addr; /**< Socket address. */
+  struct ssl_peer_key key; /**< Key of addr. */
+  int sock; /**< Connected socket (DTLS), -1 if none. */
+  struct sockaddr_storage local; /**< Local address of sock. */
+  void* data; /**< Data of the caller. */
+  char* wbuf; /**< Buffer to coalesce a message before writing it. */
+  size_t wbuf_size; /**< Size of wbuf. */
+  struct hash_node node; /**< For hash table management. */
   struct list_head list; /**< For list management. */
 };
 
+/**
+ * \var g_ssl_peer_pool
+ * \brief Pool of SSL peer descriptors.
+ */
+static struct pool g_ssl_peer_pool =
+  POOL_INITIALIZER("ssl_peer", sizeof(struct ssl_peer));
+
+/**
+ * \var g_tls_peer_stats
+ * \brief Counters of TLS/DTLS writes and handshakes.
+ */
+static struct tls_peer_stats g_tls_peer_stats;
+
+/**
+ * \struct tls_peer_handshake_pool
+ * \brief Threads which run the handshakes of the remote peers.
+ *
+ * The event loop queues the records received from a remote peer until its
+ * handshake is finished, a thread gives them to OpenSSL and the flights are
+ * sent from the thread. The remote peer is then given back to the event loop.
+ */
+struct tls_peer_handshake_pool
+{
+  pthread_mutex_t mutex; /**< Protects the queues and the records. */
+  pthread_cond_t cond; /**< Signaled when a peer is queued or to stop. */
+  struct list_head queue; /**< Remote peers waiting for a thread. */
+  struct list_head finished; /**< Remote peers given back to the event loop. */
+  pthread_t* threads; /**< Threads. */
+  size_t threads_nb; /**< Number of threads, 0 if not started. */
+  int fds[2]; /**< Pipe to wake up the event loop. */
+  int null_fd; /**< Descriptor of /dev/null (see tls_peer_abandon()). */
+  int stop; /**< If the threads have to exit. */
+};
+
+/**
+ * \var g_handshake_pool
+ * \brief Handshake threads (shared by all TLS/DTLS peers).
+ */
+static struct tls_peer_handshake_pool g_handshake_pool =
+{
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {NULL, NULL},
+  {NULL, NULL}, NULL, 0, {-1, -1}, -1, 0
+};
+
+/**
+ * \var g_ticket_keys_mutex
+ * \brief Protects the session ticket keys used by the handshake threads.
+ */
+static pthread_mutex_t g_ticket_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/**
+ * \var g_ssl_locks
+ * \brief Locks of OpenSSL shared structures (before OpenSSL 1.1.0).
+ */
+static pthread_mutex_t* g_ssl_locks = NULL;
+
+/**
+ * \brief Lock or unlock an OpenSSL lock.
+ * \param mode CRYPTO_LOCK or CRYPTO_UNLOCK.
+ * \param n lock index.
+ * \param file source file (unused).
+ * \param line source line (unused).
+ */
+static void tls_peer_locking_callback(int mode, int n, const char* file,
+    int line)
+{
+  (void)file;
+  (void)line;
+
+  if(mode & CRYPTO_LOCK)
+  {
+    pthread_mutex_lock(&g_ssl_locks[n]);
+  }
+  else
+  {
+    pthread_mutex_unlock(&g_ssl_locks[n]);
+  }
+}
+
+/**
+ * \brief Identify the current thread for OpenSSL.
+ * \param id identifier to set.
+ */
+static void tls_peer_threadid_callback(CRYPTO_THREADID* id)
+{
+  CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+#endif
+
 /**
  * \brief Free a SSL peer.
  * \param peer the SSL peer.
@@ -112,14 +268,59 @@ struct ssl_peer
 static void ssl_peer_free(struct ssl_peer** peer)
 {
   struct ssl_peer* ret = *peer;
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+
+  list_head_iterate_safe(&ret->records, get, n)
+  {
+    free(list_head_get(get, struct ssl_peer_record, list));
+  }
 
   SSL_shutdown(ret->ssl);
   SSL_free(ret->ssl);
+  free(ret->wbuf);
 
-  free(*peer);
+  pool_free(&g_ssl_peer_pool, *peer);
   *peer = NULL;
 }
 
+/**
+ * \brief Compute the key of a remote peer address.
+ * \param key key to fill.
+ * \param addr address.
+ */
+static void ssl_peer_key_set(struct ssl_peer_key* key,
+    const struct sockaddr* addr)
+{
+  memset(key, 0x00, sizeof(struct ssl_peer_key));
+
+  if(addr->sa_family == AF_INET)
+  {
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+
+    key->family = AF_INET;
+    key->port = addr4->sin_port;
+    memcpy(key->addr, &addr4->sin_addr, 4);
+  }
+  else if(addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+
+    key->port = addr6->sin6_port;
+
+    if(IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+    {
+      key->family = AF_INET;
+      memcpy(key->addr, &addr6->sin6_addr.s6_addr[12], 4);
+    }
+    else
+    {
+      key->family = AF_INET6;
+      memcpy(key->addr, &addr6->sin6_addr, 16);
+    }
+  }
+}
+
 /**
  * \brief Create a new SSL peer.
  * \param addr socket address.
@@ -132,13 +333,17 @@ static struct ssl_peer* ssl_peer_new(struct sockaddr* addr, socklen_t addrlen,
 {
   struct ssl_peer* ret = NULL;
 
-  if(!(ret = malloc(sizeof(struct ssl_peer))))
+  if(!(ret = pool_alloc(&g_ssl_peer_pool)))
   {
     return NULL;
   }
 
   memset(ret, 0x00, sizeof(struct ssl_peer));
   memcpy(&ret->addr, addr, addrlen);
+  ssl_peer_key_set(&ret->key, addr);
+  hash_node_init(&ret->node);
+  list_head_init(&ret->records);
+  ret->sock = -1;
   ret->ssl = ssl;
   ret->handshake_complete = 0;
 
@@ -155,15 +360,28 @@ static struct ssl_peer* ssl_peer_new(struct sockaddr* addr, socklen_t addrlen,
 static struct ssl_peer* tls_peer_find_connection(struct tls_peer* peer,
     const struct sockaddr* addr, socklen_t addrlen)
 {
-  struct list_head* n = NULL;
+  struct ssl_peer_key key;
+  struct list_head* bucket = NULL;
   struct list_head* get = NULL;
+  uint32_t hash = 0;
 
-  list_head_iterate_safe(&peer->remote_peers, get, n)
+  /* key does not depend on the size */
+  (void)addrlen;
+
+  ssl_peer_key_set(&key, addr);
+  hash = hash_bytes(&key, sizeof(struct ssl_peer_key), peer->hash_seed);
+
+  if(!(bucket = hash_table_bucket(&peer->remote_index, hash)))
   {
-    struct ssl_peer* tmp = NULL;
+    return NULL;
+  }
 
-    tmp = list_head_get(get, struct ssl_peer, list);
-    if(!memcmp(&tmp->addr, addr, addrlen))
+  list_head_iterate(bucket, get)
+  {
+    struct ssl_peer* tmp = list_head_get(get, struct ssl_peer, node.list);
+
+    if(tmp->node.hash == hash &&
+       !memcmp(&tmp->key, &key, sizeof(struct ssl_peer_key)))
     {
       return tmp;
     }
@@ -179,19 +397,157 @@ static struct ssl_peer* tls_peer_find_connection(struct tls_peer* peer,
 static void tls_peer_add_connection(struct tls_peer* peer,
     struct ssl_peer* speer)
 {
+  speer->peer = peer;
   list_head_add_tail(&peer->remote_peers, &speer->list);
+  hash_table_add(&peer->remote_index, &speer->node,
+      hash_bytes(&speer->key, sizeof(struct ssl_peer_key), peer->hash_seed));
+}
+
+/**
+ * \brief Update a remote peer once its handshake is finished.
+ * \param peer (D)TLS peer (NULL if the remote peer has been removed).
+ * \param speer SSL peer.
+ */
+static void tls_peer_handshake_complete(struct tls_peer* peer,
+    struct ssl_peer* speer)
+{
+  /* at this point, socket can send data */
+  speer->handshake_complete = 1;
+
+  if(SSL_session_reused(speer->ssl))
+  {
+    g_tls_peer_stats.handshakes_resumed++;
+  }
+  else
+  {
+    g_tls_peer_stats.handshakes_full++;
+  }
+
+#ifdef TLS_PEER_KTLS
+  if(peer && peer->type == TCP &&
+     BIO_get_ktls_send(SSL_get_wbio(speer->ssl)))
+  {
+    /* records are now encrypted by the kernel */
+    g_tls_peer_stats.ktls_tx++;
+  }
+#else
+  (void)peer;
+#endif
+}
+
+/**
+ * \brief Abandon a remote peer whose handshake is run by a thread.
+ *
+ * The event loop does not wait for the thread (it may be doing a private key
+ * operation), the remote peer is freed by tls_peer_handshake_finished() once
+ * the thread has left it. For TLS, the socket written by the thread is
+ * replaced by /dev/null so that the connection is closed now but the
+ * descriptor cannot be reused by another client until the remote peer is
+ * freed.
+ * \param peer (D)TLS peer.
+ * \param ssl SSL peer (handshake pool mutex locked).
+ * \return 1 if the socket of the remote peer (TLS) has been closed, 0
+ * otherwise.
+ */
+static int tls_peer_abandon(struct tls_peer* peer, struct ssl_peer* ssl)
+{
+  int fd = SSL_get_wfd(ssl->ssl);
+
+  ssl->hs_state = HANDSHAKE_ABANDONED;
+  ssl->peer = NULL;
+
+  if(peer->type != TCP || fd == -1 ||
+     dup2(g_handshake_pool.null_fd, fd) == -1)
+  {
+    return 0;
+  }
+
+  /* closed when the remote peer is freed */
+  ssl->sock = fd;
+  return 1;
+}
+
+/**
+ * \brief Free a remote peer abandoned while its handshake was running.
+ * \param ssl SSL peer.
+ */
+static void tls_peer_abandoned_free(struct ssl_peer* ssl)
+{
+  if(!ssl->hs_error)
+  {
+    /* count it even if the event loop does not take it back */
+    tls_peer_handshake_complete(NULL, ssl);
+  }
+
+  if(ssl->sock != -1)
+  {
+    close(ssl->sock);
+  }
+
+  ssl_peer_free(&ssl);
 }
 
 /**
  * \brief Remove a connection from the peer.
  * \param peer (D)TLS peer
  * \param ssl SSL peer to remove
+ * \return 1 if the socket of the remote peer (TLS) has been closed and will be
+ * released later, 0 otherwise.
  */
-static void tls_peer_remove_connection(struct tls_peer* peer,
+static int tls_peer_remove_connection(struct tls_peer* peer,
     struct ssl_peer* ssl)
 {
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  int finished = 0;
+  int closed = 0;
+
   list_head_remove(&peer->remote_peers, &ssl->list);
+  hash_table_remove(&peer->remote_index, &ssl->node);
+
+  if(ssl->sock != -1)
+  {
+    if(peer->close_callback)
+    {
+      peer->close_callback(ssl->sock, ssl);
+    }
+    close(ssl->sock);
+    ssl->sock = -1;
+  }
+
+  if(pool->threads_nb)
+  {
+    pthread_mutex_lock(&pool->mutex);
+
+    if(ssl->hs_state == HANDSHAKE_RUNNING)
+    {
+      /* do not free it under the feet of the thread */
+      closed = tls_peer_abandon(peer, ssl);
+      pthread_mutex_unlock(&pool->mutex);
+      return closed;
+    }
+
+    if(ssl->hs_state == HANDSHAKE_QUEUED)
+    {
+      list_head_remove(&pool->queue, &ssl->hs_list);
+    }
+    else if(ssl->hs_state == HANDSHAKE_FINISHED)
+    {
+      list_head_remove(&pool->finished, &ssl->hs_list);
+      finished = !ssl->hs_error;
+    }
+
+    ssl->hs_state = HANDSHAKE_INLINE;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(finished)
+    {
+      /* not taken back by the event loop but count it */
+      tls_peer_handshake_complete(peer, ssl);
+    }
+  }
+
   ssl_peer_free(&ssl);
+  return 0;
 }
 
 /**
@@ -208,8 +564,9 @@ static void tls_peer_clear_connection(struct tls_peer* peer)
     struct ssl_peer* tmp = NULL;
     tmp = list_head_get(get, struct ssl_peer, list);
     tls_peer_remove_connection(peer, tmp);
-    return;
   }
+
+  hash_table_free(&peer->remote_index);
 }
 
 /**
@@ -217,8 +574,9 @@ static void tls_peer_clear_connection(struct tls_peer* peer)
  * \param peer (D)TLS peer.
  * \param ssl SSL peer concerned.
  * \param err the error number.
+ * \return 1 if the connection has been removed (ssl is freed), 0 otherwise.
  */
-static void tls_peer_manage_error(struct tls_peer* peer, struct ssl_peer* ssl,
+static int tls_peer_manage_error(struct tls_peer* peer, struct ssl_peer* ssl,
     int err)
 {
   switch(err)
@@ -230,7 +588,7 @@ static void tls_peer_manage_error(struct tls_peer* peer, struct ssl_peer* ssl,
           ERR_reason_error_string(ERR_get_error()));
       /* big problem, remove the connection */
       tls_peer_remove_connection(peer, ssl);
-      break;
+      return 1;
     case SSL_ERROR_WANT_READ:
       fprintf(stderr, "SSL_ERROR_WANT_READ\n");
       break;
@@ -240,12 +598,12 @@ static void tls_peer_manage_error(struct tls_peer* peer, struct ssl_peer* ssl,
     case SSL_ERROR_SYSCALL:
       fprintf(stderr, "SSL_ERROR_SYSCALL\n");
       tls_peer_remove_connection(peer, ssl);
-      break;
+      return 1;
     case SSL_ERROR_ZERO_RETURN: /* connection closed */
       fprintf(stderr, "SSL_ERROR_ZERO_RETURN\n");
       /* big problem, remove the connection */
       tls_peer_remove_connection(peer, ssl);
-      break;
+      return 1;
     case SSL_ERROR_WANT_CONNECT:
       fprintf(stderr, "SSL_ERROR_WANT_CONNECT\n");
       break;
@@ -256,6 +614,8 @@ static void tls_peer_manage_error(struct tls_peer* peer, struct ssl_peer* ssl,
       fprintf(stderr, "SSL_ERROR_UNKNOWN\n");
       break;
   }
+
+  return 0;
 }
 
 /**
@@ -299,6 +659,103 @@ static int tls_peer_load_certificates(SSL_CTX* ctx, const char* ca_file,
   return 0;
 }
 
+/**
+ * \brief Initialize the contexts to encrypt a new session ticket or to decrypt
+ * a received one.
+ * \param peer TLS/DTLS peer.
+ * \param name name of the key (set if enc is 1).
+ * \param iv initialization vector (set if enc is 1).
+ * \param ectx cipher context to initialize.
+ * \param hctx HMAC context to initialize.
+ * \param enc 1 to encrypt a new ticket, 0 to decrypt a received one.
+ * \return -1 if error, 0 if the key is unknown (full handshake), 1 if success
+ * or 2 if the ticket has to be renewed.
+ */
+static int tls_peer_ticket_key_init(struct tls_peer* peer, unsigned char* name,
+    unsigned char* iv, EVP_CIPHER_CTX* ectx, HMAC_CTX* hctx, int enc)
+{
+  struct tls_peer_ticket_key* key = NULL;
+  size_t i = 0;
+
+  if(!peer || !peer->ticket_keys_nb)
+  {
+    return -1;
+  }
+
+  if(enc)
+  {
+    key = &peer->ticket_keys[0];
+
+    if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1)
+    {
+      return -1;
+    }
+
+    memcpy(name, key->name, sizeof(key->name));
+
+    if(EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes_key,
+          iv) != 1)
+    {
+      return -1;
+    }
+
+    HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(),
+        NULL);
+    return 1;
+  }
+
+  for(i = 0 ; i < peer->ticket_keys_nb ; i++)
+  {
+    if(!memcmp(name, peer->ticket_keys[i].name, sizeof(key->name)))
+    {
+      key = &peer->ticket_keys[i];
+      break;
+    }
+  }
+
+  if(!key)
+  {
+    /* expired key */
+    return 0;
+  }
+
+  HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(),
+      NULL);
+
+  if(EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes_key, iv) != 1)
+  {
+    return -1;
+  }
+
+  /* renew tickets encrypted with an old key */
+  return (i == 0) ? 1 : 2;
+}
+
+/**
+ * \brief Encrypt a new session ticket or find the key of a received one.
+ * \param ssl the connection.
+ * \param name name of the key (set if enc is 1).
+ * \param iv initialization vector (set if enc is 1).
+ * \param ectx cipher context to initialize.
+ * \param hctx HMAC context to initialize.
+ * \param enc 1 to encrypt a new ticket, 0 to decrypt a received one.
+ * \return -1 if error, 0 if the key is unknown (full handshake), 1 if success
+ * or 2 if the ticket has to be renewed.
+ */
+static int tls_peer_ticket_key_callback(SSL* ssl, unsigned char* name,
+    unsigned char* iv, EVP_CIPHER_CTX* ectx, HMAC_CTX* hctx, int enc)
+{
+  int ret = -1;
+
+  /* the keys may be reloaded while a handshake thread uses them */
+  pthread_mutex_lock(&g_ticket_keys_mutex);
+  ret = tls_peer_ticket_key_init(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)),
+      name, iv, ectx, hctx, enc);
+  pthread_mutex_unlock(&g_ticket_keys_mutex);
+
+  return ret;
+}
+
 /**
  * \brief Setup a (D)TLS peer.
  * \param peer tls_peer instance to setup.
@@ -320,9 +777,15 @@ static int tls_peer_setup(struct tls_peer* peer, enum protocol_type type,
   SSL_METHOD* method_server = NULL;
   SSL_METHOD* method_client = NULL;
 
-  /* initialize list */
+  /* initialize list, the index is empty (zeroed) */
   list_head_init(&peer->remote_peers);
 
+  /* remote users cannot predict collisions of the index */
+  if(RAND_bytes((unsigned char*)&peer->hash_seed, sizeof(uint32_t)) != 1)
+  {
+    return -1;
+  }
+
   if(type == UDP)
   {
     method_client = (SSL_METHOD*)DTLSv1_client_method();
@@ -374,6 +837,16 @@ static int tls_peer_setup(struct tls_peer* peer, enum protocol_type type,
     SSL_CTX_set_client_CA_list(peer->ctx_server, calist);
   }
 
+  /* sessions are only resumed by the context which has verified them */
+  if(SSL_CTX_set_session_id_context(peer->ctx_server,
+        (const unsigned char*)"turnserver", 10) != 1)
+  {
+    return -1;
+  }
+
+  /* for the ticket keys callback */
+  SSL_CTX_set_app_data(peer->ctx_server, peer);
+
   peer->sock = net_socket_create(type, addr, port, 0, 0);
   peer->type = type;
 
@@ -381,59 +854,272 @@ static int tls_peer_setup(struct tls_peer* peer, enum protocol_type type,
 }
 
 /**
- * \brief Read a (D)TLS message.
+ * \brief Set the BIO from which an SSL object reads records.
+ *
+ * The SSL object does not keep a reference on bio, the caller frees it after
+ * having set the BIO to NULL.
+ * \param ssl SSL object.
+ * \param bio BIO or NULL.
+ */
+static void tls_peer_set_rbio(SSL* ssl, BIO* bio)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  ssl->rbio = bio;
+#else
+  /* SSL_set0_rbio() takes ownership and frees the previous BIO */
+  if(bio)
+  {
+    BIO_up_ref(bio);
+  }
+  SSL_set0_rbio(ssl, bio);
+#endif
+}
+
+/**
+ * \brief Decrypt (D)TLS records.
  * \param peer (D)TLS peer.
  * \param buf in buffer.
  * \param buflen in buffer length.
  * \param bufout out buffer.
  * \param bufoutlen out buffer length.
  * \param speer SSL peer.
- * \return number of bytes read or -1 if error or handshake not finalized.
+ * \param err set to the SSL error if nothing is decrypted.
+ * \return number of bytes decrypted, 0 or -1 if nothing is decrypted.
  */
-static ssize_t tls_peer_read(struct tls_peer* peer, char* buf, ssize_t buflen,
-    char* bufout, ssize_t bufoutlen, struct ssl_peer* speer)
+static ssize_t tls_peer_decrypt(struct tls_peer* peer, char* buf,
+    ssize_t buflen, char* bufout, ssize_t bufoutlen, struct ssl_peer* speer,
+    int* err)
 {
   BIO* bio_read = NULL;
   ssize_t len = -1;
-  int err = 0;
-
-  /* printf("tls_peer_read\n"); */
 
   bio_read = BIO_new_mem_buf(buf, buflen);
   BIO_set_mem_eof_return(bio_read, -1);
 
-  speer->ssl->rbio = bio_read;
+  tls_peer_set_rbio(speer->ssl, bio_read);
   len = SSL_read(speer->ssl, bufout, bufoutlen);
-  err = SSL_get_error(speer->ssl, len);
+  *err = SSL_get_error(speer->ssl, len);
 
+  tls_peer_set_rbio(speer->ssl, NULL);
   BIO_free(bio_read);
-  speer->ssl->rbio = NULL;
 
   if(!speer->handshake_complete && SSL_is_init_finished(speer->ssl))
   {
-    /* at this point, socket can send data */
-    speer->handshake_complete = 1;
-  }
-
-  if(len <= 0)
-  {
-    tls_peer_manage_error(peer, speer, err);
+    tls_peer_handshake_complete(peer, speer);
   }
 
   return len;
 }
 
 /**
- * \brief Verify certificate chain.
- * \param ssl SSL pointer.
- * \return 1 if certificate verification is OK, 0 otherwise.
+ * \brief Queue records received during the handshake of a remote peer for the
+ * handshake threads.
+ * \param buf records.
+ * \param buflen length of buf.
+ * \param speer SSL peer.
+ * \return -1 (no message is decrypted).
  */
-static int verify_certificate(SSL* ssl)
+static ssize_t tls_peer_handshake_queue(char* buf, ssize_t buflen,
+    struct ssl_peer* speer)
 {
-    X509* x509 = SSL_get_peer_certificate(ssl);
-    
-    if(x509)
-    {
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  struct ssl_peer_record* record = NULL;
+
+  if(!(record = malloc(sizeof(struct ssl_peer_record) + buflen)))
+  {
+    return -1;
+  }
+
+  record->len = buflen;
+  memcpy(record->data, buf, buflen);
+
+  pthread_mutex_lock(&pool->mutex);
+  list_head_add_tail(&speer->records, &record->list);
+
+  if(speer->hs_state == HANDSHAKE_INLINE ||
+     speer->hs_state == HANDSHAKE_WAITING)
+  {
+    speer->hs_state = HANDSHAKE_QUEUED;
+    list_head_add_tail(&pool->queue, &speer->hs_list);
+    pthread_cond_signal(&pool->cond);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/**
+ * \brief Read a (D)TLS message.
+ * \param peer (D)TLS peer.
+ * \param buf in buffer.
+ * \param buflen in buffer length.
+ * \param bufout out buffer.
+ * \param bufoutlen out buffer length.
+ * \param speer SSL peer.
+ * \return number of bytes read or -1 if error or handshake not finalized.
+ */
+static ssize_t tls_peer_read(struct tls_peer* peer, char* buf, ssize_t buflen,
+    char* bufout, ssize_t bufoutlen, struct ssl_peer* speer)
+{
+  ssize_t len = -1;
+  int err = 0;
+
+  /* printf("tls_peer_read\n"); */
+
+  if(!speer->handshake_complete && g_handshake_pool.threads_nb)
+  {
+    /* no public key operation in the event loop */
+    return tls_peer_handshake_queue(buf, buflen, speer);
+  }
+
+  len = tls_peer_decrypt(peer, buf, buflen, bufout, bufoutlen, speer, &err);
+
+  if(len <= 0)
+  {
+    tls_peer_manage_error(peer, speer, err);
+  }
+
+  return len;
+}
+
+/**
+ * \brief Give a record to the handshake of a remote peer (handshake thread).
+ * \param speer SSL peer.
+ * \param record record, if the handshake is finished it is set to the data
+ * which follow the handshake.
+ * \return 1 if the handshake is finished, 0 if more records are needed, -1 if
+ * the handshake has failed.
+ */
+static int tls_peer_handshake_record(struct ssl_peer* speer,
+    struct ssl_peer_record* record)
+{
+  BIO* bio_read = NULL;
+  size_t pending = 0;
+  int ret = -1;
+  int err = 0;
+
+  if(!(bio_read = BIO_new_mem_buf(record->data, record->len)))
+  {
+    return -1;
+  }
+
+  BIO_set_mem_eof_return(bio_read, -1);
+
+  tls_peer_set_rbio(speer->ssl, bio_read);
+  ret = SSL_do_handshake(speer->ssl);
+  err = SSL_get_error(speer->ssl, ret);
+  pending = BIO_ctrl_pending(bio_read);
+
+  tls_peer_set_rbio(speer->ssl, NULL);
+  BIO_free(bio_read);
+
+  if(ret != 1)
+  {
+    record->len = 0;
+    return (err == SSL_ERROR_WANT_READ) ? 0 : -1;
+  }
+
+  /* application data in the same segment */
+  memmove(record->data, record->data + record->len - pending, pending);
+  record->len = pending;
+  return 1;
+}
+
+/**
+ * \brief Run the handshakes of the queued remote peers (handshake thread).
+ * \param data unused.
+ * \return NULL.
+ */
+static void* tls_peer_handshake_thread(void* data)
+{
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  sigset_t mask;
+
+  (void)data;
+
+  /* signals are for the event loop */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while(!pool->stop)
+  {
+    struct ssl_peer* speer = NULL;
+    ssize_t nb = -1;
+    int ret = 0;
+
+    if(list_head_is_empty(&pool->queue))
+    {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+      continue;
+    }
+
+    speer = list_head_get(pool->queue.next, struct ssl_peer, hs_list);
+    list_head_remove(&pool->queue, &speer->hs_list);
+    speer->hs_state = HANDSHAKE_RUNNING;
+
+    /* records may be queued while the previous one is processed */
+    while(ret == 0 && speer->hs_state == HANDSHAKE_RUNNING &&
+        !list_head_is_empty(&speer->records))
+    {
+      struct ssl_peer_record* record = list_head_get(speer->records.next,
+          struct ssl_peer_record, list);
+
+      list_head_remove(&speer->records, &record->list);
+      pthread_mutex_unlock(&pool->mutex);
+
+      ret = tls_peer_handshake_record(speer, record);
+
+      pthread_mutex_lock(&pool->mutex);
+
+      if(record->len)
+      {
+        list_head_add(&speer->records, &record->list);
+      }
+      else
+      {
+        free(record);
+      }
+    }
+
+    if(ret == 0 && speer->hs_state == HANDSHAKE_RUNNING)
+    {
+      speer->hs_state = HANDSHAKE_WAITING;
+    }
+    else
+    {
+      /* an abandoned peer is freed by the event loop */
+      if(speer->hs_state == HANDSHAKE_RUNNING)
+      {
+        speer->hs_state = HANDSHAKE_FINISHED;
+      }
+      speer->hs_error = (ret != 1);
+      list_head_add_tail(&pool->finished, &speer->hs_list);
+
+      /* if the pipe is full, the event loop is already woken up */
+      nb = write(pool->fds[1], "", 1);
+      (void)nb;
+    }
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+/**
+ * \brief Verify certificate chain.
+ * \param ssl SSL pointer.
+ * \return 1 if certificate verification is OK, 0 otherwise.
+ */
+static int verify_certificate(SSL* ssl)
+{
+    X509* x509 = SSL_get_peer_certificate(ssl);
+    
+    if(x509)
+    {
       if(SSL_get_verify_result(ssl) != X509_V_OK)
       {
         /* printf("problem certificate\n"); */
@@ -546,7 +1232,7 @@ int tls_peer_do_handshake(struct tls_peer* peer, const struct sockaddr* daddr,
           {
             /* DTLS can return -1 for handshake so no failure if it happens */
             tls_peer_udp_read(peer, buf, nb, bufout, sizeof(bufout), daddr,
-                daddr_size);
+                daddr_size, NULL, 0);
           }
         }
       }
@@ -605,7 +1291,7 @@ ssize_t tls_peer_tcp_read(struct tls_peer* peer, char* buf, ssize_t buflen,
 
 ssize_t tls_peer_udp_read(struct tls_peer* peer, char* buf, ssize_t buflen,
     char* bufout, ssize_t bufoutlen, const struct sockaddr* addr,
-    socklen_t addrlen)
+    socklen_t addrlen, const struct sockaddr* local, socklen_t local_size)
 {
   struct ssl_peer* speer = NULL;
 
@@ -649,18 +1335,161 @@ ssize_t tls_peer_udp_read(struct tls_peer* peer, char* buf, ssize_t buflen,
       SSL_free(ssl);
       return -1;
     }
+
+    if(local)
+    {
+      memcpy(&speer->local, local, local_size);
+    }
+
     tls_peer_add_connection(peer, speer);
   }
 
   return tls_peer_read(peer, buf, buflen, bufout, bufoutlen, speer);
 }
 
+struct ssl_peer* tls_peer_udp_connect(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen,
+    const struct sockaddr* local, socklen_t local_size)
+{
+  struct ssl_peer* speer = NULL;
+  BIO* bio_write = NULL;
+  int sock = -1;
+
+  if(peer->type != UDP)
+  {
+    return NULL;
+  }
+
+  speer = tls_peer_find_connection(peer, addr, addrlen);
+
+  if(!speer || !speer->handshake_complete || speer->sock != -1 ||
+     !(bio_write = SSL_get_wbio(speer->ssl)))
+  {
+    return NULL;
+  }
+
+  sock = net_udp_connect(peer->sock, local, local_size, addr, addrlen);
+
+  if(sock == -1)
+  {
+    return NULL;
+  }
+
+  /* send from the connected socket, the peer address of the BIO is kept */
+  BIO_set_fd(bio_write, sock, BIO_NOCLOSE);
+  speer->sock = sock;
+  memcpy(&speer->local, local, local_size);
+  return speer;
+}
+
+int tls_peer_connection_sock(const struct ssl_peer* speer)
+{
+  return speer->sock;
+}
+
+const struct sockaddr_storage* tls_peer_connection_addr(
+    const struct ssl_peer* speer)
+{
+  return &speer->addr;
+}
+
+const struct sockaddr_storage* tls_peer_connection_local(
+    const struct ssl_peer* speer)
+{
+  return &speer->local;
+}
+
+void tls_peer_connection_set_data(struct ssl_peer* speer, void* data)
+{
+  speer->data = data;
+}
+
+void* tls_peer_connection_data(const struct ssl_peer* speer)
+{
+  return speer->data;
+}
+
+struct ssl_peer* tls_peer_connection_find(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen)
+{
+  return tls_peer_find_connection(peer, addr, addrlen);
+}
+
+int tls_peer_connection_remove(struct tls_peer* peer, struct ssl_peer* speer)
+{
+  return tls_peer_remove_connection(peer, speer);
+}
+
+ssize_t tls_peer_connection_read(struct tls_peer* peer, struct ssl_peer* speer,
+    char* buf, ssize_t buflen, char* bufout, ssize_t bufoutlen)
+{
+  return tls_peer_read(peer, buf, buflen, bufout, bufoutlen, speer);
+}
+
+/**
+ * \brief Check that the event loop can write to a remote peer.
+ *
+ * With handshake threads, the SSL object of a remote peer whose handshake is
+ * not complete may be used by a thread (or would run the handshake in the
+ * event loop).
+ * \param speer remote peer.
+ * \return 1 if the remote peer can be written, 0 otherwise (errno is set to
+ * EAGAIN).
+ */
+static int tls_peer_ssl_writable(const struct ssl_peer* speer)
+{
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  int ret = 0;
+
+  if(!pool->threads_nb)
+  {
+    return 1;
+  }
+
+  if(speer->handshake_complete)
+  {
+    pthread_mutex_lock(&pool->mutex);
+    ret = (speer->hs_state == HANDSHAKE_INLINE);
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  if(!ret)
+  {
+    errno = EAGAIN;
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Write a message to a remote peer.
+ * \param peer (D)TLS peer.
+ * \param speer remote peer, it may be removed if an error occurs.
+ * \param buf buffer to send.
+ * \param buflen buffer length.
+ * \return bytes sent or -1 if error(s).
+ */
+static ssize_t tls_peer_ssl_write(struct tls_peer* peer, struct ssl_peer* speer,
+    const char* buf, ssize_t buflen)
+{
+  ssize_t len = SSL_write(speer->ssl, buf, buflen);
+  int err = SSL_get_error(speer->ssl, len);
+
+  if(len <= 0)
+  {
+    tls_peer_manage_error(peer, speer, err);
+    return len;
+  }
+
+  g_tls_peer_stats.writes++;
+  g_tls_peer_stats.bytes_written += len;
+  return len;
+}
+
 ssize_t tls_peer_write(struct tls_peer* peer, const char* buf, ssize_t buflen,
     const struct sockaddr* addr, socklen_t addrlen)
 {
   BIO* bio_write = NULL;
-  ssize_t len = -1;
-  int err = 0;
   struct ssl_peer* speer = NULL;
 
   /* printf("tls_write\n"); */
@@ -684,6 +1513,10 @@ ssize_t tls_peer_write(struct tls_peer* peer, const char* buf, ssize_t buflen,
     {
       bio_write = BIO_new_dgram(peer->sock, BIO_NOCLOSE);
       (void)BIO_dgram_set_peer(bio_write, addr);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+      /* released when the rbio is replaced by tls_peer_set_rbio() */
+      BIO_up_ref(peer->bio_fake);
+#endif
       SSL_set_bio(ssl, peer->bio_fake, bio_write);
       /* SSL_set_mtu(ssl, SSL3_RT_MAX_PLAIN_LENGTH); */
     }
@@ -695,7 +1528,9 @@ ssize_t tls_peer_write(struct tls_peer* peer, const char* buf, ssize_t buflen,
     speer = ssl_peer_new((struct sockaddr*)addr, addrlen, ssl);
     if(!speer)
     {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
       CRYPTO_add(&peer->bio_fake->references, 1, CRYPTO_LOCK_BIO);
+#endif
       SSL_free(ssl);
       return -1;
     }
@@ -705,20 +1540,168 @@ ssize_t tls_peer_write(struct tls_peer* peer, const char* buf, ssize_t buflen,
     return 0;
   }
 
-  if(!buf)
+  if(!buf || !tls_peer_ssl_writable(speer))
   {
     return -1;
   }
 
-  len = SSL_write(speer->ssl, buf, buflen);
-  err = SSL_get_error(speer->ssl, len);
+  return tls_peer_ssl_write(peer, speer, buf, buflen);
+}
 
-  if(len <= 0)
+ssize_t tls_peer_writev(struct tls_peer* peer, const struct iovec* iov,
+    size_t iovlen, const struct sockaddr* addr, socklen_t addrlen)
+{
+  struct ssl_peer* speer = NULL;
+  size_t total = 0;
+  size_t i = 0;
+  char* p = NULL;
+
+  if(iovlen == 1)
   {
-    tls_peer_manage_error(peer, speer, err);
+    /* nothing to coalesce */
+    return tls_peer_write(peer, iov[0].iov_base, iov[0].iov_len, addr,
+        addrlen);
   }
 
-  return len;
+  speer = tls_peer_find_connection(peer, addr, addrlen);
+
+  if(!speer)
+  {
+    /* start the handshake */
+    return tls_peer_write(peer, NULL, 0, addr, addrlen);
+  }
+
+  if(!tls_peer_ssl_writable(speer))
+  {
+    return -1;
+  }
+
+  for(i = 0 ; i < iovlen ; i++)
+  {
+    total += iov[i].iov_len;
+  }
+
+  if(total > speer->wbuf_size)
+  {
+    size_t size = total > TLS_PEER_WRITE_BUFFER_SIZE ? total :
+      TLS_PEER_WRITE_BUFFER_SIZE;
+
+    if(!(p = realloc(speer->wbuf, size)))
+    {
+      return -1;
+    }
+
+    speer->wbuf = p;
+    speer->wbuf_size = size;
+    g_tls_peer_stats.buffer_allocs++;
+  }
+
+  /* libssl cannot send an iovec */
+  p = speer->wbuf;
+  for(i = 0 ; i < iovlen ; i++)
+  {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  g_tls_peer_stats.bytes_copied += total;
+
+  return tls_peer_ssl_write(peer, speer, speer->wbuf, total);
+}
+
+const struct tls_peer_stats* tls_peer_stats_get(void)
+{
+  return &g_tls_peer_stats;
+}
+
+int tls_peer_enable_ktls(struct tls_peer* peer)
+{
+#ifdef TLS_PEER_KTLS
+  if(peer->type != TCP)
+  {
+    /* no kernel DTLS */
+    return -1;
+  }
+
+  /* TLSv1 method cannot negotiate TLS 1.2 or 1.3 which kernel TLS requires */
+  if(!SSL_CTX_set_ssl_version(peer->ctx_server, TLS_server_method()) ||
+     !SSL_CTX_set_min_proto_version(peer->ctx_server, TLS1_VERSION))
+  {
+    return -1;
+  }
+
+  SSL_CTX_set_options(peer->ctx_server, SSL_OP_ENABLE_KTLS);
+  return 0;
+#else
+  (void)peer;
+  return -1;
+#endif
+}
+
+int tls_peer_set_session_cache(struct tls_peer* peer, size_t size,
+    long timeout)
+{
+  if(size == 0)
+  {
+    SSL_CTX_set_session_cache_mode(peer->ctx_server, SSL_SESS_CACHE_OFF);
+  }
+  else
+  {
+    SSL_CTX_set_session_cache_mode(peer->ctx_server, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(peer->ctx_server, size);
+  }
+
+  /* also the lifetime of tickets */
+  SSL_CTX_set_timeout(peer->ctx_server, timeout);
+  return 0;
+}
+
+int tls_peer_load_ticket_keys(struct tls_peer* peer, const char* file)
+{
+  FILE* f = NULL;
+  unsigned char* keys = NULL;
+  long size = 0;
+
+  if(!(f = fopen(file, "rb")))
+  {
+    return -1;
+  }
+
+  if(fseek(f, 0, SEEK_END) == -1 || (size = ftell(f)) <= 0 ||
+     size % TLS_PEER_TICKET_KEY_SIZE || fseek(f, 0, SEEK_SET) == -1 ||
+     !(keys = malloc(size)))
+  {
+    fclose(f);
+    return -1;
+  }
+
+  if(fread(keys, 1, size, f) != (size_t)size)
+  {
+    OPENSSL_cleanse(keys, size);
+    free(keys);
+    fclose(f);
+    return -1;
+  }
+
+  fclose(f);
+
+  pthread_mutex_lock(&g_ticket_keys_mutex);
+
+  if(peer->ticket_keys)
+  {
+    OPENSSL_cleanse(peer->ticket_keys,
+        peer->ticket_keys_nb * sizeof(struct tls_peer_ticket_key));
+    free(peer->ticket_keys);
+  }
+
+  /* the structure has the layout of the file */
+  peer->ticket_keys = (struct tls_peer_ticket_key*)keys;
+  peer->ticket_keys_nb = size / TLS_PEER_TICKET_KEY_SIZE;
+
+  pthread_mutex_unlock(&g_ticket_keys_mutex);
+
+  SSL_CTX_set_tlsext_ticket_key_cb(peer->ctx_server,
+      tls_peer_ticket_key_callback);
+  return 0;
 }
 
 int tls_peer_is_encrypted(const char* buf, size_t len)
@@ -743,8 +1726,8 @@ int tls_peer_is_encrypted(const char* buf, size_t len)
      * check the next two bytes to see if it is TLSv1 or DTLSv1
      */
 
-    /* TLSv1 */
-    if(v == 0x03 && v2 == 0x01)
+    /* TLSv1, TLSv1.1 and TLSv1.2 (also used by TLSv1.3 records) */
+    if(v == 0x03 && v2 >= 0x01 && v2 <= 0x03)
     {
       return 1;
     }
@@ -787,6 +1770,13 @@ void tls_peer_free(struct tls_peer** peer)
     BUF_MEM_free(ptr);
   }
 
+  if(ret->ticket_keys)
+  {
+    OPENSSL_cleanse(ret->ticket_keys,
+        ret->ticket_keys_nb * sizeof(struct tls_peer_ticket_key));
+    free(ret->ticket_keys);
+  }
+
   if(ret->sock > 0)
   {
     close(ret->sock);
@@ -797,6 +1787,271 @@ void tls_peer_free(struct tls_peer** peer)
   *peer = NULL;
 }
 
+int tls_peer_pool_reserve(size_t nb)
+{
+  return pool_reserve(&g_ssl_peer_pool, nb);
+}
+
+const struct pool* tls_peer_pool_get(void)
+{
+  return &g_ssl_peer_pool;
+}
+
+void tls_peer_pool_cleanup(void)
+{
+  pool_destroy(&g_ssl_peer_pool);
+}
+
+int tls_peer_handshake_start(size_t nb)
+{
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  size_t i = 0;
+
+  if(pool->threads_nb || nb == 0)
+  {
+    return -1;
+  }
+
+  if(!(pool->threads = malloc(nb * sizeof(pthread_t))))
+  {
+    return -1;
+  }
+
+  if(pipe(pool->fds) == -1)
+  {
+    free(pool->threads);
+    pool->threads = NULL;
+    return -1;
+  }
+
+  /* replaces the socket of a TLS remote peer removed during its handshake */
+  if((pool->null_fd = open("/dev/null", O_WRONLY)) == -1)
+  {
+    pool->threads_nb = 0;
+    tls_peer_handshake_stop();
+    return -1;
+  }
+
+  fcntl(pool->fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(pool->fds[1], F_SETFL, O_NONBLOCK);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if(!(g_ssl_locks = malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t))))
+  {
+    pool->threads_nb = 0;
+    tls_peer_handshake_stop();
+    return -1;
+  }
+
+  for(i = 0 ; i < (size_t)CRYPTO_num_locks() ; i++)
+  {
+    pthread_mutex_init(&g_ssl_locks[i], NULL);
+  }
+
+  CRYPTO_THREADID_set_callback(tls_peer_threadid_callback);
+  CRYPTO_set_locking_callback(tls_peer_locking_callback);
+#endif
+
+  list_head_init(&pool->queue);
+  list_head_init(&pool->finished);
+  pool->stop = 0;
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    if(pthread_create(&pool->threads[i], NULL, tls_peer_handshake_thread,
+          NULL) != 0)
+    {
+      break;
+    }
+  }
+
+  /* stop the threads already started if one has failed */
+  pool->threads_nb = i;
+
+  if(i != nb)
+  {
+    tls_peer_handshake_stop();
+    return -1;
+  }
+
+  return 0;
+}
+
+void tls_peer_handshake_stop(void)
+{
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+  size_t i = 0;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for(i = 0 ; i < pool->threads_nb ; i++)
+  {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  /* the remote peers still in a queue are freed with their (D)TLS peer */
+  if(pool->threads_nb)
+  {
+    list_head_iterate_safe(&pool->queue, get, n)
+    {
+      list_head_remove(&pool->queue, get);
+    }
+
+    list_head_iterate_safe(&pool->finished, get, n)
+    {
+      struct ssl_peer* speer = list_head_get(get, struct ssl_peer, hs_list);
+
+      list_head_remove(&pool->finished, get);
+
+      /* no more in the list of its (D)TLS peer */
+      if(speer->hs_state == HANDSHAKE_ABANDONED)
+      {
+        tls_peer_abandoned_free(speer);
+      }
+    }
+  }
+
+  pool->threads_nb = 0;
+  free(pool->threads);
+  pool->threads = NULL;
+
+  if(pool->fds[0] != -1)
+  {
+    close(pool->fds[0]);
+    close(pool->fds[1]);
+    pool->fds[0] = -1;
+    pool->fds[1] = -1;
+  }
+
+  if(pool->null_fd != -1)
+  {
+    close(pool->null_fd);
+    pool->null_fd = -1;
+  }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if(g_ssl_locks)
+  {
+    CRYPTO_set_locking_callback(NULL);
+
+    for(i = 0 ; i < (size_t)CRYPTO_num_locks() ; i++)
+    {
+      pthread_mutex_destroy(&g_ssl_locks[i]);
+    }
+
+    free(g_ssl_locks);
+    g_ssl_locks = NULL;
+  }
+#endif
+}
+
+int tls_peer_handshake_fd(void)
+{
+  return g_handshake_pool.fds[0];
+}
+
+struct ssl_peer* tls_peer_handshake_finished(struct tls_peer** peer)
+{
+  struct tls_peer_handshake_pool* pool = &g_handshake_pool;
+  struct ssl_peer* speer = NULL;
+  char buf[64];
+  ssize_t nb = -1;
+
+  if(!pool->threads_nb)
+  {
+    return NULL;
+  }
+
+  /* the threads write once per finished handshake */
+  do
+  {
+    nb = read(pool->fds[0], buf, sizeof(buf));
+  }while(nb > 0);
+
+  pthread_mutex_lock(&pool->mutex);
+
+  while(!list_head_is_empty(&pool->finished))
+  {
+    int error = 0;
+
+    speer = list_head_get(pool->finished.next, struct ssl_peer, hs_list);
+    list_head_remove(&pool->finished, &speer->hs_list);
+
+    if(speer->hs_state == HANDSHAKE_ABANDONED)
+    {
+      /* removed while its handshake was running */
+      tls_peer_abandoned_free(speer);
+      continue;
+    }
+
+    speer->hs_state = HANDSHAKE_INLINE;
+    error = speer->hs_error;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(!error)
+    {
+      tls_peer_handshake_complete(speer->peer, speer);
+      *peer = speer->peer;
+      return speer;
+    }
+
+    tls_peer_remove_connection(speer->peer, speer);
+    pthread_mutex_lock(&pool->mutex);
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+ssize_t tls_peer_handshake_read(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen, char* bufout,
+    ssize_t bufoutlen)
+{
+  /* it may have been removed while processing the previous message, a new
+   * remote peer with the same address may even be in handshake
+   */
+  struct ssl_peer* speer = tls_peer_find_connection(peer, addr, addrlen);
+
+  if(!speer || !speer->handshake_complete)
+  {
+    return 0;
+  }
+
+  /* records received after the handshake and before the event loop takes
+   * the remote peer back
+   */
+  while(!list_head_is_empty(&speer->records))
+  {
+    struct ssl_peer_record* record = list_head_get(speer->records.next,
+        struct ssl_peer_record, list);
+    ssize_t len = -1;
+    int err = 0;
+
+    list_head_remove(&speer->records, &record->list);
+    len = tls_peer_decrypt(peer, record->data, record->len, bufout, bufoutlen,
+        speer, &err);
+    free(record);
+
+    if(len > 0)
+    {
+      return len;
+    }
+
+    if(tls_peer_manage_error(peer, speer, err))
+    {
+      /* removed */
+      break;
+    }
+  }
+
+  return 0;
+}
+
 struct tls_peer* tls_peer_new(enum protocol_type type, const char* addr,
     uint16_t port, const char* ca_file, const char* cert_file,
     const char* key_file, int (*verify_callback)(int, X509_STORE_CTX *))
@@ -84,6 +84,8 @@ typedef int socklen_t;
 
 #include "util_net.h"
 #include "list.h"
+#include "pool.h"
+#include "hash_table.h"
 
 #ifdef __cplusplus
 extern "C"
@@ -106,6 +108,52 @@ extern "C"
  */
 #define LIBSSL_CLEANUP {EVP_cleanup(); ERR_remove_state(0); ERR_free_strings(); CRYPTO_cleanup_all_ex_data(); }while(0)
 
+/**
+ * \def TLS_PEER_WRITE_BUFFER_SIZE
+ * \brief Minimum size of the buffer used to coalesce a message before writing
+ * it.
+ */
+#define TLS_PEER_WRITE_BUFFER_SIZE 2048
+
+/**
+ * \def TLS_PEER_TICKET_KEY_SIZE
+ * \brief Size of a session ticket key in a ticket keys file (16 bytes of
+ * name, 16 bytes of HMAC key and 16 bytes of AES key).
+ */
+#define TLS_PEER_TICKET_KEY_SIZE 48
+
+/**
+ * \struct tls_peer_ticket_key
+ * \brief Key to encrypt and authenticate session tickets.
+ */
+struct tls_peer_ticket_key
+{
+  unsigned char name[16]; /**< Name of the key, sent in the tickets. */
+  unsigned char hmac_key[16]; /**< HMAC-SHA256 key. */
+  unsigned char aes_key[16]; /**< AES-128-CBC key. */
+};
+
+/**
+ * \struct tls_peer_stats
+ * \brief Counters of TLS/DTLS writes and handshakes.
+ */
+struct tls_peer_stats
+{
+  unsigned long writes; /**< Number of messages written. */
+  unsigned long bytes_written; /**< Number of bytes written. */
+  unsigned long bytes_copied; /**< Number of bytes coalesced before writing. */
+  unsigned long buffer_allocs; /**< Number of coalescing buffer allocations. */
+  unsigned long ktls_tx; /**< Number of TLS connections sent by kernel TLS. */
+  unsigned long handshakes_full; /**< Number of full handshakes. */
+  unsigned long handshakes_resumed; /**< Number of abbreviated handshakes. */
+};
+
+/**
+ * \struct ssl_peer
+ * \brief Remote peer of a TLS/DTLS peer (opaque).
+ */
+struct ssl_peer;
+
 /**
  * \struct tls_peer
  * \brief Describes a TLS/DTLS peer.
@@ -117,8 +165,18 @@ struct tls_peer
   SSL_CTX* ctx_client; /**< SSL context for client side. */
   SSL_CTX* ctx_server; /**< SSL context for server side. */
   struct list_head remote_peers; /**< Remote peers. */
+  struct hash_table remote_index; /**< Remote peers indexed by address. */
+  uint32_t hash_seed; /**< Seed of the hash of remote addresses. */
   BIO* bio_fake; /**< Fake BIO for read operations. */
+  struct tls_peer_ticket_key* ticket_keys; /**< Session ticket keys (the first
+                                             encrypts new tickets), NULL if
+                                             OpenSSL ones are used. */
+  size_t ticket_keys_nb; /**< Number of session ticket keys. */
   int (*verify_callback)(int, X509_STORE_CTX *); /**< Verification callback. */
+  /** Called before the connected socket of a remote peer is closed (may be
+   * NULL).
+   */
+  void (*close_callback)(int sock, const struct ssl_peer* speer);
 };
 
 /**
@@ -136,12 +194,123 @@ struct tls_peer* tls_peer_new(enum protocol_type type, const char* addr,
     uint16_t port, const char* ca_file, const char* cert_file,
     const char* key_file, int (*verify_callback)(int, X509_STORE_CTX *));
 
+/**
+ * \brief Enable kernel TLS offload for the clients of a TLS server peer.
+ *
+ * Once a handshake is done, OpenSSL installs the transmit keys into the client
+ * socket if the kernel supports the negotiated version and cipher, records are
+ * then encrypted by the kernel. Otherwise userspace TLS is used.
+ * \param peer TLS peer instance (TCP).
+ * \return 0 if success, -1 if kernel TLS is not supported (OpenSSL older
+ * than 3.0 or built without kernel TLS, DTLS peer).
+ * \note Received records are still decrypted in userspace because they are
+ * read from a memory BIO.
+ */
+int tls_peer_enable_ktls(struct tls_peer* peer);
+
+/**
+ * \brief Configure the session ID cache of a TLS/DTLS server peer.
+ * \param peer TLS/DTLS peer instance.
+ * \param size maximum number of sessions cached, 0 disables the cache.
+ * \param timeout lifetime of a session in seconds (cache and tickets).
+ * \return 0 if success, -1 otherwise.
+ */
+int tls_peer_set_session_cache(struct tls_peer* peer, size_t size,
+    long timeout);
+
+/**
+ * \brief Load the session ticket keys of a TLS/DTLS server peer.
+ *
+ * The file contains one or more keys of TLS_PEER_TICKET_KEY_SIZE bytes (i.e.
+ * generated by "openssl rand"). The first key encrypts new tickets, the other
+ * ones only decrypt tickets which are then renewed with the first key. To
+ * rotate, prepend a new key to the file, drop the oldest one and reload.
+ * Peers sharing a file (i.e. workers) resume the sessions of each other.
+ * \param peer TLS/DTLS peer instance.
+ * \param file path of the keys file.
+ * \return 0 if success, -1 otherwise (the previous keys are kept).
+ */
+int tls_peer_load_ticket_keys(struct tls_peer* peer, const char* file);
+
 /**
  * \brief Free a TLS/DTLS peer.
  * \param peer pointer on tls_peer instance (create by tls_peer_new).
  */
 void tls_peer_free(struct tls_peer** peer);
 
+/**
+ * \brief Preallocate remote peer descriptors (shared by all TLS/DTLS peers).
+ * \param nb number of remote peers that can be accepted without allocating
+ * memory for their descriptor.
+ * \return 0 if success, -1 otherwise.
+ */
+int tls_peer_pool_reserve(size_t nb);
+
+/**
+ * \brief Get the pool of remote peer descriptors (for statistics).
+ * \return pool.
+ */
+const struct pool* tls_peer_pool_get(void);
+
+/**
+ * \brief Release the memory of the pool of remote peer descriptors.
+ * \note Must be called when all TLS/DTLS peers have been freed.
+ */
+void tls_peer_pool_cleanup(void);
+
+/**
+ * \brief Start the threads which run the handshakes of the remote peers.
+ *
+ * Once started, the records received from a remote peer are queued until its
+ * handshake is finished and the read functions return -1 (errno set to
+ * EAGAIN). A thread gives them to OpenSSL, so that public key operations are
+ * not done by the caller. When tls_peer_handshake_fd() is readable, the
+ * remote peers are taken back with tls_peer_handshake_finished().
+ * \param nb number of threads.
+ * \return 0 if success, -1 otherwise.
+ * \note Threads do not survive fork(), start them in the process which reads.
+ */
+int tls_peer_handshake_start(size_t nb);
+
+/**
+ * \brief Stop the handshake threads.
+ * \note The remote peers whose handshake is not finished are kept until their
+ * TLS/DTLS peer is freed.
+ */
+void tls_peer_handshake_stop(void);
+
+/**
+ * \brief Get the descriptor readable when handshakes are finished.
+ * \return descriptor or -1 if the threads are not started.
+ */
+int tls_peer_handshake_fd(void);
+
+/**
+ * \brief Take back a remote peer whose handshake is finished.
+ *
+ * Remote peers whose handshake has failed are removed.
+ * \param peer set to the TLS/DTLS peer of the returned remote peer.
+ * \return remote peer (valid until another function is called on peer) or
+ * NULL if there is no more.
+ */
+struct ssl_peer* tls_peer_handshake_finished(struct tls_peer** peer);
+
+/**
+ * \brief Read a message received during the handshake of a remote peer.
+ *
+ * Call it until it returns 0 when a remote peer is taken back, each call
+ * returns one message for DTLS.
+ * \param peer TLS/DTLS peer instance.
+ * \param addr address of the remote peer.
+ * \param addrlen sizeof addr.
+ * \param bufout out buffer that will receive the data.
+ * \param bufoutlen out buffer length.
+ * \return bytes read or 0 if there is no more message.
+ */
+ssize_t tls_peer_handshake_read(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen, char* bufout,
+    ssize_t bufoutlen);
+
 /**
  * \brief Write a message using TLS/DTLS.
  * \param peer TLS/DTLS peer instance.
@@ -149,11 +318,34 @@ void tls_peer_free(struct tls_peer** peer);
  * \param buflen buffer length.
  * \param addr destination address.
  * \param addrlen sizeof address.
- * \return bytes sent or -1 if error(s).
+ * \return bytes sent or -1 if error(s), errno is EAGAIN if the handshake
+ * of the remote peer is not complete and handshake threads are used.
  */
 ssize_t tls_peer_write(struct tls_peer* peer, const char* buf, ssize_t buflen,
     const struct sockaddr* addr, socklen_t addrlen);
 
+/**
+ * \brief Write a message stored in several buffers using TLS/DTLS.
+ *
+ * The buffers are sent as one TLS/DTLS record. If there are several buffers,
+ * they are coalesced in a buffer which belongs to the remote peer and is
+ * reused for the next messages.
+ * \param peer TLS/DTLS peer instance.
+ * \param iov vector of data.
+ * \param iovlen number of elements of iov.
+ * \param addr destination address.
+ * \param addrlen sizeof address.
+ * \return bytes sent or -1 if error(s) (see tls_peer_write()).
+ */
+ssize_t tls_peer_writev(struct tls_peer* peer, const struct iovec* iov,
+    size_t iovlen, const struct sockaddr* addr, socklen_t addrlen);
+
+/**
+ * \brief Get the counters of TLS/DTLS writes and handshakes.
+ * \return counters of all TLS/DTLS peers.
+ */
+const struct tls_peer_stats* tls_peer_stats_get(void);
+
 /**
  * \brief Read a message using TLS for TCP use only.
  * \param peer TLS/DTLS peer instance.
@@ -181,13 +373,111 @@ ssize_t tls_peer_tcp_read(struct tls_peer* peer, char* buf, ssize_t buflen,
  * \param bufoutlen out buffer length.
  * \param addr source address.
  * \param addrlen sizeof address.
+ * \param local local address the datagram has been received on, recorded for
+ * a new remote peer (may be NULL).
+ * \param local_size sizeof local.
  * \return bytes sent or -1 if error(s).
  * \note Before calling this function, the caller must have recvfrom() data.
  * \warning UDP use only!
  */
 ssize_t tls_peer_udp_read(struct tls_peer* peer, char* buf, ssize_t buflen,
     char* bufout, ssize_t bufoutlen, const struct sockaddr* addr,
-    socklen_t addrlen);
+    socklen_t addrlen, const struct sockaddr* local, socklen_t local_size);
+
+/**
+ * \brief Move a DTLS remote peer onto its own connected UDP socket.
+ *
+ * Once the handshake is done, the datagrams of the remote peer are received
+ * on the new socket (see net_udp_connect()) and its messages are sent from
+ * it. The socket is closed when the remote peer is removed, close_callback is
+ * called before.
+ * \param peer DTLS peer instance.
+ * \param addr address of the remote peer.
+ * \param addrlen sizeof addr.
+ * \param local local address the remote peer has contacted.
+ * \param local_size sizeof local.
+ * \return remote peer or NULL if it is not found, its handshake is not done,
+ * it already has a socket or the socket cannot be created.
+ */
+struct ssl_peer* tls_peer_udp_connect(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen,
+    const struct sockaddr* local, socklen_t local_size);
+
+/**
+ * \brief Get the connected socket of a remote peer.
+ * \param speer remote peer.
+ * \return socket descriptor, -1 if the remote peer has none.
+ */
+int tls_peer_connection_sock(const struct ssl_peer* speer);
+
+/**
+ * \brief Get the address of a remote peer.
+ * \param speer remote peer.
+ * \return address.
+ */
+const struct sockaddr_storage* tls_peer_connection_addr(
+    const struct ssl_peer* speer);
+
+/**
+ * \brief Get the local address of a remote peer.
+ * \param speer remote peer.
+ * \return local address (valid only if the remote peer has a connected
+ * socket or if it has been given to tls_peer_udp_read()).
+ */
+const struct sockaddr_storage* tls_peer_connection_local(
+    const struct ssl_peer* speer);
+
+/**
+ * \brief Attach data of the caller to a remote peer.
+ * \param speer remote peer.
+ * \param data data (not freed with the remote peer).
+ */
+void tls_peer_connection_set_data(struct ssl_peer* speer, void* data);
+
+/**
+ * \brief Get the data attached to a remote peer.
+ * \param speer remote peer.
+ * \return data given to tls_peer_connection_set_data() or NULL.
+ */
+void* tls_peer_connection_data(const struct ssl_peer* speer);
+
+/**
+ * \brief Find a remote peer.
+ * \param peer TLS/DTLS peer instance.
+ * \param addr address of the remote peer.
+ * \param addrlen sizeof addr.
+ * \return remote peer or NULL if not found.
+ */
+struct ssl_peer* tls_peer_connection_find(struct tls_peer* peer,
+    const struct sockaddr* addr, socklen_t addrlen);
+
+/**
+ * \brief Remove (and free) a remote peer.
+ *
+ * If its handshake is being run by a thread, the remote peer is freed once the
+ * thread has finished with it.
+ * \param peer TLS/DTLS peer instance.
+ * \param speer remote peer.
+ * \return 1 if the socket of the TLS remote peer has been closed and its
+ * descriptor will be released with the remote peer (do not close it), 0
+ * otherwise.
+ * \note For TLS, call it before the socket of the remote peer is closed, a
+ * close_notify alert is sent and its handshake may be run by a thread.
+ */
+int tls_peer_connection_remove(struct tls_peer* peer, struct ssl_peer* speer);
+
+/**
+ * \brief Read a message of a remote peer received on its connected socket.
+ * \param peer DTLS peer instance.
+ * \param speer remote peer (it may be removed if an error occurs).
+ * \param buf buffer that contains the data from recv.
+ * \param buflen buffer length.
+ * \param bufout out buffer that will receive the data.
+ * \param bufoutlen out buffer length.
+ * \return bytes read or -1 if error(s).
+ */
+ssize_t tls_peer_connection_read(struct tls_peer* peer, struct ssl_peer* speer,
+    char* buf, ssize_t buflen, char* bufout, ssize_t bufoutlen);
 
 /**
  * \brief Do the TLS/DTLS handshake.
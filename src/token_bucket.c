@@ -0,0 +1,215 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file token_bucket.c
+ * \brief Hierarchical token bucket rate limiter.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "token_bucket.h"
+
+/**
+ * \brief Add the tokens earned since the last refill.
+ * \param bucket token bucket
+ * \param now current time in milliseconds (monotonic clock)
+ */
+static void token_bucket_refill(struct token_bucket* bucket, uint64_t now)
+{
+  uint64_t elapsed = 0;
+  uint64_t missing = 0;
+
+  if(now <= bucket->last)
+  {
+    return;
+  }
+
+  elapsed = now - bucket->last;
+  bucket->last = now;
+
+  if(bucket->tokens >= bucket->capacity)
+  {
+    return;
+  }
+
+  /* compare before multiplying to avoid overflow after a long idle time */
+  missing = (uint64_t)(bucket->capacity - bucket->tokens);
+
+  if(elapsed >= missing / bucket->rate + 1)
+  {
+    bucket->tokens = bucket->capacity;
+  }
+  else
+  {
+    bucket->tokens += (int64_t)(elapsed * bucket->rate);
+  }
+}
+
+void token_bucket_init(struct token_bucket* bucket, uint32_t rate,
+    uint32_t burst, struct token_bucket* parent, uint64_t now)
+{
+  if(burst == 0)
+  {
+    burst = rate;
+  }
+
+  bucket->rate = ((uint64_t)rate << TOKEN_BUCKET_SHIFT) / 1000;
+  bucket->capacity = (int64_t)burst << TOKEN_BUCKET_SHIFT;
+  bucket->tokens = bucket->capacity;
+  bucket->last = now;
+  bucket->parent = parent;
+
+  if(rate && !bucket->rate)
+  {
+    /* less than one fixed-point token per millisecond */
+    bucket->rate = 1;
+  }
+}
+
+int token_bucket_consume(struct token_bucket* bucket, size_t len,
+    uint64_t now)
+{
+  int64_t tokens = (int64_t)len << TOKEN_BUCKET_SHIFT;
+  struct token_bucket* tmp = NULL;
+
+  /* check all levels before taking anything */
+  for(tmp = bucket ; tmp ; tmp = tmp->parent)
+  {
+    if(!tmp->rate)
+    {
+      continue;
+    }
+
+    token_bucket_refill(tmp, now);
+
+    if(tmp->tokens < tokens)
+    {
+      return -1;
+    }
+  }
+
+  for(tmp = bucket ; tmp ; tmp = tmp->parent)
+  {
+    if(tmp->rate)
+    {
+      tmp->tokens -= tokens;
+    }
+  }
+
+  return 0;
+}
+
+void token_bucket_charge(struct token_bucket* bucket, size_t len,
+    uint64_t now)
+{
+  int64_t tokens = (int64_t)len << TOKEN_BUCKET_SHIFT;
+  struct token_bucket* tmp = NULL;
+
+  for(tmp = bucket ; tmp ; tmp = tmp->parent)
+  {
+    if(tmp->rate)
+    {
+      token_bucket_refill(tmp, now);
+      tmp->tokens -= tokens;
+    }
+  }
+}
+
+uint64_t token_bucket_delay(struct token_bucket* bucket, size_t len,
+    uint64_t now)
+{
+  int64_t tokens = (int64_t)len << TOKEN_BUCKET_SHIFT;
+  struct token_bucket* tmp = NULL;
+  uint64_t delay = 0;
+
+  for(tmp = bucket ; tmp ; tmp = tmp->parent)
+  {
+    uint64_t wait = 0;
+
+    if(!tmp->rate)
+    {
+      continue;
+    }
+
+    token_bucket_refill(tmp, now);
+
+    if(tmp->tokens >= tokens)
+    {
+      continue;
+    }
+
+    /* round up */
+    wait = ((uint64_t)(tokens - tmp->tokens) + tmp->rate - 1) / tmp->rate;
+
+    if(wait > delay)
+    {
+      delay = wait;
+    }
+  }
+
+  return delay;
+}
+
+size_t token_bucket_available(struct token_bucket* bucket, uint64_t now)
+{
+  struct token_bucket* tmp = NULL;
+  size_t available = SIZE_MAX;
+
+  for(tmp = bucket ; tmp ; tmp = tmp->parent)
+  {
+    size_t len = 0;
+
+    if(!tmp->rate)
+    {
+      continue;
+    }
+
+    token_bucket_refill(tmp, now);
+
+    if(tmp->tokens > 0)
+    {
+      len = (size_t)(tmp->tokens >> TOKEN_BUCKET_SHIFT);
+    }
+
+    if(len < available)
+    {
+      available = len;
+    }
+  }
+
+  return available;
+}
+
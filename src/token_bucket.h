@@ -0,0 +1,133 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2013 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file token_bucket.h
+ * \brief Hierarchical token bucket rate limiter.
+ *
+ * Tokens are bytes stored in fixed-point so that the refill of a few
+ * milliseconds is not lost for low rates. A bucket may have a parent (i.e.
+ * the limit of an account for the buckets of its allocations, or the limit
+ * of the server for the accounts) and traffic is accounted on all levels.
+ * A bucket can be charged beyond its tokens (debt) by a caller that paces
+ * its traffic instead of dropping it.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * \def TOKEN_BUCKET_SHIFT
+ * \brief Number of fractional bits of the tokens.
+ */
+#define TOKEN_BUCKET_SHIFT 16
+
+/**
+ * \struct token_bucket
+ * \brief Token bucket.
+ */
+struct token_bucket
+{
+  int64_t tokens; /**< Available tokens (fixed-point bytes), negative if the
+                    bucket is in debt */
+  int64_t capacity; /**< Maximum number of tokens (fixed-point bytes) */
+  uint64_t rate; /**< Tokens added each millisecond (fixed-point bytes), 0
+                   means no limit for this level */
+  uint64_t last; /**< Time of the last refill in milliseconds */
+  struct token_bucket* parent; /**< Enclosing limit or NULL */
+};
+
+/**
+ * \brief Initialize a token bucket.
+ *
+ * The bucket is full when initialized. A zeroed bucket has no limit and no
+ * parent.
+ * \param bucket token bucket
+ * \param rate rate in bytes per second, 0 means no limit for this level
+ * \param burst capacity in bytes, 0 means one second of traffic
+ * \param parent enclosing limit or NULL
+ * \param now current time in milliseconds (monotonic clock)
+ */
+void token_bucket_init(struct token_bucket* bucket, uint32_t rate,
+    uint32_t burst, struct token_bucket* parent, uint64_t now);
+
+/**
+ * \brief Take tokens from a bucket and its parents if all of them have
+ * enough tokens.
+ * \param bucket token bucket
+ * \param len number of bytes
+ * \param now current time in milliseconds (monotonic clock)
+ * \return 0 if tokens are taken, -1 if a limit is exceeded (no tokens are
+ * taken)
+ */
+int token_bucket_consume(struct token_bucket* bucket, size_t len,
+    uint64_t now);
+
+/**
+ * \brief Take tokens from a bucket and its parents even if the buckets go in
+ * debt.
+ * \param bucket token bucket
+ * \param len number of bytes
+ * \param now current time in milliseconds (monotonic clock)
+ */
+void token_bucket_charge(struct token_bucket* bucket, size_t len,
+    uint64_t now);
+
+/**
+ * \brief Get the time to wait until a bucket and its parents have enough
+ * tokens.
+ * \param bucket token bucket
+ * \param len number of bytes
+ * \param now current time in milliseconds (monotonic clock)
+ * \return delay in milliseconds, 0 if tokens are available
+ */
+uint64_t token_bucket_delay(struct token_bucket* bucket, size_t len,
+    uint64_t now);
+
+/**
+ * \brief Get the number of bytes that a bucket and its parents allow now.
+ * \param bucket token bucket
+ * \param now current time in milliseconds (monotonic clock)
+ * \return number of bytes (SIZE_MAX if there is no limit), 0 if in debt
+ */
+size_t token_bucket_available(struct token_bucket* bucket, uint64_t now);
+
+#endif /* TOKEN_BUCKET_H */
+
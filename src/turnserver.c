@@ -49,6 +49,8 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -56,12 +58,17 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <netdb.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "conf.h"
 #include "protocol.h"
 #include "allocation.h"
@@ -73,6 +80,10 @@
 #include "dbg.h"
 #include "turnserver.h"
 #include "mod_tmpuser.h"
+#include "prefix_trie.h"
+#include "pool.h"
+#include "nonce.h"
+#include "port_alloc.h"
 
 #ifndef HAVE_SIGACTION
 /* expiration stuff use real-time signals
@@ -118,6 +129,32 @@ static volatile sig_atomic_t g_run = 0;
  */
 static volatile sig_atomic_t g_reinit = 0;
 
+/**
+ * \struct turnserver_account_reload
+ * \brief Account file parsed by a thread.
+ */
+struct turnserver_account_reload
+{
+  pthread_mutex_t mutex; /**< Mutex for done and ret */
+  pthread_t thread; /**< Thread which parses the file */
+  int thread_created; /**< If thread has to be joined */
+  int running; /**< If a reload is in progress */
+  int pending; /**< If file has to be parsed again after this reload */
+  int done; /**< If file has been parsed */
+  int ret; /**< Result of account_parse_file() */
+  const char* file; /**< Account file */
+  struct list_head list; /**< Accounts parsed (not indexed) */
+};
+
+/**
+ * \var g_account_reload
+ * \brief Reload of the account file in progress.
+ */
+static struct turnserver_account_reload g_account_reload =
+{
+  PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, NULL, {NULL, NULL}
+};
+
 /**
  * \var g_expired_allocation_list
  * \brief List which constains expired allocation.
@@ -148,6 +185,82 @@ static struct list_head g_expired_token_list;
  */
 static struct list_head g_expired_tcp_relay_list;
 
+/**
+ * \var g_expired_dtls_client_list
+ * \brief List which contains idle DTLS clients with a connected socket.
+ */
+static struct list_head g_expired_dtls_client_list;
+
+/**
+ * \def TIMER_TICK_MS
+ * \brief Resolution of the expiration timers in milliseconds.
+ */
+#define TIMER_TICK_MS 100
+
+/**
+ * \def DTLS_CLIENT_IDLE_TIMEOUT
+ * \brief Time in seconds without datagram after which the connected socket of
+ * a DTLS client is closed.
+ *
+ * The timer is pushed back only when less than TURN_MAX_ALLOCATION_LIFETIME
+ * remains, so a client is removed after being idle between one and two
+ * maximum allocation lifetimes: none of its allocations can still be alive.
+ */
+#define DTLS_CLIENT_IDLE_TIMEOUT (2 * TURN_MAX_ALLOCATION_LIFETIME)
+
+/**
+ * \def POOL_PEERS_PER_ALLOCATION
+ * \brief Number of permissions and channels preallocated per allocation.
+ */
+#define POOL_PEERS_PER_ALLOCATION 4
+
+/**
+ * \var g_timer_wheel
+ * \brief Expiration timers of allocations, permissions, channels, tokens and
+ * TCP relays.
+ */
+static struct timer_wheel g_timer_wheel;
+
+/**
+ * \var g_nonce_ctx
+ * \brief Nonce generation and verification (keys and verified nonces cache).
+ */
+static struct nonce_ctx g_nonce_ctx;
+
+/**
+ * \var g_now_ms
+ * \brief Time of the monotonic clock in milliseconds, sampled once per event
+ * loop iteration.
+ */
+static uint64_t g_now_ms = 0;
+
+/**
+ * \var g_now
+ * \brief Wall-clock time, sampled once per event loop iteration.
+ */
+static time_t g_now = 0;
+
+/**
+ * \struct turnserver_bandwidth
+ * \brief Bandwidth limits of the server and counters.
+ */
+struct turnserver_bandwidth
+{
+  struct token_bucket up; /**< Limit of data received from peers */
+  struct token_bucket down; /**< Limit of data received from clients */
+  struct list_head paced; /**< Allocations whose relayed socket is paced */
+  int pacing; /**< If data received from peers is delayed rather than
+                dropped */
+  unsigned long dropped; /**< Number of packets dropped */
+  unsigned long paced_nb; /**< Number of times a relayed socket is paced */
+};
+
+/**
+ * \var g_bandwidth
+ * \brief Bandwidth limits of the server.
+ */
+static struct turnserver_bandwidth g_bandwidth;
+
 /**
  * \var g_token_list
  * \brief List of valid tokens.
@@ -160,14 +273,20 @@ static struct list_head g_token_list;
  */
 static struct list_head g_denied_address_list;
 
+/**
+ * \var g_denied_address_trie
+ * \brief The denied addresses indexed by prefix.
+ */
+static struct prefix_trie* g_denied_address_trie = NULL;
+
 /**
  * \var g_supported_even_port_flags
  * \brief EVEN-PORT flags supported.
  *
  * For the moment the following flags are supported:
- * - R: reserve couple of ports (one even, one odd).
+ * - R: reserve couple of ports (one even, one odd), only with one worker.
  */
-static const uint8_t g_supported_even_port_flags = 0x80;
+static uint8_t g_supported_even_port_flags = 0x80;
 
 /**
  * \var g_tcp_socket_list
@@ -177,6 +296,45 @@ static const uint8_t g_supported_even_port_flags = 0x80;
  */
 static struct list_head g_tcp_socket_list;
 
+/**
+ * \var g_socket_desc_pool
+ * \brief Pool of remote TCP sockets descriptors (g_tcp_socket_list).
+ */
+static struct pool g_socket_desc_pool =
+  POOL_INITIALIZER("socket_desc", sizeof(struct socket_desc));
+
+/**
+ * \var g_stream_buf_pool
+ * \brief Pool of the chunks used to receive data of remote TCP sockets.
+ */
+static struct pool g_stream_buf_pool =
+  POOL_INITIALIZER("stream_buf", STREAM_BUF_CHUNK_SIZE);
+
+/**
+ * \struct relay_ports
+ * \brief Relayed ports of a relay address.
+ */
+struct relay_ports
+{
+  int family; /**< AF_INET or AF_INET6 */
+  uint8_t addr[16]; /**< Relay address */
+  char str[INET6_ADDRSTRLEN]; /**< Relay address (string) */
+  struct port_alloc ports; /**< Used and reserved ports */
+  struct list_head list; /**< For list management */
+};
+
+/**
+ * \var g_relay_ports_list
+ * \brief Port allocators of the relay addresses used by this process.
+ */
+static struct list_head g_relay_ports_list;
+
+/**
+ * \var g_worker_index
+ * \brief Index of this worker process (0 if there is only one process).
+ */
+static size_t g_worker_index = 0;
+
 /**
  * \struct listen_sockets
  * \brief Gather all listen sockets (UDP, TCP, TLS and DTLS).
@@ -187,8 +345,185 @@ struct listen_sockets
   int sock_udp; /**< Listen UDP socket */
   struct tls_peer* sock_tls; /**< Listen TLS socket */
   struct tls_peer* sock_dtls; /**< Listen DTLS socket */
+  struct sockaddr_storage addr_udp; /**< Bound address of sock_udp */
+  struct sockaddr_storage addr_dtls; /**< Bound address of sock_dtls */
+};
+
+/**
+ * \def EVENT_READ
+ * \brief Interest in read operations for a registered socket.
+ */
+#define EVENT_READ 0x01
+
+/**
+ * \def EVENT_WRITE
+ * \brief Interest in write operations for a registered socket.
+ */
+#define EVENT_WRITE 0x02
+
+/**
+ * \def EVENT_MAX_READY
+ * \brief Maximum number of ready sockets returned by one epoll_pwait() call.
+ */
+#define EVENT_MAX_READY 256
+
+/**
+ * \enum turnserver_event_type
+ * \brief Kind of socket registered in the event loop.
+ */
+enum turnserver_event_type
+{
+  EVENT_NONE = 0, /**< Slot not used */
+  EVENT_LISTEN_UDP, /**< UDP listen socket */
+  EVENT_LISTEN_TCP, /**< TCP listen socket */
+  EVENT_LISTEN_TLS, /**< TLS listen socket */
+  EVENT_LISTEN_DTLS, /**< DTLS listen socket */
+  EVENT_DTLS_CLIENT, /**< Connected socket of a DTLS client (ssl_peer) */
+  EVENT_HANDSHAKE, /**< TLS/DTLS handshakes finished by the threads */
+  EVENT_TCP_CLIENT, /**< Remote TCP or TLS client (socket_desc) */
+  EVENT_RELAYED, /**< Relayed socket of an allocation */
+  EVENT_TCP_RELAY_PEER, /**< Peer data connection (RFC6062) */
+  EVENT_TCP_RELAY_CLIENT, /**< Client data connection (RFC6062) */
+  EVENT_TMPUSER_LISTEN, /**< mod_tmpuser listen socket */
+  EVENT_TMPUSER_CLIENT /**< mod_tmpuser remote client (socket_desc) */
+};
+
+/**
+ * \struct turnserver_event
+ * \brief Describes what a registered socket belongs to.
+ *
+ * The event loop keeps an array of these structures indexed by socket
+ * descriptor.
+ */
+struct turnserver_event
+{
+  enum turnserver_event_type type; /**< Kind of socket */
+  int flags; /**< Registered interest (EVENT_READ and/or EVENT_WRITE) */
+  void* data; /**< Object that owns the socket */
+  struct allocation_desc* desc; /**< Allocation (for relay sockets) */
+};
+
+/**
+ * \var g_epoll_fd
+ * \brief epoll descriptor, -1 if the pselect() backend is used.
+ */
+static int g_epoll_fd = -1;
+
+/**
+ * \var g_events
+ * \brief Registered sockets indexed by descriptor.
+ */
+static struct turnserver_event* g_events = NULL;
+
+/**
+ * \var g_events_size
+ * \brief Number of elements of g_events.
+ */
+static size_t g_events_size = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * \var g_events_ready
+ * \brief Ready sockets being dispatched by the event loop.
+ */
+static struct epoll_event g_events_ready[EVENT_MAX_READY];
+
+/**
+ * \var g_events_ready_nb
+ * \brief Number of elements of g_events_ready being dispatched.
+ */
+static int g_events_ready_nb = 0;
+#endif
+
+/**
+ * \struct turnserver_worker
+ * \brief Worker process and its listen sockets.
+ */
+struct turnserver_worker
+{
+  pid_t pid; /**< Process ID, 0 if not running */
+  time_t start; /**< Time the process has been started */
+  struct listen_sockets sockets; /**< Listen sockets */
+};
+
+/**
+ * \struct turnserver_dtls_client
+ * \brief DTLS client moved onto its own connected socket.
+ */
+struct turnserver_dtls_client
+{
+  struct ssl_peer* conn; /**< Remote peer of the DTLS listen socket */
+  struct timer_entry timer; /**< Idle timer */
+  struct list_head list2; /**< For list management (expired list) */
+};
+
+/**
+ * \var g_workers
+ * \brief Worker processes (only if more than one worker is configured).
+ */
+static struct turnserver_worker* g_workers = NULL;
+
+/**
+ * \var g_workers_nb
+ * \brief Number of elements of g_workers.
+ */
+static size_t g_workers_nb = 0;
+
+/**
+ * \def UDP_BATCH_BUFFER_SIZE
+ * \brief Size of each buffer used for batched UDP I/O.
+ */
+#define UDP_BATCH_BUFFER_SIZE 8192
+
+/**
+ * \def UDP_BATCH_HEADROOM
+ * \brief Room kept before each buffer to prepend a ChannelData header.
+ */
+#define UDP_BATCH_HEADROOM sizeof(struct turn_channel_data)
+
+/**
+ * \def UDP_BATCH_STRIDE
+ * \brief Space used by each buffer of batched UDP I/O.
+ */
+#define UDP_BATCH_STRIDE (UDP_BATCH_HEADROOM + UDP_BATCH_BUFFER_SIZE)
+
+/**
+ * \struct turnserver_udp_batch
+ * \brief Buffers and counters of batched UDP I/O.
+ */
+struct turnserver_udp_batch
+{
+  size_t size; /**< Maximum number of datagrams of a batch */
+  char* data; /**< Memory of all buffers */
+  struct net_datagram* in; /**< Datagrams being received */
+  struct net_datagram* out; /**< Datagrams waiting to be sent */
+  char** out_buf; /**< Buffer owned by each element of out */
+  struct net_datagram* in_cur; /**< Received datagram being processed */
+  const struct sockaddr_storage* in_daddr; /**< Local address of the
+                                             datagram being processed (source
+                                             address of the responses) */
+  int* out_sock; /**< Socket of each datagram waiting to be sent */
+  size_t out_nb; /**< Number of datagrams waiting to be sent */
+  unsigned long recv_calls; /**< Number of receive system calls */
+  unsigned long recv_datagrams; /**< Number of datagrams received */
+  unsigned long send_calls; /**< Number of send system calls */
+  unsigned long send_datagrams; /**< Number of datagrams sent */
+  unsigned long send_errors; /**< Number of datagrams not sent */
+  unsigned long send_inplace; /**< Number of datagrams queued without copy */
 };
 
+/**
+ * \var g_udp_batch
+ * \brief Batched UDP I/O.
+ */
+static struct turnserver_udp_batch g_udp_batch;
+
+/**
+ * \var g_print_stats
+ * \brief Log statistics (SIGUSR1).
+ */
+static volatile sig_atomic_t g_print_stats = 0;
+
 /**
  * \brief Get sockaddr structure size according to its type.
  * \param ss sockaddr_storage structure
@@ -211,9 +546,12 @@ static void signal_handler(int code)
 {
   switch(code)
   {
-    case SIGUSR1:
     case SIGUSR2:
     case SIGPIPE:
+    case SIGCHLD:
+      break;
+    case SIGUSR1:
+      g_print_stats = 1;
       break;
     case SIGHUP:
       g_reinit = 1;
@@ -229,1194 +567,1320 @@ static void signal_handler(int code)
 }
 
 /**
- * \brief Realtime signal management.
+ * \brief Timer wheel expiration callback.
  *
- * This is mainly used when a object timer expired. As usage of functions like
- * free() in a signal handler are not permitted and to avoid race conditions,
- * this function put the desired expired object in an expired list and the main
- * loop will purge it.
- * \param signo signal number
- * \param info additionnal info
- * \param extra not used
- */
-static void realtime_signal_handler(int signo, siginfo_t* info, void* extra)
+ * It is called from the main loop when an object timer expired. To keep the
+ * purge in one place, this function put the expired object in an expired list
+ * and the main loop will purge it.
+ * \param entry timer entry that expired
+ */
+static void turnserver_timer_expired(struct timer_entry* entry)
 {
-  /* to avoid compilation warning because it is not used */
-  (void)extra;
-
-  if(!g_run)
+  if(!g_run || !entry->data)
   {
-    /* if the program will exit, do not care about signals */
+    /* if the program will exit, do not care about timers */
     return;
   }
 
-  debug(DBG_ATTR, "Realtime signal received\n");
-
-  if(signo == SIGRT_EXPIRE_ALLOCATION)
+  switch(entry->type)
   {
-    struct allocation_desc* desc = info->si_value.sival_ptr;
-
-    if(!desc)
+    case ALLOCATION_EXPIRE_ALLOCATION:
     {
-      return;
+      struct allocation_desc* desc = entry->data;
+      debug(DBG_ATTR, "Allocation expires: %p\n", desc);
+      /* add it to the expired list, the next loop will
+       * purge it
+       */
+      list_head_add(&g_expired_allocation_list, &desc->list2);
+      break;
     }
-
-    debug(DBG_ATTR, "Allocation expires: %p\n", desc);
-    /* add it to the expired list, the next loop will
-     * purge it
-     */
-    list_head_add(&g_expired_allocation_list, &desc->list2);
-  }
-  else if(signo == SIGRT_EXPIRE_PERMISSION)
-  {
-    struct allocation_permission* desc = info->si_value.sival_ptr;
-
-    if(!desc)
+    case ALLOCATION_EXPIRE_PERMISSION:
     {
-      return;
+      struct allocation_permission* desc = entry->data;
+      debug(DBG_ATTR, "Permission expires: %p\n", desc);
+      /* add it to the expired list */
+      list_head_add(&g_expired_permission_list, &desc->list2);
+      break;
     }
-
-    debug(DBG_ATTR, "Permission expires: %p\n", desc);
-    /* add it to the expired list */
-    list_head_add(&g_expired_permission_list, &desc->list2);
-  }
-  else if(signo == SIGRT_EXPIRE_CHANNEL)
-  {
-    struct allocation_channel* desc = info->si_value.sival_ptr;
-
-    if(!desc)
+    case ALLOCATION_EXPIRE_CHANNEL:
     {
-      return;
+      struct allocation_channel* desc = entry->data;
+      debug(DBG_ATTR, "Channel expires: %p\n", desc);
+      /* add it to the expired list */
+      list_head_add(&g_expired_channel_list, &desc->list2);
+      break;
     }
-
-    debug(DBG_ATTR, "Channel expires: %p\n", desc);
-    /* add it to the expired list */
-    list_head_add(&g_expired_channel_list, &desc->list2);
-  }
-  else if(signo == SIGRT_EXPIRE_TOKEN)
-  {
-    struct allocation_token* desc = info->si_value.sival_ptr;
-
-    if(!desc)
+    case ALLOCATION_EXPIRE_TOKEN:
     {
-      return;
+      struct allocation_token* desc = entry->data;
+      debug(DBG_ATTR, "Token expires: %p\n", desc);
+      /* add it to the expired list */
+      list_head_add(&g_expired_token_list, &desc->list2);
+      break;
     }
-
-    debug(DBG_ATTR, "Token expires: %p\n", desc);
-    /* add it to the expired list */
-    list_head_add(&g_expired_token_list, &desc->list2);
-  }
-  else if(signo == SIGRT_EXPIRE_TCP_RELAY)
-  {
-    struct allocation_tcp_relay* desc = info->si_value.sival_ptr;
-
-    if(!desc)
+    case ALLOCATION_EXPIRE_TCP_RELAY:
     {
-      return;
+      struct allocation_tcp_relay* desc = entry->data;
+      debug(DBG_ATTR, "TCP relay expires: %p\n", desc);
+      list_head_add(&g_expired_tcp_relay_list, &desc->list2);
+      break;
     }
-
-    /* remove relay from list */
-    debug(DBG_ATTR, "TCP relay expires: %p\n", desc);
-    list_head_add(&g_expired_tcp_relay_list, &desc->list2);
+    case ALLOCATION_EXPIRE_DTLS_CLIENT:
+    {
+      struct turnserver_dtls_client* desc = entry->data;
+      debug(DBG_ATTR, "DTLS client idle: %p\n", desc);
+      list_head_add(&g_expired_dtls_client_list, &desc->list2);
+      break;
+    }
+    default:
+      break;
   }
 }
 
 /**
- * \brief Block realtime signal used in TurnServer.
- *
- * This is used to prevent race conditions when adding or removing objects in
- * expired list (which is mainly done in signal handler and in purge loop).
+ * \brief Sample the clocks shared by timers, rate limiting and nonces.
  */
-static inline void turnserver_block_realtime_signal(void)
+static void turnserver_clock_update(void)
 {
-  sigset_t mask;
-
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGRT_EXPIRE_ALLOCATION);
-  sigaddset(&mask, SIGRT_EXPIRE_PERMISSION);
-  sigaddset(&mask, SIGRT_EXPIRE_CHANNEL);
-  sigaddset(&mask, SIGRT_EXPIRE_TOKEN);
-  sigprocmask(SIG_BLOCK, &mask, NULL);
+  g_now_ms = sys_clock_ms();
+  g_now = time(NULL);
 }
 
 /**
- * \brief Unblock realtime signal used in TurnServer.
+ * \brief Initialize the event loop backend.
  *
- * This is used to prevent race conditions when adding or removing objects in
- * expired list (which is mainly done in signal handler and in purge loop).
+ * If "epoll" backend is configured and available, create the epoll
+ * descriptor, otherwise the pselect() backend will be used.
+ * \return 0 if epoll backend is used, -1 otherwise
  */
-static inline void turnserver_unblock_realtime_signal(void)
+static int turnserver_event_init(void)
 {
-  sigset_t mask;
+#ifdef HAVE_SYS_EPOLL_H
+  if(strcmp(turnserver_cfg_event_backend(), "epoll") != 0)
+  {
+    return -1;
+  }
 
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGRT_EXPIRE_ALLOCATION);
-  sigaddset(&mask, SIGRT_EXPIRE_PERMISSION);
-  sigaddset(&mask, SIGRT_EXPIRE_CHANNEL);
-  sigaddset(&mask, SIGRT_EXPIRE_TOKEN);
-  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+  /* size is ignored by recent kernels but must be greater than zero */
+  g_epoll_fd = epoll_create(EVENT_MAX_READY);
+
+  if(g_epoll_fd == -1)
+  {
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "epoll_create() failed: %s\n", error_str);
+    syslog(LOG_ERR, "epoll_create() failed, use select(): %s", error_str);
+    return -1;
+  }
+
+  return 0;
+#else
+  return -1;
+#endif
 }
 
 /**
- * \brief Print help menu.
- * \param name name of the program
- * \param version version of the program
+ * \brief Release event loop resources.
  */
-static void turnserver_print_help(const char* name, const char* version)
+static void turnserver_event_cleanup(void)
 {
-  fprintf(stdout, "TurnServer %s\n", version);
-  fprintf(stdout, "Usage: %s [-c file] [-p pidfile] [-h] [-v]\n", name);
+  if(g_epoll_fd != -1)
+  {
+    close(g_epoll_fd);
+    g_epoll_fd = -1;
+  }
+
+  free(g_events);
+  g_events = NULL;
+  g_events_size = 0;
 }
 
 /**
- * \brief Parse the command line arguments.
- * \param argc number of argument
- * \param argv array of argument
- * \param configuration_file configuration (-c) argument will be filled in if
- * any
- * \param pid_file pid file (-p) argument will be filled in if any
+ * \brief Register a socket in the event loop or update its registration.
+ *
+ * It does nothing if the pselect() backend is used.
+ * \param sock socket descriptor
+ * \param flags interest (EVENT_READ and/or EVENT_WRITE), 0 to keep the socket
+ * registered without waiting for it
+ * \param type kind of socket
+ * \param data object that owns the socket
+ * \param desc allocation descriptor (for relay sockets)
+ * \return 0 if success, -1 otherwise
  */
-static void turnserver_parse_cmdline(int argc, char** argv,
-    char** configuration_file, char** pid_file)
+static int turnserver_event_set(int sock, int flags,
+    enum turnserver_event_type type, void* data, struct allocation_desc* desc)
 {
-  static const char* optstr = "c:p:hv";
-  int s = 0;
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int op = EPOLL_CTL_ADD;
 
-  while((s = getopt(argc, argv, optstr)) != -1)
+  if(g_epoll_fd == -1)
   {
-    switch(s)
-    {
-      case 'h': /* help */
-        turnserver_print_help(argv[0], PACKAGE_VERSION);
-        exit(EXIT_SUCCESS);
-        break;
-      case 'v': /* version */
-        fprintf(stdout, "TurnServer %s\n", PACKAGE_VERSION);
-        fprintf(stdout, "Copyright (C) 2008-2012 Sebastien Vincent.\n");
-        fprintf(stdout, "This is free software; see the source for copying "
-            "conditions.  There is NO\n");
-        fprintf(stdout, "warranty; not even for MERCHANTABILITY or FITNESS FOR "
-            "A PARTICULAR PURPOSE.\n\n");
-        exit(EXIT_SUCCESS);
-      case 'c': /* configuration file */
-        if(optarg)
-        {
-          *configuration_file = optarg;
-        }
-        break;
-      case 'p': /* pid file */
-        if(optarg)
-        {
-          *pid_file = optarg;
-        }
-        break;
-      default:
-        break;
-    }
+    return 0;
   }
-}
 
-#ifdef NDEBUG
+  if(sock < 0)
+  {
+    return -1;
+  }
 
-/**
- * \brief Disable core dump if the server crash.
- *
- * Typically it is used in release mode. It prevents
- * user/attacker to have access to core dump which could
- * contains some sensitive data.
- */
-static void turnserver_disable_core_dump(void)
-{
-  struct rlimit limit;
+  if((size_t)sock >= g_events_size)
+  {
+    size_t size = g_events_size ? g_events_size : 1024;
+    struct turnserver_event* events = NULL;
 
-  limit.rlim_cur = 0;
-  limit.rlim_max = 0;
-  setrlimit(RLIMIT_CORE, &limit);
-}
+    while(size <= (size_t)sock)
+    {
+      size *= 2;
+    }
 
-#endif
+    if(!(events = realloc(g_events, size * sizeof(struct turnserver_event))))
+    {
+      return -1;
+    }
 
-/**
- * \brief Check bandwidth limitation on uplink OR downlink.
- * \param desc allocation descriptor
- * \param byteup byte received on uplink connection. 0 means bandwidth check
- * will be made on downlink (if different than 0)
- * \param bytedown byte received on downlink connection. 0 means bandwidth check
- * will be made on uplink (if different than 0)
- * \return 1 if bandwidth threshold is exceeded, 0 otherwise
- */
-static int turnserver_check_bandwidth_limit(struct allocation_desc* desc,
-    size_t byteup, size_t bytedown)
-{
-  struct timeval now;
-  unsigned long diff = 0;
-  unsigned long d = turnserver_cfg_bandwidth_per_allocation();
+    memset(events + g_events_size, 0x00,
+        (size - g_events_size) * sizeof(struct turnserver_event));
+    g_events = events;
+    g_events_size = size;
+  }
 
-  if(d <= 0)
+  if(g_events[sock].type != EVENT_NONE)
   {
-    /* bandwidth quota disabled */
-    return 0;
+    op = EPOLL_CTL_MOD;
   }
 
-  /* check in ms */
-  gettimeofday(&now, NULL);
+  memset(&ev, 0x00, sizeof(struct epoll_event));
+  ev.events = ((flags & EVENT_READ) ? EPOLLIN : 0) |
+    ((flags & EVENT_WRITE) ? EPOLLOUT : 0);
+  ev.data.fd = sock;
 
-  if(byteup)
+  if(epoll_ctl(g_epoll_fd, op, sock, &ev) == -1)
   {
-    if(desc->bucket_tokenup < desc->bucket_capacity)
+    /* slot may be out of date (socket closed and descriptor reused) */
+    op = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    if(epoll_ctl(g_epoll_fd, op, sock, &ev) == -1)
     {
-      /* count in milliseconds */
-      diff = (now.tv_sec - desc->last_timeup.tv_sec) * 1000 +
-        (now.tv_usec - desc->last_timeup.tv_usec) / 1000;
-      d *= diff;
-      desc->bucket_tokenup = SYS_MIN(desc->bucket_capacity,
-          desc->bucket_tokenup + d);
-      gettimeofday(&desc->last_timeup, NULL);
+      char error_str[256];
+      sys_get_error(errno, error_str, sizeof(error_str));
+      debug(DBG_ATTR, "epoll_ctl() failed: %s\n", error_str);
+      return -1;
     }
+  }
+
+  g_events[sock].type = type;
+  g_events[sock].flags = flags;
+  g_events[sock].data = data;
+  g_events[sock].desc = desc;
+  return 0;
+#else
+  (void)sock;
+  (void)flags;
+  (void)type;
+  (void)data;
+  (void)desc;
+  return 0;
+#endif
+}
 
-    debug(DBG_ATTR, "Tokenup bucket available: %u, tokens requested: %u\n",
-        desc->bucket_tokenup, byteup);
+/**
+ * \brief Remove a socket from the event loop.
+ *
+ * Must be called before the socket is closed or its owner freed. The socket
+ * is only removed if it is still registered for data.
+ * \param sock socket descriptor
+ * \param data object that owns the socket
+ */
+static void turnserver_event_del(int sock, const void* data)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int i = 0;
 
-    if(byteup <= desc->bucket_tokenup)
-    {
-      desc->bucket_tokenup -= byteup;
-    }
-    else
-    {
-      /* bandwidth exceeded */
-      return 1;
-    }
+  if(g_epoll_fd == -1 || sock < 0 || (size_t)sock >= g_events_size ||
+     g_events[sock].type == EVENT_NONE || g_events[sock].data != data)
+  {
+    return;
   }
-  else if(bytedown)
+
+  /* non-NULL event for kernel before 2.6.9 */
+  memset(&ev, 0x00, sizeof(struct epoll_event));
+  epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, sock, &ev);
+  memset(&g_events[sock], 0x00, sizeof(struct turnserver_event));
+
+  /* the socket may be in the ready ones not yet processed */
+  for(i = 0 ; i < g_events_ready_nb ; i++)
   {
-    if(desc->bucket_tokendown < desc->bucket_capacity)
+    if(g_events_ready[i].data.fd == sock)
     {
-      /* count in milliseconds */
-      diff = (now.tv_sec - desc->last_timedown.tv_sec) * 1000 +
-        (now.tv_usec - desc->last_timedown.tv_usec) / 1000;
-      d *= diff;
-      desc->bucket_tokendown = SYS_MIN(desc->bucket_capacity,
-          desc->bucket_tokendown + d);
-      gettimeofday(&desc->last_timedown, NULL);
+      g_events_ready[i].data.fd = -1;
     }
+  }
+#else
+  (void)sock;
+  (void)data;
+#endif
+}
 
-    debug(DBG_ATTR, "Tokendown bucket available: %u, tokens requested: %u\n",
-        desc->bucket_tokendown, bytedown);
+/**
+ * \brief Register the sockets of a TCP relay according to its state
+ * (RFC6062).
+ *
+ * The peer socket waits for write until the asynchronous connect() completes,
+ * then for read if the client data connection exists or if userspace
+ * buffering is enabled (otherwise the OS buffers data).
+ * \param desc allocation descriptor
+ * \param relay TCP relay descriptor
+ */
+static void turnserver_event_set_tcp_relay(struct allocation_desc* desc,
+    struct allocation_tcp_relay* relay)
+{
+  if(relay->peer_sock > 0)
+  {
+    int flags = 0;
 
-    if(bytedown <= desc->bucket_tokendown)
+    if(!relay->ready)
     {
-      desc->bucket_tokendown -= bytedown;
+      flags = EVENT_WRITE;
     }
-    else
+    else if(relay->client_sock != -1 || turnserver_cfg_tcp_buffer_userspace())
     {
-      /* bandwidth exceeded */
-      return 1;
+      flags = EVENT_READ;
     }
+
+    turnserver_event_set(relay->peer_sock, flags, EVENT_TCP_RELAY_PEER, relay,
+        desc);
   }
 
-  /* bandwidth quota not reached */
-  return 0;
+  if(relay->client_sock > 0)
+  {
+    turnserver_event_set(relay->client_sock, EVENT_READ,
+        EVENT_TCP_RELAY_CLIENT, relay, desc);
+  }
 }
 
 /**
- * \brief Verify if the address is an IPv6 tunneled ones.
- * \param addr address to check
- * \param addrlen sizeof address
- * \return 1 if address is an IPv6 tunneled ones, 0 otherwise
+ * \brief Remove the sockets of a TCP relay from the event loop (RFC6062).
+ * \param relay TCP relay descriptor
  */
-static int turnserver_is_ipv6_tunneled_address(const uint8_t* addr,
-    size_t addrlen)
+static void turnserver_event_del_tcp_relay(struct allocation_tcp_relay* relay)
 {
-  if(addrlen == 16)
-  {
-    static const uint8_t addr_6to4[2] = {0x20, 0x02};
-    static const uint8_t addr_teredo[4] = {0x20, 0x01, 0x00, 0x00};
-
-    /* 6to4 or teredo address ? */
-    if(!memcmp(addr, addr_6to4, 2) || !memcmp(addr, addr_teredo, 4))
-    {
-      return 1;
-    }
-  }
-  return 0;
+  turnserver_event_del(relay->peer_sock, relay);
+  turnserver_event_del(relay->client_sock, relay);
 }
 
 /**
- * \brief Verify if address/port is in denied list.
- * \param addr IPv4/IPv6 address to check
- * \param addrlen sizeof the address (IPv4 = 4, IPv6 = 16)
- * \param port port to check
- * \return 1 if address is denied, 0 otherwise
+ * \brief Remove the sockets of an allocation (and its TCP relays) from the
+ * event loop.
+ * \param desc allocation descriptor
  */
-static int turnserver_is_address_denied(const uint8_t* addr, size_t addrlen,
-    uint16_t port)
+static void turnserver_event_del_allocation(struct allocation_desc* desc)
 {
   struct list_head* get = NULL;
   struct list_head* n = NULL;
-  uint8_t nb = 0;
-  uint8_t mod = 0;
-  size_t i = 0;
 
-  /* IPv6 address maximum length is 16 bytes */
-  if(addrlen > 16)
+  list_head_iterate_safe(&desc->tcp_relays, get, n)
   {
-    return 0;
+    struct allocation_tcp_relay* tmp = list_head_get(get,
+        struct allocation_tcp_relay, list);
+    turnserver_event_del_tcp_relay(tmp);
   }
 
-  list_head_iterate_safe(&g_denied_address_list, get, n)
+  turnserver_event_del(desc->relayed_sock, desc);
+
+  /* bandwidth pacing */
+  list_head_remove(&g_bandwidth.paced, &desc->list_paced);
+  desc->paced_until = 0;
+}
+
+/**
+ * \brief Stop reading the relayed socket of an allocation until its bandwidth
+ * limits have tokens again (bandwidth pacing).
+ *
+ * Data from peers waits in the socket buffer meanwhile.
+ * \param desc allocation descriptor
+ * \param delay delay in milliseconds
+ */
+static void turnserver_pacing_pause(struct allocation_desc* desc,
+    uint64_t delay)
+{
+  if(!desc->paced_until)
   {
-    struct denied_address* tmp = list_head_get(get, struct denied_address, list);
-    int diff = 0;
+    list_head_add_tail(&g_bandwidth.paced, &desc->list_paced);
+    g_bandwidth.paced_nb++;
+  }
 
-    /* compare addresses from same family */
-    if((tmp->family == AF_INET6 && addrlen != 16) ||
-       (tmp->family == AF_INET && addrlen != 4))
-    {
-      continue;
-    }
+  desc->paced_until = g_now_ms + delay;
 
-    nb = (uint8_t)(tmp->mask / 8);
+  /* keep the socket registered without waiting for it */
+  turnserver_event_set(desc->relayed_sock, 0, EVENT_RELAYED, desc, desc);
+}
 
-    for(i = 0 ; i < nb ; i++)
-    {
-      if(tmp->addr[i] != addr[i])
-      {
-        diff = 1;
-        break;
-      }
-    }
+/**
+ * \brief Read again the relayed sockets whose pacing delay has elapsed.
+ */
+static void turnserver_pacing_run(void)
+{
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+
+  list_head_iterate_safe(&g_bandwidth.paced, get, n)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        list_paced);
 
-    /* if mismatch in the addresses */
-    if(diff)
+    if(tmp->paced_until <= g_now_ms)
     {
-      continue;
+      list_head_remove(&g_bandwidth.paced, &tmp->list_paced);
+      tmp->paced_until = 0;
+      turnserver_event_set(tmp->relayed_sock, EVENT_READ, EVENT_RELAYED, tmp,
+          tmp);
     }
+  }
+}
 
-    /* OK so now the full bytes from the address are the same,
-     * check for last bit if any
-     */
-    mod = (tmp->mask % 8);
-
-    if(mod)
-    {
-      uint8_t b = 0;
+/**
+ * \brief Get how long the event loop can wait before a pacing delay elapses.
+ * \param timeout maximum wait in milliseconds
+ * \return wait in milliseconds
+ */
+static long turnserver_pacing_timeout(long timeout)
+{
+  struct list_head* get = NULL;
 
-      for(i = 0 ; i < mod ; i++)
-      {
-        b |= (1 << (7 - i));
-      }
+  list_head_iterate(&g_bandwidth.paced, get)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc,
+        list_paced);
 
-      if((tmp->addr[nb] & b) == (addr[nb] & b))
-      {
-        if(tmp->port == 0 || tmp->port == port)
-        {
-          return 1;
-        }
-      }
+    if(tmp->paced_until <= g_now_ms)
+    {
+      return 0;
     }
-    else
+
+    if(tmp->paced_until - g_now_ms < (uint64_t)timeout)
     {
-      if(tmp->port == 0 || tmp->port == port)
-      {
-        return 1;
-      }
+      timeout = (long)(tmp->paced_until - g_now_ms);
     }
   }
 
-  return 0;
+  return timeout;
 }
 
 /**
- * \brief Send a TURN Error response.
- * \param transport_protocol transport protocol to send the message
- * \param sock socket
- * \param method STUN/TURN method
- * \param id transaction ID
- * \param saddr address to send
- * \param saddr_size sizeof address
- * \param error error code
- * \param speer TLS peer, if not NULL, send the error in TLS
- * \param key MD5 hash of account, if present, MESSAGE-INTEGRITY will be added
- * \note Some error codes cannot be sent using this function (420, 438, ...).
+ * \brief Allocate the buffers of batched UDP I/O.
+ * \param size maximum number of datagrams received or sent at once
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_send_error(int transport_protocol, int sock, int method,
-    const uint8_t* id, int error, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct tls_peer* speer, unsigned char* key)
+static int turnserver_udp_batch_init(size_t size)
 {
-  struct iovec iov[16]; /* should be sufficient */
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  size_t idx = 0;
+  size_t i = 0;
 
-  switch(error)
-  {
-    case 400: /* Bad request */
-      hdr = turn_error_response_400(method, id, &iov[idx], &idx);
-      break;
-    case 403: /* Forbidden */
-      hdr = turn_error_response_403(method, id, &iov[idx], &idx);
-      break;
-    case 437: /* Alocation mismatch */
-      hdr = turn_error_response_437(method, id, &iov[idx], &idx);
-      break;
-    case 440: /* Address family not supported */
-      hdr = turn_error_response_440(method, id, &iov[idx], &idx);
-      break;
-    case 441: /* Wrong credentials */
-      hdr = turn_error_response_441(method, id, &iov[idx], &idx);
-      break;
-    case 442: /* Unsupported transport protocol */
-      hdr = turn_error_response_442(method, id, &iov[idx], &idx);
-      break;
-    case 443: /* Peer address family mismatch */
-      hdr = turn_error_response_443(method, id, &iov[idx], &idx);
-      break;
-    case 446: /* Connection already exists (RFC6062) */
-      hdr = turn_error_response_446(method, id, &iov[idx], &idx);
-      break;
-    case 447: /* Connection timeout or failure (RFC6062) */
-      hdr = turn_error_response_447(method, id, &iov[idx], &idx);
-      break;
-    case 486: /* Allocation quota reached */
-      hdr = turn_error_response_486(method, id, &iov[idx], &idx);
-      break;
-    case 500: /* Server error */
-      hdr = turn_error_response_500(method, id, &iov[idx], &idx);
-      break;
-    case 508: /* Insufficient port capacity */
-      hdr = turn_error_response_508(method, id, &iov[idx], &idx);
-      break;
-    default:
-      break;
-  }
+  memset(&g_udp_batch, 0x00, sizeof(struct turnserver_udp_batch));
+  g_udp_batch.data = malloc(2 * size * UDP_BATCH_STRIDE);
+  g_udp_batch.in = calloc(size, sizeof(struct net_datagram));
+  g_udp_batch.out = calloc(size, sizeof(struct net_datagram));
+  g_udp_batch.out_buf = calloc(size, sizeof(char*));
+  g_udp_batch.out_sock = calloc(size, sizeof(int));
 
-  if(!hdr)
+  if(!g_udp_batch.data || !g_udp_batch.in || !g_udp_batch.out ||
+     !g_udp_batch.out_buf || !g_udp_batch.out_sock)
   {
     return -1;
   }
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+  /* each buffer has a headroom so that received data can be relayed with a
+   * ChannelData header without being copied
+   */
+  for(i = 0 ; i < size ; i++)
   {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+    g_udp_batch.in[i].buf = g_udp_batch.data + i * UDP_BATCH_STRIDE +
+      UDP_BATCH_HEADROOM;
+    g_udp_batch.in[i].size = UDP_BATCH_BUFFER_SIZE;
+    g_udp_batch.out_buf[i] = g_udp_batch.data + (size + i) * UDP_BATCH_STRIDE +
+      UDP_BATCH_HEADROOM;
+    g_udp_batch.out[i].buf = g_udp_batch.out_buf[i];
+    g_udp_batch.out[i].size = UDP_BATCH_BUFFER_SIZE;
   }
 
-  if(key)
+  g_udp_batch.size = size;
+  return 0;
+}
+
+/**
+ * \brief Free the buffers of batched UDP I/O.
+ */
+static void turnserver_udp_batch_free(void)
+{
+  free(g_udp_batch.data);
+  free(g_udp_batch.in);
+  free(g_udp_batch.out);
+  free(g_udp_batch.out_buf);
+  free(g_udp_batch.out_sock);
+  memset(&g_udp_batch, 0x00, sizeof(struct turnserver_udp_batch));
+}
+
+#ifdef OS_SET_DF_SUPPORT
+/**
+ * \brief Set the DF behavior of an UDP socket.
+ * \param sock socket descriptor
+ * \param df IP_MTU_DISCOVER value
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_udp_set_df(int sock, int df)
+{
+  return setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &df, sizeof(int));
+}
+#endif
+
+/**
+ * \brief Send the datagrams waiting in the batch.
+ *
+ * Consecutive datagrams for the same socket are sent with one system call.
+ */
+static void turnserver_udp_flush(void)
+{
+  size_t i = 0;
+
+  while(i < g_udp_batch.out_nb)
   {
-    if(turn_add_message_integrity(iov, &idx, key, 16, 1) == -1)
+    int sock = g_udp_batch.out_sock[i];
+    size_t n = 1;
+    size_t sent = 0;
+
+    while(i + n < g_udp_batch.out_nb && g_udp_batch.out_sock[i + n] == sock)
     {
-      /* MESSAGE-INTEGRITY option has to be in message, so
-       * deallocate ressources and return
-       */
-      net_iovec_free_data(iov, idx);
-      return -1;
+      n++;
     }
-    /* function above already set turn_msg_len field to big endian */
-  }
-  else
-  {
-    turn_add_fingerprint(iov, &idx); /* not fatal if not successful */
 
-    /* convert to big endian */
-    hdr->turn_msg_len = htons(hdr->turn_msg_len);
+    sent = net_udp_send_batch(sock, &g_udp_batch.out[i], n,
+        &g_udp_batch.send_calls);
+
+    g_udp_batch.send_datagrams += sent;
+    g_udp_batch.send_errors += n - sent;
+    i += n;
   }
 
-  /* finally send the response */
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  g_udp_batch.out_nb = 0;
+}
+
+/**
+ * \brief Set the source address of a datagram waiting to be sent.
+ * \param dgram datagram
+ * \param local source address, NULL to let the system choose it
+ */
+static void turnserver_udp_set_local(struct net_datagram* dgram,
+    const struct sockaddr_storage* local)
+{
+  if(local)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    memcpy(&dgram->local, local, sizeof(struct sockaddr_storage));
+    dgram->local_size = sizeof(struct sockaddr_storage);
+  }
+  else
+  {
+    dgram->local_size = 0;
   }
-
-  net_iovec_free_data(iov, idx);
-  return 0;
 }
 
 /**
- * \brief Process a TURN Connect request (RFC6062).
- * \param transport_protocol transport protocol used
- * \param sock socket
- * \param message STUN message
- * \param saddr source address
- * \param saddr_size sizeof address
- * \param desc allocation descriptor
- * \param speer TLS peer, if not NULL the connection is in TLS so response is
- * also in TLS
- * \return 0 if success, -1 otherwise
+ * \brief Send an UDP datagram.
+ *
+ * If batching is enabled, the datagram is copied in the batch and sent with
+ * the other ones by turnserver_udp_flush().
+ * \param sock socket descriptor
+ * \param addr destination address
+ * \param addr_size sizeof addr
+ * \param iov vector of data
+ * \param iovlen number of elements of iov
+ * \param local source address, NULL to let the system choose it
+ * \return number of bytes sent or queued, -1 if error
  */
-static int turnserver_process_connect_request(int transport_protocol, int sock,
-    const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
+static ssize_t turnserver_udp_send(int sock, const struct sockaddr* addr,
+    socklen_t addr_size, const struct iovec* iov, size_t iovlen,
+    const struct sockaddr_storage* local)
 {
-  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
-  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  uint8_t peer_addr[16];
-  uint16_t peer_port = 0;
-  uint16_t len = 0;
-  struct sockaddr_storage storage;
-  int peer_sock = -1;
-  int family = 0;
-  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
-  uint8_t* p = (uint8_t*)&cookie;
-  uint32_t id = 0;
-  long flags = 0;
-  int ret = 0;
-
-  debug(DBG_ATTR, "Connect request received!\n");
+  struct net_datagram* dgram = NULL;
+  size_t len = 0;
+  size_t i = 0;
 
-  /* check also that allocation has a maximum of one
-   * outgoing connection
-   * (if relayed_sock_tcp equals -1 it means that it exists
-   * already an outgoing connection for this allocation)
-   */
-  if(!message->peer_addr[0] || desc->relayed_sock_tcp == -1)
+  for(i = 0 ; i < iovlen ; i++)
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return -1;
+    len += iov[i].iov_len;
   }
 
-  switch(message->peer_addr[0]->turn_attr_family)
+  if(g_udp_batch.size <= 1 || len > UDP_BATCH_BUFFER_SIZE ||
+     addr_size > sizeof(struct sockaddr_storage))
   {
-    case STUN_ATTR_FAMILY_IPV4:
-      len = 4;
-      family = AF_INET;
-      break;
-    case STUN_ATTR_FAMILY_IPV6:
-      len = 16;
-      family = AF_INET6;
-      break;
-    default:
-      return -1;
-      break;
+    ssize_t nb = -1;
+
+    /* keep order of the datagrams */
+    turnserver_udp_flush();
+
+    nb = net_udp_sendv(sock, iov, iovlen, addr, addr_size, local);
+    g_udp_batch.send_calls++;
+
+    if(nb == -1)
+    {
+      g_udp_batch.send_errors++;
+    }
+    else
+    {
+      g_udp_batch.send_datagrams++;
+    }
+
+    return nb;
   }
 
-  /* copy address/port */
-  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
-  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
+  dgram = &g_udp_batch.out[g_udp_batch.out_nb];
+  dgram->buf = g_udp_batch.out_buf[g_udp_batch.out_nb];
+  dgram->len = 0;
 
-  if(turn_xor_address_cookie(family, peer_addr, &peer_port, p,
-        message->msg->turn_msg_id) == -1)
+  for(i = 0 ; i < iovlen ; i++)
   {
-    return -1;
+    memcpy(dgram->buf + dgram->len, iov[i].iov_base, iov[i].iov_len);
+    dgram->len += iov[i].iov_len;
   }
 
-  if(desc->relayed_addr.ss_family != family)
+  memcpy(&dgram->addr, addr, addr_size);
+  dgram->addr_size = addr_size;
+  turnserver_udp_set_local(dgram, local);
+  g_udp_batch.out_sock[g_udp_batch.out_nb] = sock;
+  g_udp_batch.out_nb++;
+
+  if(g_udp_batch.out_nb == g_udp_batch.size)
   {
-    debug(DBG_ATTR, "Could not relayed from a different family\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return -1;
+    turnserver_udp_flush();
   }
 
-  /* check if server has already processed the same
-   * XOR-PEER-ADDRESS with this allocation => error 446
-   */
-  if(allocation_desc_find_tcp_relay_addr(desc, family, peer_addr, peer_port))
+  return len;
+}
+
+/**
+ * \brief Send an UDP datagram stored in the datagram being processed.
+ *
+ * If batching is enabled, the buffer of the received datagram is queued as is
+ * and the received datagram takes the buffer it replaces, so data is never
+ * copied. Otherwise the data is sent right away.
+ * \param sock socket descriptor
+ * \param addr destination address
+ * \param addr_size sizeof addr
+ * \param buf data, if it is not located in the buffer (headroom included) of
+ * g_udp_batch.in_cur, data is copied as with turnserver_udp_send()
+ * \param len length of data
+ * \param local source address, NULL to let the system choose it
+ * \return number of bytes sent or queued, -1 if error
+ */
+static ssize_t turnserver_udp_send_inplace(int sock,
+    const struct sockaddr* addr, socklen_t addr_size, const char* buf,
+    size_t len, const struct sockaddr_storage* local)
+{
+  struct net_datagram* in = g_udp_batch.in_cur;
+  struct net_datagram* dgram = NULL;
+  char* tmp = NULL;
+
+  if(!in || g_udp_batch.size <= 1 || buf < in->buf - UDP_BATCH_HEADROOM ||
+     buf + len > in->buf + in->size ||
+     addr_size > sizeof(struct sockaddr_storage))
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 446, saddr, saddr_size, speer, desc->key);
-    return -1;
+    struct iovec iov;
+
+    iov.iov_base = (char*)buf;
+    iov.iov_len = len;
+    return turnserver_udp_send(sock, addr, addr_size, &iov, 1, local);
   }
 
-  /* check if the address is not blacklisted, also check for an IPv6 tunneled
-   * address that can lead to a tunne amplification attack
-   * (see section 9.1 of RFC6156)
-   */
-  if(turnserver_is_address_denied(peer_addr, len, peer_port) ||
-      turnserver_is_ipv6_tunneled_address(peer_addr, len))
+  /* exchange buffers, received data is now owned by the batch */
+  dgram = &g_udp_batch.out[g_udp_batch.out_nb];
+  tmp = g_udp_batch.out_buf[g_udp_batch.out_nb];
+  g_udp_batch.out_buf[g_udp_batch.out_nb] = in->buf;
+  in->buf = tmp;
+  g_udp_batch.in_cur = NULL;
+
+  dgram->buf = (char*)buf;
+  dgram->len = len;
+  memcpy(&dgram->addr, addr, addr_size);
+  dgram->addr_size = addr_size;
+  turnserver_udp_set_local(dgram, local);
+  g_udp_batch.out_sock[g_udp_batch.out_nb] = sock;
+  g_udp_batch.out_nb++;
+  g_udp_batch.send_inplace++;
+
+  if(g_udp_batch.out_nb == g_udp_batch.size)
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 403, saddr, saddr_size, speer, desc->key);
-    return -1;
+    turnserver_udp_flush();
   }
 
-  /* connection to peer */
-  switch(family)
+  return len;
+}
+
+/**
+ * \brief Returns whether or not an allocation relays data between an IPv4
+ * client and IPv4 peers.
+ *
+ * RFC6156: If present, the DONT-FRAGMENT attribute MUST be ignored by the
+ * server for IPv4-IPv6, IPv6-IPv6 and IPv6-IPv4 relays.
+ * \param desc allocation descriptor
+ * \return 1 if DF behavior applies to the relay, 0 otherwise
+ */
+static int turnserver_relayed_is_ipv4(const struct allocation_desc* desc)
+{
+  return desc->relayed_addr.ss_family == AF_INET &&
+    (desc->tuple.client_addr.ss_family == AF_INET ||
+     (desc->tuple.client_addr.ss_family == AF_INET6 &&
+      IN6_IS_ADDR_V4MAPPED(
+        &((struct sockaddr_in6*)&desc->tuple.client_addr)->sin6_addr)));
+}
+
+#ifdef OS_SET_DF_SUPPORT
+/**
+ * \brief Set the DF behavior of the relayed socket of an allocation.
+ *
+ * The behavior is a property of the socket, it is only changed when a client
+ * switches between data with and without DONT-FRAGMENT. Datagrams waiting in
+ * the batch are sent before with the previous behavior.
+ * \param desc allocation descriptor
+ * \param df IP_MTU_DISCOVER value
+ */
+static void turnserver_relayed_set_df(struct allocation_desc* desc, int df)
+{
+  if(desc->relayed_df == df)
   {
-    case AF_INET:
-      ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
-      memcpy(&((struct sockaddr_in*)&storage)->sin_addr, peer_addr, 4);
-      ((struct sockaddr_in*)&storage)->sin_port = htons(peer_port);
-      memset(&((struct sockaddr_in*)&storage)->sin_zero, 0x00,
-          sizeof((struct sockaddr_in*)&storage)->sin_zero);
-      break;
-    case AF_INET6:
-      ((struct sockaddr_in6*)&storage)->sin6_family = AF_INET6;
-      memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, peer_addr, 16);
-      ((struct sockaddr_in6*)&storage)->sin6_port = htons(peer_port);
-      ((struct sockaddr_in6*)&storage)->sin6_flowinfo = htonl(0);
-      ((struct sockaddr_in6*)&storage)->sin6_scope_id = htonl(0);
-#ifdef SIN6_LEN
-      ((struct sockaddr_in6*)&storage)->sin6_len = sizeof(struct sockaddr_in6);
-#endif
-      break;
-    default:
-      return -1;
-      break;
+    return;
   }
 
-  peer_sock = desc->relayed_sock_tcp;
-  desc->relayed_sock_tcp = -1;
+  turnserver_udp_flush();
 
-  /* set non-blocking mode */
-  if((flags = fcntl(peer_sock, F_GETFL, NULL)) == -1)
+  if(turnserver_udp_set_df(desc->relayed_sock, df) == 0)
   {
-    return -1;
+    desc->relayed_df = df;
   }
+}
+#endif
 
-  flags |= O_NONBLOCK;
+/**
+ * \brief Maximum number of allocations of this process.
+ *
+ * max_client is the total of the server, clients are spread across the
+ * workers so each one accepts its share.
+ * \return share of max_client of a worker
+ */
+static size_t turnserver_max_allocations(void)
+{
+  size_t workers = turnserver_cfg_workers();
 
-  if(fcntl(peer_sock, F_SETFL, flags) == -1)
+  workers = workers ? workers : 1;
+  return (turnserver_cfg_max_client() + workers - 1) / workers;
+}
+
+/**
+ * \brief Preallocate the pools of objects according to max_client.
+ *
+ * Pools still grow if more objects are needed (permissions and channels).
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_pool_init(void)
+{
+  size_t nb = turnserver_max_allocations();
+
+  if(allocation_pool_reserve(ALLOCATION_POOL_DESC, nb) == -1 ||
+     allocation_pool_reserve(ALLOCATION_POOL_PERMISSION,
+       nb * POOL_PEERS_PER_ALLOCATION) == -1 ||
+     allocation_pool_reserve(ALLOCATION_POOL_CHANNEL,
+       nb * POOL_PEERS_PER_ALLOCATION) == -1 ||
+     pool_reserve(&g_socket_desc_pool, nb) == -1)
   {
     return -1;
   }
 
-  ret = connect(peer_sock, (struct sockaddr*)&storage,
-      sockaddr_get_size(&storage));
-
-  if(errno == EINPROGRESS)
+  if(turnserver_cfg_turn_tcp() &&
+     allocation_pool_reserve(ALLOCATION_POOL_TCP_RELAY, nb) == -1)
   {
-    /* connection ongoing */
-    /* generate unique ID */
-    crypto_random_bytes_generate((uint8_t*)&id, 4);
-
-    /* add it to allocation */
-    if(allocation_desc_add_tcp_relay(desc, id, peer_sock, family, peer_addr,
-          peer_port, TURN_DEFAULT_TCP_RELAY_TIMEOUT, 0,
-          message->msg->turn_msg_id) == -1)
-    {
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
-    return 0;
+    return -1;
   }
-  else if(ret < 0)
+
+  if(turnserver_cfg_dtls() && tls_peer_pool_reserve(nb) == -1)
   {
-    /* error */
-    char error_str[256];
-    sys_get_error(errno, error_str, sizeof(error_str));
-    syslog(LOG_ERR, "connect to peer failed: %s", error_str);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 447, saddr, saddr_size, speer, desc->key);
     return -1;
   }
 
-  return -1;
+  return 0;
 }
 
 /**
- * \brief Process a TURN ConnectionBind request (RFC6062).
- * \param transport_protocol transport protocol used
- * \param sock socket
- * \param message STUN message
- * \param saddr source address
- * \param saddr_size sizeof address
- * \param speer TLS peer, if not NULL the connection is in TLS so response is
- * also in TLS
- * \param account account descriptor
- * \param allocation_list list of allocations
- * \return 0 if success, -1 otherwise
+ * \brief Release the memory of the pools of objects.
+ *
+ * Must be called when all objects have been freed.
  */
-static int turnserver_process_connectionbind_request(int transport_protocol,
-    int sock, const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct tls_peer* speer, struct account_desc* account,
-    struct list_head* allocation_list)
+static void turnserver_pool_cleanup(void)
 {
-  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
-  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  struct allocation_tcp_relay* tcp_relay = NULL;
+  allocation_pool_cleanup();
+  tls_peer_pool_cleanup();
+  pool_destroy(&g_socket_desc_pool);
+  pool_destroy(&g_stream_buf_pool);
+}
+
+/**
+ * \brief Log the occupancy of a pool.
+ * \param pool pool
+ */
+static void turnserver_print_pool(const struct pool* pool)
+{
+  debug(DBG_ATTR, "Pool %s: %lu/%lu used, high-water %lu\n", pool->name,
+      (unsigned long)pool->used, (unsigned long)pool->total,
+      (unsigned long)pool->high_water);
+  syslog(LOG_INFO, "Pool %s: %lu/%lu used, high-water %lu", pool->name,
+      (unsigned long)pool->used, (unsigned long)pool->total,
+      (unsigned long)pool->high_water);
+}
+
+/**
+ * \brief Log statistics.
+ */
+static void turnserver_print_stats(void)
+{
+  unsigned long recv_calls = g_udp_batch.recv_calls;
+  unsigned long send_calls = g_udp_batch.send_calls;
+  const struct tls_peer_stats* tls_stats = tls_peer_stats_get();
   struct list_head* get = NULL;
   struct list_head* n = NULL;
-  struct allocation_desc* desc = NULL;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  struct iovec iov[8];
-  size_t idx = 0;
+  int i = 0;
 
-  debug(DBG_ATTR, "ConnectionBind request received!\n");
+  debug(DBG_ATTR, "UDP receive: %lu datagrams, %lu calls\n",
+      g_udp_batch.recv_datagrams, recv_calls);
+  debug(DBG_ATTR, "UDP relay send: %lu datagrams, %lu calls, %lu errors, "
+      "%lu without copy\n", g_udp_batch.send_datagrams, send_calls,
+      g_udp_batch.send_errors, g_udp_batch.send_inplace);
 
-  if(!message->connection_id)
-  {
-    debug(DBG_ATTR, "No CONNECTION-ID attribute!\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, account->key);
-    return -1;
-  }
+  syslog(LOG_INFO, "UDP receive: %lu datagrams, %lu calls (%lu per call)",
+      g_udp_batch.recv_datagrams, recv_calls,
+      recv_calls ? g_udp_batch.recv_datagrams / recv_calls : 0);
+  syslog(LOG_INFO, "UDP relay send: %lu datagrams, %lu calls (%lu per call), "
+      "%lu errors, %lu without copy", g_udp_batch.send_datagrams, send_calls,
+      send_calls ? g_udp_batch.send_datagrams / send_calls : 0,
+      g_udp_batch.send_errors, g_udp_batch.send_inplace);
 
-  /* find corresponding allocation for TCP connection ID */
-  list_head_iterate_safe(allocation_list, get, n)
-  {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
-    struct list_head* get2 = NULL;
-    struct list_head* n2 = NULL;
+  debug(DBG_ATTR, "TLS send: %lu messages, %lu bytes, %lu bytes copied, "
+      "%lu buffer allocations, %lu kernel TLS connections\n",
+      tls_stats->writes, tls_stats->bytes_written, tls_stats->bytes_copied,
+      tls_stats->buffer_allocs, tls_stats->ktls_tx);
+  syslog(LOG_INFO, "TLS send: %lu messages, %lu bytes, %lu bytes copied, "
+      "%lu buffer allocations, %lu kernel TLS connections", tls_stats->writes,
+      tls_stats->bytes_written, tls_stats->bytes_copied,
+      tls_stats->buffer_allocs, tls_stats->ktls_tx);
 
-    if(tmp->relayed_transport_protocol != IPPROTO_TCP ||
-        memcmp(tmp->key, account->key, sizeof(tmp->key)) != 0)
-    {
-      continue;
-    }
+  debug(DBG_ATTR, "TLS handshakes: %lu full, %lu resumed\n",
+      tls_stats->handshakes_full, tls_stats->handshakes_resumed);
+  syslog(LOG_INFO, "TLS handshakes: %lu full, %lu resumed",
+      tls_stats->handshakes_full, tls_stats->handshakes_resumed);
 
-    list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
-    {
-      struct allocation_tcp_relay* tmp2 =
-        list_head_get(get2, struct allocation_tcp_relay, list);
+  debug(DBG_ATTR, "Bandwidth: %lu packets dropped, %lu relayed sockets "
+      "paced\n", g_bandwidth.dropped, g_bandwidth.paced_nb);
+  syslog(LOG_INFO, "Bandwidth: %lu packets dropped, %lu relayed sockets paced",
+      g_bandwidth.dropped, g_bandwidth.paced_nb);
 
-      if(tmp2->connection_id == message->connection_id->turn_attr_id)
-      {
-        desc = tmp;
-        break;
-      }
-    }
+  debug(DBG_ATTR, "Nonce: %lu verified, %lu from cache\n",
+      g_nonce_ctx.verified, g_nonce_ctx.cache_hits);
+  syslog(LOG_INFO, "Nonce: %lu verified, %lu from cache", g_nonce_ctx.verified,
+      g_nonce_ctx.cache_hits);
 
-    /* found ? */
-    if(desc)
-    {
-      break;
-    }
+  list_head_iterate_safe(&g_relay_ports_list, get, n)
+  {
+    struct relay_ports* tmp = list_head_get(get, struct relay_ports, list);
+
+    debug(DBG_ATTR, "Relayed ports %s: %lu free\n", tmp->str,
+        (unsigned long)port_alloc_available(&tmp->ports));
+    syslog(LOG_INFO, "Relayed ports %s: %lu free", tmp->str,
+        (unsigned long)port_alloc_available(&tmp->ports));
   }
 
-  /* check if allocation exists and if its ID exists for this allocation
-   * otherwise => error 400
-   */
-  if(!desc || !(tcp_relay = allocation_desc_find_tcp_relay_id(desc,
-          message->connection_id->turn_attr_id)))
+  for(i = 0 ; i < ALLOCATION_POOL_MAX ; i++)
   {
-    debug(DBG_ATTR, "No allocation or no allocation for CONNECTION-ID\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, account->key);
-    return -1;
+    turnserver_print_pool(allocation_pool_get(i));
   }
 
-  /* only one ConnectionBind for a connection ID */
-  if(tcp_relay->client_sock != -1)
-  {
-    return 0;
-  }
+  turnserver_print_pool(&g_socket_desc_pool);
+  turnserver_print_pool(&g_stream_buf_pool);
+  turnserver_print_pool(tls_peer_pool_get());
+}
 
-  /* ConnectionBind response */
-  if(!(hdr = turn_msg_connectionbind_response_create(0,
-      message->msg->turn_msg_id, &iov[idx])))
+/**
+ * \brief Print help menu.
+ * \param name name of the program
+ * \param version version of the program
+ */
+static void turnserver_print_help(const char* name, const char* version)
+{
+  fprintf(stdout, "TurnServer %s\n", version);
+  fprintf(stdout, "Usage: %s [-c file] [-p pidfile] [-h] [-v]\n", name);
+}
+
+/**
+ * \brief Parse the command line arguments.
+ * \param argc number of argument
+ * \param argv array of argument
+ * \param configuration_file configuration (-c) argument will be filled in if
+ * any
+ * \param pid_file pid file (-p) argument will be filled in if any
+ */
+static void turnserver_parse_cmdline(int argc, char** argv,
+    char** configuration_file, char** pid_file)
+{
+  static const char* optstr = "c:p:hv";
+  int s = 0;
+
+  while((s = getopt(argc, argv, optstr)) != -1)
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, account->key);
-    return -1;
+    switch(s)
+    {
+      case 'h': /* help */
+        turnserver_print_help(argv[0], PACKAGE_VERSION);
+        exit(EXIT_SUCCESS);
+        break;
+      case 'v': /* version */
+        fprintf(stdout, "TurnServer %s\n", PACKAGE_VERSION);
+        fprintf(stdout, "Copyright (C) 2008-2012 Sebastien Vincent.\n");
+        fprintf(stdout, "This is free software; see the source for copying "
+            "conditions.  There is NO\n");
+        fprintf(stdout, "warranty; not even for MERCHANTABILITY or FITNESS FOR "
+            "A PARTICULAR PURPOSE.\n\n");
+        exit(EXIT_SUCCESS);
+      case 'c': /* configuration file */
+        if(optarg)
+        {
+          *configuration_file = optarg;
+        }
+        break;
+      case 'p': /* pid file */
+        if(optarg)
+        {
+          *pid_file = optarg;
+        }
+        break;
+      default:
+        break;
+    }
   }
-  idx++;
+}
 
-  /* connection-id */
-  if(!(attr = turn_attr_connection_id_create(
-          message->connection_id->turn_attr_id, &iov[idx])))
+/**
+ * \brief Configure session resumption (cache and tickets) of a TLS/DTLS peer.
+ * \param speer TLS/DTLS peer
+ * \return 0 if success, -1 if the ticket keys cannot be loaded
+ */
+static int turnserver_tls_session_setup(struct tls_peer* speer)
+{
+  char* file = turnserver_cfg_tls_ticket_key_file();
+
+  tls_peer_set_session_cache(speer, turnserver_cfg_tls_session_cache_size(),
+      turnserver_cfg_tls_session_timeout());
+
+  if(file && tls_peer_load_ticket_keys(speer, file) == -1)
   {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, account->key);
+    debug(DBG_ATTR, "Cannot load TLS ticket keys from %s\n", file);
+    syslog(LOG_ERR, "Cannot load TLS ticket keys from %s", file);
     return -1;
   }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          strlen(SOFTWARE_DESCRIPTION), &iov[idx])))
+  return 0;
+}
+
+/**
+ * \brief Raise the limit of open files according to max_client.
+ *
+ * A client uses up to 3 file descriptors (TCP connection, relayed socket
+ * and TURN-TCP socket). The soft limit is raised up to the hard one.
+ */
+static void turnserver_set_file_limit(void)
+{
+  struct rlimit limit;
+  rlim_t needed = (rlim_t)turnserver_max_allocations() * 3 + 64;
+
+  if(getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= needed)
   {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+    return;
   }
 
-  if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-      == -1)
+  if(limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed)
   {
-    /* MESSAGE-INTEGRITY option has to be in message, so
-     * deallocate ressources and return
-     */
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, account->key);
-    return -1;
+    syslog(LOG_WARNING, "Open files limited to %lu, max_client cannot be "
+        "reached", (unsigned long)limit.rlim_max);
+    needed = limit.rlim_max;
   }
 
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  limit.rlim_cur = needed;
+  if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
-    net_iovec_free_data(iov, idx);
-    return -1;
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    syslog(LOG_WARNING, "Cannot raise open files limit: %s", error_str);
   }
-
-  /* free message */
-  net_iovec_free_data(iov, idx);
-
-  /* initialized client socket */
-  tcp_relay->client_sock = sock;
-
-  /* now on this socket no other TURN messaging is allowed, remove the socket
-   * from the TCP remote sockets list
-   */
-  list_head_iterate_safe(&g_tcp_socket_list, get, n)
+  else
   {
-    struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
-
-    if(tmp->sock == sock)
-    {
-      tmp->sock = -1;
-      break;
-    }
+    debug(DBG_ATTR, "Open files limit set to %lu\n", (unsigned long)needed);
   }
+}
 
-  /* when removed from tcp_socket_list, it will be checked
-   * again in tcp_relay list in select() so avoid it
-   */
-  tcp_relay->new = 1;
+#ifdef NDEBUG
 
-  /* stop timer */
-  allocation_tcp_relay_set_timer(tcp_relay, 0);
+/**
+ * \brief Disable core dump if the server crash.
+ *
+ * Typically it is used in release mode. It prevents
+ * user/attacker to have access to core dump which could
+ * contains some sensitive data.
+ */
+static void turnserver_disable_core_dump(void)
+{
+  struct rlimit limit;
 
-  /* send out buffered data
-   * note that it is only used if server
-   * has been configured to use userspace
-   * TCP internal buffer
-   */
-  if(tcp_relay->buf_len)
-  {
-    ssize_t nb_read = 0;
-    ssize_t nb_read2 = 0;
+  limit.rlim_cur = 0;
+  limit.rlim_max = 0;
+  setrlimit(RLIMIT_CORE, &limit);
+}
 
-    debug(DBG_ATTR, "Send buffered data to client (TURN-TCP)\n");
+#endif
 
-    /* server has buffered data available,
-     * send them to client
-     */
-    while(tcp_relay->buf_len)
+/**
+ * \brief Check bandwidth limitation on uplink OR downlink.
+ *
+ * The limits of the allocation, its account and the server are checked.
+ * \param desc allocation descriptor
+ * \param byteup byte received on uplink connection. 0 means bandwidth check
+ * will be made on downlink (if different than 0)
+ * \param bytedown byte received on downlink connection. 0 means bandwidth check
+ * will be made on uplink (if different than 0)
+ * \return 1 if bandwidth threshold is exceeded, 0 otherwise
+ */
+static int turnserver_check_bandwidth_limit(struct allocation_desc* desc,
+    size_t byteup, size_t bytedown)
+{
+  if(byteup)
+  {
+    if(g_bandwidth.pacing)
     {
-      nb_read = send(tcp_relay->client_sock, tcp_relay->buf + nb_read2,
-          tcp_relay->buf_len, 0);
+      /* data is already received, debt is paid back by pacing the relayed
+       * socket
+       */
+      token_bucket_charge(&desc->bucket_up, byteup, g_now_ms);
+      return 0;
+    }
 
-      if(nb_read > 0)
-      {
-        tcp_relay->buf_len -= nb_read;
-        nb_read2 += nb_read;
-      }
-      else
-      {
-        tcp_relay->buf_len = 0;
-        break;
-      }
+    if(token_bucket_consume(&desc->bucket_up, byteup, g_now_ms) == -1)
+    {
+      /* bandwidth exceeded */
+      debug(DBG_ATTR, "Tokenup bucket exceeded, tokens requested: %zu\n",
+          byteup);
+      g_bandwidth.dropped++;
+      return 1;
     }
   }
-
-  /* free memory now as it will not be used anymore */
-  if(tcp_relay->buf)
+  else if(bytedown)
   {
-    free(tcp_relay->buf);
-    tcp_relay->buf = NULL;
-    tcp_relay->buf_size = 0;
+    if(token_bucket_consume(&desc->bucket_down, bytedown, g_now_ms) == -1)
+    {
+      /* bandwidth exceeded */
+      debug(DBG_ATTR, "Tokendown bucket exceeded, tokens requested: %zu\n",
+          bytedown);
+      g_bandwidth.dropped++;
+      return 1;
+    }
   }
 
+  /* bandwidth quota not reached */
   return 0;
 }
 
 /**
- * \brief Process a STUN Binding request.
- * \param transport_protocol transport protocol used
- * \param sock socket
- * \param message STUN message
- * \param saddr source address
- * \param saddr_size sizeof address
- * \param speer TLS peer, if not NULL the connection is in TLS so response is
- * also in TLS
- * \return 0 if success, -1 otherwise
+ * \brief Verify if the address is an IPv6 tunneled ones.
+ * \param addr address to check
+ * \param addrlen sizeof address
+ * \return 1 if address is an IPv6 tunneled ones, 0 otherwise
  */
-static int turnserver_process_binding_request(int transport_protocol, int sock,
-    const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct tls_peer* speer)
+static int turnserver_is_ipv6_tunneled_address(const uint8_t* addr,
+    size_t addrlen)
 {
-  struct iovec iov[4]; /* header, software, xor-address, fingerprint */
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-
-  debug(DBG_ATTR, "Binding request received!\n");
-
-  if(!(hdr = turn_msg_binding_response_create(0, message->msg->turn_msg_id,
-          &iov[idx])))
+  if(addrlen == 16)
   {
-    return -1;
-  }
-  idx++;
+    static const uint8_t addr_6to4[2] = {0x20, 0x02};
+    static const uint8_t addr_teredo[4] = {0x20, 0x01, 0x00, 0x00};
 
-  if(!(attr = turn_attr_xor_mapped_address_create(saddr, STUN_MAGIC_COOKIE,
-          message->msg->turn_msg_id, &iov[idx])))
-  {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, STUN_METHOD_BINDING,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
-    return -1;
+    /* 6to4 or teredo address ? */
+    if(!memcmp(addr, addr_6to4, 2) || !memcmp(addr, addr_teredo, 4))
+    {
+      return 1;
+    }
   }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
+  return 0;
+}
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-  {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
-  }
+/**
+ * \brief Build the prefix trie of the denied address list.
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_denied_address_init(void)
+{
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
 
-  /* NOTE: maybe add a configuration flag to enable/disable fingerprint in
-   * output message
-   */
-  /* add a fingerprint */
-  if(!(attr = turn_attr_fingerprint_create(0, &iov[idx])))
+  if(!(g_denied_address_trie = prefix_trie_new()))
   {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, STUN_METHOD_BINDING,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
     return -1;
   }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
-
-  /* compute fingerprint */
-
-  /* convert to big endian */
-  hdr->turn_msg_len = htons(hdr->turn_msg_len);
-
-  /* do not take into account the attribute itself */
-  ((struct turn_attr_fingerprint*)attr)->turn_attr_crc =
-    htonl(turn_calculate_fingerprint(iov, idx - 1));
-  ((struct turn_attr_fingerprint*)attr)->turn_attr_crc ^=
-    htonl(STUN_FINGERPRINT_XOR_VALUE);
 
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  list_head_iterate_safe(&g_denied_address_list, get, n)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    struct denied_address* tmp = list_head_get(get, struct denied_address, list);
+
+    if(prefix_trie_add(g_denied_address_trie, tmp->family, tmp->addr,
+          tmp->mask, tmp->port) == -1)
+    {
+      return -1;
+    }
   }
 
-  net_iovec_free_data(iov, idx);
   return 0;
 }
 
 /**
- * \brief Process a TURN ChannelData.
- * \param transport_protocol transport protocol used
- * \param channel_number channel number
- * \param buf raw data (including ChannelData header)
- * \param buflen length of the data
- * \param saddr source address (TURN client)
- * \param daddr destination address (TURN server)
- * \param saddr_size sizeof address
- * \param allocation_list list of allocations
- * \return 0 if success, -1 otherwise
+ * \brief Verify if address/port is in denied list.
+ * \param addr IPv4/IPv6 address to check
+ * \param addrlen sizeof the address (IPv4 = 4, IPv6 = 16)
+ * \param port port to check
+ * \return 1 if address is denied, 0 otherwise
  */
-static int turnserver_process_channeldata(int transport_protocol,
-    uint16_t channel_number, const char* buf, ssize_t buflen,
-    const struct sockaddr* saddr, const struct sockaddr* daddr,
-    socklen_t saddr_size, struct list_head* allocation_list)
+static int turnserver_is_address_denied(const uint8_t* addr, size_t addrlen,
+    uint16_t port)
 {
-  struct allocation_desc* desc = NULL;
-  struct turn_channel_data* channel_data = NULL;
-  struct allocation_channel* alloc_channel = NULL;
-  size_t len = 0;
-  char* msg = NULL;
-  ssize_t nb = -1;
-  int optval = 0;
-  int save_val = 0;
-  socklen_t optlen = sizeof(int);
-  struct sockaddr_storage storage;
-  uint8_t* peer_addr = NULL;
-  uint16_t peer_port = 0;
-
-  debug(DBG_ATTR, "ChannelData received!\n");
-
-  channel_data = (struct turn_channel_data*)buf;
-  len = ntohs(channel_data->turn_channel_len);
-
-  if(len > (buflen - sizeof(struct turn_channel_data)))
+  if(!g_denied_address_trie)
   {
-    /* length mismatch */
-    debug(DBG_ATTR, "Length too big\n");
-    return -1;
+    return 0;
   }
 
-  msg = (char*)channel_data->turn_channel_data;
+  return prefix_trie_match(g_denied_address_trie, addr, addrlen, port);
+}
 
-  if(channel_number > 0x7FFF)
-  {
-    /* channel reserved for future use */
-    debug(DBG_ATTR, "Channel number reserved for future use!\n");
-    return -1;
-  }
+/**
+ * \brief Finish a TURN message and send it.
+ *
+ * SOFTWARE, MESSAGE-INTEGRITY (if key is set) and FINGERPRINT attributes are
+ * added to the message.
+ * \param builder message built so far
+ * \param transport_protocol transport protocol to send the message
+ * \param sock socket
+ * \param saddr address to send
+ * \param saddr_size sizeof address
+ * \param speer TLS peer, if not NULL, send the message in TLS
+ * \param key HMAC key of account, if present, MESSAGE-INTEGRITY will be added
+ * \return 0 if success, -1 if MESSAGE-INTEGRITY cannot be added
+ */
+static int turnserver_send_response(struct turn_msg_builder* builder,
+    int transport_protocol, int sock, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct tls_peer* speer,
+    const struct crypto_hmac_sha1_key* key)
+{
+  /* software (not fatal if it cannot be added) */
+  turn_msg_builder_add_software(builder, SOFTWARE_DESCRIPTION,
+      sizeof(SOFTWARE_DESCRIPTION) - 1);
 
-  /* with TCP, length MUST a multiple of four */
-  if(transport_protocol == IPPROTO_TCP && (buflen % 4))
+  if(key && turn_msg_builder_add_message_integrity_key(builder, key) == -1)
   {
-    debug(DBG_ATTR, "TCP length must be multiple of four!\n");
+    /* MESSAGE-INTEGRITY option has to be in message */
     return -1;
   }
 
-  desc = allocation_list_find_tuple(allocation_list, transport_protocol, daddr,
-      saddr, saddr_size);
-  if(!desc)
-  {
-    /* not found */
-    debug(DBG_ATTR, "No allocation found\n");
-    return -1;
-  }
+  turn_msg_builder_add_fingerprint(builder); /* not fatal if not successful */
 
-  if(desc->relayed_transport_protocol != IPPROTO_UDP)
+  if(transport_protocol == IPPROTO_UDP && !speer)
   {
-    /* ignore for TCP relayed allocation */
-    debug(DBG_ATTR,
-        "ChannelData does not intend to work with TCP relayed address!");
-    return -1;
-  }
+    struct iovec iov;
 
-  alloc_channel = allocation_desc_find_channel_number(desc, channel_number);
+    /* reply from the address the request has been received on */
+    iov.iov_base = builder->buf;
+    iov.iov_len = builder->len;
 
-  if(!alloc_channel)
-  {
-    /* no channel bound to this peer */
-    debug(DBG_ATTR, "No channel bound to this peer\n");
-    return -1;
+    if(turnserver_udp_send(sock, saddr, saddr_size, &iov, 1,
+          g_udp_batch.in_daddr) == -1)
+    {
+      debug(DBG_ATTR, "turnserver_udp_send failed\n");
+    }
   }
-
-  if(desc->relayed_addr.ss_family != alloc_channel->family)
+  else if(turn_send_buffer(transport_protocol, sock, speer, saddr, saddr_size,
+        builder->buf, builder->len) == -1)
   {
-    debug(DBG_ATTR, "Could not relayed from a different family\n");
-    return -1;
+    debug(DBG_ATTR, "turn_send_buffer failed\n");
   }
 
-  /* check bandwidth limit */
-  if(turnserver_check_bandwidth_limit(desc, 0, len))
-  {
-    debug(DBG_ATTR, "Bandwidth quotas reached!\n");
-    return -1;
-  }
+  return 0;
+}
 
-  peer_addr = alloc_channel->peer_addr;
-  peer_port = alloc_channel->peer_port;
+/**
+ * \brief Send a TURN Error response.
+ * \param transport_protocol transport protocol to send the message
+ * \param sock socket
+ * \param method STUN/TURN method
+ * \param id transaction ID
+ * \param saddr address to send
+ * \param saddr_size sizeof address
+ * \param error error code
+ * \param speer TLS peer, if not NULL, send the error in TLS
+ * \param key HMAC key of account, if present, MESSAGE-INTEGRITY will be added
+ * \note Some error codes cannot be sent using this function (420, 438, ...).
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_send_error(int transport_protocol, int sock, int method,
+    const uint8_t* id, int error, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct tls_peer* speer,
+    const struct crypto_hmac_sha1_key* key)
+{
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  const char* reason = NULL;
 
-  switch(desc->relayed_addr.ss_family)
+  switch(error)
   {
-    case AF_INET:
-      ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
-      memcpy(&((struct sockaddr_in*)&storage)->sin_addr, peer_addr, 4);
-      ((struct sockaddr_in*)&storage)->sin_port = htons(peer_port);
-      memset(&((struct sockaddr_in*)&storage)->sin_zero, 0x00,
-          sizeof((struct sockaddr_in*)&storage)->sin_zero);
+    case 400: /* Bad request */
+      reason = STUN_ERROR_400;
       break;
-    case AF_INET6:
-      ((struct sockaddr_in6*)&storage)->sin6_family = AF_INET6;
-      memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, peer_addr, 16);
-      ((struct sockaddr_in6*)&storage)->sin6_port = htons(peer_port);
-      ((struct sockaddr_in6*)&storage)->sin6_flowinfo = htonl(0);
-      ((struct sockaddr_in6*)&storage)->sin6_scope_id = htonl(0);
-#ifdef SIN6_LEN
-      ((struct sockaddr_in6*)&storage)->sin6_len = sizeof(struct sockaddr_in6);
-#endif
+    case 403: /* Forbidden */
+      reason = TURN_ERROR_403;
+      break;
+    case 437: /* Alocation mismatch */
+      reason = TURN_ERROR_437;
+      break;
+    case 440: /* Address family not supported */
+      reason = TURN_ERROR_440;
+      break;
+    case 441: /* Wrong credentials */
+      reason = TURN_ERROR_441;
+      break;
+    case 442: /* Unsupported transport protocol */
+      reason = TURN_ERROR_442;
+      break;
+    case 443: /* Peer address family mismatch */
+      reason = TURN_ERROR_443;
+      break;
+    case 446: /* Connection already exists (RFC6062) */
+      reason = TURN_ERROR_446;
+      break;
+    case 447: /* Connection timeout or failure (RFC6062) */
+      reason = TURN_ERROR_447;
+      break;
+    case 486: /* Allocation quota reached */
+      reason = TURN_ERROR_486;
+      break;
+    case 500: /* Server error */
+      reason = STUN_ERROR_500;
+      break;
+    case 508: /* Insufficient port capacity */
+      reason = TURN_ERROR_508;
       break;
     default:
-      return -1;
       break;
   }
 
-  /* RFC6156: If present, the DONT-FRAGMENT attribute MUST be ignored by the
-   * server for IPv4-IPv6, IPv6-IPv6 and IPv6-IPv4 relays
-   */
-  if(desc->relayed_addr.ss_family == AF_INET &&
-     (desc->tuple.client_addr.ss_family == AF_INET ||
-      (desc->tuple.client_addr.ss_family == AF_INET6 &&
-      IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)&desc->tuple.client_addr)->sin6_addr))))
+  if(!reason)
   {
-#ifdef OS_SET_DF_SUPPORT
-    /* alternate behavior */
-    optval = IP_PMTUDISC_DONT;
-
-    if(!getsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-          &optlen))
-    {
-      setsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval,
-          sizeof(int));
-    }
-    else
-    {
-      /* little hack for not setting the old value of *_MTU_DISCOVER after
-       * sending message in case getsockopt failed
-       */
-      optlen = 0;
-    }
-#else
-    /* avoid compilation warning */
-    (void)optval;
-    (void)optlen;
-    (void)save_val;
-#endif
+    return -1;
   }
 
-  debug(DBG_ATTR, "Send ChannelData to peer\n");
-  nb = sendto(desc->relayed_sock, msg, len, 0, (struct sockaddr*)&storage,
-      sockaddr_get_size(&desc->relayed_addr));
-
-#ifdef OS_SET_DF_SUPPORT
-  /* if not an IPv4-IPv4 relay, optlen keep its default value 0 */
-  if(optlen)
+  /* reason is sent with its final NULL character */
+  if(turn_msg_builder_init(&builder, buf, sizeof(buf), method | STUN_ERROR_RESP,
+        id) == -1 ||
+     turn_msg_builder_add_error(&builder, error, reason, strlen(reason) + 1)
+      == -1)
   {
-    /* restore original value */
-    setsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-        sizeof(int));
+    return -1;
   }
-#endif
 
-  if(nb == -1)
+  /* finally send the response */
+  return turnserver_send_response(&builder, transport_protocol, sock, saddr,
+      saddr_size, speer, key);
+}
+
+/**
+ * \brief Send a TURN Error response with REALM and a fresh NONCE (401 or 438).
+ * \param transport_protocol transport protocol to send the message
+ * \param sock socket
+ * \param method STUN/TURN method
+ * \param id transaction ID
+ * \param error error code (401 or 438)
+ * \param saddr address to send
+ * \param saddr_size sizeof address
+ * \param speer TLS peer, if not NULL, send the error in TLS
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_send_auth_error(int transport_protocol, int sock,
+    int method, const uint8_t* id, int error, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct tls_peer* speer)
+{
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  uint8_t nonce[NONCE_LEN];
+  int nonce_len = 0;
+  char* realm = turnserver_cfg_realm();
+  const char* reason = (error == 438) ? STUN_ERROR_438 : STUN_ERROR_401;
+
+  /* reason is sent with its final NULL character */
+  if((nonce_len = nonce_generate(&g_nonce_ctx, g_now, nonce,
+          sizeof(nonce))) == -1 ||
+     turn_msg_builder_init(&builder, buf, sizeof(buf), method | STUN_ERROR_RESP,
+        id) == -1 ||
+     turn_msg_builder_add_error(&builder, error, reason, strlen(reason) + 1)
+      == -1 ||
+     turn_msg_builder_add_realm(&builder, realm, strlen(realm)) == -1 ||
+     turn_msg_builder_add_nonce(&builder, nonce, nonce_len) == -1)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    return -1;
   }
 
-  return 0;
+  return turnserver_send_response(&builder, transport_protocol, sock, saddr,
+      saddr_size, speer, NULL);
 }
 
 /**
- * \brief Process a TURN Send indication.
- * \param message TURN message
+ * \brief Process a TURN Connect request (RFC6062).
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param message STUN message
+ * \param saddr source address
+ * \param saddr_size sizeof address
  * \param desc allocation descriptor
+ * \param speer TLS peer, if not NULL the connection is in TLS so response is
+ * also in TLS
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_send_indication(
-    const struct turn_message* message, struct allocation_desc* desc)
+static int turnserver_process_connect_request(int transport_protocol, int sock,
+    const struct turn_message* message, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
 {
-  const char* msg = NULL;
-  size_t msg_len = 0;
-  struct allocation_permission* alloc_permission = NULL;
-  uint16_t peer_port = 0;
+  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
+  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
   uint8_t peer_addr[16];
-  size_t len = 0;
+  uint16_t peer_port = 0;
+  uint16_t len = 0;
+  struct sockaddr_storage storage;
+  int peer_sock = -1;
+  int family = 0;
   uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
   uint8_t* p = (uint8_t*)&cookie;
-  ssize_t nb = -1;
-  /* for get/setsockopt */
-  int optval = 0;
-  int save_val = 0;
-  socklen_t optlen = sizeof(int);
-  char str[INET6_ADDRSTRLEN];
-  int family = 0;
-  struct sockaddr_storage storage;
+  uint32_t id = 0;
+  long flags = 0;
+  int ret = 0;
 
-  debug(DBG_ATTR, "Send indication received!\n");
+  debug(DBG_ATTR, "Connect request received!\n");
 
-  if(!message->peer_addr[0] || !message->data)
+  /* check also that allocation has a maximum of one
+   * outgoing connection
+   * (if relayed_sock_tcp equals -1 it means that it exists
+   * already an outgoing connection for this allocation)
+   */
+  if(!message->peer_addr[0] || desc->relayed_sock_tcp == -1)
   {
-    /* no peer address, indication ignored */
-    debug(DBG_ATTR, "No peer address\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return -1;
   }
 
@@ -1435,905 +1899,694 @@ static int turnserver_process_send_indication(
       break;
   }
 
+  /* copy address/port */
+  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
+  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
+
+  if(turn_xor_address_cookie(family, peer_addr, &peer_port, p,
+        message->msg->turn_msg_id) == -1)
+  {
+    return -1;
+  }
+
   if(desc->relayed_addr.ss_family != family)
   {
     debug(DBG_ATTR, "Could not relayed from a different family\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return -1;
   }
 
-  /* copy peer address */
-  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
-  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
-
-  if(turn_xor_address_cookie(message->peer_addr[0]->turn_attr_family, peer_addr,
-        &peer_port, p, message->msg->turn_msg_id) == -1)
+  /* check if server has already processed the same
+   * XOR-PEER-ADDRESS with this allocation => error 446
+   */
+  if(allocation_desc_find_tcp_relay_addr(desc, family, peer_addr, peer_port))
   {
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 446, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return -1;
   }
 
   /* check if the address is not blacklisted, also check for an IPv6 tunneled
-   * address that can lead to a tunnel amplification attack (see section 9.1 of
-   * RFC6156)
+   * address that can lead to a tunne amplification attack
+   * (see section 9.1 of RFC6156)
    */
   if(turnserver_is_address_denied(peer_addr, len, peer_port) ||
       turnserver_is_ipv6_tunneled_address(peer_addr, len))
   {
-    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
-    debug(DBG_ATTR, "TurnServer does not permit relaying to %s\n", str);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 403, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return -1;
   }
 
-  /* find a permission */
-  alloc_permission = allocation_desc_find_permission(desc,
-      desc->relayed_addr.ss_family, peer_addr);
-
-  if(!alloc_permission)
+  /* connection to peer */
+  switch(family)
   {
-    /* no permission so packet dropped! */
-    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
-    debug(DBG_ATTR, "No permission for this peer (%s)\n", str);
-    return -1;
+    case AF_INET:
+      ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
+      memcpy(&((struct sockaddr_in*)&storage)->sin_addr, peer_addr, 4);
+      ((struct sockaddr_in*)&storage)->sin_port = htons(peer_port);
+      memset(&((struct sockaddr_in*)&storage)->sin_zero, 0x00,
+          sizeof((struct sockaddr_in*)&storage)->sin_zero);
+      break;
+    case AF_INET6:
+      ((struct sockaddr_in6*)&storage)->sin6_family = AF_INET6;
+      memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, peer_addr, 16);
+      ((struct sockaddr_in6*)&storage)->sin6_port = htons(peer_port);
+      ((struct sockaddr_in6*)&storage)->sin6_flowinfo = htonl(0);
+      ((struct sockaddr_in6*)&storage)->sin6_scope_id = htonl(0);
+#ifdef SIN6_LEN
+      ((struct sockaddr_in6*)&storage)->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+      break;
+    default:
+      return -1;
+      break;
   }
 
-  /* send the message */
-  if(message->data)
-  {
-    msg = (char*)message->data->turn_attr_data;
-    msg_len = ntohs(message->data->turn_attr_len);
-
-    /* check bandwidth limit */
-    if(turnserver_check_bandwidth_limit(desc, 0, msg_len))
-    {
-      debug(DBG_ATTR, "Bandwidth quotas reached!\n");
-      return -1;
-    }
+  peer_sock = desc->relayed_sock_tcp;
+  desc->relayed_sock_tcp = -1;
 
-    switch(desc->relayed_addr.ss_family)
-    {
-      case AF_INET:
-        ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
-        memcpy(&((struct sockaddr_in*)&storage)->sin_addr, peer_addr, 4);
-        ((struct sockaddr_in*)&storage)->sin_port = htons(peer_port);
-        memset(&((struct sockaddr_in*)&storage)->sin_zero, 0x00,
-            sizeof((struct sockaddr_in*)&storage)->sin_zero);
-        break;
-      case AF_INET6:
-        ((struct sockaddr_in6*)&storage)->sin6_family = AF_INET6;
-        memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, peer_addr, 16);
-        ((struct sockaddr_in6*)&storage)->sin6_port = htons(peer_port);
-        ((struct sockaddr_in6*)&storage)->sin6_flowinfo = htonl(0);
-        ((struct sockaddr_in6*)&storage)->sin6_scope_id = htonl(0);
-#ifdef SIN6_LEN
-        ((struct sockaddr_in6*)&storage)->sin6_len =
-          sizeof(struct sockaddr_in6);
-#endif
-        break;
-      default:
-        return -1;
-        break;
-    }
+  /* set non-blocking mode */
+  if((flags = fcntl(peer_sock, F_GETFL, NULL)) == -1)
+  {
+    return -1;
+  }
 
-    /* RFC6156: If present, the DONT-FRAGMENT attribute MUST be ignored by the
-     * server for IPv4-IPv6, IPv6-IPv6 and IPv6-IPv4 relays
-     */
-    if(desc->relayed_addr.ss_family == AF_INET &&
-       (desc->tuple.client_addr.ss_family == AF_INET ||
-        (desc->tuple.client_addr.ss_family == AF_INET6 &&
-        IN6_IS_ADDR_V4MAPPED(
-          &((struct sockaddr_in6*)&desc->tuple.client_addr)->sin6_addr))))
-    {
-      /* following is for IPv4-IPv4 relay only */
-#ifdef OS_SET_DF_SUPPORT
-      if(message->dont_fragment)
-      {
-        optval = IP_PMTUDISC_DO;
-        debug(DBG_ATTR, "Will set DF flag\n");
-      }
-      else /* IPv4-IPv4 relay but no DONT-FRAGMENT attribute */
-      {
-        /* alternate behavior, set DF to 0 */
-        optval = IP_PMTUDISC_DONT;
-        debug(DBG_ATTR, "Will not set DF flag\n");
-      }
+  flags |= O_NONBLOCK;
 
-      if(!getsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-            &optlen))
-      {
-        setsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval,
-            sizeof(int));
-      }
-      else
-      {
-        /* little hack for not setting the old value of *_MTU_DISCOVER after
-         * sending message in case getsockopt failed
-         */
-        optlen = 0;
-      }
-#else
-      /* avoid compilation warning */
-      (void)optval;
-      (void)optlen;
-      (void)save_val;
+  if(fcntl(peer_sock, F_SETFL, flags) == -1)
+  {
+    return -1;
+  }
 
-      if(message->dont_fragment)
-      {
-        /* ignore message */
-        debug(DBG_ATTR, "DONT-FRAGMENT attribute present and OS cannot set DF flag, ignore packet!\n");
-        return -1;
-      }
-#endif
-    }
+  ret = connect(peer_sock, (struct sockaddr*)&storage,
+      sockaddr_get_size(&storage));
 
-    debug(DBG_ATTR, "Send data to peer\n");
-    nb = sendto(desc->relayed_sock, msg, msg_len, 0, (struct sockaddr*)&storage,
-        sockaddr_get_size(&desc->relayed_addr));
+  if(errno == EINPROGRESS)
+  {
+    /* connection ongoing */
+    /* generate unique ID */
+    crypto_random_bytes_generate((uint8_t*)&id, 4);
 
-    /* if not an IPv4-IPv4 relay, optlen keep its default value 0 */
-#ifdef OS_SET_DF_SUPPORT
-    if(optlen)
+    /* add it to allocation */
+    if(allocation_desc_add_tcp_relay(desc, id, peer_sock, family, peer_addr,
+          peer_port, TURN_DEFAULT_TCP_RELAY_TIMEOUT, 0,
+          message->msg->turn_msg_id) == -1)
     {
-      /* restore original value */
-      setsockopt(desc->relayed_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-          sizeof(int));
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+          &desc->hmac_key);
+      return -1;
     }
-#endif
 
-    if(nb == -1)
-    {
-      debug(DBG_ATTR, "turn_send_message failed\n");
-    }
+    /* wait for connect() completion */
+    turnserver_event_set_tcp_relay(desc,
+        allocation_desc_find_tcp_relay_id(desc, id));
+    return 0;
+  }
+  else if(ret < 0)
+  {
+    /* error */
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    syslog(LOG_ERR, "connect to peer failed: %s", error_str);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 447, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
   }
 
-  return 0;
+  return -1;
 }
 
 /**
- * \brief Process a TURN CreatePermission request.
+ * \brief Process a TURN ConnectionBind request (RFC6062).
  * \param transport_protocol transport protocol used
  * \param sock socket
- * \param message TURN message
- * \param saddr source address of the message
- * \param saddr_size sizeof addr
- * \param desc allocation descriptor
+ * \param message STUN message
+ * \param saddr source address
+ * \param saddr_size sizeof address
  * \param speer TLS peer, if not NULL the connection is in TLS so response is
  * also in TLS
+ * \param account account descriptor
+ * \param allocation_list list of allocations
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_createpermission_request(int transport_protocol,
+static int turnserver_process_connectionbind_request(int transport_protocol,
     int sock, const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
+    socklen_t saddr_size, struct tls_peer* speer, struct account_desc* account,
+    struct list_head* allocation_list)
 {
   uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
   uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  uint16_t peer_port = 0;
-  uint8_t peer_addr[16];
-  size_t len = 0;
-  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
-  uint8_t* p = (uint8_t*)&cookie;
-  size_t i = 0;
-  size_t j = 0;
-  struct allocation_permission* alloc_permission = NULL;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  struct iovec iov[4]; /* header, software, integrity, fingerprint */
-  size_t idx = 0;
-  char str[INET6_ADDRSTRLEN];
-  char str2[INET6_ADDRSTRLEN];
-  char str3[INET6_ADDRSTRLEN];
-  uint16_t port = 0;
-  uint16_t port2 = 0;
-  int family = 0;
+  struct allocation_tcp_relay* tcp_relay = NULL;
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+  struct allocation_desc* desc = NULL;
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
 
-  debug(DBG_ATTR, "CreatePermission request received\n");
+  debug(DBG_ATTR, "ConnectionBind request received!\n");
 
-  if(message->xor_peer_addr_overflow)
+  if(!message->connection_id)
   {
-    /* too many XOR-PEER-ADDRESS attributes => error 508 */
-    debug(DBG_ATTR, "Too many XOR-PEER-ADDRESS attributes\n");
+    debug(DBG_ATTR, "No CONNECTION-ID attribute!\n");
     turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 508, saddr, saddr_size, speer, desc->key);
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &account->hmac_key);
     return -1;
   }
 
-  if(!message->peer_addr[0])
+  /* find corresponding allocation for TCP connection ID */
+  list_head_iterate_safe(allocation_list, get, n)
   {
-    /* no XOR-PEER-ADDRESS => error 400 */
-    debug(DBG_ATTR, "Missing address attribute\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return -1;
-  }
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+    struct list_head* get2 = NULL;
+    struct list_head* n2 = NULL;
 
-  /* get string representation of addresses for syslog */
-  if(desc->relayed_addr.ss_family == AF_INET)
-  {
-    inet_ntop(AF_INET, &((struct sockaddr_in*)&desc->relayed_addr)->sin_addr,
-        str3, INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in*)&desc->relayed_addr)->sin_port);
+    if(tmp->relayed_transport_protocol != IPPROTO_TCP ||
+        memcmp(tmp->key, account->key, sizeof(tmp->key)) != 0)
+    {
+      continue;
+    }
+
+    list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
+    {
+      struct allocation_tcp_relay* tmp2 =
+        list_head_get(get2, struct allocation_tcp_relay, list);
+
+      if(tmp2->connection_id == message->connection_id->turn_attr_id)
+      {
+        desc = tmp;
+        break;
+      }
+    }
+
+    /* found ? */
+    if(desc)
+    {
+      break;
+    }
   }
-  else /* IPv6 */
+
+  /* check if allocation exists and if its ID exists for this allocation
+   * otherwise => error 400
+   */
+  if(!desc || !(tcp_relay = allocation_desc_find_tcp_relay_id(desc,
+          message->connection_id->turn_attr_id)))
   {
-    inet_ntop(AF_INET6, &((struct sockaddr_in6*)&desc->relayed_addr)->sin6_addr,
-        str3, INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in6*)&desc->relayed_addr)->sin6_port);
+    debug(DBG_ATTR, "No allocation or no allocation for CONNECTION-ID\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
   }
 
-  if(saddr->sa_family == AF_INET)
+  /* only one ConnectionBind for a connection ID */
+  if(tcp_relay->client_sock != -1)
   {
-    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str2,
-        INET6_ADDRSTRLEN);
-    port2 = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+    return 0;
   }
-  else /* IPv6 */
+
+  /* ConnectionBind response */
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_CONNECTIONBIND | STUN_SUCCESS_RESP,
+      message->msg->turn_msg_id);
+
+  if(turn_msg_builder_add_connection_id(&builder,
+        message->connection_id->turn_attr_id) == -1 ||
+     turnserver_send_response(&builder, transport_protocol, sock, saddr,
+       saddr_size, speer, &desc->hmac_key) == -1)
   {
-    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str2,
-        INET6_ADDRSTRLEN);
-    port2 = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
   }
 
-  /* check address family for all XOR-PEER-ADDRESS attributes against the
-   * relayed ones
-   */
-  for(i = 0 ; i < XOR_PEER_ADDRESS_MAX && message->peer_addr[i] ; i++)
-  {
-    switch(message->peer_addr[i]->turn_attr_family)
-    {
-      case STUN_ATTR_FAMILY_IPV4:
-        len = 4;
-        family = AF_INET;
-        break;
-      case STUN_ATTR_FAMILY_IPV6:
-        len = 16;
-        family = AF_INET6;
-        break;
-      default:
-        return -1;
-    }
+  /* initialized client socket */
+  tcp_relay->client_sock = sock;
 
-    if((desc->relayed_addr.ss_family != family))
-    {
-      /* peer family mismatch => error 443 */
-      debug(DBG_ATTR, "Peer family mismatch\n");
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 443, saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
+  /* the socket is now a data connection, data from peer can be relayed */
+  turnserver_event_set_tcp_relay(desc, tcp_relay);
 
-    /* now check that address is not denied */
-    memcpy(peer_addr, message->peer_addr[i]->turn_attr_address, len);
-    peer_port = ntohs(message->peer_addr[i]->turn_attr_port);
+  /* now on this socket no other TURN messaging is allowed, remove the socket
+   * from the TCP remote sockets list
+   */
+  list_head_iterate_safe(&g_tcp_socket_list, get, n)
+  {
+    struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
 
-    if(turn_xor_address_cookie(message->peer_addr[i]->turn_attr_family,
-          peer_addr, &peer_port, p, message->msg->turn_msg_id) == -1)
+    if(tmp->sock == sock)
     {
-      return -1;
+      tmp->sock = -1;
+      break;
     }
+  }
 
-    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
+  /* when removed from tcp_socket_list, it will be checked
+   * again in tcp_relay list in select() so avoid it
+   */
+  tcp_relay->new = 1;
 
-    /* if one of the addresses is denied, directly send
-     * a CreatePermission error response.
-     */
-    if(turnserver_is_address_denied(peer_addr, len, peer_port))
-    {
-      debug(DBG_ATTR,
-          "TurnServer does not permit to install permission to %s\n", str);
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 403, saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
-  }
+  /* stop timer */
+  allocation_tcp_relay_set_timer(tcp_relay, 0);
 
-  for(j = 0 ; j < XOR_PEER_ADDRESS_MAX && message->peer_addr[j] ; j++)
+  /* send out buffered data
+   * note that it is only used if server
+   * has been configured to use userspace
+   * TCP internal buffer
+   */
+  if(tcp_relay->buf_len)
   {
-    /* copy peer address */
-    switch(message->peer_addr[j]->turn_attr_family)
-    {
-      case STUN_ATTR_FAMILY_IPV4:
-        len = 4;
-        family = AF_INET;
-        break;
-      case STUN_ATTR_FAMILY_IPV6:
-        len = 16;
-        family = AF_INET6;
-        break;
-      default:
-        return -1;
-    }
+    ssize_t nb_read = 0;
+    ssize_t nb_read2 = 0;
 
-    memcpy(peer_addr, message->peer_addr[j]->turn_attr_address, len);
-    peer_port = ntohs(message->peer_addr[j]->turn_attr_port);
+    debug(DBG_ATTR, "Send buffered data to client (TURN-TCP)\n");
 
-    if(turn_xor_address_cookie(message->peer_addr[j]->turn_attr_family,
-          peer_addr, &peer_port, p, message->msg->turn_msg_id) == -1)
+    /* server has buffered data available,
+     * send them to client
+     */
+    while(tcp_relay->buf_len)
     {
-      return -1;
-    }
-
-    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
-
-    syslog(LOG_INFO, "CreatePermission transport=%u (d)tls=%u source=%s:%u "
-        "account=%s relayed=%s:%u install_or_refresh=%s", transport_protocol,
-        desc->relayed_tls || desc->relayed_dtls, str2, port2, desc->username,
-        str3, port, str);
-
-    /* find a permission */
-    alloc_permission = allocation_desc_find_permission(desc,
-        desc->relayed_addr.ss_family, peer_addr);
+      nb_read = send(tcp_relay->client_sock, tcp_relay->buf + nb_read2,
+          tcp_relay->buf_len, 0);
 
-    /* update or create allocation permission on that peer */
-    if(!alloc_permission)
-    {
-      debug(DBG_ATTR, "Install permission for %s %u\n", str, peer_port);
-      allocation_desc_add_permission(desc, TURN_DEFAULT_PERMISSION_LIFETIME,
-          desc->relayed_addr.ss_family, peer_addr);
-    }
-    else
-    {
-      debug(DBG_ATTR, "Refresh permission\n");
-      allocation_permission_set_timer(alloc_permission,
-          TURN_DEFAULT_PERMISSION_LIFETIME);
+      if(nb_read > 0)
+      {
+        tcp_relay->buf_len -= nb_read;
+        nb_read2 += nb_read;
+      }
+      else
+      {
+        tcp_relay->buf_len = 0;
+        break;
+      }
     }
   }
 
-  /* send a CreatePermission success response */
-  if(!(hdr = turn_msg_createpermission_response_create(0,
-          message->msg->turn_msg_id, &iov[idx])))
+  /* free memory now as it will not be used anymore */
+  if(tcp_relay->buf)
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-    return -1;
+    free(tcp_relay->buf);
+    tcp_relay->buf = NULL;
+    tcp_relay->buf_size = 0;
   }
-  idx++;
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-  {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
-  }
+  return 0;
+}
 
-  if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-      == -1)
-  {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-    return -1;
-  }
+/**
+ * \brief Process a STUN Binding request.
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param message STUN message
+ * \param saddr source address
+ * \param saddr_size sizeof address
+ * \param speer TLS peer, if not NULL the connection is in TLS so response is
+ * also in TLS
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_process_binding_request(int transport_protocol, int sock,
+    const struct turn_message* message, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct tls_peer* speer)
+{
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
 
-  debug(DBG_ATTR,
-      "CreatePermission successful, send success CreatePermission response\n");
+  debug(DBG_ATTR, "Binding request received!\n");
 
-  /* finally send the response */
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      STUN_METHOD_BINDING | STUN_SUCCESS_RESP, message->msg->turn_msg_id);
 
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  if(turn_msg_builder_add_xor_address(&builder, STUN_ATTR_XOR_MAPPED_ADDRESS,
+        saddr) == -1)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    turnserver_send_error(transport_protocol, sock, STUN_METHOD_BINDING,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
+    return -1;
   }
 
-  net_iovec_free_data(iov, idx);
-  return 0;
+  /* NOTE: maybe add a configuration flag to enable/disable fingerprint in
+   * output message
+   */
+  return turnserver_send_response(&builder, transport_protocol, sock, saddr,
+      saddr_size, speer, NULL);
 }
 
 /**
- * \brief Process a TURN ChannelBind request.
+ * \brief Process a TURN ChannelData.
  * \param transport_protocol transport protocol used
- * \param sock socket
- * \param message TURN message
- * \param saddr source address of the message
- * \param saddr_size sizeof addr
- * \param desc allocation descriptor
- * \param speer TLS peer, if not NULL the connection is in TLS so response is
- * also in TLS
+ * \param channel_number channel number
+ * \param buf raw data (including ChannelData header)
+ * \param buflen length of the data
+ * \param saddr source address (TURN client)
+ * \param daddr destination address (TURN server)
+ * \param saddr_size sizeof address
+ * \param allocation_list list of allocations
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_channelbind_request(int transport_protocol,
-    int sock, const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
+static int turnserver_process_channeldata(int transport_protocol,
+    uint16_t channel_number, const char* buf, ssize_t buflen,
+    const struct sockaddr* saddr, const struct sockaddr* daddr,
+    socklen_t saddr_size, struct list_head* allocation_list)
 {
-  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
-  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  struct iovec iov[5]; /* header, lifetime, software, integrity, fingerprint */
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  uint16_t channel = 0;
+  struct allocation_desc* desc = NULL;
+  struct turn_channel_data* channel_data = NULL;
   struct allocation_channel* alloc_channel = NULL;
-  struct allocation_permission* alloc_permission = NULL;
-  uint8_t family = 0;
-  uint16_t peer_port = 0;
-  uint8_t peer_addr[16];
   size_t len = 0;
-  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
-  uint8_t* p = (uint8_t*)&cookie;
-  char str[INET6_ADDRSTRLEN];
-  char str2[INET6_ADDRSTRLEN];
-  char str3[INET6_ADDRSTRLEN];
-  uint16_t port = 0;
-  uint16_t port2 = 0;
-  uint32_t channel_use = 0; /* if refresh an existing ChannelBind */
+  const char* msg = NULL;
+  ssize_t nb = -1;
 
-  debug(DBG_ATTR, "ChannelBind request received!\n");
+  debug(DBG_ATTR, "ChannelData received!\n");
 
-  if(!message->channel_number || !message->peer_addr[0])
+  channel_data = (struct turn_channel_data*)buf;
+  len = ntohs(channel_data->turn_channel_len);
+
+  if(len > (buflen - sizeof(struct turn_channel_data)))
   {
-    /* attributes missing => error 400 */
-    debug(DBG_ATTR, "Channel number or peer address attributes missing\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return 0;
+    /* length mismatch */
+    debug(DBG_ATTR, "Length too big\n");
+    return -1;
   }
 
-  channel = ntohs(message->channel_number->turn_attr_number);
+  msg = (const char*)channel_data->turn_channel_data;
 
-  if(channel < 0x4000 || channel > 0x7FFF)
+  if(channel_number > 0x7FFF)
   {
-    /* bad channel => error 400 */
-    debug(DBG_ATTR, "Channel number is invalid\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return 0;
+    /* channel reserved for future use */
+    debug(DBG_ATTR, "Channel number reserved for future use!\n");
+    return -1;
   }
 
-  switch(message->peer_addr[0]->turn_attr_family)
+  /* with TCP, length MUST a multiple of four */
+  if(transport_protocol == IPPROTO_TCP && (buflen % 4))
   {
-    case STUN_ATTR_FAMILY_IPV4:
-      len = 4;
-      family = AF_INET;
-      break;
-    case STUN_ATTR_FAMILY_IPV6:
-      len = 16;
-      family = AF_INET6;
-      break;
-    default:
-      return -1;
-      break;
+    debug(DBG_ATTR, "TCP length must be multiple of four!\n");
+    return -1;
   }
 
-  /* check if the client has allocated a family address that match the peer
-   * family address
-   */
-  if(desc->relayed_addr.ss_family != family)
-  {
-    debug(DBG_ATTR, "Do not allow requesting a Channel when allocated address "
-        "family mismatch peer address family\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 443, saddr, saddr_size, speer, desc->key);
-    return -1;
-  }
-
-  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
-  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
-
-  if(turn_xor_address_cookie(message->peer_addr[0]->turn_attr_family, peer_addr,
-        &peer_port, p, message->msg->turn_msg_id) == -1)
+  desc = allocation_list_find_tuple(allocation_list, transport_protocol, daddr,
+      saddr, saddr_size);
+  if(!desc)
   {
+    /* not found */
+    debug(DBG_ATTR, "No allocation found\n");
     return -1;
   }
 
-  inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
-
-  /* check if the address is not blacklisted, also check for an IPv6 tunneled
-   * address that can lead to a tunnel amplification attack (see section 9.1 of
-   * RFC6156)
-   */
-  if(turnserver_is_address_denied(peer_addr, len, peer_port) ||
-      turnserver_is_ipv6_tunneled_address(peer_addr, len))
+  if(desc->relayed_transport_protocol != IPPROTO_UDP)
   {
-    /* permission denied => error 403 */
+    /* ignore for TCP relayed allocation */
     debug(DBG_ATTR,
-        "TurnServer does not permit to create a ChannelBind to %s\n", str);
-
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 403, saddr, saddr_size, speer, desc->key);
+        "ChannelData does not intend to work with TCP relayed address!");
     return -1;
   }
 
-  debug(DBG_ATTR, "Client request a ChannelBinding for %s %u\n", str,
-      peer_port);
-
-  /* check that the transport address is not currently bound to another
-   * channel
-   */
-  channel_use = allocation_desc_find_channel(desc, family, peer_addr,
-      peer_port);
-  if(channel_use && channel_use != channel)
-  {
-    /* transport address already bound to another channel */
-    debug(DBG_ATTR, "Transport address already bound to another channel\n");
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-    return 0;
-  }
-
-  alloc_channel = allocation_desc_find_channel_number(desc, channel);
-
-  if(alloc_channel)
-  {
-    /* check if same transport address */
-    if(alloc_channel->peer_port != peer_port ||
-        memcmp(alloc_channel->peer_addr, peer_addr, len) != 0)
-    {
-      /* different transport address => error 400 */
-      debug(DBG_ATTR, "Channel already bound to another transport address\n");
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 400, saddr, saddr_size, speer, desc->key);
-      return 0;
-    }
-
-    /* same transport address OK so refresh */
-    allocation_channel_set_timer(alloc_channel, TURN_DEFAULT_CHANNEL_LIFETIME);
-  }
-  else
-  {
-    /* allocate new channel */
-    if(allocation_desc_add_channel(desc, channel, TURN_DEFAULT_CHANNEL_LIFETIME,
-          family, peer_addr, peer_port) == -1)
-    {
-      return -1;
-    }
-  }
-
-  /* get string representation of addresses for syslog */
-  if(desc->relayed_addr.ss_family == AF_INET)
-  {
-    inet_ntop(AF_INET, &((struct sockaddr_in*)&desc->relayed_addr)->sin_addr,
-        str3, INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in*)&desc->relayed_addr)->sin_port);
-  }
-  else /* IPv6 */
-  {
-    inet_ntop(AF_INET6, &((struct sockaddr_in6*)&desc->relayed_addr)->sin6_addr,
-        str3, INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in6*)&desc->relayed_addr)->sin6_port);
-  }
-
-  if(saddr->sa_family == AF_INET)
-  {
-    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str2,
-        INET6_ADDRSTRLEN);
-    port2 = ntohs(((struct sockaddr_in*)saddr)->sin_port);
-  }
-  else /* IPv6 */
-  {
-    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str2,
-        INET6_ADDRSTRLEN);
-    port2 = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
-  }
-
-  syslog(LOG_INFO, "ChannelBind transport=%u (d)tls=%u source=%s:%u account=%s "
-      "relayed=%s:%u channel=%s:%u", transport_protocol, desc->relayed_tls ||
-      desc->relayed_dtls, str2, port2, desc->username, str3, port, str,
-      peer_port);
-
-  /* find a permission */
-  alloc_permission = allocation_desc_find_permission(desc, family, peer_addr);
+  alloc_channel = allocation_desc_find_channel_number(desc, channel_number);
 
-  /* update or create allocation permission on that peer */
-  if(!alloc_permission)
-  {
-    allocation_desc_add_permission(desc, TURN_DEFAULT_PERMISSION_LIFETIME,
-        family, peer_addr);
-  }
-  else
+  if(!alloc_channel)
   {
-    allocation_permission_set_timer(alloc_permission,
-        TURN_DEFAULT_PERMISSION_LIFETIME);
+    /* no channel bound to this peer */
+    debug(DBG_ATTR, "No channel bound to this peer\n");
+    return -1;
   }
 
-  /* finally send the response */
-  if(!(hdr = turn_msg_channelbind_response_create(0, message->msg->turn_msg_id,
-          &iov[idx])))
+  if(desc->relayed_addr.ss_family != alloc_channel->family)
   {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
+    debug(DBG_ATTR, "Could not relayed from a different family\n");
     return -1;
   }
-  idx++;
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+  /* check bandwidth limit */
+  if(turnserver_check_bandwidth_limit(desc, 0, len))
   {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+    debug(DBG_ATTR, "Bandwidth quotas reached!\n");
+    return -1;
   }
 
-  if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-      == -1)
+  if(turnserver_relayed_is_ipv4(desc))
   {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-    return -1;
+#ifdef OS_SET_DF_SUPPORT
+    /* alternate behavior (set when allocated, unless a Send indication with
+     * DONT-FRAGMENT has been relayed)
+     */
+    turnserver_relayed_set_df(desc, IP_PMTUDISC_DONT);
+#endif
   }
 
-  debug(DBG_ATTR,
-      "ChannelBind successful, send success ChannelBind response\n");
+  /* send the payload from where it has been received */
+  debug(DBG_ATTR, "Send ChannelData to peer\n");
+  nb = turnserver_udp_send_inplace(desc->relayed_sock,
+      (struct sockaddr*)&alloc_channel->peer_saddr,
+      alloc_channel->peer_saddr_size, msg, len, NULL);
 
-  /* finally send the response */
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  if(nb == -1)
   {
     debug(DBG_ATTR, "turn_send_message failed\n");
   }
 
-  net_iovec_free_data(iov, idx);
   return 0;
 }
 
 /**
- * \brief Process a TURN Refresh request.
- * \param transport_protocol transport protocol used
- * \param sock socket
+ * \brief Process a TURN Send indication.
  * \param message TURN message
- * \param saddr source address of the message
- * \param saddr_size sizeof addr
- * \param allocation_list list of allocations
  * \param desc allocation descriptor
- * \param account account descriptor
- * \param speer TLS peer, if not NULL the connection is in TLS so response is
- * also in TLS
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_refresh_request(int transport_protocol, int sock,
-    const struct turn_message* message, const struct sockaddr* saddr,
-    socklen_t saddr_size, struct list_head* allocation_list,
-    struct allocation_desc* desc, struct account_desc* account,
-    struct tls_peer* speer)
+static int turnserver_process_send_indication(
+    const struct turn_message* message, struct allocation_desc* desc)
 {
-  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
-  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  uint32_t lifetime = 0;
-  struct iovec iov[5]; /* header, lifetime, software, integrity, fingerprint */
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  uint8_t key[16];
+  const char* msg = NULL;
+  size_t msg_len = 0;
+  struct allocation_permission* alloc_permission = NULL;
+  uint16_t peer_port = 0;
+  uint8_t peer_addr[16];
+  size_t len = 0;
+  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
+  uint8_t* p = (uint8_t*)&cookie;
+  ssize_t nb = -1;
   char str[INET6_ADDRSTRLEN];
-  uint16_t port = 0;
-
-  debug(DBG_ATTR, "Refresh request received!\n");
-
-  /* save key from allocation as it could be freed if lifetime equals 0 */
-  memcpy(key, desc->key, sizeof(desc->key));
+  int family = 0;
+  struct sockaddr_storage storage;
 
-  /* RFC6156: at this stage server knows the 5-tuple and the allocation
-   * associated.
-   * No matter to know if the relayed address has a different address family
-   * than 5-tuple, so no need to have REQUESTED-ADDRESS-FAMILY attribute in
-   * Refresh request.
-   */
+  debug(DBG_ATTR, "Send indication received!\n");
 
-  /* if REQUESTED-ADDRESS-FAMILY attribute is present and do not match relayed
-   * address ones => error 443
-   */
-  if(message->requested_addr_family)
+  if(!message->peer_addr[0] || !message->data)
   {
-    int family = 0;
-
-    switch(message->requested_addr_family->turn_attr_family)
-    {
-      case STUN_ATTR_FAMILY_IPV4:
-        family = AF_INET;
-        break;
-      case STUN_ATTR_FAMILY_IPV6:
-        family = AF_INET6;
-        break;
-      default:
-        return -1;
-    }
+    /* no peer address, indication ignored */
+    debug(DBG_ATTR, "No peer address\n");
+    return -1;
+  }
 
-    if(desc->relayed_addr.ss_family != family)
-    {
-      /* peer family mismatch => error 443 */
-      debug(DBG_ATTR, "Peer family mismatch\n");
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 443, saddr, saddr_size, speer, key);
+  switch(message->peer_addr[0]->turn_attr_family)
+  {
+    case STUN_ATTR_FAMILY_IPV4:
+      len = 4;
+      family = AF_INET;
+      break;
+    case STUN_ATTR_FAMILY_IPV6:
+      len = 16;
+      family = AF_INET6;
+      break;
+    default:
       return -1;
-    }
+      break;
   }
 
-  if(message->lifetime)
+  if(desc->relayed_addr.ss_family != family)
   {
-    lifetime = htonl(message->lifetime->turn_attr_lifetime);
-
-    debug(DBG_ATTR, "lifetime: %u seconds\n", lifetime);
+    debug(DBG_ATTR, "Could not relayed from a different family\n");
+    return -1;
+  }
 
-    /* adjust lifetime (cannot be greater that maximum allowed) */
-    lifetime = SYS_MIN(lifetime, TURN_MAX_ALLOCATION_LIFETIME);
+  /* copy peer address */
+  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
+  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
 
-    if(lifetime > 0)
-    {
-      /* lifetime cannot be smaller than default */
-      lifetime = SYS_MAX(lifetime, TURN_DEFAULT_ALLOCATION_LIFETIME);
-    }
-  }
-  else
+  if(turn_xor_address_cookie(message->peer_addr[0]->turn_attr_family, peer_addr,
+        &peer_port, p, message->msg->turn_msg_id) == -1)
   {
-    /* cannot override default max value for allocation time */
-    lifetime = SYS_MIN(turnserver_cfg_allocation_lifetime(),
-        TURN_DEFAULT_ALLOCATION_LIFETIME);
+    return -1;
   }
 
-  if(saddr->sa_family == AF_INET)
-  {
-    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str,
-        INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
-  }
-  else /* IPv6 */
+  /* check if the address is not blacklisted, also check for an IPv6 tunneled
+   * address that can lead to a tunnel amplification attack (see section 9.1 of
+   * RFC6156)
+   */
+  if(turnserver_is_address_denied(peer_addr, len, peer_port) ||
+      turnserver_is_ipv6_tunneled_address(peer_addr, len))
   {
-    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str,
-        INET6_ADDRSTRLEN);
-    port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
+    debug(DBG_ATTR, "TurnServer does not permit relaying to %s\n", str);
+    return -1;
   }
 
-  syslog(LOG_INFO, "Refresh transport=%u (d)tls=%u source=%s:%u account=%s",
-      transport_protocol, desc->relayed_tls || desc->relayed_dtls, str, port,
-      desc->username);
+  /* find a permission */
+  alloc_permission = allocation_desc_find_permission(desc,
+      desc->relayed_addr.ss_family, peer_addr);
 
-  if(lifetime > 0)
+  if(!alloc_permission)
   {
-    /* adjust lifetime */
-    debug(DBG_ATTR, "Refresh allocation\n");
-    allocation_desc_set_timer(desc, lifetime);
+    /* no permission so packet dropped! */
+    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
+    debug(DBG_ATTR, "No permission for this peer (%s)\n", str);
+    return -1;
   }
-  else
-  {
-    /* lifetime = 0 delete the allocation */
-    /* protect the removing of the expired list if any */
-    turnserver_block_realtime_signal();
-    allocation_desc_set_timer(desc, 0); /* stop timeout */
-    /* in case the allocation has expired during this statement */
-    list_head_remove(&desc->list2, &desc->list2);
-    turnserver_unblock_realtime_signal();
 
-    allocation_list_remove(allocation_list, desc);
+  /* send the message */
+  if(message->data)
+  {
+    msg = (char*)message->data->turn_attr_data;
+    msg_len = ntohs(message->data->turn_attr_len);
 
-    /* decrement allocations for the account */
-    account->allocations--;
-    debug(DBG_ATTR, "Account %s, allocations used: %u\n", account->username,
-        account->allocations);
-    debug(DBG_ATTR, "Explicit delete of allocation\n");
-    if(account->allocations == 0 && account->is_tmp)
+    /* check bandwidth limit */
+    if(turnserver_check_bandwidth_limit(desc, 0, msg_len))
     {
-      account_list_remove(NULL, account);
+      debug(DBG_ATTR, "Bandwidth quotas reached!\n");
+      return -1;
     }
-  }
-
-  if(!(hdr = turn_msg_refresh_response_create(0, message->msg->turn_msg_id,
-          &iov[idx])))
-  {
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, key);
-    return -1;
-  }
-  idx++;
-
-  if(!(attr = turn_attr_lifetime_create(lifetime, &iov[idx])))
-  {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, key);
-    return -1;
-  }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-  {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
-  }
+    switch(desc->relayed_addr.ss_family)
+    {
+      case AF_INET:
+        ((struct sockaddr_in*)&storage)->sin_family = AF_INET;
+        memcpy(&((struct sockaddr_in*)&storage)->sin_addr, peer_addr, 4);
+        ((struct sockaddr_in*)&storage)->sin_port = htons(peer_port);
+        memset(&((struct sockaddr_in*)&storage)->sin_zero, 0x00,
+            sizeof((struct sockaddr_in*)&storage)->sin_zero);
+        break;
+      case AF_INET6:
+        ((struct sockaddr_in6*)&storage)->sin6_family = AF_INET6;
+        memcpy(&((struct sockaddr_in6*)&storage)->sin6_addr, peer_addr, 16);
+        ((struct sockaddr_in6*)&storage)->sin6_port = htons(peer_port);
+        ((struct sockaddr_in6*)&storage)->sin6_flowinfo = htonl(0);
+        ((struct sockaddr_in6*)&storage)->sin6_scope_id = htonl(0);
+#ifdef SIN6_LEN
+        ((struct sockaddr_in6*)&storage)->sin6_len =
+          sizeof(struct sockaddr_in6);
+#endif
+        break;
+      default:
+        return -1;
+        break;
+    }
 
-  if(turn_add_message_integrity(iov, &idx, key, sizeof(key), 1) == -1)
-  {
-    net_iovec_free_data(iov, idx);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, key);
-    return -1;
-  }
+    if(turnserver_relayed_is_ipv4(desc))
+    {
+      /* following is for IPv4-IPv4 relay only */
+#ifdef OS_SET_DF_SUPPORT
+      if(message->dont_fragment)
+      {
+        turnserver_relayed_set_df(desc, IP_PMTUDISC_DO);
+        debug(DBG_ATTR, "Will set DF flag\n");
+      }
+      else /* IPv4-IPv4 relay but no DONT-FRAGMENT attribute */
+      {
+        /* alternate behavior, set DF to 0 */
+        turnserver_relayed_set_df(desc, IP_PMTUDISC_DONT);
+        debug(DBG_ATTR, "Will not set DF flag\n");
+      }
+#else
+      if(message->dont_fragment)
+      {
+        /* ignore message */
+        debug(DBG_ATTR, "DONT-FRAGMENT attribute present and OS cannot set DF flag, ignore packet!\n");
+        return -1;
+      }
+#endif
+    }
 
-  debug(DBG_ATTR, "Refresh successful, send success refresh response\n");
+    debug(DBG_ATTR, "Send data to peer\n");
+    nb = turnserver_udp_send_inplace(desc->relayed_sock,
+        (struct sockaddr*)&storage, sockaddr_get_size(&desc->relayed_addr),
+        msg, msg_len, NULL);
 
-  /* finally send the response */
-  if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
-  {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    if(nb == -1)
+    {
+      debug(DBG_ATTR, "turn_send_message failed\n");
+    }
   }
 
-  net_iovec_free_data(iov, idx);
   return 0;
 }
 
 /**
- * \brief Process a TURN Allocate request.
+ * \brief Process a TURN CreatePermission request.
  * \param transport_protocol transport protocol used
  * \param sock socket
  * \param message TURN message
  * \param saddr source address of the message
- * \param daddr destination address of the message
  * \param saddr_size sizeof addr
- * \param allocation_list list of allocations
- * \param account account descriptor
+ * \param desc allocation descriptor
  * \param speer TLS peer, if not NULL the connection is in TLS so response is
  * also in TLS
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_allocate_request(int transport_protocol, int sock,
-    const struct turn_message* message, const struct sockaddr* saddr,
-    const struct sockaddr* daddr, socklen_t saddr_size,
-    struct list_head* allocation_list, struct account_desc* account,
-    struct tls_peer* speer)
+static int turnserver_process_createpermission_request(int transport_protocol,
+    int sock, const struct turn_message* message, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
 {
-  struct allocation_desc* desc = NULL;
-  struct itimerspec t; /* time before expire */
-  uint16_t hdr_msg_type = ntohs(message->msg->turn_msg_type);
+  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
   uint16_t method = STUN_GET_METHOD(hdr_msg_type);
-  struct sockaddr_storage relayed_addr;
-  int r_flag = 0;
-  uint32_t lifetime = 0;
-  uint16_t port = 0;
-  uint16_t reservation_port = 0;
-  int relayed_sock = -1;
-  int relayed_sock_tcp = -1; /* RFC6062 (TURN-TCP) */
-  int reservation_sock = -1;
-  socklen_t relayed_size = sizeof(struct sockaddr_storage);
-  size_t quit_loop = 0;
-  uint8_t reservation_token[8];
+  uint16_t peer_port = 0;
+  uint8_t peer_addr[16];
+  size_t len = 0;
+  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
+  uint8_t* p = (uint8_t*)&cookie;
+  size_t i = 0;
+  size_t j = 0;
+  struct allocation_permission* alloc_permission = NULL;
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
   char str[INET6_ADDRSTRLEN];
   char str2[INET6_ADDRSTRLEN];
+  char str3[INET6_ADDRSTRLEN];
+  uint16_t port = 0;
   uint16_t port2 = 0;
-  int has_token = 0;
-  char* family_address = NULL;
-  const uint16_t max_port = turnserver_cfg_max_port();
-  const uint16_t min_port = turnserver_cfg_min_port();
-
-  debug(DBG_ATTR, "Allocate request received!\n");
+  int family = 0;
 
-  /* check if it was a valid allocation */
-  desc = allocation_list_find_tuple(allocation_list, transport_protocol, daddr,
-      saddr, saddr_size);
+  debug(DBG_ATTR, "CreatePermission request received\n");
 
-  if(desc)
+  if(message->xor_peer_addr_overflow)
   {
-    if(transport_protocol == IPPROTO_UDP && !memcmp(message->msg->turn_msg_id,
-          desc->transaction_id, 12))
-    {
-      /* the request is a retransmission of a valid request, rebuild the
-       * response
-       */
-
-      /* get some states */
-      timer_gettime(desc->expire_timer, &t);
-      lifetime = t.it_value.tv_sec;
-      memcpy(&relayed_addr, &desc->relayed_addr,
-          sizeof(struct sockaddr_storage));
+    /* too many XOR-PEER-ADDRESS attributes => error 508 */
+    debug(DBG_ATTR, "Too many XOR-PEER-ADDRESS attributes\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
+  }
 
-      /* goto is bad... */
-      goto send_success_response;
-    }
-    else
-    {
-      /* allocation mismatch => error 437 */
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 437, saddr, saddr_size, speer, desc->key);
-    }
+  if(!message->peer_addr[0])
+  {
+    /* no XOR-PEER-ADDRESS => error 400 */
+    debug(DBG_ATTR, "Missing address attribute\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
+  }
 
-    return 0;
+  /* get string representation of addresses for syslog */
+  if(desc->relayed_addr.ss_family == AF_INET)
+  {
+    inet_ntop(AF_INET, &((struct sockaddr_in*)&desc->relayed_addr)->sin_addr,
+        str3, INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in*)&desc->relayed_addr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6*)&desc->relayed_addr)->sin6_addr,
+        str3, INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in6*)&desc->relayed_addr)->sin6_port);
   }
 
-  /* get string representation of address for syslog */
   if(saddr->sa_family == AF_INET)
   {
     inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str2,
@@ -2345,578 +2598,794 @@ static int turnserver_process_allocate_request(int transport_protocol, int sock,
     inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str2,
         INET6_ADDRSTRLEN);
     port2 = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+  }
 
-    /* Do not accept allocation request from IPv6 tunneled address,
-     * see section 9.1 of RC6156
-     */
-    if(turnserver_is_ipv6_tunneled_address(
-          ((struct sockaddr_in6*)saddr)->sin6_addr.s6_addr, 16))
+  /* check address family for all XOR-PEER-ADDRESS attributes against the
+   * relayed ones
+   */
+  for(i = 0 ; i < XOR_PEER_ADDRESS_MAX && message->peer_addr[i] ; i++)
+  {
+    switch(message->peer_addr[i]->turn_attr_family)
+    {
+      case STUN_ATTR_FAMILY_IPV4:
+        len = 4;
+        family = AF_INET;
+        break;
+      case STUN_ATTR_FAMILY_IPV6:
+        len = 16;
+        family = AF_INET6;
+        break;
+      default:
+        return -1;
+    }
+
+    if((desc->relayed_addr.ss_family != family))
     {
+      /* peer family mismatch => error 443 */
+      debug(DBG_ATTR, "Peer family mismatch\n");
       turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 403, saddr, saddr_size, speer,
-          account->key);
+          message->msg->turn_msg_id, 443, saddr, saddr_size, speer,
+          &desc->hmac_key);
+      return -1;
     }
-  }
 
-  /* check for allocation quota */
-  if(account->allocations >= turnserver_cfg_max_relay_per_username())
-  {
-    /* quota exceeded => error 486 */
-    syslog(LOG_WARNING, "Allocation transport=%u (d)tls=%u source=%s:%u account=%s"
-        " quota exceeded", transport_protocol, speer ? 1 : 0, str2, port2,
-        account->username);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 486, saddr, saddr_size, speer, account->key);
-    return -1;
-  }
-
-  /* check requested-transport */
-  if(!message->requested_transport)
-  {
-    /* bad request => error 400 */
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, account->key);
-    return 0;
-  }
+    /* now check that address is not denied */
+    memcpy(peer_addr, message->peer_addr[i]->turn_attr_address, len);
+    peer_port = ntohs(message->peer_addr[i]->turn_attr_port);
 
-  /* check if DONT-FRAGMENT attribute is supported */
-#ifndef OS_SET_DF_SUPPORT
-  if(message->dont_fragment)
-  {
-    /* header, error-code, unknown-attributes, software, message-integrity,
-     * fingerprint
-     */
-    struct iovec iov[6];
-    uint16_t unknown[2];
-    struct turn_msg_hdr* error = NULL;
-    struct turn_attr_hdr* attr = NULL;
-    size_t idx = 0;
+    if(turn_xor_address_cookie(message->peer_addr[i]->turn_attr_family,
+          peer_addr, &peer_port, p, message->msg->turn_msg_id) == -1)
+    {
+      return -1;
+    }
 
-    /* send error 420 */
-    unknown[0] = TURN_ATTR_DONT_FRAGMENT;
+    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
 
-    if(!(error = turn_error_response_420(method, message->msg->turn_msg_id,
-            unknown, 1, iov, &idx)))
+    /* if one of the addresses is denied, directly send
+     * a CreatePermission error response.
+     */
+    if(turnserver_is_address_denied(peer_addr, len, peer_port))
     {
+      debug(DBG_ATTR,
+          "TurnServer does not permit to install permission to %s\n", str);
       turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
-          account->key);
+          message->msg->turn_msg_id, 403, saddr, saddr_size, speer,
+          &desc->hmac_key);
       return -1;
     }
+  }
 
-    /* software (not fatal if it cannot be allocated) */
-    if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-            sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+  for(j = 0 ; j < XOR_PEER_ADDRESS_MAX && message->peer_addr[j] ; j++)
+  {
+    /* copy peer address */
+    switch(message->peer_addr[j]->turn_attr_family)
     {
-      error->turn_msg_len += iov[idx].iov_len;
-      idx++;
+      case STUN_ATTR_FAMILY_IPV4:
+        len = 4;
+        family = AF_INET;
+        break;
+      case STUN_ATTR_FAMILY_IPV6:
+        len = 16;
+        family = AF_INET6;
+        break;
+      default:
+        return -1;
     }
 
-    if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-        == -1)
+    memcpy(peer_addr, message->peer_addr[j]->turn_attr_address, len);
+    peer_port = ntohs(message->peer_addr[j]->turn_attr_port);
+
+    if(turn_xor_address_cookie(message->peer_addr[j]->turn_attr_family,
+          peer_addr, &peer_port, p, message->msg->turn_msg_id) == -1)
     {
-      net_iovec_free_data(iov, idx);
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
-          account->key);
       return -1;
     }
 
-    if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-          ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-        == -1)
+    inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
+
+    syslog(LOG_INFO, "CreatePermission transport=%u (d)tls=%u source=%s:%u "
+        "account=%s relayed=%s:%u install_or_refresh=%s", transport_protocol,
+        desc->relayed_tls || desc->relayed_dtls, str2, port2, desc->username,
+        str3, port, str);
+
+    /* find a permission */
+    alloc_permission = allocation_desc_find_permission(desc,
+        desc->relayed_addr.ss_family, peer_addr);
+
+    /* update or create allocation permission on that peer */
+    if(!alloc_permission)
     {
-      debug(DBG_ATTR, "turn_send_message failed\n");
+      debug(DBG_ATTR, "Install permission for %s %u\n", str, peer_port);
+      allocation_desc_add_permission(desc, TURN_DEFAULT_PERMISSION_LIFETIME,
+          desc->relayed_addr.ss_family, peer_addr);
+    }
+    else
+    {
+      debug(DBG_ATTR, "Refresh permission\n");
+      allocation_permission_set_timer(alloc_permission,
+          TURN_DEFAULT_PERMISSION_LIFETIME);
     }
-
-    /* free sent data */
-    net_iovec_free_data(iov, idx);
-    return 0;
   }
-#endif
 
-  /* check if server supports requested transport */
-  if(message->requested_transport->turn_attr_protocol != IPPROTO_UDP &&
-     (message->requested_transport->turn_attr_protocol != IPPROTO_TCP ||
-      !turnserver_cfg_turn_tcp()))
+  /* send a CreatePermission success response */
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_CREATEPERMISSION | STUN_SUCCESS_RESP,
+      message->msg->turn_msg_id);
+
+  debug(DBG_ATTR,
+      "CreatePermission successful, send success CreatePermission response\n");
+
+  /* finally send the response */
+  if(turnserver_send_response(&builder, transport_protocol, sock, saddr,
+        saddr_size, speer, &desc->hmac_key) == -1)
   {
-    /* unsupported transport protocol => error 442 */
     turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 442, saddr, saddr_size, speer, account->key);
-    return 0;
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
   }
 
-  if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
-  {
-    /* RFC6062 (TURN-TCP):
-     * - do not permit to allocate TCP relay with an
-     * UDP-based connection
-     * - requests do not contains DONT-FRAGMENT,
-     * RESERVATION-TOKEN or EVEN-PORT.
-     * => error 400
-     */
-    if(transport_protocol == IPPROTO_UDP || message->dont_fragment ||
-        message->reservation_token || message->even_port)
-    {
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
-          account->key);
-      return 0;
-    }
-  }
+  return 0;
+}
 
-  if(message->even_port && message->reservation_token)
+/**
+ * \brief Process a TURN ChannelBind request.
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param message TURN message
+ * \param saddr source address of the message
+ * \param saddr_size sizeof addr
+ * \param desc allocation descriptor
+ * \param speer TLS peer, if not NULL the connection is in TLS so response is
+ * also in TLS
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_process_channelbind_request(int transport_protocol,
+    int sock, const struct turn_message* message, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct allocation_desc* desc, struct tls_peer* speer)
+{
+  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
+  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  uint16_t channel = 0;
+  struct allocation_channel* alloc_channel = NULL;
+  struct allocation_permission* alloc_permission = NULL;
+  uint8_t family = 0;
+  uint16_t peer_port = 0;
+  uint8_t peer_addr[16];
+  size_t len = 0;
+  uint32_t cookie = htonl(STUN_MAGIC_COOKIE);
+  uint8_t* p = (uint8_t*)&cookie;
+  char str[INET6_ADDRSTRLEN];
+  char str2[INET6_ADDRSTRLEN];
+  char str3[INET6_ADDRSTRLEN];
+  uint16_t port = 0;
+  uint16_t port2 = 0;
+  uint32_t channel_use = 0; /* if refresh an existing ChannelBind */
+
+  debug(DBG_ATTR, "ChannelBind request received!\n");
+
+  if(!message->channel_number || !message->peer_addr[0])
   {
-    /* cannot have both EVEN-PORT and RESERVATION-TOKEN => error 400 */
+    /* attributes missing => error 400 */
+    debug(DBG_ATTR, "Channel number or peer address attributes missing\n");
     turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, account->key);
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return 0;
   }
 
-  if(message->requested_addr_family && message->reservation_token)
+  channel = ntohs(message->channel_number->turn_attr_number);
+
+  if(channel < 0x4000 || channel > 0x7FFF)
   {
-    /* RFC6156: cannot have both REQUESTED-ADDRESS-FAMILY and RESERVATION-TOKEN
-     * => error 400
-     */
+    /* bad channel => error 400 */
+    debug(DBG_ATTR, "Channel number is invalid\n");
     turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 400, saddr, saddr_size, speer, account->key);
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
     return 0;
   }
 
-  /* check reservation-token */
-  if(message->reservation_token)
+  switch(message->peer_addr[0]->turn_attr_family)
   {
-    struct allocation_token* token = NULL;
-
-    /* check if the requested reservation-token exists */
-    if((token = allocation_token_list_find(&g_token_list,
-            message->reservation_token->turn_attr_token)))
-    {
-      relayed_sock = token->sock;
-      has_token = 1;
-
-      /* suppress from the list */
-      turnserver_block_realtime_signal();
-      allocation_token_set_timer(token, 0); /* stop timer */
-      list_head_remove(&token->list2, &token->list2);
-      turnserver_unblock_realtime_signal();
-
-      allocation_token_list_remove(&g_token_list, token);
-      debug(DBG_ATTR, "Take token reserved address!\n");
-    }
-    else
-    {
-      /* token does not exists so token not valid => error 508 */
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
-          account->key);
-      return 0;
-    }
+    case STUN_ATTR_FAMILY_IPV4:
+      len = 4;
+      family = AF_INET;
+      break;
+    case STUN_ATTR_FAMILY_IPV6:
+      len = 16;
+      family = AF_INET6;
+      break;
+    default:
+      return -1;
+      break;
   }
 
-  if(message->even_port)
+  /* check if the client has allocated a family address that match the peer
+   * family address
+   */
+  if(desc->relayed_addr.ss_family != family)
   {
-    r_flag = message->even_port->turn_attr_flags & 0x80;
-
-    /* check if there are unknown other flags */
-    if(message->even_port->turn_attr_flags & (~g_supported_even_port_flags))
-    {
-      /* unsupported flags => error 508 */
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
-          account->key);
-      return 0;
-    }
+    debug(DBG_ATTR, "Do not allow requesting a Channel when allocated address "
+        "family mismatch peer address family\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 443, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
   }
 
-  if(message->lifetime)
+  memcpy(peer_addr, message->peer_addr[0]->turn_attr_address, len);
+  peer_port = ntohs(message->peer_addr[0]->turn_attr_port);
+
+  if(turn_xor_address_cookie(message->peer_addr[0]->turn_attr_family, peer_addr,
+        &peer_port, p, message->msg->turn_msg_id) == -1)
   {
-    lifetime = htonl(message->lifetime->turn_attr_lifetime);
+    return -1;
+  }
 
-    debug(DBG_ATTR, "lifetime: %u seconds\n", lifetime);
+  inet_ntop(family, peer_addr, str, INET6_ADDRSTRLEN);
 
-    /* adjust lifetime (cannot be greater than maximum allowed) */
-    lifetime = SYS_MIN(lifetime, TURN_MAX_ALLOCATION_LIFETIME);
+  /* check if the address is not blacklisted, also check for an IPv6 tunneled
+   * address that can lead to a tunnel amplification attack (see section 9.1 of
+   * RFC6156)
+   */
+  if(turnserver_is_address_denied(peer_addr, len, peer_port) ||
+      turnserver_is_ipv6_tunneled_address(peer_addr, len))
+  {
+    /* permission denied => error 403 */
+    debug(DBG_ATTR,
+        "TurnServer does not permit to create a ChannelBind to %s\n", str);
 
-    /* lifetime cannot be smaller than default */
-    lifetime = SYS_MAX(lifetime, TURN_DEFAULT_ALLOCATION_LIFETIME);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 403, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
   }
-  else
+
+  debug(DBG_ATTR, "Client request a ChannelBinding for %s %u\n", str,
+      peer_port);
+
+  /* check that the transport address is not currently bound to another
+   * channel
+   */
+  channel_use = allocation_desc_find_channel(desc, family, peer_addr,
+      peer_port);
+  if(channel_use && channel_use != channel)
   {
-    /* cannot override default max value for allocation time */
-    lifetime = SYS_MIN(turnserver_cfg_allocation_lifetime(),
-        TURN_MAX_ALLOCATION_LIFETIME);
+    /* transport address already bound to another channel */
+    debug(DBG_ATTR, "Transport address already bound to another channel\n");
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return 0;
   }
 
-  /* RFC6156 */
-  if(message->requested_addr_family)
-  {
-    switch(message->requested_addr_family->turn_attr_family)
-    {
-      case STUN_ATTR_FAMILY_IPV4:
-        family_address = turnserver_cfg_listen_address();
-        break;
-      case STUN_ATTR_FAMILY_IPV6:
-        family_address = turnserver_cfg_listen_addressv6();
-        break;
-      default:
-        family_address = NULL;
-        break;
-    }
+  alloc_channel = allocation_desc_find_channel_number(desc, channel);
 
-    /* check the family requested is supported */
-    if(!family_address)
+  if(alloc_channel)
+  {
+    /* check if same transport address */
+    if(alloc_channel->peer_port != peer_port ||
+        memcmp(alloc_channel->peer_addr, peer_addr, len) != 0)
     {
-      /* family not supported */
+      /* different transport address => error 400 */
+      debug(DBG_ATTR, "Channel already bound to another transport address\n");
       turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 440, saddr, saddr_size, speer,
-          account->key);
-      return -1;
+          message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+          &desc->hmac_key);
+      return 0;
     }
+
+    /* same transport address OK so refresh */
+    allocation_channel_set_timer(alloc_channel, TURN_DEFAULT_CHANNEL_LIFETIME);
   }
   else
   {
-    /* REQUESTED-ADDRESS-FAMILY absent so allocate an IPv4 address */
-    family_address = turnserver_cfg_listen_address();
-
-    if(!family_address)
+    /* allocate new channel */
+    if(allocation_desc_add_channel(desc, channel, TURN_DEFAULT_CHANNEL_LIFETIME,
+          family, peer_addr, peer_port) == -1)
     {
-      /* only happen when IPv4 relaying is disabled and try to allocate IPv6
-       * address without adding REQUESTED-ADDRESS-FAMILY attribute.
-       */
-      /* family not supported */
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 440, saddr, saddr_size, speer,
-          account->key);
       return -1;
     }
   }
 
-  strncpy(str, family_address, INET6_ADDRSTRLEN);
-  str[INET6_ADDRSTRLEN - 1] = 0x00;
-
-  /* after all these checks, allocate an allocation! */
+  /* get string representation of addresses for syslog */
+  if(desc->relayed_addr.ss_family == AF_INET)
+  {
+    inet_ntop(AF_INET, &((struct sockaddr_in*)&desc->relayed_addr)->sin_addr,
+        str3, INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in*)&desc->relayed_addr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6*)&desc->relayed_addr)->sin6_addr,
+        str3, INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in6*)&desc->relayed_addr)->sin6_port);
+  }
 
-  /* allocate the relayed address or skip this if server has a token,
-   * try 5 times to find a free port or couple of free ports.
-   */
-  while(!has_token && (relayed_sock == -1 && quit_loop < 5))
+  if(saddr->sa_family == AF_INET)
   {
-    /* pick up a port (default between 49152 - 65535) */
-    port = (uint16_t) (rand() % (max_port - min_port)) + min_port;
+    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str2,
+        INET6_ADDRSTRLEN);
+    port2 = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str2,
+        INET6_ADDRSTRLEN);
+    port2 = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+  }
 
-    /* allocate a even port */
-    if(message->even_port && (port % 2))
-    {
-      port++;
-    }
+  syslog(LOG_INFO, "ChannelBind transport=%u (d)tls=%u source=%s:%u account=%s "
+      "relayed=%s:%u channel=%s:%u", transport_protocol, desc->relayed_tls ||
+      desc->relayed_dtls, str2, port2, desc->username, str3, port, str,
+      peer_port);
 
-    /* TCP or UDP */
-    /* in case of TCP, allow socket to reuse transport address since we create
-     * another socket that will be bound to the same address
-     */
-    relayed_sock = net_socket_create(
-        message->requested_transport->turn_attr_protocol, str, port,
-        message->requested_transport->turn_attr_protocol == IPPROTO_TCP,
-        message->requested_transport->turn_attr_protocol == IPPROTO_TCP);
+  /* find a permission */
+  alloc_permission = allocation_desc_find_permission(desc, family, peer_addr);
 
-    if(relayed_sock == -1)
-    {
-      quit_loop++;
-      continue;
-    }
+  /* update or create allocation permission on that peer */
+  if(!alloc_permission)
+  {
+    allocation_desc_add_permission(desc, TURN_DEFAULT_PERMISSION_LIFETIME,
+        family, peer_addr);
+  }
+  else
+  {
+    allocation_permission_set_timer(alloc_permission,
+        TURN_DEFAULT_PERMISSION_LIFETIME);
+  }
 
-    if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
-    {
-      /* special handling for TCP relay:
-       * create a second socket bind on the same address/port,
-       * the first one will be used to listen incoming connections,
-       * the second will be used to connect peer (Connect request)
-       */
-      relayed_sock_tcp = net_socket_create(
-          message->requested_transport->turn_attr_protocol, str, port, 1, 1);
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_CHANNELBIND | STUN_SUCCESS_RESP, message->msg->turn_msg_id);
 
-      if(relayed_sock_tcp == -1)
-      {
-        /* system error */
-        char error_str[256];
-        sys_get_error(errno, error_str, sizeof(error_str));
-        syslog(LOG_ERR, "Unable to allocate TCP relay socket: %s", error_str);
-        close(relayed_sock);
-        turnserver_send_error(transport_protocol, sock, method,
-            message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
-            account->key);
-        return -1;
-      }
+  debug(DBG_ATTR,
+      "ChannelBind successful, send success ChannelBind response\n");
 
-      if(listen(relayed_sock, 5) == -1)
-      {
-        /* system error */
-        char error_str[256];
-        sys_get_error(errno, error_str, sizeof(error_str));
-        syslog(LOG_ERR, "Unable to listen on relayed socket: %s", error_str);
-        close(relayed_sock);
-        close(relayed_sock_tcp);
-        turnserver_send_error(transport_protocol, sock, method,
-            message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
-            account->key);
-        return -1;
-      }
-    }
+  /* finally send the response */
+  if(turnserver_send_response(&builder, transport_protocol, sock, saddr,
+        saddr_size, speer, &desc->hmac_key) == -1)
+  {
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &desc->hmac_key);
+    return -1;
+  }
 
-    if(r_flag)
-    {
-      reservation_port = port + 1;
-      reservation_sock = net_socket_create(IPPROTO_UDP, str, reservation_port, 0,
-          0);
+  return 0;
+}
 
-      if(reservation_sock == -1)
-      {
-        close(relayed_sock);
-        relayed_sock = -1;
-      }
-      else
-      {
-        struct allocation_token* token = NULL;
+/**
+ * \brief Find the port allocator of a relay address.
+ * \param family AF_INET or AF_INET6
+ * \param addr binary address (struct in_addr or struct in6_addr)
+ * \return port allocator or NULL if not found
+ */
+static struct relay_ports* turnserver_relay_ports_find(int family,
+    const void* addr)
+{
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+  size_t len = (family == AF_INET6) ? 16 : 4;
 
-        /* store the reservation */
-        crypto_random_bytes_generate(reservation_token, 8);
+  list_head_iterate_safe(&g_relay_ports_list, get, n)
+  {
+    struct relay_ports* tmp = list_head_get(get, struct relay_ports, list);
 
-        token = allocation_token_new(reservation_token, reservation_sock,
-            TURN_DEFAULT_TOKEN_LIFETIME);
-        if(token)
-        {
-          allocation_token_list_add(&g_token_list, token);
-        }
-        else
-        {
-          close(reservation_sock);
-          close(relayed_sock);
-          reservation_sock = -1;
-          relayed_sock = -1;
-        }
-      }
+    if(tmp->family == family && !memcmp(tmp->addr, addr, len))
+    {
+      return tmp;
     }
-
-    quit_loop++;
   }
 
-  if(relayed_sock == -1)
-  {
-    char error_str[256];
-    sys_get_error(errno, error_str, sizeof(error_str));
-    syslog(LOG_ERR, "Unable to allocate socket: %s", error_str);
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, account->key);
-    return -1;
-  }
+  return NULL;
+}
 
-  if(getsockname(relayed_sock, (struct sockaddr*)&relayed_addr, &relayed_size)
-      != 0)
-  {
-    char error_str[256];
-    sys_get_error(errno, error_str, sizeof(error_str));
-    syslog(LOG_ERR, "Error in getsockname: %s", error_str);
-    close(relayed_sock);
-    return -1;
-  }
+/**
+ * \brief Get the port allocator of a relay address, create it if needed.
+ *
+ * With several workers, the configured port range is split so that each
+ * worker has its own ports and never tries to bind a port used by another.
+ * \param str relay address
+ * \return port allocator or NULL if error
+ */
+static struct relay_ports* turnserver_relay_ports_get(const char* str)
+{
+  struct relay_ports* ret = NULL;
+  uint8_t addr[16];
+  int family = strchr(str, ':') ? AF_INET6 : AF_INET;
+  size_t workers = turnserver_cfg_workers();
+  uint16_t min_port = turnserver_cfg_min_port();
+  uint16_t max_port = turnserver_cfg_max_port();
+  size_t slice = 0;
 
-  if(relayed_addr.ss_family == AF_INET)
+  if(inet_pton(family, str, addr) != 1)
   {
-    port = ntohs(((struct sockaddr_in*)&relayed_addr)->sin_port);
+    return NULL;
   }
-  else /* IPv6 */
+
+  if((ret = turnserver_relay_ports_find(family, addr)))
   {
-    port = ntohs(((struct sockaddr_in6*)&relayed_addr)->sin6_port);
+    return ret;
   }
 
-  desc = allocation_desc_new(message->msg->turn_msg_id, transport_protocol,
-      account->username, account->key, account->realm,
-      message->nonce->turn_attr_nonce, (struct sockaddr*)&relayed_addr, daddr,
-      saddr, sizeof(struct sockaddr_storage), lifetime);
-
-  if(!desc)
+  /* slices start on ports of the same parity so pairs are not split */
+  slice = ((size_t)max_port - min_port + 1) / (workers ? workers : 1);
+  slice &= ~(size_t)1;
+  if(workers > 1 && slice >= 2)
   {
-    /* send error response with code 500 */
-    turnserver_send_error(transport_protocol, sock, method,
-        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, account->key);
-    close(relayed_sock);
-    return -1;
+    min_port = (uint16_t)(min_port + g_worker_index * slice);
+    if(g_worker_index + 1 < workers)
+    {
+      max_port = (uint16_t)(min_port + slice - 1);
+    }
   }
 
-  /* init token bucket */
-  if(account->state == AUTHORIZED)
+  ret = malloc(sizeof(struct relay_ports));
+  if(!ret)
   {
-    /* store it in bytes */
-    desc->bucket_capacity = turnserver_cfg_bandwidth_per_allocation() * 1000;
+    return NULL;
   }
-  else
+
+  if(port_alloc_init(&ret->ports, min_port, max_port) == -1)
   {
-    /* store it in bytes */
-    desc->bucket_capacity = turnserver_cfg_restricted_bandwidth() * 1000;
+    free(ret);
+    return NULL;
   }
 
-  desc->bucket_tokenup = desc->bucket_capacity;
-  desc->bucket_tokendown = desc->bucket_capacity;
+  ret->family = family;
+  memcpy(ret->addr, addr, sizeof(addr));
+  strncpy(ret->str, str, sizeof(ret->str));
+  ret->str[sizeof(ret->str) - 1] = 0x00;
+  list_head_add_tail(&g_relay_ports_list, &ret->list);
 
-  desc->relayed_transport_protocol =
-    message->requested_transport->turn_attr_protocol;
+  debug(DBG_ATTR, "Relayed ports for %s: %u-%u\n", ret->str,
+      (unsigned int)min_port, (unsigned int)max_port);
+  return ret;
+}
 
-  /* increment number of allocations */
-  account->allocations++;
-  debug(DBG_ATTR, "Account %s, allocations used: %u\n", account->username,
-      account->allocations);
-  syslog(LOG_INFO, "Account %s, allocations used: %zu", account->username,
-      account->allocations);
+/**
+ * \brief Release the port of a relayed transport address.
+ * \param addr relayed transport address
+ */
+static void turnserver_relay_port_release(const struct sockaddr* addr)
+{
+  struct relay_ports* ports = NULL;
 
-  if(speer)
+  if(addr->sa_family == AF_INET)
   {
-    if(desc->tuple.transport_protocol == IPPROTO_TCP)
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+
+    ports = turnserver_relay_ports_find(AF_INET, &addr4->sin_addr);
+    if(ports)
     {
-      desc->relayed_tls = 1;
+      port_alloc_release(&ports->ports, ntohs(addr4->sin_port));
     }
-    else /* UDP */
+  }
+  else if(addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+
+    ports = turnserver_relay_ports_find(AF_INET6, &addr6->sin6_addr);
+    if(ports)
     {
-      desc->relayed_dtls = 1;
+      port_alloc_release(&ports->ports, ntohs(addr6->sin6_port));
     }
   }
+}
 
-  syslog(LOG_INFO, "Allocation transport=%u (d)tls=%u source=%s:%u account=%s "
-      "relayed=%s:%u", transport_protocol, desc->relayed_tls ||
-      desc->relayed_dtls, str2, port2, account->username, str, port);
-
-  /* assign the sockets to the allocation */
-  desc->relayed_sock = relayed_sock;
+/**
+ * \brief Release the port reserved by a token.
+ * \param token allocation token
+ */
+static void turnserver_token_port_release(struct allocation_token* token)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_size = sizeof(addr);
 
-  if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
+  if(token->sock > 0 &&
+     getsockname(token->sock, (struct sockaddr*)&addr, &addr_size) == 0)
   {
-    desc->relayed_sock_tcp = relayed_sock_tcp;
+    turnserver_relay_port_release((struct sockaddr*)&addr);
   }
+}
 
-  desc->tuple_sock = sock;
-
-  /* add to the list */
-  allocation_list_add(allocation_list, desc);
+/**
+ * \brief Free the port allocators.
+ */
+static void turnserver_relay_ports_cleanup(void)
+{
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
 
-  /* send back the success response */
-send_success_response:
+  list_head_iterate_safe(&g_relay_ports_list, get, n)
   {
-    /* header, relayed-address, lifetime, reservation-token (if any),
-     * xor-mapped-address, username, software, message-integrity, fingerprint
-     */
-    struct iovec iov[12];
-    struct turn_msg_hdr* hdr = NULL;
-    struct turn_attr_hdr* attr = NULL;
-    size_t idx = 0;
+    struct relay_ports* tmp = list_head_get(get, struct relay_ports, list);
 
-    if(!(hdr = turn_msg_allocate_response_create(0, message->msg->turn_msg_id,
-            &iov[idx])))
-    {
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
-    idx++;
+    list_head_remove(&g_relay_ports_list, &tmp->list);
+    port_alloc_destroy(&tmp->ports);
+    free(tmp);
+  }
+}
 
-    /* required attributes */
-    if(!(attr = turn_attr_xor_relayed_address_create(
-            (struct sockaddr*)&relayed_addr, STUN_MAGIC_COOKIE,
-            message->msg->turn_msg_id, &iov[idx])))
-    {
-      net_iovec_free_data(iov, idx);
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+/**
+ * \brief Process a TURN Refresh request.
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param message TURN message
+ * \param saddr source address of the message
+ * \param saddr_size sizeof addr
+ * \param allocation_list list of allocations
+ * \param desc allocation descriptor
+ * \param account account descriptor
+ * \param speer TLS peer, if not NULL the connection is in TLS so response is
+ * also in TLS
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_process_refresh_request(int transport_protocol, int sock,
+    const struct turn_message* message, const struct sockaddr* saddr,
+    socklen_t saddr_size, struct list_head* allocation_list,
+    struct allocation_desc* desc, struct account_desc* account,
+    struct tls_peer* speer)
+{
+  uint16_t hdr_msg_type = htons(message->msg->turn_msg_type);
+  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
+  uint32_t lifetime = 0;
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  struct crypto_hmac_sha1_key key;
+  char str[INET6_ADDRSTRLEN];
+  uint16_t port = 0;
 
-    if(!(attr = turn_attr_lifetime_create(lifetime, &iov[idx])))
-    {
-      net_iovec_free_data(iov, idx);
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500,saddr, saddr_size, speer, desc->key);
-      return -1;
-    }
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+  debug(DBG_ATTR, "Refresh request received!\n");
 
-    switch(saddr->sa_family)
+  /* save key from allocation as it could be freed if lifetime equals 0 */
+  key = desc->hmac_key;
+
+  /* RFC6156: at this stage server knows the 5-tuple and the allocation
+   * associated.
+   * No matter to know if the relayed address has a different address family
+   * than 5-tuple, so no need to have REQUESTED-ADDRESS-FAMILY attribute in
+   * Refresh request.
+   */
+
+  /* if REQUESTED-ADDRESS-FAMILY attribute is present and do not match relayed
+   * address ones => error 443
+   */
+  if(message->requested_addr_family)
+  {
+    int family = 0;
+
+    switch(message->requested_addr_family->turn_attr_family)
     {
-      case AF_INET:
-        port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+      case STUN_ATTR_FAMILY_IPV4:
+        family = AF_INET;
         break;
-      case AF_INET6:
-        port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+      case STUN_ATTR_FAMILY_IPV6:
+        family = AF_INET6;
         break;
       default:
-        net_iovec_free_data(iov, idx);
         return -1;
-        break;
     }
 
-    if(!(attr = turn_attr_xor_mapped_address_create(saddr, STUN_MAGIC_COOKIE,
-            message->msg->turn_msg_id, &iov[idx])))
+    if(desc->relayed_addr.ss_family != family)
     {
-      net_iovec_free_data(iov, idx);
+      /* peer family mismatch => error 443 */
+      debug(DBG_ATTR, "Peer family mismatch\n");
       turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
+          message->msg->turn_msg_id, 443, saddr, saddr_size, speer, &key);
       return -1;
     }
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+  }
 
-    if(reservation_port)
+  if(message->lifetime)
+  {
+    lifetime = htonl(message->lifetime->turn_attr_lifetime);
+
+    debug(DBG_ATTR, "lifetime: %u seconds\n", lifetime);
+
+    /* adjust lifetime (cannot be greater that maximum allowed) */
+    lifetime = SYS_MIN(lifetime, TURN_MAX_ALLOCATION_LIFETIME);
+
+    if(lifetime > 0)
     {
-      /* server has stored a socket/port */
-      debug(DBG_ATTR, "Send a reservation-token attribute\n");
-      if(!(attr = turn_attr_reservation_token_create(reservation_token,
-              &iov[idx])))
-      {
-        net_iovec_free_data(iov, idx);
-        turnserver_send_error(transport_protocol, sock, method,
-            message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
-            desc->key);
-        return -1;
-      }
-      hdr->turn_msg_len += iov[idx].iov_len;
-      idx++;
+      /* lifetime cannot be smaller than default */
+      lifetime = SYS_MAX(lifetime, TURN_DEFAULT_ALLOCATION_LIFETIME);
+    }
+  }
+  else
+  {
+    /* cannot override default max value for allocation time */
+    lifetime = SYS_MIN(turnserver_cfg_allocation_lifetime(),
+        TURN_DEFAULT_ALLOCATION_LIFETIME);
+  }
+
+  if(saddr->sa_family == AF_INET)
+  {
+    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str,
+        INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str,
+        INET6_ADDRSTRLEN);
+    port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+  }
+
+  syslog(LOG_INFO, "Refresh transport=%u (d)tls=%u source=%s:%u account=%s",
+      transport_protocol, desc->relayed_tls || desc->relayed_dtls, str, port,
+      desc->username);
+
+  if(lifetime > 0)
+  {
+    /* adjust lifetime */
+    debug(DBG_ATTR, "Refresh allocation\n");
+    allocation_desc_set_timer(desc, lifetime);
+  }
+  else
+  {
+    /* lifetime = 0 delete the allocation */
+    allocation_desc_set_timer(desc, 0); /* stop timeout */
+    /* in case the allocation has already expired */
+    list_head_remove(&desc->list2, &desc->list2);
+
+    /* datagrams waiting to be sent may use the relayed socket */
+    turnserver_udp_flush();
+
+    turnserver_event_del_allocation(desc);
+    turnserver_relay_port_release((struct sockaddr*)&desc->relayed_addr);
+    allocation_list_remove(allocation_list, desc);
+
+    /* decrement allocations for the account */
+    account->allocations--;
+    debug(DBG_ATTR, "Account %s, allocations used: %u\n", account->username,
+        account->allocations);
+    debug(DBG_ATTR, "Explicit delete of allocation\n");
+    if(account->allocations == 0 && account->is_tmp)
+    {
+      account_list_remove(NULL, account);
     }
+  }
+
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_REFRESH | STUN_SUCCESS_RESP, message->msg->turn_msg_id);
+
+  if(turn_msg_builder_add_lifetime(&builder, lifetime) == -1)
+  {
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, &key);
+    return -1;
+  }
+
+  debug(DBG_ATTR, "Refresh successful, send success refresh response\n");
+
+  /* finally send the response */
+  if(turnserver_send_response(&builder, transport_protocol, sock, saddr,
+        saddr_size, speer, &key) == -1)
+  {
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer, &key);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Choose an address in the pool of relay addresses.
+ *
+ * With the "least_loaded" policy, the address with the most free ports is
+ * chosen. With the "hash" policy, the address depends on the client address
+ * so the allocations of a client share the same one, the next addresses are
+ * tried if it has no free port.
+ * \param family AF_INET or AF_INET6
+ * \param saddr source address of the Allocate request
+ * \return address or NULL if the pool of the family is empty
+ */
+static char* turnserver_relay_address_pool(int family,
+    const struct sockaddr* saddr)
+{
+  size_t nb = turnserver_cfg_relay_address_nb(family);
+  int hash = !strcmp(turnserver_cfg_relay_address_policy(), "hash");
+  size_t start = 0;
+  size_t best = 0;
+  size_t i = 0;
+  char* ret = NULL;
+
+  if(nb == 0)
+  {
+    return NULL;
+  }
+
+  if(hash && saddr->sa_family == AF_INET)
+  {
+    start = hash_bytes(&((const struct sockaddr_in*)saddr)->sin_addr,
+        sizeof(struct in_addr), 0) % nb;
+  }
+  else if(hash && saddr->sa_family == AF_INET6)
+  {
+    start = hash_bytes(&((const struct sockaddr_in6*)saddr)->sin6_addr,
+        sizeof(struct in6_addr), 0) % nb;
+  }
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    char* str = turnserver_cfg_relay_address(family, (start + i) % nb);
+    struct relay_ports* ports = turnserver_relay_ports_get(str);
+    size_t available = ports ? port_alloc_available(&ports->ports) : 0;
 
-    /* software (not fatal if it cannot be allocated) */
-    if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-            sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+    if(!ret || available > best)
     {
-      hdr->turn_msg_len += iov[idx].iov_len;
-      idx++;
+      ret = str;
+      best = available;
     }
 
-    if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-        == -1)
+    if(hash && available)
     {
-      net_iovec_free_data(iov, idx);
-      turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 500, saddr, saddr_size, speer, desc->key);
-      return -1;
+      /* first address with a free port */
+      break;
     }
+  }
 
-    debug(DBG_ATTR, "Allocation successful, send success allocate response\n");
+  return ret;
+}
 
-    if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-          ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-        == -1)
+/**
+ * \brief Choose the address of a new relayed transport address.
+ *
+ * If relay addresses are configured for the family, the address is taken
+ * from them. Otherwise if the client has contacted the server on one of the
+ * configured listen addresses of the family, the same address is used, or
+ * one is chosen at random.
+ * \param family AF_INET or AF_INET6
+ * \param daddr destination address of the Allocate request
+ * \param saddr source address of the Allocate request
+ * \return address or NULL if the family is not relayed
+ */
+static char* turnserver_relay_address(int family, const struct sockaddr* daddr,
+    const struct sockaddr* saddr)
+{
+  const void* addr = NULL;
+  char* ret = NULL;
+
+  if((ret = turnserver_relay_address_pool(family, saddr)))
+  {
+    return ret;
+  }
+
+  if(daddr->sa_family == AF_INET && family == AF_INET)
+  {
+    addr = &((const struct sockaddr_in*)daddr)->sin_addr;
+  }
+  else if(daddr->sa_family == AF_INET6)
+  {
+    const struct in6_addr* addr6 =
+      &((const struct sockaddr_in6*)daddr)->sin6_addr;
+
+    if(!IN6_IS_ADDR_V4MAPPED(addr6))
     {
-      debug(DBG_ATTR, "turn_send_message failed\n");
+      addr = (family == AF_INET6) ? addr6 : NULL;
+    }
+    else if(family == AF_INET)
+    {
+      addr = &addr6->s6_addr[12];
     }
+  }
 
-    net_iovec_free_data(iov, idx);
+  if(addr && (ret = turnserver_cfg_listen_address_lookup(family, addr)))
+  {
+    return ret;
   }
 
-  return 0;
+  return (family == AF_INET6) ? turnserver_cfg_listen_addressv6() :
+    turnserver_cfg_listen_address();
 }
 
 /**
- * \brief Process a TURN request.
+ * \brief Process a TURN Allocate request.
  * \param transport_protocol transport protocol used
  * \param sock socket
  * \param message TURN message
@@ -2924,2017 +3393,3687 @@ send_success_response:
  * \param daddr destination address of the message
  * \param saddr_size sizeof addr
  * \param allocation_list list of allocations
- * \param account account descriptor (may be NULL)
+ * \param account account descriptor
  * \param speer TLS peer, if not NULL the connection is in TLS so response is
  * also in TLS
  * \return 0 if success, -1 otherwise
  */
-static int turnserver_process_turn(int transport_protocol, int sock,
+static int turnserver_process_allocate_request(int transport_protocol, int sock,
     const struct turn_message* message, const struct sockaddr* saddr,
     const struct sockaddr* daddr, socklen_t saddr_size,
     struct list_head* allocation_list, struct account_desc* account,
     struct tls_peer* speer)
 {
-  uint16_t hdr_msg_type = 0;
-  uint16_t method = 0;
   struct allocation_desc* desc = NULL;
+  uint16_t hdr_msg_type = ntohs(message->msg->turn_msg_type);
+  uint16_t method = STUN_GET_METHOD(hdr_msg_type);
+  struct sockaddr_storage relayed_addr;
+  int r_flag = 0;
+  uint32_t lifetime = 0;
+  uint32_t rate = 0;
+  uint16_t port = 0;
+  uint16_t reservation_port = 0;
+  int relayed_sock = -1;
+  int relayed_sock_tcp = -1; /* RFC6062 (TURN-TCP) */
+  int reservation_sock = -1;
+  socklen_t relayed_size = sizeof(struct sockaddr_storage);
+  size_t quit_loop = 0;
+  uint8_t reservation_token[8];
+  char str[INET6_ADDRSTRLEN];
+  char str2[INET6_ADDRSTRLEN];
+  uint16_t port2 = 0;
+  int has_token = 0;
+  char* family_address = NULL;
+  struct relay_ports* ports = NULL;
+  uint16_t tried[5];
+  size_t i = 0;
 
-  debug(DBG_ATTR, "Process a TURN message\n");
-
-  hdr_msg_type = ntohs(message->msg->turn_msg_type);
-  method = STUN_GET_METHOD(hdr_msg_type);
+  debug(DBG_ATTR, "Allocate request received!\n");
 
-  /* process STUN binding request */
-  if(STUN_IS_REQUEST(hdr_msg_type) && method == STUN_METHOD_BINDING)
-  {
-    return turnserver_process_binding_request(transport_protocol, sock, message,
-        saddr, saddr_size, speer);
-  }
+  /* check if it was a valid allocation */
+  desc = allocation_list_find_tuple(allocation_list, transport_protocol, daddr,
+      saddr, saddr_size);
 
-  /* RFC6062 (TURN-TCP) */
-  /* find right tuple for a TCP allocation (ConnectionBind case) */
-  if(STUN_IS_REQUEST(hdr_msg_type) && method == TURN_METHOD_CONNECTIONBIND)
+  if(desc)
   {
-    /* ConnectionBind is only for TCP or TLS over TCP <-> TCP */
-    if(transport_protocol == IPPROTO_TCP)
-    {
-      return turnserver_process_connectionbind_request(transport_protocol, sock,
-          message, saddr, saddr_size, speer, account, allocation_list);
-    }
-    else
+    if(transport_protocol == IPPROTO_UDP && !memcmp(message->msg->turn_msg_id,
+          desc->transaction_id, 12))
     {
-      return turnserver_send_error(transport_protocol, sock, method,
-          message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
-          account->key);
-    }
+      /* the request is a retransmission of a valid request, rebuild the
+       * response
+       */
+
+      /* get some states */
+      lifetime = allocation_desc_get_timer(desc);
+      memcpy(&relayed_addr, &desc->relayed_addr,
+          sizeof(struct sockaddr_storage));
+
+      /* goto is bad... */
+      goto send_success_response;
+    }
+    else
+    {
+      /* allocation mismatch => error 437 */
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 437, saddr, saddr_size, speer,
+          &desc->hmac_key);
+    }
+
+    return 0;
   }
 
-  /* check the 5-tuple except for an Allocate request */
-  if(method != TURN_METHOD_ALLOCATE)
+  /* get string representation of address for syslog */
+  if(saddr->sa_family == AF_INET)
   {
-    desc = allocation_list_find_tuple(allocation_list, transport_protocol,
-        daddr, saddr, saddr_size);
+    inet_ntop(AF_INET, &((struct sockaddr_in*)saddr)->sin_addr, str2,
+        INET6_ADDRSTRLEN);
+    port2 = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    inet_ntop(AF_INET6, &((struct sockaddr_in6*)saddr)->sin6_addr, str2,
+        INET6_ADDRSTRLEN);
+    port2 = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
 
-    if(STUN_IS_REQUEST(hdr_msg_type))
+    /* Do not accept allocation request from IPv6 tunneled address,
+     * see section 9.1 of RC6156
+     */
+    if(turnserver_is_ipv6_tunneled_address(
+          ((struct sockaddr_in6*)saddr)->sin6_addr.s6_addr, 16))
     {
-      /* check for the allocated username */
-      if(desc && message->username && message->realm)
-      {
-        size_t len = ntohs(message->username->turn_attr_len);
-        size_t rlen = ntohs(message->realm->turn_attr_len);
-        if(len != strlen(desc->username) ||
-           strncmp((char*)message->username->turn_attr_username,
-             desc->username, len) ||
-           rlen != strlen(desc->realm) ||
-           strncmp((char*)message->realm->turn_attr_realm, desc->realm, rlen))
-        {
-          desc = NULL;
-        }
-      }
-      else
-      {
-        desc = NULL;
-      }
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 403, saddr, saddr_size, speer,
+          &account->hmac_key);
     }
+  }
 
-    if(!desc)
-    {
-      /* reject with error 437 if it a request, ignored otherwise */
-      /* the refresh function will handle this case */
-      if(STUN_IS_REQUEST(hdr_msg_type))
-      {
-        /* allocation mismatch => error 437 */
-        turnserver_send_error(transport_protocol, sock, method,
-            message->msg->turn_msg_id, 437, saddr, saddr_size, speer,
-            account->key);
-        return 0;
-      }
+  /* check for allocation quota */
+  if(account->allocations >= turnserver_cfg_max_relay_per_username())
+  {
+    /* quota exceeded => error 486 */
+    syslog(LOG_WARNING, "Allocation transport=%u (d)tls=%u source=%s:%u account=%s"
+        " quota exceeded", transport_protocol, speer ? 1 : 0, str2, port2,
+        account->username);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 486, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
+  }
 
-      debug(DBG_ATTR, "No valid 5-tuple match\n");
+  /* check for server capacity */
+  if(allocation_pool_get(ALLOCATION_POOL_DESC)->used >=
+      turnserver_max_allocations())
+  {
+    /* max_client reached => error 508 */
+    syslog(LOG_WARNING, "Allocation transport=%u (d)tls=%u source=%s:%u "
+        "account=%s max_client reached", transport_protocol, speer ? 1 : 0,
+        str2, port2, account->username);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
+  }
+
+  /* check requested-transport */
+  if(!message->requested_transport)
+  {
+    /* bad request => error 400 */
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return 0;
+  }
+
+  /* check if DONT-FRAGMENT attribute is supported */
+#ifndef OS_SET_DF_SUPPORT
+  if(message->dont_fragment)
+  {
+    /* error-code, unknown-attributes, software, message-integrity,
+     * fingerprint
+     */
+    uint8_t buf[TURN_MSG_BUILDER_SIZE];
+    struct turn_msg_builder builder;
+    uint16_t unknown[2];
+
+    /* send error 420 */
+    unknown[0] = TURN_ATTR_DONT_FRAGMENT;
+
+    turn_msg_builder_init(&builder, buf, sizeof(buf), method | STUN_ERROR_RESP,
+        message->msg->turn_msg_id);
+
+    if(turn_msg_builder_add_error(&builder, 420, STUN_ERROR_420,
+          sizeof(STUN_ERROR_420)) == -1 ||
+       turn_msg_builder_add_unknown_attributes(&builder, unknown, 1) == -1 ||
+       turnserver_send_response(&builder, transport_protocol, sock, saddr,
+         saddr_size, speer, &desc->hmac_key) == -1)
+    {
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+          &account->hmac_key);
       return -1;
     }
 
-    /* update allocation nonce */
-    if(message->nonce)
+    return 0;
+  }
+#endif
+
+  /* check if server supports requested transport */
+  if(message->requested_transport->turn_attr_protocol != IPPROTO_UDP &&
+     (message->requested_transport->turn_attr_protocol != IPPROTO_TCP ||
+      !turnserver_cfg_turn_tcp()))
+  {
+    /* unsupported transport protocol => error 442 */
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 442, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return 0;
+  }
+
+  if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
+  {
+    /* RFC6062 (TURN-TCP):
+     * - do not permit to allocate TCP relay with an
+     * UDP-based connection
+     * - requests do not contains DONT-FRAGMENT,
+     * RESERVATION-TOKEN or EVEN-PORT.
+     * => error 400
+     */
+    if(transport_protocol == IPPROTO_UDP || message->dont_fragment ||
+        message->reservation_token || message->even_port)
     {
-      memcpy(desc->nonce, message->nonce->turn_attr_nonce, 24);
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return 0;
     }
   }
 
-  if(STUN_IS_REQUEST(hdr_msg_type))
+  if(message->even_port && message->reservation_token)
   {
-    if(method != TURN_METHOD_ALLOCATE)
+    /* cannot have both EVEN-PORT and RESERVATION-TOKEN => error 400 */
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return 0;
+  }
+
+  if(message->requested_addr_family && message->reservation_token)
+  {
+    /* RFC6156: cannot have both REQUESTED-ADDRESS-FAMILY and RESERVATION-TOKEN
+     * => error 400
+     */
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return 0;
+  }
+
+  /* check reservation-token */
+  if(message->reservation_token)
+  {
+    struct allocation_token* token = NULL;
+
+    /* check if the requested reservation-token exists */
+    if((token = allocation_token_list_find(&g_token_list,
+            message->reservation_token->turn_attr_token)))
     {
-      /* check to prevent hijacking the client's allocation */
-      size_t len = strlen(account->username);
-      size_t rlen = strlen(account->realm);
-      if(len != ntohs(message->username->turn_attr_len) ||
-         strncmp((char*)message->username->turn_attr_username,
-           account->username, len) ||
-         rlen != ntohs(message->realm->turn_attr_len) ||
-         strncmp((char*)message->realm->turn_attr_realm, account->realm, rlen))
-      {
-        /* credentials do not match with those used for allocation
-         * => error 441
-         */
-        debug(DBG_ATTR, "Wrong credentials!\n");
-        turnserver_send_error(transport_protocol, sock, method,
-            message->msg->turn_msg_id, 441, saddr, saddr_size, speer,
-            account->key);
-        return 0;
-      }
-    }
+      relayed_sock = token->sock;
+      has_token = 1;
 
-    switch(method)
+      /* suppress from the list */
+      allocation_token_set_timer(token, 0); /* stop timer */
+      list_head_remove(&token->list2, &token->list2);
+
+      allocation_token_list_remove(&g_token_list, token);
+      debug(DBG_ATTR, "Take token reserved address!\n");
+    }
+    else
     {
-      case TURN_METHOD_ALLOCATE:
-        turnserver_process_allocate_request(transport_protocol, sock, message,
-            saddr, daddr, saddr_size, allocation_list, account, speer);
-        break;
-      case TURN_METHOD_REFRESH:
-        turnserver_process_refresh_request(transport_protocol, sock, message,
-            saddr, saddr_size, allocation_list, desc, account, speer);
-        break;
-      case TURN_METHOD_CREATEPERMISSION:
-        turnserver_process_createpermission_request(transport_protocol, sock,
-            message, saddr, saddr_size, desc, speer);
-        break;
-      case TURN_METHOD_CHANNELBIND:
-        /* ChannelBind is only for UDP relay */
-        if(desc->relayed_transport_protocol == IPPROTO_UDP)
-        {
-          turnserver_process_channelbind_request(transport_protocol, sock,
-              message, saddr, saddr_size, desc, speer);
-        }
-        else
-        {
-          turnserver_send_error(transport_protocol, sock, method,
-              message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
-              desc->key);
-        }
-        break;
-      case TURN_METHOD_CONNECT: /* RFC6062 (TURN-TCP) */
-        /* Connect is only for TCP or TLS over TCP <-> TCP */
-        if(transport_protocol == IPPROTO_TCP &&
-            desc->relayed_transport_protocol == IPPROTO_TCP)
-        {
-          turnserver_process_connect_request(transport_protocol, sock, message,
-              saddr, saddr_size, desc, speer);
-        }
-        else
-        {
-          turnserver_send_error(transport_protocol, sock, method,
-              message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
-              desc->key);
-        }
-        break;
-      default:
-        return -1;
-        break;
+      /* token does not exists so token not valid => error 508 */
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return 0;
     }
   }
-  else if(STUN_IS_SUCCESS_RESP(hdr_msg_type) ||
-      STUN_IS_ERROR_RESP(hdr_msg_type))
-  {
-    /* should not happen */
-  }
-  else if(STUN_IS_INDICATION(hdr_msg_type))
+
+  if(message->even_port)
   {
-    switch(method)
+    r_flag = message->even_port->turn_attr_flags & 0x80;
+
+    /* check if there are unknown other flags */
+    if(message->even_port->turn_attr_flags & (~g_supported_even_port_flags))
     {
-      case TURN_METHOD_SEND:
-        if(desc->relayed_transport_protocol == IPPROTO_UDP)
+      /* unsupported flags => error 508 */
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return 0;
+    }
+  }
+
+  if(message->lifetime)
+  {
+    lifetime = htonl(message->lifetime->turn_attr_lifetime);
+
+    debug(DBG_ATTR, "lifetime: %u seconds\n", lifetime);
+
+    /* adjust lifetime (cannot be greater than maximum allowed) */
+    lifetime = SYS_MIN(lifetime, TURN_MAX_ALLOCATION_LIFETIME);
+
+    /* lifetime cannot be smaller than default */
+    lifetime = SYS_MAX(lifetime, TURN_DEFAULT_ALLOCATION_LIFETIME);
+  }
+  else
+  {
+    /* cannot override default max value for allocation time */
+    lifetime = SYS_MIN(turnserver_cfg_allocation_lifetime(),
+        TURN_MAX_ALLOCATION_LIFETIME);
+  }
+
+  /* RFC6156 */
+  if(message->requested_addr_family)
+  {
+    switch(message->requested_addr_family->turn_attr_family)
+    {
+      case STUN_ATTR_FAMILY_IPV4:
+        family_address = turnserver_relay_address(AF_INET, daddr, saddr);
+        break;
+      case STUN_ATTR_FAMILY_IPV6:
+        family_address = turnserver_relay_address(AF_INET6, daddr, saddr);
+        break;
+      default:
+        family_address = NULL;
+        break;
+    }
+
+    /* check the family requested is supported */
+    if(!family_address)
+    {
+      /* family not supported */
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 440, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return -1;
+    }
+  }
+  else
+  {
+    /* REQUESTED-ADDRESS-FAMILY absent so allocate an IPv4 address */
+    family_address = turnserver_relay_address(AF_INET, daddr, saddr);
+
+    if(!family_address)
+    {
+      /* only happen when IPv4 relaying is disabled and try to allocate IPv6
+       * address without adding REQUESTED-ADDRESS-FAMILY attribute.
+       */
+      /* family not supported */
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 440, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return -1;
+    }
+  }
+
+  strncpy(str, family_address, INET6_ADDRSTRLEN);
+  str[INET6_ADDRSTRLEN - 1] = 0x00;
+
+  /* after all these checks, allocate an allocation! */
+
+  /* allocate the relayed address or skip this if server has a token,
+   * free ports (or couple of ports) are taken from the bitmap of the relay
+   * address so an exhausted range is detected before any system call. Try 5
+   * times in case the port is used by another program, the ports tried are
+   * kept until the end of the loop so they are not picked again.
+   */
+  if(!has_token)
+  {
+    int flags = r_flag ? PORT_ALLOC_PAIR :
+      (message->even_port ? PORT_ALLOC_EVEN : 0);
+
+    ports = turnserver_relay_ports_get(str);
+
+    while(ports && relayed_sock == -1 && quit_loop < 5)
+    {
+      port = port_alloc_get(&ports->ports, flags);
+
+      if(!port)
+      {
+        /* no more free port (or couple of ports) */
+        break;
+      }
+
+      tried[quit_loop] = port;
+      quit_loop++;
+
+      /* TCP or UDP */
+      /* in case of TCP, allow socket to reuse transport address since we
+       * create another socket that will be bound to the same address
+       */
+      relayed_sock = net_socket_create(
+          message->requested_transport->turn_attr_protocol, str, port,
+          message->requested_transport->turn_attr_protocol == IPPROTO_TCP,
+          message->requested_transport->turn_attr_protocol == IPPROTO_TCP);
+
+      if(relayed_sock == -1)
+      {
+        continue;
+      }
+
+      if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
+      {
+        /* special handling for TCP relay:
+         * create a second socket bind on the same address/port,
+         * the first one will be used to listen incoming connections,
+         * the second will be used to connect peer (Connect request)
+         */
+        relayed_sock_tcp = net_socket_create(
+            message->requested_transport->turn_attr_protocol, str, port, 1,
+            1);
+
+        if(relayed_sock_tcp == -1 || listen(relayed_sock, 5) == -1)
+        {
+          /* system error */
+          char error_str[256];
+          sys_get_error(errno, error_str, sizeof(error_str));
+          syslog(LOG_ERR, "Unable to allocate TCP relay socket: %s",
+              error_str);
+          close(relayed_sock);
+          if(relayed_sock_tcp != -1)
+          {
+            close(relayed_sock_tcp);
+          }
+          relayed_sock = -1;
+          break;
+        }
+      }
+
+      if(r_flag)
+      {
+        reservation_port = port + 1;
+        reservation_sock = net_socket_create(IPPROTO_UDP, str,
+            reservation_port, 0, 0);
+
+        if(reservation_sock == -1)
+        {
+          close(relayed_sock);
+          relayed_sock = -1;
+          reservation_port = 0;
+        }
+        else
+        {
+          struct allocation_token* token = NULL;
+
+          /* store the reservation */
+          crypto_random_bytes_generate(reservation_token, 8);
+
+          token = allocation_token_new(reservation_token, reservation_sock,
+              TURN_DEFAULT_TOKEN_LIFETIME);
+          if(token)
+          {
+            allocation_token_list_add(&g_token_list, token);
+          }
+          else
+          {
+            close(reservation_sock);
+            close(relayed_sock);
+            reservation_sock = -1;
+            relayed_sock = -1;
+            reservation_port = 0;
+          }
+        }
+      }
+    }
+
+    /* give back the ports that have not been used */
+    for(i = 0 ; i < quit_loop ; i++)
+    {
+      if(relayed_sock != -1 && i + 1 == quit_loop)
+      {
+        /* the last one is now used by the allocation (and the token) */
+        break;
+      }
+
+      port_alloc_release(&ports->ports, tried[i]);
+      if(r_flag)
+      {
+        port_alloc_release(&ports->ports, tried[i] + 1);
+      }
+    }
+
+    if(ports && relayed_sock == -1 && quit_loop == 0)
+    {
+      /* relayed ports exhausted, error 508 */
+      debug(DBG_ATTR, "No free relayed port on %s\n", str);
+      syslog(LOG_WARNING, "No free relayed port on %s", str);
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 508, saddr, saddr_size, speer,
+          &account->hmac_key);
+      return -1;
+    }
+  }
+
+  if(relayed_sock == -1)
+  {
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    syslog(LOG_ERR, "Unable to allocate socket: %s", error_str);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
+  }
+
+  if(getsockname(relayed_sock, (struct sockaddr*)&relayed_addr, &relayed_size)
+      != 0)
+  {
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    syslog(LOG_ERR, "Error in getsockname: %s", error_str);
+    close(relayed_sock);
+    if(ports)
+    {
+      port_alloc_release(&ports->ports, port);
+    }
+    return -1;
+  }
+
+  if(relayed_addr.ss_family == AF_INET)
+  {
+    port = ntohs(((struct sockaddr_in*)&relayed_addr)->sin_port);
+  }
+  else /* IPv6 */
+  {
+    port = ntohs(((struct sockaddr_in6*)&relayed_addr)->sin6_port);
+  }
+
+  desc = allocation_desc_new(message->msg->turn_msg_id, transport_protocol,
+      account->username, account->key, account->realm,
+      message->nonce->turn_attr_nonce, (struct sockaddr*)&relayed_addr, daddr,
+      saddr, sizeof(struct sockaddr_storage), lifetime);
+
+  if(!desc)
+  {
+    /* send error response with code 500 */
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &account->hmac_key);
+    close(relayed_sock);
+    turnserver_relay_port_release((struct sockaddr*)&relayed_addr);
+    return -1;
+  }
+
+  /* init token buckets (in bytes), the limit of the account is shared by
+   * its allocations and the one of the server by all accounts
+   */
+  if(account->allocations == 0)
+  {
+    rate = turnserver_cfg_bandwidth_per_account() * 1000;
+    token_bucket_init(&account->bucket_up, rate, 0, &g_bandwidth.up,
+        g_now_ms);
+    token_bucket_init(&account->bucket_down, rate, 0, &g_bandwidth.down,
+        g_now_ms);
+  }
+
+  if(account->state == AUTHORIZED)
+  {
+    rate = turnserver_cfg_bandwidth_per_allocation() * 1000;
+  }
+  else
+  {
+    rate = turnserver_cfg_restricted_bandwidth() * 1000;
+  }
+
+  token_bucket_init(&desc->bucket_up, rate, 0, &account->bucket_up, g_now_ms);
+  token_bucket_init(&desc->bucket_down, rate, 0, &account->bucket_down,
+      g_now_ms);
+
+  desc->relayed_transport_protocol =
+    message->requested_transport->turn_attr_protocol;
+
+  /* increment number of allocations */
+  account->allocations++;
+  debug(DBG_ATTR, "Account %s, allocations used: %u\n", account->username,
+      account->allocations);
+  syslog(LOG_INFO, "Account %s, allocations used: %zu", account->username,
+      account->allocations);
+
+  if(speer)
+  {
+    if(desc->tuple.transport_protocol == IPPROTO_TCP)
+    {
+      desc->relayed_tls = 1;
+    }
+    else /* UDP */
+    {
+      desc->relayed_dtls = 1;
+    }
+  }
+
+  syslog(LOG_INFO, "Allocation transport=%u (d)tls=%u source=%s:%u account=%s "
+      "relayed=%s:%u", transport_protocol, desc->relayed_tls ||
+      desc->relayed_dtls, str2, port2, account->username, str, port);
+
+  /* assign the sockets to the allocation */
+  desc->relayed_sock = relayed_sock;
+
+#ifdef OS_SET_DF_SUPPORT
+  /* UDP IPv4-IPv4 relay: default to the alternate behavior (DF bit not set),
+   * it only changes if the client uses DONT-FRAGMENT in Send indications
+   */
+  if(message->requested_transport->turn_attr_protocol == IPPROTO_UDP &&
+     turnserver_relayed_is_ipv4(desc))
+  {
+    turnserver_relayed_set_df(desc, IP_PMTUDISC_DONT);
+  }
+#endif
+
+  if(message->requested_transport->turn_attr_protocol == IPPROTO_TCP)
+  {
+    desc->relayed_sock_tcp = relayed_sock_tcp;
+  }
+
+  desc->tuple_sock = sock;
+
+  /* wait for data or connections on relayed address */
+  if(turnserver_event_set(relayed_sock, EVENT_READ, EVENT_RELAYED, desc, desc)
+      == -1)
+  {
+    account->allocations--;
+    turnserver_relay_port_release((struct sockaddr*)&desc->relayed_addr);
+    allocation_desc_free(&desc);
+    turnserver_send_error(transport_protocol, sock, method,
+        message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+        &account->hmac_key);
+    return -1;
+  }
+
+  /* add to the list */
+  allocation_list_add(allocation_list, desc);
+
+  /* send back the success response */
+send_success_response:
+  {
+    /* xor-relayed-address, lifetime, xor-mapped-address, reservation-token
+     * (if any), software, message-integrity, fingerprint
+     */
+    uint8_t buf[TURN_MSG_BUILDER_SIZE];
+    struct turn_msg_builder builder;
+
+    switch(saddr->sa_family)
+    {
+      case AF_INET:
+        port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+        break;
+      case AF_INET6:
+        port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+        break;
+      default:
+        return -1;
+        break;
+    }
+
+    turn_msg_builder_init(&builder, buf, sizeof(buf),
+        TURN_METHOD_ALLOCATE | STUN_SUCCESS_RESP, message->msg->turn_msg_id);
+
+    /* required attributes */
+    if(turn_msg_builder_add_xor_address(&builder,
+          TURN_ATTR_XOR_RELAYED_ADDRESS, (struct sockaddr*)&relayed_addr)
+        == -1 ||
+       turn_msg_builder_add_lifetime(&builder, lifetime) == -1 ||
+       turn_msg_builder_add_xor_address(&builder, STUN_ATTR_XOR_MAPPED_ADDRESS,
+         saddr) == -1)
+    {
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+          &desc->hmac_key);
+      return -1;
+    }
+
+    if(reservation_port)
+    {
+      /* server has stored a socket/port */
+      debug(DBG_ATTR, "Send a reservation-token attribute\n");
+      if(turn_msg_builder_add_reservation_token(&builder, reservation_token)
+          == -1)
+      {
+        turnserver_send_error(transport_protocol, sock, method,
+            message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+            &desc->hmac_key);
+        return -1;
+      }
+    }
+
+    debug(DBG_ATTR, "Allocation successful, send success allocate response\n");
+
+    if(turnserver_send_response(&builder, transport_protocol, sock, saddr,
+          saddr_size, speer, &desc->hmac_key) == -1)
+    {
+      turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 500, saddr, saddr_size, speer,
+          &desc->hmac_key);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Process a TURN request.
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param message TURN message
+ * \param saddr source address of the message
+ * \param daddr destination address of the message
+ * \param saddr_size sizeof addr
+ * \param allocation_list list of allocations
+ * \param account account descriptor (may be NULL)
+ * \param speer TLS peer, if not NULL the connection is in TLS so response is
+ * also in TLS
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_process_turn(int transport_protocol, int sock,
+    const struct turn_message* message, const struct sockaddr* saddr,
+    const struct sockaddr* daddr, socklen_t saddr_size,
+    struct list_head* allocation_list, struct account_desc* account,
+    struct tls_peer* speer)
+{
+  uint16_t hdr_msg_type = 0;
+  uint16_t method = 0;
+  struct allocation_desc* desc = NULL;
+
+  debug(DBG_ATTR, "Process a TURN message\n");
+
+  hdr_msg_type = ntohs(message->msg->turn_msg_type);
+  method = STUN_GET_METHOD(hdr_msg_type);
+
+  /* process STUN binding request */
+  if(STUN_IS_REQUEST(hdr_msg_type) && method == STUN_METHOD_BINDING)
+  {
+    return turnserver_process_binding_request(transport_protocol, sock, message,
+        saddr, saddr_size, speer);
+  }
+
+  /* RFC6062 (TURN-TCP) */
+  /* find right tuple for a TCP allocation (ConnectionBind case) */
+  if(STUN_IS_REQUEST(hdr_msg_type) && method == TURN_METHOD_CONNECTIONBIND)
+  {
+    /* ConnectionBind is only for TCP or TLS over TCP <-> TCP */
+    if(transport_protocol == IPPROTO_TCP)
+    {
+      return turnserver_process_connectionbind_request(transport_protocol, sock,
+          message, saddr, saddr_size, speer, account, allocation_list);
+    }
+    else
+    {
+      return turnserver_send_error(transport_protocol, sock, method,
+          message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+          &account->hmac_key);
+    }
+  }
+
+  /* check the 5-tuple except for an Allocate request */
+  if(method != TURN_METHOD_ALLOCATE)
+  {
+    desc = allocation_list_find_tuple(allocation_list, transport_protocol,
+        daddr, saddr, saddr_size);
+
+    if(STUN_IS_REQUEST(hdr_msg_type))
+    {
+      /* check for the allocated username */
+      if(desc && message->username && message->realm)
+      {
+        size_t len = ntohs(message->username->turn_attr_len);
+        size_t rlen = ntohs(message->realm->turn_attr_len);
+        if(len != strlen(desc->username) ||
+           strncmp((char*)message->username->turn_attr_username,
+             desc->username, len) ||
+           rlen != strlen(desc->realm) ||
+           strncmp((char*)message->realm->turn_attr_realm, desc->realm, rlen))
+        {
+          desc = NULL;
+        }
+      }
+      else
+      {
+        desc = NULL;
+      }
+    }
+
+    if(!desc)
+    {
+      /* reject with error 437 if it a request, ignored otherwise */
+      /* the refresh function will handle this case */
+      if(STUN_IS_REQUEST(hdr_msg_type))
+      {
+        /* allocation mismatch => error 437 */
+        turnserver_send_error(transport_protocol, sock, method,
+            message->msg->turn_msg_id, 437, saddr, saddr_size, speer,
+            &account->hmac_key);
+        return 0;
+      }
+
+      debug(DBG_ATTR, "No valid 5-tuple match\n");
+      return -1;
+    }
+
+    /* update allocation nonce */
+    if(message->nonce)
+    {
+      memcpy(desc->nonce, message->nonce->turn_attr_nonce, 24);
+    }
+  }
+
+  if(STUN_IS_REQUEST(hdr_msg_type))
+  {
+    if(method != TURN_METHOD_ALLOCATE)
+    {
+      /* check to prevent hijacking the client's allocation */
+      size_t len = strlen(account->username);
+      size_t rlen = strlen(account->realm);
+      if(len != ntohs(message->username->turn_attr_len) ||
+         strncmp((char*)message->username->turn_attr_username,
+           account->username, len) ||
+         rlen != ntohs(message->realm->turn_attr_len) ||
+         strncmp((char*)message->realm->turn_attr_realm, account->realm, rlen))
+      {
+        /* credentials do not match with those used for allocation
+         * => error 441
+         */
+        debug(DBG_ATTR, "Wrong credentials!\n");
+        turnserver_send_error(transport_protocol, sock, method,
+            message->msg->turn_msg_id, 441, saddr, saddr_size, speer,
+            &account->hmac_key);
+        return 0;
+      }
+    }
+
+    switch(method)
+    {
+      case TURN_METHOD_ALLOCATE:
+        turnserver_process_allocate_request(transport_protocol, sock, message,
+            saddr, daddr, saddr_size, allocation_list, account, speer);
+        break;
+      case TURN_METHOD_REFRESH:
+        turnserver_process_refresh_request(transport_protocol, sock, message,
+            saddr, saddr_size, allocation_list, desc, account, speer);
+        break;
+      case TURN_METHOD_CREATEPERMISSION:
+        turnserver_process_createpermission_request(transport_protocol, sock,
+            message, saddr, saddr_size, desc, speer);
+        break;
+      case TURN_METHOD_CHANNELBIND:
+        /* ChannelBind is only for UDP relay */
+        if(desc->relayed_transport_protocol == IPPROTO_UDP)
+        {
+          turnserver_process_channelbind_request(transport_protocol, sock,
+              message, saddr, saddr_size, desc, speer);
+        }
+        else
+        {
+          turnserver_send_error(transport_protocol, sock, method,
+              message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+              &desc->hmac_key);
+        }
+        break;
+      case TURN_METHOD_CONNECT: /* RFC6062 (TURN-TCP) */
+        /* Connect is only for TCP or TLS over TCP <-> TCP */
+        if(transport_protocol == IPPROTO_TCP &&
+            desc->relayed_transport_protocol == IPPROTO_TCP)
+        {
+          turnserver_process_connect_request(transport_protocol, sock, message,
+              saddr, saddr_size, desc, speer);
+        }
+        else
+        {
+          turnserver_send_error(transport_protocol, sock, method,
+              message->msg->turn_msg_id, 400, saddr, saddr_size, speer,
+              &desc->hmac_key);
+        }
+        break;
+      default:
+        return -1;
+        break;
+    }
+  }
+  else if(STUN_IS_SUCCESS_RESP(hdr_msg_type) ||
+      STUN_IS_ERROR_RESP(hdr_msg_type))
+  {
+    /* should not happen */
+  }
+  else if(STUN_IS_INDICATION(hdr_msg_type))
+  {
+    switch(method)
+    {
+      case TURN_METHOD_SEND:
+        if(desc->relayed_transport_protocol == IPPROTO_UDP)
+        {
+          turnserver_process_send_indication(message, desc);
+        }
+        break;
+      case TURN_METHOD_DATA:
+        /* should not happen */
+        return -1;
+        break;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Receive and check basic validation of the message.
+ * \param transport_protocol transport protocol used
+ * \param sock socket
+ * \param buf data received
+ * \param buflen length of data
+ * \param saddr source address of the message
+ * \param daddr destination address of the message
+ * \param saddr_size sizeof addr
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ * \param speer TLS peer if not NULL, the server accept TLS connection
+ * \return 0 if message processed correctly, -1 otherwise
+ */
+static int turnserver_listen_recv(int transport_protocol, int sock,
+    const char* buf, ssize_t buflen, const struct sockaddr* saddr,
+    const struct sockaddr* daddr, socklen_t saddr_size,
+    struct list_head* allocation_list, struct list_head* account_list,
+    struct tls_peer* speer)
+{
+  struct turn_message message;
+  uint16_t unknown[32];
+  size_t unknown_size = sizeof(unknown) / sizeof(uint32_t);
+  struct account_desc* account = NULL;
+  uint16_t method = 0;
+  uint16_t hdr_msg_type = 0;
+  size_t total_len = 0;
+  uint16_t type = 0;
+  int turn_tcp = turnserver_cfg_turn_tcp();
+
+  /* protocol mismatch */
+  if(transport_protocol != IPPROTO_UDP && transport_protocol != IPPROTO_TCP)
+  {
+    debug(DBG_ATTR, "Transport protocol mismatch\n");
+    return -1;
+  }
+
+  if(buflen < 4)
+  {
+    debug(DBG_ATTR, "Size too short\n");
+    return -1;
+  }
+
+  memcpy(&type, buf, sizeof(uint16_t));
+  type = ntohs(type);
+
+  /* is it a ChannelData message (bit 0 and 1 are not set to 0) ? */
+  if(TURN_IS_CHANNELDATA(type))
+  {
+    /* ChannelData */
+    return turnserver_process_channeldata(transport_protocol, type, buf, buflen,
+        saddr, daddr, saddr_size, allocation_list);
+  }
+
+  /* first parsing */
+  if(turn_parse_message(buf, buflen, &message, unknown, &unknown_size) == -1)
+  {
+    debug(DBG_ATTR, "Parse message failed\n");
+    return -1;
+  }
+
+  /* check if it is a STUN/TURN header */
+  if(!message.msg)
+  {
+    debug(DBG_ATTR, "No STUN/TURN header\n");
+    return -1;
+  }
+
+  /* convert into host byte order */
+  hdr_msg_type = ntohs(message.msg->turn_msg_type);
+  total_len = ntohs(message.msg->turn_msg_len) + sizeof(struct turn_msg_hdr);
+
+  /* check that the two first bit of the STUN header are set to 0 */
+  /*
+     if((hdr_msg_type & 0xC000) != 0)
+     {
+     debug(DBG_ATTR, "Not a STUN-formated packet\n");
+     return -1;
+     }
+   */
+
+  /* check if it is a known class */
+  if(!STUN_IS_REQUEST(hdr_msg_type) &&
+     !STUN_IS_INDICATION(hdr_msg_type) &&
+     !STUN_IS_SUCCESS_RESP(hdr_msg_type) &&
+     !STUN_IS_ERROR_RESP(hdr_msg_type))
+  {
+    debug(DBG_ATTR, "Unknown message class\n");
+    return -1;
+  }
+
+  method = STUN_GET_METHOD(hdr_msg_type);
+
+  /* check that the method value is supported */
+  if(method != STUN_METHOD_BINDING &&
+     method != TURN_METHOD_ALLOCATE &&
+     method != TURN_METHOD_REFRESH &&
+     method != TURN_METHOD_CREATEPERMISSION &&
+     method != TURN_METHOD_CHANNELBIND &&
+     method != TURN_METHOD_SEND &&
+     method != TURN_METHOD_DATA &&
+     (method != TURN_METHOD_CONNECT || !turn_tcp) &&
+     (method != TURN_METHOD_CONNECTIONBIND || !turn_tcp))
+  {
+    debug(DBG_ATTR, "Unknown method\n");
+    return -1;
+  }
+
+  /* check the magic cookie */
+  if(message.msg->turn_msg_cookie != htonl(STUN_MAGIC_COOKIE))
+  {
+    debug(DBG_ATTR, "Bad magic cookie\n");
+    return -1;
+  }
+
+  /* check the fingerprint if present */
+  if(message.fingerprint)
+  {
+    /* verify if CRC is valid */
+    uint32_t crc = 0;
+
+    crc = crypto_crc32_generate((const unsigned char*)buf,
+        total_len - sizeof(struct turn_attr_fingerprint), 0);
+
+    if(htonl(crc) != (message.fingerprint->turn_attr_crc ^ htonl(
+            STUN_FINGERPRINT_XOR_VALUE)))
+    {
+      debug(DBG_ATTR, "Fingerprint mismatch\n");
+      return -1;
+    }
+  }
+
+  /* all this cases above discard silently the packets,
+   * so now process the packet more in details
+   */
+
+  if(STUN_IS_REQUEST(hdr_msg_type) && method != STUN_METHOD_BINDING)
+  {
+    /* check long-term authentication for all requests except for a STUN
+     * binding request
+     */
+    if(!message.message_integrity)
+    {
+      /* no messages integrity => error 401 */
+      debug(DBG_ATTR, "No message integrity\n");
+
+      if(turnserver_send_auth_error(transport_protocol, sock, method,
+            message.msg->turn_msg_id, 401, saddr, saddr_size, speer) == -1)
+      {
+        turnserver_send_error(transport_protocol, sock, method,
+            message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
+        return -1;
+      }
+      return 0;
+    }
+
+    if(!message.username || !message.realm || !message.nonce)
+    {
+      /* missing username, realm or nonce => error 400 */
+      turnserver_send_error(transport_protocol, sock, method,
+          message.msg->turn_msg_id, 400, saddr, saddr_size, speer, NULL);
+      return 0;
+    }
+
+    if(nonce_verify(&g_nonce_ctx, g_now, message.nonce->turn_attr_nonce,
+          ntohs(message.nonce->turn_attr_len), saddr, saddr_size) == -1)
+    {
+      /* nonce staled => error 438 */
+      if(turnserver_send_auth_error(transport_protocol, sock, method,
+            message.msg->turn_msg_id, 438, saddr, saddr_size, speer) == -1)
+      {
+        turnserver_send_error(transport_protocol, sock, method,
+            message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
+        return -1;
+      }
+      return 0;
+    }
+
+    /* find the desired username and password in the account list */
+    {
+      char username[514];
+      char user_realm[256];
+      size_t username_len = ntohs(message.username->turn_attr_len) + 1;
+      size_t realm_len = ntohs(message.realm->turn_attr_len) + 1;
+
+      if(username_len > 513 || realm_len > 256)
+      {
+        /* some attributes are too long */
+        turnserver_send_error(transport_protocol, sock, method,
+            message.msg->turn_msg_id, 400, saddr, saddr_size, speer, NULL);
+        return -1;
+      }
+
+      strncpy(username, (char*)message.username->turn_attr_username,
+          username_len);
+      username[username_len - 1] = 0x00;
+      strncpy(user_realm, (char*)message.realm->turn_attr_realm, realm_len);
+      user_realm[realm_len - 1] = 0x00;
+
+      /* search the account */
+      account = account_list_find(account_list, username, user_realm);
+
+      if(!account)
+      {
+        /* not valid username => error 401 */
+        debug(DBG_ATTR, "No account\n");
+
+        if(turnserver_send_auth_error(transport_protocol, sock, method,
+              message.msg->turn_msg_id, 401, saddr, saddr_size, speer) == -1)
+        {
+          turnserver_send_error(transport_protocol, sock, method,
+              message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
+          return -1;
+        }
+        return 0;
+      }
+    }
+
+    /* compute HMAC-SHA1 and compare with the value in message_integrity */
+    {
+      /* MESSAGE-INTEGRITY is the last attribute or is followed by
+       * FINGERPRINT
+       */
+      size_t len = total_len - sizeof(struct turn_attr_message_integrity) -
+        (message.fingerprint ? sizeof(struct turn_attr_fingerprint) : 0);
+
+      if(turn_verify_integrity((const unsigned char*)buf, len,
+            &account->hmac_key,
+            message.message_integrity->turn_attr_hmac) == -1)
+      {
+        /* integrity does not match => error 401 */
+        debug(DBG_ATTR, "Hash mismatch\n");
+
+        if(turnserver_send_auth_error(transport_protocol, sock, method,
+              message.msg->turn_msg_id, 401, saddr, saddr_size, speer) == -1)
+        {
+          turnserver_send_error(transport_protocol, sock, method,
+              message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
+          return -1;
+        }
+        return 0;
+      }
+    }
+  }
+
+  /* check if there are unknown comprehension-required attributes */
+  if(unknown_size)
+  {
+    /* error-code, unknown-attributes, software, fingerprint */
+    uint8_t error_buf[TURN_MSG_BUILDER_SIZE];
+    struct turn_msg_builder builder;
+
+    /* if not a request, message is discarded */
+    if(!STUN_IS_REQUEST(hdr_msg_type))
+    {
+      debug(DBG_ATTR, "message has unknown attribute and it is not a request, "
+          "discard\n");
+      return -1;
+    }
+
+    /* unknown attributes found => error 420 */
+    turn_msg_builder_init(&builder, error_buf, sizeof(error_buf),
+        method | STUN_ERROR_RESP, message.msg->turn_msg_id);
+
+    if(turn_msg_builder_add_error(&builder, 420, STUN_ERROR_420,
+          sizeof(STUN_ERROR_420)) == -1 ||
+       turn_msg_builder_add_unknown_attributes(&builder, unknown,
+         unknown_size) == -1 ||
+       turnserver_send_response(&builder, transport_protocol, sock, saddr,
+         saddr_size, speer, NULL) == -1)
+    {
+      turnserver_send_error(transport_protocol, sock, method,
+          message.msg->turn_msg_id, 500, saddr, saddr_size, speer,
+          account ? &account->hmac_key : NULL);
+      return -1;
+    }
+    return 0;
+  }
+
+  /* the basic checks are done,
+   * now check that specific method requirement are OK
+   */
+  debug(DBG_ATTR, "OK basic validation are done, process the TURN message\n");
+
+  return turnserver_process_turn(transport_protocol, sock, &message, saddr,
+      daddr, saddr_size, allocation_list, account, speer);
+}
+
+/**
+ * \brief Receive a message on an relayed address.
+ * \param buf data received
+ * \param buflen length of data
+ * \param saddr source address of the message
+ * \param daddr destination address of the message
+ * \param saddr_size sizeof addr
+ * \param allocation_list list of allocations
+ * \param speer TLS peer, if not NULL, message is relayed in TLS
+ * \return 0 if message processed correctly, -1 otherwise
+ */
+static int turnserver_relayed_recv(const char* buf, ssize_t buflen,
+    const struct sockaddr* saddr, struct sockaddr* daddr, socklen_t saddr_size,
+    struct list_head* allocation_list, struct tls_peer* speer)
+{
+  struct allocation_desc* desc = NULL;
+  uint8_t peer_addr[16];
+  uint16_t peer_port;
+  uint32_t channel = 0;
+  struct iovec iov[8]; /* header and peer-address, data, padding */
+  size_t idx = 0;
+  uint8_t msg_buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  struct turn_attr_data data_attr;
+  struct turn_channel_data channel_data;
+  uint32_t padding = 0;
+  ssize_t nb = -1;
+  size_t len = 0; /* for TLS */
+  char str[INET6_ADDRSTRLEN];
+
+  /* find the allocation associated with the relayed transport address */
+  desc = allocation_list_find_relayed(allocation_list, daddr, saddr_size);
+  if(!desc)
+  {
+    /* no allocation found, discard */
+    debug(DBG_ATTR, "No allocation found\n");
+    return -1;
+  }
+
+  switch(saddr->sa_family)
+  {
+    case AF_INET:
+      memcpy(peer_addr, &((struct sockaddr_in*)saddr)->sin_addr, 4);
+      peer_port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
+      break;
+    case AF_INET6:
+      memcpy(peer_addr, &((struct sockaddr_in6*)saddr)->sin6_addr, 16);
+      peer_port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
+      break;
+    default:
+      return -1;
+  }
+
+  /* check if the peer has permission */
+  if(!allocation_desc_find_permission_sockaddr(desc, saddr))
+  {
+    /* no permission, discard */
+    inet_ntop(saddr->sa_family, peer_addr, str, INET6_ADDRSTRLEN);
+    debug(DBG_ATTR, "No permission installed (%s)\n", str);
+    return -1;
+  }
+
+  /* check bandwidth limit */
+  if(turnserver_check_bandwidth_limit(desc, buflen, 0))
+  {
+    debug(DBG_ATTR, "Bandwidth quotas reached!\n");
+    return -1;
+  }
+
+  /* see if a channel is bound to the peer */
+  channel = allocation_desc_find_channel(desc, saddr->sa_family, peer_addr,
+      peer_port);
+
+  if(channel != 0 && g_udp_batch.in_cur && buf == g_udp_batch.in_cur->buf &&
+     (speer || desc->tuple.transport_protocol == IPPROTO_UDP))
+  {
+    /* fast path: the ChannelData header is written in the headroom of the
+     * received buffer which is sent as is
+     */
+    struct turn_channel_data* frame = (struct turn_channel_data*)
+      (g_udp_batch.in_cur->buf - UDP_BATCH_HEADROOM);
+    size_t frame_len = buflen + sizeof(struct turn_channel_data);
+
+    frame->turn_channel_number = htons(channel);
+    frame->turn_channel_len = htons(buflen); /* big endian */
+
+    if(!speer)
+    {
+      /* padding is not needed over UDP */
+      debug(DBG_ATTR, "Send ChannelData to client\n");
+      nb = turnserver_udp_send_inplace(desc->tuple_sock,
+          (struct sockaddr*)&desc->tuple.client_addr,
+          sockaddr_get_size(&desc->tuple.client_addr), (const char*)frame,
+          frame_len, &desc->tuple.server_addr);
+
+      if(nb == -1)
+      {
+        debug(DBG_ATTR, "turnserver_udp_send_inplace failed\n");
+      }
+      return 0;
+    }
+    else if(buflen % 4 == 0 ||
+        (size_t)buflen + (4 - (buflen % 4)) <= g_udp_batch.in_cur->size)
+    {
+      /* padding MUST be included for TCP, it is written after the data */
+      if(buflen % 4)
+      {
+        memset(g_udp_batch.in_cur->buf + buflen, 0x00, 4 - (buflen % 4));
+        frame_len += 4 - (buflen % 4);
+      }
+
+      debug(DBG_ATTR, "Send ChannelData to TLS client\n");
+      nb = tls_peer_write(speer, (const char*)frame, frame_len,
+          (struct sockaddr*)&desc->tuple.client_addr,
+          sockaddr_get_size(&desc->tuple.client_addr));
+
+      if(nb == -1)
+      {
+        debug(DBG_ATTR, "tls_peer_write failed\n");
+      }
+      return 0;
+    }
+  }
+
+  if(channel != 0)
+  {
+    len = sizeof(struct turn_channel_data);
+
+    /* send it with ChannelData */
+    channel_data.turn_channel_number = htons(channel);
+    channel_data.turn_channel_len = htons(buflen); /* big endian */
+
+    iov[idx].iov_base = &channel_data;
+    iov[idx].iov_len = sizeof(struct turn_channel_data);
+    idx++;
+
+    if(buflen > 0)
+    {
+      iov[idx].iov_base = (void*)buf;
+      iov[idx].iov_len = buflen;
+      len += buflen;
+      idx++;
+    }
+
+    /* add padding (MUST be included for TCP, MAY be included for UDP) */
+    if(buflen % 4)
+    {
+      iov[idx].iov_base = &padding;
+      iov[idx].iov_len = 4 - (buflen % 4);
+      len += iov[idx].iov_len;
+      idx++;
+    }
+  }
+  else
+  {
+    /* send it with Data Indication, payload is not copied */
+    uint8_t id[12];
+    size_t data_len = buflen;
+
+    turn_generate_transaction_id(id);
+    turn_msg_builder_init(&builder, msg_buf, sizeof(msg_buf),
+        TURN_METHOD_DATA | STUN_INDICATION, id);
+
+    if(turn_msg_builder_add_xor_address(&builder, TURN_ATTR_XOR_PEER_ADDRESS,
+          saddr) == -1)
+    {
+      return -1;
+    }
+
+    iov[idx].iov_base = builder.buf;
+    iov[idx].iov_len = builder.len;
+    idx++;
+
+    data_attr.turn_attr_type = htons(TURN_ATTR_DATA);
+    data_attr.turn_attr_len = htons(buflen);
+    iov[idx].iov_base = &data_attr;
+    iov[idx].iov_len = sizeof(struct turn_attr_data);
+    idx++;
+
+    if(buflen > 0)
+    {
+      iov[idx].iov_base = (void*)buf;
+      iov[idx].iov_len = buflen;
+      idx++;
+    }
+
+    if(buflen % 4)
+    {
+      iov[idx].iov_base = &padding;
+      iov[idx].iov_len = 4 - (buflen % 4);
+      data_len += iov[idx].iov_len;
+      idx++;
+    }
+
+    len = builder.len + sizeof(struct turn_attr_data) + data_len;
+    builder.hdr->turn_msg_len = htons(len - sizeof(struct turn_msg_hdr));
+  }
+
+  /* send it to the tuple (TURN client) */
+  debug(DBG_ATTR, "Send data to client\n");
+
+  if(speer) /* TLS */
+  {
+    nb = turn_tls_send(speer, (struct sockaddr*)&desc->tuple.client_addr,
+        sockaddr_get_size(&desc->tuple.client_addr), len, iov, idx);
+  }
+  else if(desc->tuple.transport_protocol == IPPROTO_UDP) /* UDP */
+  {
+    nb = turnserver_udp_send(desc->tuple_sock,
+        (struct sockaddr*)&desc->tuple.client_addr,
+        sockaddr_get_size(&desc->tuple.client_addr), iov, idx,
+        &desc->tuple.server_addr);
+  }
+  else /* TCP */
+  {
+    nb = turn_tcp_send(desc->tuple_sock, iov, idx);
+  }
+
+  if(nb == -1)
+  {
+    debug(DBG_ATTR, "turn_send_message failed\n");
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Get the length of the STUN message or ChannelData at the beginning
+ * of TCP stream data.
+ * \param buf data
+ * \return length of the message (padding included), 0 if it is not a STUN
+ * request, indication or ChannelData
+ */
+static size_t turnserver_tcp_frame_len(const char* buf)
+{
+  uint16_t type = 0;
+  uint16_t len = 0;
+
+  memcpy(&type, buf, sizeof(uint16_t));
+  memcpy(&len, buf + 2, sizeof(uint16_t));
+  type = ntohs(type);
+  len = ntohs(len);
+
+  if(TURN_IS_CHANNELDATA(type))
+  {
+    /* TCP, so padding mandatory, plus size of ChannelData header */
+    return ((len + 3) & ~3) + 4;
+  }
+  else if(STUN_IS_REQUEST(type) || STUN_IS_INDICATION(type))
+  {
+    /* size of STUN header */
+    return len + 20;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Process message(s) received in the stream buffer of a TCP client.
+ *
+ * Complete messages are processed where they have been received, bytes of an
+ * incomplete message stay in the buffer.
+ * \param sock TCP client descriptor
+ * \param saddr source address of the message
+ * \param daddr destination address of the message
+ * \param saddr_size sizeof addr
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ * \param speer TLS peer if not NULL, the server accept TLS connection
+ */
+static void turnserver_process_tcp_stream(struct socket_desc* sock,
+    struct sockaddr* saddr, struct sockaddr* daddr, socklen_t saddr_size,
+    struct list_head* allocation_list, struct list_head* account_list,
+    struct tls_peer* speer)
+{
+  struct stream_buf* stream = &sock->stream;
+
+  while(stream_buf_len(stream) >= 4)
+  {
+    char* buf = stream_buf_data(stream);
+
+    if(!sock->msg_len && !(sock->msg_len = turnserver_tcp_frame_len(buf)))
+    {
+      debug(DBG_ATTR, "Not a STUN request or TURN ChannelData!\n");
+      stream_buf_consume(stream, stream_buf_len(stream));
+      break;
+    }
+
+    if(stream_buf_len(stream) < sock->msg_len)
+    {
+      /* incomplete message */
+      debug(DBG_ATTR, "Incomplete message\n");
+      break;
+    }
+
+    if(turnserver_listen_recv(IPPROTO_TCP, sock->sock, buf, sock->msg_len,
+          saddr, daddr, saddr_size, allocation_list, account_list, speer)
+        == -1)
+    {
+      debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
+    }
+
+    stream_buf_consume(stream, sock->msg_len);
+    sock->msg_len = 0;
+
+    if(sock->sock == -1)
+    {
+      /* ConnectionBind, the connection is now a TCP relay */
+      stream_buf_consume(stream, stream_buf_len(stream));
+      break;
+    }
+  }
+
+  /* an idle connection does not hold memory */
+  stream_buf_shrink(stream, &g_stream_buf_pool);
+}
+
+/**
+ * \brief Check if server can relay specific address with its current
+ * configuration.
+ *
+ * For example if IPv6 is disabled, the server will drop immediately packets
+ * coming from an IPv6-only client.
+ * \param listen_address IPv4 listen address
+ * \param listen_addressv6 IPv6 listen_address (could be NULL if IPv6 is
+ * disabled)
+ * \param saddr source address of client
+ * \return 1 if the server can relay data for this client,
+ * 0 otherwise
+ */
+static int turnserver_check_relay_address(char* listen_address,
+    char* listen_addressv6, struct sockaddr_storage* saddr)
+{
+  if((!listen_addressv6 && (saddr->ss_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))) ||
+     (!listen_address && (saddr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))) ||
+     (!listen_address && saddr->ss_family == AF_INET))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * \brief Handle state of remote peer asynchronous TCP connect() (RFC6062).
+ * \param sock TCP socket
+ * \param relay TCP relay descriptor
+ * \param desc allocation descriptor
+ * \param speer TLS peer, if not NULL send data in TLS
+ * \return -1 if timeout or error which means that server have to send
+ * a 447 error, -2 if system error happens and 0 if connect() succeed
+ */
+static int turnserver_handle_tcp_connect(int sock,
+    struct allocation_tcp_relay* relay, struct allocation_desc* desc,
+    struct tls_peer* speer)
+{
+  int err = 0;
+  socklen_t err_size = sizeof(int);
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  struct sockaddr* saddr = (struct sockaddr*)&desc->tuple.client_addr;
+  socklen_t saddr_size = sockaddr_get_size(&desc->tuple.client_addr);
+  long flags = 0;
+  int ret = 0;
+
+  if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_size) == -1)
+  {
+    return -2;
+  }
+
+  if(err != 0)
+  {
+    return -1;
+  }
+
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_CONNECT | STUN_SUCCESS_RESP, relay->connect_msg_id);
+
+  /* software (not fatal if it cannot be added) */
+  turn_msg_builder_add_software(&builder, SOFTWARE_DESCRIPTION,
+      sizeof(SOFTWARE_DESCRIPTION) - 1);
+
+  if(turn_msg_builder_add_connection_id(&builder, relay->connection_id) == -1 ||
+     turn_msg_builder_add_message_integrity_key(&builder,
+       &desc->hmac_key) == -1)
+  {
+    return -2;
+  }
+
+  turn_msg_builder_add_fingerprint(&builder); /* not fatal if not successful */
+
+  /* send message */
+  ret = turn_send_buffer(IPPROTO_TCP, desc->tuple_sock, speer, saddr,
+      saddr_size, builder.buf, builder.len);
+
+  if(ret == -1)
+  {
+    debug(DBG_ATTR, "turn_send_buffer failed\n");
+    return -2;
+  }
+  else
+  {
+    /* back to blocking mode */
+    if((flags = fcntl(sock, F_GETFL, NULL)) == -1)
+    {
+      return -2;
+    }
+
+    flags &= (~O_NONBLOCK);
+
+    if(fcntl(sock, F_SETFL, flags) == -1)
+    {
+      return -2;
+    }
+
+    /* connect() succeed, mark as ready */
+    relay->ready = 1;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Handle incoming TCP connection (RFC6062).
+ * \param sock TCP listen socket
+ * \param desc allocation descriptor
+ * \param speer TLS peer, if not NULL send data in TLS
+ */
+static void turnserver_handle_tcp_incoming_connection(int sock,
+    struct allocation_desc* desc, struct tls_peer* speer)
+{
+  int family = 0;
+  uint8_t peer_addr[16];
+  uint16_t peer_port = 0;
+  uint32_t id = 0;
+  uint8_t msg_id[12]; /* for ConnectionAttempt message ID */
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  struct turn_msg_builder builder;
+  int rsock = -1;
+  struct sockaddr_storage saddr;
+  socklen_t saddr_size = sizeof(struct sockaddr_storage);
+  size_t buffer_size = turnserver_cfg_tcp_buffer_userspace() ?
+    turnserver_cfg_tcp_buffer_size() : 0;
+
+  rsock = accept(sock, (struct sockaddr*)&saddr, &saddr_size);
+
+  if(rsock == -1)
+  {
+    debug(DBG_ATTR,
+        "Cannot process incoming TCP connection on listening socket.\n");
+    return;
+  }
+
+  if(!allocation_desc_find_permission_sockaddr(desc, (struct sockaddr*)&saddr))
+  {
+    /* no permission installed so close socket */
+    close(rsock);
+    return;
+  }
+
+  /* generate unique ID */
+  crypto_random_bytes_generate((uint8_t*)&id, 4);
+
+  turn_generate_transaction_id(msg_id);
+
+  switch(saddr.ss_family)
+  {
+    case AF_INET:
+      family = AF_INET;
+      memcpy(peer_addr, &((struct sockaddr_in*)&saddr)->sin_addr, 4);
+      peer_port = ntohs(((struct sockaddr_in*)&saddr)->sin_port);
+      break;
+    case AF_INET6:
+      family = AF_INET6;
+      memcpy(peer_addr, &((struct sockaddr_in6*)&saddr)->sin6_addr, 16);
+      peer_port = ntohs(((struct sockaddr_in6*)&saddr)->sin6_port);
+      break;
+    default:
+      return;
+      break;
+  }
+
+  /* add it to allocation */
+  if(allocation_desc_add_tcp_relay(desc, id, rsock, family, peer_addr,
+        peer_port, TURN_DEFAULT_TCP_RELAY_TIMEOUT, buffer_size, NULL) == -1)
+  {
+    close(rsock);
+    return;
+  }
+
+  /* now send ConnectionAttempt to client */
+  turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_CONNECTIONATTEMPT | STUN_INDICATION, msg_id);
+
+  if(turn_msg_builder_add_connection_id(&builder, id) == -1 ||
+     turn_msg_builder_add_xor_address(&builder, TURN_ATTR_XOR_PEER_ADDRESS,
+       (struct sockaddr*)&saddr) == -1 ||
+     turnserver_send_response(&builder, IPPROTO_TCP, desc->tuple_sock,
+       (struct sockaddr*)&desc->tuple.client_addr,
+       sockaddr_get_size(&desc->tuple.client_addr), speer,
+       &desc->hmac_key) == -1)
+  {
+    /* ignore ? */
+    close(rsock);
+    return;
+  }
+
+  /* wait for data from peer */
+  turnserver_event_set_tcp_relay(desc,
+      allocation_desc_find_tcp_relay_id(desc, id));
+  return;
+}
+
+/**
+ * \brief Give back a remote TCP socket descriptor and its buffer to their
+ * pools.
+ *
+ * The socket is not closed.
+ * \param sdesc remote TCP socket descriptor
+ */
+static void turnserver_socket_desc_free(struct socket_desc* sdesc)
+{
+  stream_buf_free(&sdesc->stream, &g_stream_buf_pool);
+  pool_free(&g_socket_desc_pool, sdesc);
+}
+
+/**
+ * \brief Handle TCP or TLS over TCP accept().
+ * \param sock listen TCP or TLS socket
+ * \param tcp_socket_list list of remote TCP sockets
+ * \param tls if socket use TLS (connect on TLS port)
+ */
+static void turnserver_handle_tcp_accept(int sock,
+    struct list_head* tcp_socket_list, int tls)
+{
+  struct socket_desc* sdesc = NULL;
+  struct sockaddr_storage saddr;
+  socklen_t saddr_size = sizeof(struct sockaddr_storage);
+  struct sockaddr_storage daddr;
+  socklen_t daddr_size = sizeof(struct sockaddr_storage);
+  char* listen_address = turnserver_cfg_listen_address();
+  char* listen_addressv6 = turnserver_cfg_listen_addressv6();
+  char* proto = NULL;
+  int rsock = accept(sock, (struct sockaddr*)&saddr, &saddr_size);
+
+  (void)proto; /* avoid compilation warning in release mode */
+
+  if(rsock > 0)
+  {
+    if(!turnserver_check_relay_address(listen_address, listen_addressv6,
+          &saddr))
+    {
+      /* don't relay the specified address family so close connection */
+      proto = (saddr.ss_family == AF_INET6 &&
+          !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)&saddr)->sin6_addr))
+        ? "IPv6" : "IPv4";
+      debug(DBG_ATTR, "Do not relay family: %s\n", proto);
+      close(rsock);
+    }
+    else if(getsockname(rsock, (struct sockaddr*)&daddr, &daddr_size) == -1)
+    {
+      close(rsock);
+    }
+    else
+    {
+      if(!(sdesc = pool_alloc(&g_socket_desc_pool)))
+      {
+        close(rsock);
+      }
+      else
+      {
+        /* initialize, the addresses of the connection are cached so that
+         * they are not requested for each segment received
+         */
+        memset(&sdesc->stream, 0x00, sizeof(struct stream_buf));
+        sdesc->msg_len = 0;
+        sdesc->tls = tls;
+        sdesc->sock = rsock;
+        memcpy(&sdesc->saddr, &saddr, sizeof(struct sockaddr_storage));
+        sdesc->saddr_size = saddr_size;
+        memcpy(&sdesc->daddr, &daddr, sizeof(struct sockaddr_storage));
+
+        /* add it to the list */
+        list_head_add(tcp_socket_list, &sdesc->list);
+
+        if(turnserver_event_set(rsock, EVENT_READ, EVENT_TCP_CLIENT, sdesc,
+              NULL) == -1)
         {
-          turnserver_process_send_indication(message, desc);
+          list_head_remove(&sdesc->list, &sdesc->list);
+          close(rsock);
+          turnserver_socket_desc_free(sdesc);
         }
-        break;
-      case TURN_METHOD_DATA:
-        /* should not happen */
-        return -1;
-        break;
+      }
     }
   }
+}
 
-  return 0;
+/**
+ * \brief Remove a TCP relay from its allocation (RFC6062).
+ * \param desc allocation descriptor
+ * \param relay TCP relay to remove
+ */
+static void turnserver_tcp_relay_remove(struct allocation_desc* desc,
+    struct allocation_tcp_relay* relay)
+{
+  allocation_tcp_relay_set_timer(relay, 0); /* stop timeout */
+  /* in case TCP relay has already expired */
+  list_head_remove(&relay->list2, &relay->list2);
+
+  turnserver_event_del_tcp_relay(relay);
+  allocation_tcp_relay_list_remove(&desc->tcp_relays, relay);
 }
 
 /**
- * \brief Receive and check basic validation of the message.
- * \param transport_protocol transport protocol used
- * \param sock socket
- * \param buf data received
- * \param buflen length of data
- * \param saddr source address of the message
- * \param daddr destination address of the message
- * \param saddr_size sizeof addr
+ * \brief Check connect() timeout and OS buffering limit of TCP relays
+ * (RFC6062).
+ * \param sockets all listen sockets
  * \param allocation_list list of allocations
- * \param account_list list of accounts
- * \param speer TLS peer if not NULL, the server accept TLS connection
- * \return 0 if message processed correctly, -1 otherwise
  */
-static int turnserver_listen_recv(int transport_protocol, int sock,
-    const char* buf, ssize_t buflen, const struct sockaddr* saddr,
-    const struct sockaddr* daddr, socklen_t saddr_size,
-    struct list_head* allocation_list, struct list_head* account_list,
-    struct tls_peer* speer)
+static void turnserver_check_tcp_relays(struct listen_sockets* sockets,
+    struct list_head* allocation_list)
 {
-  struct turn_message message;
-  uint16_t unknown[32];
-  size_t unknown_size = sizeof(unknown) / sizeof(uint32_t);
-  struct account_desc* account = NULL;
-  uint16_t method = 0;
-  uint16_t hdr_msg_type = 0;
-  size_t total_len = 0;
-  uint16_t type = 0;
-  int turn_tcp = turnserver_cfg_turn_tcp();
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+  time_t now = g_now;
 
-  /* protocol mismatch */
-  if(transport_protocol != IPPROTO_UDP && transport_protocol != IPPROTO_TCP)
+  list_head_iterate_safe(allocation_list, get, n)
   {
-    debug(DBG_ATTR, "Transport protocol mismatch\n");
-    return -1;
-  }
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+    struct list_head* get2 = NULL;
+    struct list_head* n2 = NULL;
 
-  if(buflen < 4)
-  {
-    debug(DBG_ATTR, "Size too short\n");
-    return -1;
-  }
+    list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
+    {
+      struct allocation_tcp_relay* tmp2 = list_head_get(get2,
+          struct allocation_tcp_relay, list);
 
-  memcpy(&type, buf, sizeof(uint16_t));
-  type = ntohs(type);
+      if(tmp2->peer_sock <= 0)
+      {
+        continue;
+      }
 
-  /* is it a ChannelData message (bit 0 and 1 are not set to 0) ? */
-  if(TURN_IS_CHANNELDATA(type))
-  {
-    /* ChannelData */
-    return turnserver_process_channeldata(transport_protocol, type, buf, buflen,
-        saddr, daddr, saddr_size, allocation_list);
+      /* if asynchronous connect() has not succeed yet, check if it timeout
+       * (with value define in RFC6062)
+       */
+      if(tmp2->ready != 1 &&
+         (tmp2->created + TURN_DEFAULT_TCP_CONNECT_TIMEOUT) <= now)
+      {
+        debug(DBG_ATTR, "TCP connect() timeout\n");
+
+        /* send error and remove relay */
+        turnserver_send_error(IPPROTO_TCP, tmp->tuple_sock,
+            TURN_METHOD_CONNECT, tmp2->connect_msg_id, 447,
+            (struct sockaddr*)&tmp->tuple.client_addr,
+            sockaddr_get_size(&tmp->tuple.client_addr), sockets->sock_tls,
+            NULL);
+
+        turnserver_tcp_relay_remove(tmp, tmp2);
+        continue;
+      }
+
+      /* if client has not send its ConnectionBind yet and userspace buffering
+       * is not enable, OS performs buffering but see if TCP receive buffer
+       * size does not exceed the limit
+       */
+      if(tmp2->client_sock == -1 && !turnserver_cfg_tcp_buffer_userspace())
+      {
+        uint32_t val = 0;
+
+        /* use FIONREAD (same as SIOCINQ) to see how much
+         * ready-to-read bytes are in TCP receive queue
+         */
+        if(ioctl(tmp2->peer_sock, FIONREAD, &val) >= 0 &&
+           val > turnserver_cfg_tcp_buffer_size())
+        {
+          /* limit exceeded, remove TCP relay */
+          debug(DBG_ATTR, "Exceed TCP buffer size limit (OS buffering)!\n");
+          turnserver_tcp_relay_remove(tmp, tmp2);
+        }
+      }
+    }
   }
+}
 
-  /* first parsing */
-  if(turn_parse_message(buf, buflen, &message, unknown, &unknown_size) == -1)
+/**
+ * \brief Configure an UDP (or DTLS) listen socket.
+ *
+ * Listen sockets are bound to a wildcard address so that one socket serves
+ * all the configured addresses. The destination address of each datagram is
+ * received with it (IP_PKTINFO) rather than requested with getsockname().
+ * \param sock socket descriptor
+ * \param addr filled with the bound address of the socket
+ */
+static void turnserver_listen_udp_init(int sock, struct sockaddr_storage* addr)
+{
+  socklen_t addr_size = sizeof(struct sockaddr_storage);
+
+  if(getsockname(sock, (struct sockaddr*)addr, &addr_size) == -1)
   {
-    debug(DBG_ATTR, "Parse message failed\n");
-    return -1;
+    memset(addr, 0x00, sizeof(struct sockaddr_storage));
   }
 
-  /* check if it is a STUN/TURN header */
-  if(!message.msg)
+  if(net_udp_set_pktinfo(sock) == -1)
   {
-    debug(DBG_ATTR, "No STUN/TURN header\n");
-    return -1;
+    debug(DBG_ATTR, "Destination address of datagrams not available\n");
   }
 
-  /* convert into host byte order */
-  hdr_msg_type = ntohs(message.msg->turn_msg_type);
-  total_len = ntohs(message.msg->turn_msg_len) + sizeof(struct turn_msg_hdr);
-
-  /* check that the two first bit of the STUN header are set to 0 */
-  /*
-     if((hdr_msg_type & 0xC000) != 0)
-     {
-     debug(DBG_ATTR, "Not a STUN-formated packet\n");
-     return -1;
-     }
+#ifdef OS_SET_DF_SUPPORT
+  /* data relayed to UDP clients is sent with the RFC5766 alternate behavior
+   * (DF bit not set), configure it once for the socket
    */
+  turnserver_udp_set_df(sock, IP_PMTUDISC_DONT);
+#endif
+}
 
-  /* check if it is a known class */
-  if(!STUN_IS_REQUEST(hdr_msg_type) &&
-     !STUN_IS_INDICATION(hdr_msg_type) &&
-     !STUN_IS_SUCCESS_RESP(hdr_msg_type) &&
-     !STUN_IS_ERROR_RESP(hdr_msg_type))
+/**
+ * \brief Get the local address (TURN server) a datagram has been received on.
+ * \param dgram datagram received on a listen socket
+ * \param listen_addr bound address of the listen socket
+ * \param daddr filled with the destination address and port of the datagram
+ */
+static void turnserver_listen_daddr(const struct net_datagram* dgram,
+    const struct sockaddr_storage* listen_addr, struct sockaddr_storage* daddr)
+{
+  if(!dgram->local_size || dgram->local.ss_family != listen_addr->ss_family)
   {
-    debug(DBG_ATTR, "Unknown message class\n");
-    return -1;
+    /* IP_PKTINFO not supported */
+    memcpy(daddr, listen_addr, sizeof(struct sockaddr_storage));
+    return;
   }
 
-  method = STUN_GET_METHOD(hdr_msg_type);
+  memcpy(daddr, &dgram->local, sizeof(struct sockaddr_storage));
 
-  /* check that the method value is supported */
-  if(method != STUN_METHOD_BINDING &&
-     method != TURN_METHOD_ALLOCATE &&
-     method != TURN_METHOD_REFRESH &&
-     method != TURN_METHOD_CREATEPERMISSION &&
-     method != TURN_METHOD_CHANNELBIND &&
-     method != TURN_METHOD_SEND &&
-     method != TURN_METHOD_DATA &&
-     (method != TURN_METHOD_CONNECT || !turn_tcp) &&
-     (method != TURN_METHOD_CONNECTIONBIND || !turn_tcp))
+  if(daddr->ss_family == AF_INET6)
   {
-    debug(DBG_ATTR, "Unknown method\n");
-    return -1;
+    ((struct sockaddr_in6*)daddr)->sin6_port =
+      ((struct sockaddr_in6*)listen_addr)->sin6_port;
   }
-
-  /* check the magic cookie */
-  if(message.msg->turn_msg_cookie != htonl(STUN_MAGIC_COOKIE))
+  else
   {
-    debug(DBG_ATTR, "Bad magic cookie\n");
-    return -1;
+    ((struct sockaddr_in*)daddr)->sin_port =
+      ((struct sockaddr_in*)listen_addr)->sin_port;
   }
+}
 
-  /* check the fingerprint if present */
-  if(message.fingerprint)
-  {
-    /* verify if CRC is valid */
-    uint32_t crc = 0;
+/**
+ * \brief Receive and process a datagram on the UDP listen socket.
+ * \param sockets all listen sockets
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ */
+static void turnserver_handle_udp_read(struct listen_sockets* sockets,
+    struct list_head* allocation_list, struct list_head* account_list)
+{
+  char error_str[1024];
+  struct sockaddr_storage daddr;
+  int nb = -1;
+  int i = 0;
+  char* proto = NULL;
 
-    crc = crypto_crc32_generate((const unsigned char*)buf,
-        total_len - sizeof(struct turn_attr_fingerprint), 0);
+  (void)proto;
 
-    if(htonl(crc) != (message.fingerprint->turn_attr_crc ^ htonl(
-            STUN_FINGERPRINT_XOR_VALUE)))
-    {
-      debug(DBG_ATTR, "Fingerprint mismatch\n");
-      return -1;
-    }
-  }
+  debug(DBG_ATTR, "Received UDP on listening address\n");
 
-  /* all this cases above discard silently the packets,
-   * so now process the packet more in details
-   */
+  /* drain the socket */
+  nb = net_udp_recv_batch(sockets->sock_udp, g_udp_batch.in, g_udp_batch.size);
 
-  if(STUN_IS_REQUEST(hdr_msg_type) && method != STUN_METHOD_BINDING)
+  if(nb <= 0)
   {
-    /* check long-term authentication for all requests except for a STUN
-     * binding request
-     */
-    if(!message.message_integrity)
-    {
-      /* no messages integrity => error 401 */
-      /* header, error-code, realm, nonce, software */
-      struct iovec iov[12];
-      uint8_t nonce[48];
-      struct turn_msg_hdr* error = NULL;
-      struct turn_attr_hdr* attr = NULL;
-      char* key = NULL;
-      size_t idx = 0;
-
-      debug(DBG_ATTR, "No message integrity\n");
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Error: %s\n", error_str);
+    return;
+  }
 
-      key = turnserver_cfg_nonce_key();
-      turn_generate_nonce(nonce, sizeof(nonce), (unsigned char*)key,
-          strlen(key));
+  g_udp_batch.recv_calls++;
+  g_udp_batch.recv_datagrams += nb;
 
-      if(!(error = turn_error_response_401(method, message.msg->turn_msg_id,
-              turnserver_cfg_realm(), nonce, sizeof(nonce), iov, &idx)))
-      {
-        turnserver_send_error(transport_protocol, sock, method,
-            message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
-        return -1;
-      }
+  for(i = 0 ; i < nb ; i++)
+  {
+    struct net_datagram* dgram = &g_udp_batch.in[i];
 
-      /* software (not fatal if it cannot be allocated) */
-      if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-              sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-      {
-        error->turn_msg_len += iov[idx].iov_len;
-        idx++;
-      }
+    if(dgram->len == 0)
+    {
+      continue;
+    }
 
-      turn_add_fingerprint(iov, &idx); /* not fatal if not successful */
+    if(!turnserver_check_relay_address(turnserver_cfg_listen_address(),
+          turnserver_cfg_listen_addressv6(), &dgram->addr))
+    {
+      proto = (dgram->addr.ss_family == AF_INET6 &&
+          !IN6_IS_ADDR_V4MAPPED(
+            &((struct sockaddr_in6*)&dgram->addr)->sin6_addr))
+        ? "IPv6" : "IPv4";
+      debug(DBG_ATTR, "Do not relay family: %s\n", proto);
+    }
+    else
+    {
+      turnserver_listen_daddr(dgram, &sockets->addr_udp, &daddr);
 
-      /* convert to big endian */
-      error->turn_msg_len = htons(error->turn_msg_len);
+      /* ChannelData may be relayed directly from this buffer */
+      g_udp_batch.in_cur = dgram;
+      g_udp_batch.in_daddr = &daddr;
 
-      if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-            ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov,
-            idx) == -1)
+      if(turnserver_listen_recv(IPPROTO_UDP, sockets->sock_udp, dgram->buf,
+            dgram->len, (struct sockaddr*)&dgram->addr,
+            (struct sockaddr*)&daddr, dgram->addr_size, allocation_list,
+            account_list, NULL) == -1)
       {
-        debug(DBG_ATTR, "turn_send_message failed\n");
+        debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
       }
 
-      /* free sent data */
-      net_iovec_free_data(iov, idx);
-      return 0;
+      g_udp_batch.in_cur = NULL;
+      g_udp_batch.in_daddr = NULL;
     }
+  }
+}
 
-    if(!message.username || !message.realm || !message.nonce)
-    {
-      /* missing username, realm or nonce => error 400 */
-      turnserver_send_error(transport_protocol, sock, method,
-          message.msg->turn_msg_id, 400, saddr, saddr_size, speer, NULL);
-      return 0;
-    }
+/**
+ * \brief Process a message decrypted from a DTLS client.
+ * \param sockets all listen sockets
+ * \param buf message
+ * \param len length of buf
+ * \param saddr source address of the message
+ * \param daddr destination address of the message
+ * \param saddr_size sizeof saddr
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ */
+static void turnserver_dtls_recv(struct listen_sockets* sockets, char* buf,
+    ssize_t len, const struct sockaddr_storage* saddr,
+    const struct sockaddr_storage* daddr, socklen_t saddr_size,
+    struct list_head* allocation_list, struct list_head* account_list)
+{
+  char* proto = NULL;
 
-    if(turn_nonce_is_stale(message.nonce->turn_attr_nonce,
-          ntohs(message.nonce->turn_attr_len),
-          (unsigned char*)turnserver_cfg_nonce_key(),
-          strlen(turnserver_cfg_nonce_key())))
-    {
-      /* nonce staled => error 438 */
-      /* header, error-code, realm, nonce, software */
-      struct iovec iov[5];
-      size_t idx = 0;
-      struct turn_msg_hdr* error = NULL;
-      struct turn_attr_hdr* attr = NULL;
-      uint8_t nonce[48];
-      char* realm = turnserver_cfg_realm();
-      char* key = turnserver_cfg_nonce_key();
-
-      turn_generate_nonce(nonce, sizeof(nonce), (unsigned char*)key,
-          strlen(key));
-      idx = 0;
-
-      if(!(error = turn_error_response_438(method, message.msg->turn_msg_id,
-              realm, nonce, sizeof(nonce), iov, &idx)))
-      {
-        turnserver_send_error(transport_protocol, sock, method,
-            message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
-        return -1;
-      }
+  (void)proto;
 
-      /* software (not fatal if it cannot be allocated) */
-      if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-              sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-      {
-        error->turn_msg_len += iov[idx].iov_len;
-        idx++;
-      }
+  if(!turnserver_check_relay_address(turnserver_cfg_listen_address(),
+        turnserver_cfg_listen_addressv6(), (struct sockaddr_storage*)saddr))
+  {
+    proto = (saddr->ss_family == AF_INET6 &&
+        !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))
+      ? "IPv6" : "IPv4";
+    debug(DBG_ATTR, "Do not relay family: %s\n", proto);
+  }
+  else if(turnserver_listen_recv(IPPROTO_UDP, sockets->sock_dtls->sock, buf,
+        len, (struct sockaddr*)saddr, (struct sockaddr*)daddr, saddr_size,
+        allocation_list, account_list, sockets->sock_dtls) == -1)
+  {
+    debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
+  }
+}
 
-      /* convert to big endian */
-      error->turn_msg_len = htons(error->turn_msg_len);
+/**
+ * \brief Called by the DTLS peer before it closes the connected socket of a
+ * client.
+ * \param sock connected socket
+ * \param speer DTLS client
+ */
+static void turnserver_dtls_client_close(int sock, const struct ssl_peer* speer)
+{
+  struct turnserver_dtls_client* client = tls_peer_connection_data(speer);
 
-      if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-            ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov,
-            idx) == -1)
-      {
-        debug(DBG_ATTR, "turn_send_message failed\n");
-      }
+  turnserver_event_del(sock, speer);
 
-      /* free sent data */
-      net_iovec_free_data(iov, idx);
-      return 0;
-    }
+  if(client)
+  {
+    timer_wheel_del(&g_timer_wheel, &client->timer);
+    list_head_remove(&g_expired_dtls_client_list, &client->list2);
+    free(client);
+  }
+}
 
-    /* find the desired username and password in the account list */
-    {
-      char username[514];
-      char user_realm[256];
-      size_t username_len = ntohs(message.username->turn_attr_len) + 1;
-      size_t realm_len = ntohs(message.realm->turn_attr_len) + 1;
+/**
+ * \brief Move a DTLS client onto its own connected socket if it has done its
+ * handshake.
+ * \param sockets all listen sockets
+ * \param saddr address of the client
+ * \param daddr local address the client has contacted
+ */
+static void turnserver_dtls_connect(struct listen_sockets* sockets,
+    const struct sockaddr_storage* saddr, struct sockaddr_storage* daddr)
+{
+  struct ssl_peer* conn = NULL;
+  struct turnserver_dtls_client* client = NULL;
 
-      if(username_len > 513 || realm_len > 256)
-      {
-        /* some attributes are too long */
-        turnserver_send_error(transport_protocol, sock, method,
-            message.msg->turn_msg_id, 400, saddr, saddr_size, speer, NULL);
-        return -1;
-      }
+  if(g_epoll_fd == -1 || !turnserver_cfg_dtls_connected_sockets())
+  {
+    return;
+  }
 
-      strncpy(username, (char*)message.username->turn_attr_username,
-          username_len);
-      username[username_len - 1] = 0x00;
-      strncpy(user_realm, (char*)message.realm->turn_attr_realm, realm_len);
-      user_realm[realm_len - 1] = 0x00;
+  conn = tls_peer_udp_connect(sockets->sock_dtls, (struct sockaddr*)saddr,
+      sockaddr_get_size((struct sockaddr_storage*)saddr),
+      (struct sockaddr*)daddr, sockaddr_get_size(daddr));
 
-      /* search the account */
-      account = account_list_find(account_list, username, user_realm);
+  if(!conn)
+  {
+    return;
+  }
 
-      if(!account)
-      {
-        /* not valid username => error 401 */
-        struct iovec iov[5]; /* header, error-code, realm, nonce, software */
-        size_t idx = 0;
-        struct turn_msg_hdr* error = NULL;
-        struct turn_attr_hdr* attr = NULL;
-        uint8_t nonce[48];
-        char* realm = turnserver_cfg_realm();
-        char* key = turnserver_cfg_nonce_key();
+  if(!(client = malloc(sizeof(struct turnserver_dtls_client))))
+  {
+    tls_peer_connection_remove(sockets->sock_dtls, conn);
+    return;
+  }
 
-        debug(DBG_ATTR, "No account\n");
+  /* a client which goes away silently would keep its socket forever */
+  client->conn = conn;
+  list_head_init(&client->list2);
+  timer_entry_init(&client->timer, ALLOCATION_EXPIRE_DTLS_CLIENT, client);
+  timer_wheel_add(&g_timer_wheel, &client->timer,
+      DTLS_CLIENT_IDLE_TIMEOUT * 1000);
+  tls_peer_connection_set_data(conn, client);
 
-        turn_generate_nonce(nonce, sizeof(nonce), (unsigned char*)key,
-            strlen(key));
-        idx = 0;
+  debug(DBG_ATTR, "DTLS client moved to socket %d\n",
+      tls_peer_connection_sock(conn));
 
-        if(!(error = turn_error_response_401(method, message.msg->turn_msg_id,
-                realm, nonce, sizeof(nonce), iov, &idx)))
-        {
-          turnserver_send_error(transport_protocol, sock, method,
-              message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
-          return -1;
-        }
+  if(turnserver_event_set(tls_peer_connection_sock(conn), EVENT_READ,
+        EVENT_DTLS_CLIENT, conn, NULL) == -1)
+  {
+    /* its datagrams would not be read anymore */
+    tls_peer_connection_remove(sockets->sock_dtls, conn);
+  }
+}
 
-        /* software (not fatal if it cannot be allocated) */
-        if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-                sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-        {
-          error->turn_msg_len += iov[idx].iov_len;
-          idx++;
-        }
+/**
+ * \brief Receive and process a datagram on the DTLS listen socket.
+ * \param sockets all listen sockets
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ */
+static void turnserver_handle_dtls_read(struct listen_sockets* sockets,
+    struct list_head* allocation_list, struct list_head* account_list)
+{
+  char buf[8192];
+  char error_str[1024];
+  struct net_datagram dgram;
+  struct sockaddr_storage daddr;
+  int nb = -1;
 
-        turn_add_fingerprint(iov, &idx); /* not fatal if not successful */
+  debug(DBG_ATTR, "Received DTLS on listening address\n");
 
-        /* convert to big endian */
-        error->turn_msg_len = htons(error->turn_msg_len);
+  dgram.buf = buf;
+  dgram.size = sizeof(buf);
+  nb = net_udp_recv_batch(sockets->sock_dtls->sock, &dgram, 1);
 
-        if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-              ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov,
-              idx) == -1)
-        {
-          debug(DBG_ATTR, "turn_send_message failed\n");
-        }
+  if(nb > 0 && tls_peer_is_encrypted(buf, dgram.len))
+  {
+    char buf2[1500];
+    ssize_t nb2 = -1;
 
-        /* free sent data */
-        net_iovec_free_data(iov, idx);
-        return 0;
-      }
-    }
+    turnserver_listen_daddr(&dgram, &sockets->addr_dtls, &daddr);
 
-    /* compute HMAC-SHA1 and compare with the value in message_integrity */
+    if((nb2 = tls_peer_udp_read(sockets->sock_dtls, buf, dgram.len, buf2,
+            sizeof(buf2), (struct sockaddr*)&dgram.addr, dgram.addr_size,
+            (struct sockaddr*)&daddr, sockaddr_get_size(&daddr))) > 0)
     {
-      uint8_t hash[20];
+      turnserver_dtls_recv(sockets, buf2, nb2, &dgram.addr, &daddr,
+          dgram.addr_size, allocation_list, account_list);
+    }
 
-      if(message.fingerprint)
-      {
-        /* if the message contains a FINGERPRINT attribute, adjust the size */
-        size_t len_save = message.msg->turn_msg_len;
+    /* the last datagram of a handshake does not contain a message */
+    turnserver_dtls_connect(sockets, &dgram.addr, &daddr);
+  }
+  else
+  {
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Error: %s\n", error_str);
+  }
+}
 
-        message.msg->turn_msg_len =
-          ntohs(message.msg->turn_msg_len) - sizeof(
-              struct turn_attr_fingerprint);
+/**
+ * \brief Receive and process a datagram on the connected socket of a DTLS
+ * client.
+ * \param sockets all listen sockets
+ * \param conn DTLS client
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ */
+static void turnserver_handle_dtls_client_read(struct listen_sockets* sockets,
+    struct ssl_peer* conn, struct list_head* allocation_list,
+    struct list_head* account_list)
+{
+  char buf[8192];
+  char buf2[1500];
+  struct sockaddr_storage saddr;
+  struct sockaddr_storage daddr;
+  struct turnserver_dtls_client* client = NULL;
+  ssize_t nb = -1;
+  ssize_t nb2 = -1;
 
-        message.msg->turn_msg_len = htons(message.msg->turn_msg_len);
-        turn_calculate_integrity_hmac((const unsigned char*)buf,
-            total_len - sizeof(struct turn_attr_fingerprint) -
-            sizeof(struct turn_attr_message_integrity), account->key,
-            sizeof(account->key), hash);
+  nb = recv(tls_peer_connection_sock(conn), buf, sizeof(buf), MSG_DONTWAIT);
 
-        /* restore length */
-        message.msg->turn_msg_len = len_save;
-      }
-      else
-      {
-        turn_calculate_integrity_hmac((const unsigned char*)buf,
-            total_len - sizeof(struct turn_attr_message_integrity),
-            account->key, sizeof(account->key), hash);
-      }
+  if(nb == -1 && errno == ECONNREFUSED)
+  {
+    /* ICMP port unreachable, the client has gone */
+    debug(DBG_ATTR, "DTLS client unreachable\n");
+    tls_peer_connection_remove(sockets->sock_dtls, conn);
+    return;
+  }
 
-      if(memcmp(hash, message.message_integrity->turn_attr_hmac, 20) != 0)
-      {
-        /* integrity does not match => error 401 */
-        struct iovec iov[5]; /* header, error-code, realm, nonce, software */
-        size_t idx = 0;
-        struct turn_msg_hdr* error = NULL;
-        struct turn_attr_hdr* attr = NULL;
-        uint8_t nonce[48];
-        char* nonce_key = turnserver_cfg_nonce_key();
+  if(nb <= 0)
+  {
+    return;
+  }
 
-        debug(DBG_ATTR, "Hash mismatch\n");
-#ifndef NDEBUG
-        /* print computed hash and the one from the message */
-        crypto_digest_print(hash, 20);
-        crypto_digest_print(message.message_integrity->turn_attr_hmac, 20);
-#endif
-        turn_generate_nonce(nonce, sizeof(nonce), (unsigned char*)nonce_key,
-            strlen(nonce_key));
-        idx = 0;
+  client = tls_peer_connection_data(conn);
+  if(timer_wheel_remaining(&g_timer_wheel, &client->timer) <
+      TURN_MAX_ALLOCATION_LIFETIME * 1000)
+  {
+    /* not at each datagram */
+    timer_wheel_add(&g_timer_wheel, &client->timer,
+        DTLS_CLIENT_IDLE_TIMEOUT * 1000);
+  }
 
-        if(!(error = turn_error_response_401(method, message.msg->turn_msg_id,
-                turnserver_cfg_realm(), nonce, sizeof(nonce), iov, &idx)))
-        {
-          turnserver_send_error(transport_protocol, sock, method,
-              message.msg->turn_msg_id, 500, saddr, saddr_size, speer, NULL);
-          return -1;
-        }
+  if(!tls_peer_is_encrypted(buf, nb))
+  {
+    return;
+  }
 
-        /* software (not fatal if it cannot be allocated) */
-        if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-                sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-        {
-          error->turn_msg_len += iov[idx].iov_len;
-          idx++;
-        }
+  /* conn may be removed if the record is not valid */
+  memcpy(&saddr, tls_peer_connection_addr(conn), sizeof(saddr));
+  memcpy(&daddr, tls_peer_connection_local(conn), sizeof(daddr));
 
-        turn_add_fingerprint(iov, &idx); /* not fatal if not successful */
+  if((nb2 = tls_peer_connection_read(sockets->sock_dtls, conn, buf, nb, buf2,
+          sizeof(buf2))) > 0)
+  {
+    turnserver_dtls_recv(sockets, buf2, nb2, &saddr, &daddr,
+        sockaddr_get_size(&saddr), allocation_list, account_list);
+  }
+}
 
-        /* convert to big endian */
-        error->turn_msg_len = htons(error->turn_msg_len);
+/**
+ * \brief Receive and process data from a remote TCP or TLS client.
+ * \param sdesc remote TCP socket descriptor
+ * \param sockets all listen sockets
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ * \return 0 if success, -1 if the connection has been closed (sdesc is freed)
+ */
+static int turnserver_handle_tcp_read(struct socket_desc* sdesc,
+    struct listen_sockets* sockets, struct list_head* allocation_list,
+    struct list_head* account_list)
+{
+  char buf[8192];
+  char error_str[1024];
+  struct sockaddr* saddr = (struct sockaddr*)&sdesc->saddr;
+  struct sockaddr* daddr = (struct sockaddr*)&sdesc->daddr;
+  socklen_t saddr_size = sdesc->saddr_size;
+  struct tls_peer* speer = sdesc->tls ? sockets->sock_tls : NULL;
+  struct ssl_peer* conn = NULL;
+  size_t len = stream_buf_len(&sdesc->stream);
+  size_t min = 1;
+  size_t avail = 0;
+  char* space = NULL;
+  ssize_t nb = -1;
 
-        if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-              ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov,
-              idx) == -1)
-        {
-          debug(DBG_ATTR, "turn_send_message failed\n");
-        }
+  debug(DBG_ATTR, "Received data from %s client\n", !sdesc->tls
+      ? "TCP" : "TLS");
 
-        /* free sent data */
-        net_iovec_free_data(iov, idx);
-        return 0;
-      }
-    }
+  /* the rest of an incomplete message is received at once if possible */
+  if(sdesc->msg_len > len)
+  {
+    min = sdesc->msg_len - len;
   }
 
-  /* check if there are unknown comprehension-required attributes */
-  if(unknown_size)
-  {
-    struct iovec iov[4]; /* header, error-code, unknown-attributes, software */
-    size_t idx = 0;
-    struct turn_msg_hdr* error = NULL;
-    struct turn_attr_hdr* attr = NULL;
+  space = stream_buf_reserve(&sdesc->stream, &g_stream_buf_pool, min, &avail);
 
-    /* if not a request, message is discarded */
-    if(!STUN_IS_REQUEST(hdr_msg_type))
+  if(!space)
+  {
+    debug(DBG_ATTR, "Cannot receive TCP message of %u bytes\n",
+        (unsigned int)sdesc->msg_len);
+  }
+  else if(!speer)
+  {
+    /* TCP data is received right after the bytes not processed yet */
+    if((nb = recv(sdesc->sock, space, avail, 0)) > 0)
     {
-      debug(DBG_ATTR, "message has unknown attribute and it is not a request, "
-          "discard\n");
-      return -1;
+      stream_buf_commit(&sdesc->stream, nb);
     }
-
-    /* unknown attributes found => error 420 */
-    if(!(error = turn_error_response_420(method, message.msg->turn_msg_id,
-            unknown, unknown_size, iov, &idx)))
+  }
+  else if((nb = recv(sdesc->sock, buf, sizeof(buf), 0)) > 0)
+  {
+    if(tls_peer_is_encrypted(buf, nb))
     {
-      turnserver_send_error(transport_protocol, sock, method,
-          message.msg->turn_msg_id, 500, saddr, saddr_size, speer,
-          account ? account->key : NULL);
-      return -1;
-    }
+      ssize_t nb2 = -1;
 
-    /* software (not fatal if it cannot be allocated) */
-    if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-            sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
-    {
-      error->turn_msg_len += iov[idx].iov_len;
-      idx++;
+      /* decode TLS data in the stream buffer */
+      if((nb2 = tls_peer_tcp_read(speer, buf, nb, space, avail, saddr,
+              saddr_size, sdesc->sock)) > 0)
+      {
+        stream_buf_commit(&sdesc->stream, nb2);
+      }
+      else
+      {
+        sys_get_error(errno, error_str, sizeof(error_str));
+        debug(DBG_ATTR, "Error: %s\n", error_str);
+      }
     }
-
-    /* convert to big endian */
-    error->turn_msg_len = htons(error->turn_msg_len);
-
-    if(turn_send_message(transport_protocol, sock, speer, saddr, saddr_size,
-          ntohs(error->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
+    else if(stream_buf_append(&sdesc->stream, &g_stream_buf_pool, buf, nb)
         == -1)
     {
-      debug(DBG_ATTR, "turn_send_message failed\n");
+      nb = -1;
     }
+  }
 
-    /* free sent data */
-    net_iovec_free_data(iov, idx);
-    return 0;
+  if(nb > 0)
+  {
+    /* TCP stream may contain multiple STUN/TURN messages */
+    turnserver_process_tcp_stream(sdesc, saddr, daddr, saddr_size,
+        allocation_list, account_list, speer);
   }
+  else
+  {
+    /* 0: disconnection case
+     * -1: error
+     */
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Error: %s\n", error_str);
 
-  /* the basic checks are done,
-   * now check that specific method requirement are OK
-   */
-  debug(DBG_ATTR, "OK basic validation are done, process the TURN message\n");
+    turnserver_event_del(sdesc->sock, sdesc);
 
-  return turnserver_process_turn(transport_protocol, sock, &message, saddr,
-      daddr, saddr_size, allocation_list, account, speer);
+    /* the descriptor may be reused by a new client, if a handshake thread
+     * still uses it, it is released with the TLS remote peer
+     */
+    if(!speer || !(conn = tls_peer_connection_find(speer, saddr, saddr_size))
+       || tls_peer_connection_remove(speer, conn) == 0)
+    {
+      close(sdesc->sock);
+    }
+    sdesc->sock = -1;
+    list_head_remove(&sdesc->list, &sdesc->list);
+    turnserver_socket_desc_free(sdesc);
+    return -1;
+  }
+
+  return 0;
 }
 
 /**
- * \brief Receive a message on an relayed address.
- * \param buf data received
- * \param buflen length of data
- * \param saddr source address of the message
- * \param daddr destination address of the message
- * \param saddr_size sizeof addr
+ * \brief Take back the TLS and DTLS clients whose handshake has been finished
+ * by the handshake threads and process the messages received meanwhile.
+ * \param sockets all listen sockets
+ * \param tcp_socket_list list of remote TCP sockets
  * \param allocation_list list of allocations
- * \param speer TLS peer, if not NULL, message is relayed in TLS
- * \return 0 if message processed correctly, -1 otherwise
+ * \param account_list list of accounts
  */
-static int turnserver_relayed_recv(const char* buf, ssize_t buflen,
-    const struct sockaddr* saddr, struct sockaddr* daddr, socklen_t saddr_size,
-    struct list_head* allocation_list, struct tls_peer* speer)
+static void turnserver_handle_handshakes(struct listen_sockets* sockets,
+    struct list_head* tcp_socket_list, struct list_head* allocation_list,
+    struct list_head* account_list)
 {
-  struct allocation_desc* desc = NULL;
-  uint8_t peer_addr[16];
-  uint16_t peer_port;
-  uint32_t channel = 0;
-  struct iovec iov[8]; /* header, peer-address, data */
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  struct turn_channel_data channel_data;
-  uint32_t padding = 0;
-  ssize_t nb = -1;
-  size_t len = 0; /* for TLS */
-  char str[INET6_ADDRSTRLEN];
+  struct tls_peer* speer = NULL;
+  struct ssl_peer* conn = NULL;
 
-  /* find the allocation associated with the relayed transport address */
-  desc = allocation_list_find_relayed(allocation_list, daddr, saddr_size);
-  if(!desc)
+  while((conn = tls_peer_handshake_finished(&speer)))
   {
-    /* no allocation found, discard */
-    debug(DBG_ATTR, "No allocation found\n");
-    return -1;
-  }
+    struct sockaddr_storage saddr;
+    struct sockaddr_storage daddr;
+    struct socket_desc* sdesc = NULL;
+    struct list_head* get = NULL;
+    struct list_head* n = NULL;
+    char buf[1500];
+    ssize_t nb = -1;
 
-  switch(saddr->sa_family)
-  {
-    case AF_INET:
-      memcpy(peer_addr, &((struct sockaddr_in*)saddr)->sin_addr, 4);
-      peer_port = ntohs(((struct sockaddr_in*)saddr)->sin_port);
-      break;
-    case AF_INET6:
-      memcpy(peer_addr, &((struct sockaddr_in6*)saddr)->sin6_addr, 16);
-      peer_port = ntohs(((struct sockaddr_in6*)saddr)->sin6_port);
-      break;
-    default:
-      return -1;
-  }
+    memcpy(&saddr, tls_peer_connection_addr(conn), sizeof(saddr));
+    memcpy(&daddr, tls_peer_connection_local(conn), sizeof(daddr));
 
-  /* check if the peer has permission */
-  if(!allocation_desc_find_permission_sockaddr(desc, saddr))
-  {
-    /* no permission, discard */
-    inet_ntop(saddr->sa_family, peer_addr, str, INET6_ADDRSTRLEN);
-    debug(DBG_ATTR, "No permission installed (%s)\n", str);
-    return -1;
+    if(speer == sockets->sock_dtls)
+    {
+      while((nb = tls_peer_handshake_read(speer, (struct sockaddr*)&saddr,
+              sockaddr_get_size(&saddr), buf, sizeof(buf))) > 0)
+      {
+        turnserver_dtls_recv(sockets, buf, nb, &saddr, &daddr,
+            sockaddr_get_size(&saddr), allocation_list, account_list);
+      }
+
+      turnserver_dtls_connect(sockets, &saddr, &daddr);
+      continue;
+    }
+
+    /* TLS, a client usually waits for the handshake before sending */
+    while((nb = tls_peer_handshake_read(speer, (struct sockaddr*)&saddr,
+            sockaddr_get_size(&saddr), buf, sizeof(buf))) > 0)
+    {
+      list_head_iterate_safe(tcp_socket_list, get, n)
+      {
+        struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
+
+        if(tmp->tls && tmp->sock != -1 && tmp->saddr_size ==
+           sockaddr_get_size(&saddr) && !memcmp(&tmp->saddr, &saddr,
+             tmp->saddr_size))
+        {
+          sdesc = tmp;
+          break;
+        }
+      }
+
+      if(!sdesc || stream_buf_append(&sdesc->stream, &g_stream_buf_pool, buf,
+            nb) == -1)
+      {
+        break;
+      }
+
+      turnserver_process_tcp_stream(sdesc, (struct sockaddr*)&sdesc->saddr,
+          (struct sockaddr*)&sdesc->daddr, sdesc->saddr_size, allocation_list,
+          account_list, speer);
+
+      if(sdesc->sock == -1)
+      {
+        /* TCP connection after ConnectionBind */
+        list_head_remove(&sdesc->list, &sdesc->list);
+        turnserver_socket_desc_free(sdesc);
+        break;
+      }
+    }
   }
+}
 
-  /* check bandwidth limit */
-  if(turnserver_check_bandwidth_limit(desc, buflen, 0))
+/**
+ * \brief Receive data or connection on the relayed address of an allocation.
+ * \param desc allocation descriptor
+ * \param sockets all listen sockets
+ * \param allocation_list list of allocations
+ */
+static void turnserver_handle_relayed_read(struct allocation_desc* desc,
+    struct listen_sockets* sockets, struct list_head* allocation_list)
+{
+  /* UDP relay is described in RFC 5766
+   * and TCP relay is described in RFC6062
+   */
+  if(desc->relayed_transport_protocol == IPPROTO_UDP)
   {
-    debug(DBG_ATTR, "Bandwidth quotas reached!\n");
-    return -1;
-  }
+    struct tls_peer* speer = NULL;
+    size_t nb_max = g_udp_batch.size;
+    int nb = -1;
+    int i = 0;
 
-  /* see if a channel is bound to the peer */
-  channel = allocation_desc_find_channel(desc, saddr->sa_family, peer_addr,
-      peer_port);
+    debug(DBG_ATTR, "Received UDP on a relayed address\n");
 
-  if(channel != 0)
-  {
-    len = sizeof(struct turn_channel_data);
+    if(g_bandwidth.pacing)
+    {
+      size_t available = token_bucket_available(&desc->bucket_up, g_now_ms);
 
-    /* send it with ChannelData */
-    channel_data.turn_channel_number = htons(channel);
-    channel_data.turn_channel_len = htons(buflen); /* big endian */
+      if(!available)
+      {
+        /* bandwidth exceeded, read it later */
+        uint64_t delay = token_bucket_delay(&desc->bucket_up, 1, g_now_ms);
 
-    iov[idx].iov_base = &channel_data;
-    iov[idx].iov_len = sizeof(struct turn_channel_data);
-    idx++;
+        debug(DBG_ATTR, "Bandwidth quotas reached, pace for %llu ms\n",
+            (unsigned long long)delay);
+        turnserver_pacing_pause(desc, delay);
+        return;
+      }
 
-    if(buflen > 0)
-    {
-      iov[idx].iov_base = (void*)buf;
-      iov[idx].iov_len = buflen;
-      len += buflen;
-      idx++;
+      /* do not read much more than allowed (a datagram fills one buffer at
+       * most)
+       */
+      nb_max = SYS_MIN(nb_max, available / UDP_BATCH_BUFFER_SIZE + 1);
     }
 
-    /* add padding (MUST be included for TCP, MAY be included for UDP) */
-    if(buflen % 4)
+    /* drain the socket */
+    nb = net_udp_recv_batch(desc->relayed_sock, g_udp_batch.in, nb_max);
+
+    if(nb <= 0)
     {
-      iov[idx].iov_base = &padding;
-      iov[idx].iov_len = 4 - (buflen % 4);
-      len += iov[idx].iov_len;
-      idx++;
+      return;
     }
-  }
-  else
-  {
-    /* send it with Data Indication */
-    uint8_t id[12];
 
-    turn_generate_transaction_id(id);
-    if(!(hdr = turn_msg_data_indication_create(0, id, &iov[idx])))
+    g_udp_batch.recv_calls++;
+    g_udp_batch.recv_datagrams += nb;
+
+    if(desc->relayed_tls)
     {
-      return -1;
+      speer = sockets->sock_tls;
     }
-    idx++;
-
-    if(!(attr = turn_attr_xor_peer_address_create(saddr, STUN_MAGIC_COOKIE, id,
-            &iov[idx])))
+    else if(desc->relayed_dtls)
     {
-      net_iovec_free_data(iov, idx);
-      return -1;
+      speer = sockets->sock_dtls;
     }
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
 
-    if(!(attr = turn_attr_data_create(buf, buflen, &iov[idx])))
+    for(i = 0 ; i < nb ; i++)
     {
-      net_iovec_free_data(iov, idx);
-      return -1;
-    }
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+      struct net_datagram* dgram = &g_udp_batch.in[i];
 
-    len = hdr->turn_msg_len + sizeof(struct turn_msg_hdr);
-    hdr->turn_msg_len = htons(hdr->turn_msg_len);
+      if(dgram->len > 0)
+      {
+        /* data may be relayed directly from this buffer */
+        g_udp_batch.in_cur = dgram;
+        turnserver_relayed_recv(dgram->buf, dgram->len,
+            (struct sockaddr*)&dgram->addr,
+            (struct sockaddr*)&desc->relayed_addr, dgram->addr_size,
+            allocation_list, speer);
+        g_udp_batch.in_cur = NULL;
+      }
+    }
+  }
+  else if(desc->relayed_transport_protocol == IPPROTO_TCP)
+  {
+    /* RFC6062 (TURN-TCP) */
+    /* handle incoming TCP connection on relayed address */
+    debug(DBG_ATTR, "Received incoming connection on a listening TCP "
+        "relayed address\n");
+    turnserver_handle_tcp_incoming_connection(desc->relayed_sock, desc,
+        desc->relayed_tls ? sockets->sock_tls : NULL);
   }
+}
 
-  /* send it to the tuple (TURN client) */
-  debug(DBG_ATTR, "Send data to client\n");
+/**
+ * \brief Handle completion of an asynchronous connect() to a peer (RFC6062).
+ * \param desc allocation descriptor
+ * \param relay TCP relay descriptor
+ * \param sockets all listen sockets
+ */
+static void turnserver_handle_tcp_relay_connect(struct allocation_desc* desc,
+    struct allocation_tcp_relay* relay, struct listen_sockets* sockets)
+{
+  int ret_connect = turnserver_handle_tcp_connect(relay->peer_sock, relay,
+      desc, desc->relayed_tls ? sockets->sock_tls : NULL);
 
-  if(speer) /* TLS */
+  if(ret_connect == 0)
   {
-    nb = turn_tls_send(speer, (struct sockaddr*)&desc->tuple.client_addr,
-        sockaddr_get_size(&desc->tuple.client_addr), len, iov, idx);
+    /* connected, now wait for data */
+    turnserver_event_set_tcp_relay(desc, relay);
+    return;
   }
-  else if(desc->tuple.transport_protocol == IPPROTO_UDP) /* UDP */
+
+  if(ret_connect == -1)
   {
-    int optval = 0;
-    int save_val = 0;
-    socklen_t optlen = sizeof(int);
+    /* connect() failed */
+    debug(DBG_ATTR, "connect() failed!\n");
 
-#ifdef OS_SET_DF_SUPPORT
-    /* RFC6156: If present, the DONT-FRAGMENT attribute MUST be ignored by the
-     * server for IPv4-IPv6, IPv6-IPv6 and IPv6-IPv4 relays
+    turnserver_send_error(IPPROTO_TCP, desc->tuple_sock,
+        TURN_METHOD_CONNECT, relay->connect_msg_id, 447,
+        (struct sockaddr*)&desc->tuple.client_addr,
+        sockaddr_get_size(&desc->tuple.client_addr),
+        desc->relayed_tls ? sockets->sock_tls : NULL,
+        &desc->hmac_key);
+  }
+  else
+  {
+    /* a system error happens */
+    debug(DBG_ATTR, "connect() success but system error!\n");
+
+    turnserver_send_error(IPPROTO_TCP, desc->tuple_sock,
+        TURN_METHOD_CONNECT, relay->connect_msg_id, 500,
+        (struct sockaddr*)&desc->tuple.client_addr,
+        sockaddr_get_size(&desc->tuple.client_addr),
+        desc->relayed_tls ? sockets->sock_tls : NULL,
+        &desc->hmac_key);
+  }
+
+  /* bring back relayed_tcp_sock to permit again TCP connect
+   * request
+   */
+  turnserver_event_del(relay->peer_sock, relay);
+  desc->relayed_sock_tcp = relay->peer_sock;
+  relay->peer_sock = -1;
+}
+
+/**
+ * \brief Relay data from a TCP peer to the client (RFC6062).
+ * \param desc allocation descriptor
+ * \param relay TCP relay descriptor
+ * \return 0 if success, -1 if the relay has been removed
+ */
+static int turnserver_handle_tcp_relay_peer_read(struct allocation_desc* desc,
+    struct allocation_tcp_relay* relay)
+{
+  char buf[8192];
+  char error_str[1024];
+  ssize_t nb = -1;
+
+  debug(DBG_ATTR, "Receive data from TCP peer\n");
+
+  /* relay data from peer to client */
+  nb = recv(relay->peer_sock, buf, sizeof(buf), 0);
+
+  if(nb > 0)
+  {
+    /* client has not send ConnectionBind yet,
+     * buffer data
      */
-    if((desc->tuple.client_addr.ss_family == AF_INET ||
-          (desc->tuple.client_addr.ss_family == AF_INET6 &&
-           IN6_IS_ADDR_V4MAPPED(
-             &((struct sockaddr_in6*)&desc->tuple.client_addr)->sin6_addr))) &&
-       (saddr->sa_family == AF_INET || (saddr->sa_family == AF_INET6 &&
-       IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))))
-    {
-      /* only for IPv4-IPv4 relay */
-      /* alternate behavior, set DF to 0 */
-      optval = IP_PMTUDISC_DONT;
-
-      if(!getsockopt(desc->tuple_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-            &optlen))
+    if(relay->client_sock == -1)
+    {
+      debug(DBG_ATTR, "Buffer data from peer (TURN-TCP)\n");
+      if((size_t)nb <= (relay->buf_size - relay->buf_len))
       {
-        setsockopt(desc->tuple_sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval,
-            sizeof(int));
+        memcpy(relay->buf + relay->buf_len, buf, nb);
+        relay->buf_len += nb;
       }
       else
       {
-        /* little hack for not setting the old value of *_MTU_DISCOVER after
-         * sending message in case getsockopt failed
-         */
-        optlen = 0;
+        /* limit exceeded, remove TCP relay */
+        debug(DBG_ATTR, "Exceed TCP buffer size limit (userspace "
+            "buffering)!\n");
+        turnserver_tcp_relay_remove(desc, relay);
+        return -1;
       }
-    }
-#else
-    (void)optlen;
-    (void)optval;
-    (void)save_val;
-#endif
 
-    nb = turn_udp_send(desc->tuple_sock,
-        (struct sockaddr*)&desc->tuple.client_addr,
-        sockaddr_get_size(&desc->tuple.client_addr), iov, idx);
+      return 0;
+    }
 
-    /* if not an IPv4-IPv4 relay, optlen keep its default value 0 */
-#ifdef OS_SET_DF_SUPPORT
-    if(optlen)
+    /* send just received data to client */
+    if(send(relay->client_sock, buf, nb, 0) == -1)
     {
-      /* restore original value */
-      setsockopt(desc->tuple_sock, IPPROTO_IP, IP_MTU_DISCOVER, &save_val,
-          sizeof(int));
+      debug(DBG_ATTR, "Error sending data from peer to client "
+          "(TURN-TCP)\n");
     }
-#endif
   }
-  else /* TCP */
+  else
   {
-    nb = turn_tcp_send(desc->tuple_sock, iov, idx);
+    /* problem on the socket, remove relay */
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Error TCP relay: %s\n", error_str);
+    turnserver_tcp_relay_remove(desc, relay);
+    return -1;
   }
 
-  if(nb == -1)
+  return 0;
+}
+
+/**
+ * \brief Relay data from the client to a TCP peer (RFC6062).
+ * \param desc allocation descriptor
+ * \param relay TCP relay descriptor
+ * \return 0 if success, -1 if the relay has been removed
+ */
+static int turnserver_handle_tcp_relay_client_read(
+    struct allocation_desc* desc, struct allocation_tcp_relay* relay)
+{
+  char buf[8192];
+  char error_str[1024];
+  ssize_t nb = -1;
+
+  /* case when peer connect first */
+  if(relay->new)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    relay->new = 0;
+    return 0;
   }
 
-  /* if use a channel, do not used dynamic allocation */
-  if(!channel)
+  debug(DBG_ATTR, "Receive data from TCP client to TCP peer\n");
+
+  /* relay data from client to peer */
+  nb = recv(relay->client_sock, buf, sizeof(buf), 0);
+
+  if(nb > 0)
+  {
+    /* send just received data to peer */
+    if(send(relay->peer_sock, buf, nb, 0) == -1)
+    {
+      debug(DBG_ATTR, "Error sending data from client to peer "
+          "(TURN-TCP)\n");
+    }
+  }
+  else
   {
-    net_iovec_free_data(iov, idx);
+    /* problem on the socket, remove relay */
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Error TCP relay: %s\n", error_str);
+    turnserver_tcp_relay_remove(desc, relay);
+    return -1;
   }
 
   return 0;
 }
 
 /**
- * \brief Process message(s) in a single TCP stream.
- * \param buf data received
- * \param nb length of data
- * \param sock socket
- * \param saddr source address of the message
- * \param daddr destination address of the message
- * \param saddr_size sizeof addr
- * \param allocation_list list of allocations
- * \param account_list list of accounts
- * \param speer TLS peer if not NULL, the server accept TLS connection
+ * \brief Accept a connection on mod_tmpuser listen socket.
  */
-static void turnserver_process_tcp_stream(const char* buf, ssize_t nb,
-    struct socket_desc* sock, struct sockaddr* saddr, struct sockaddr* daddr,
-    socklen_t saddr_size, struct list_head* allocation_list,
-    struct list_head* account_list, struct tls_peer* speer)
+static void turnserver_handle_tmpuser_accept(void)
 {
-  char* tmp_buf = NULL;
-  size_t tmp_len = 0;
-  size_t tmp_nb = (size_t)nb;
+  int fd = accept(tmpuser_get_socket(), NULL, NULL);
 
-  /* maybe it is an incomplete message */
-  if(sock->buf_pos)
+  if(fd > 0)
   {
-    tmp_buf = sock->buf;
+    struct socket_desc* desc = malloc(sizeof(struct socket_desc));
 
-    /* check for buffer size */
-    if(sock->buf_pos + SYS_MIN(sizeof(sock->buf), tmp_nb) > sizeof(sock->buf))
+    if(desc)
     {
-      /* discard message */
-      debug(DBG_ATTR, "Buffer too small, discard TCP message.\n");
-      sock->buf_pos = 0;
-      sock->msg_len = 0;
-      return;
+      desc->sock = fd;
+      tmpuser_add_tcp_client(desc);
+
+      if(turnserver_event_set(fd, EVENT_READ, EVENT_TMPUSER_CLIENT, desc,
+            NULL) == -1)
+      {
+        tmpuser_remove_tcp_client(desc);
+        close(fd);
+        free(desc);
+      }
+    }
+    else
+    {
+      close(fd);
     }
+  }
+}
+
+/**
+ * \brief Receive and process a command from a mod_tmpuser client.
+ * \param sdesc remote client socket descriptor
+ */
+static void turnserver_handle_tmpuser_read(struct socket_desc* sdesc)
+{
+  char buf[8192];
+  ssize_t nb = recv(sdesc->sock, buf, sizeof(buf), 0);
+
+  if(nb > 0)
+  {
+    int r = tmpuser_process_msg(buf, nb);
 
-    /* concatenate bytes received */
-    memcpy(tmp_buf + sock->buf_pos, buf, SYS_MIN(sizeof(sock->buf), tmp_nb));
-    sock->buf_pos += tmp_nb;
-    /* fprintf(stderr, "Incomplete packet!\n"); */
-    tmp_nb = sock->buf_pos;
+    if(!r)
+    {
+      send(sdesc->sock, "success", sizeof("success"), 0);
+    }
+    else
+    {
+      send(sdesc->sock, "error", sizeof("error"), 0);
+    }
   }
   else
   {
-    tmp_buf = (char*)buf; /* after that don't modify buf */
+    turnserver_event_del(sdesc->sock, sdesc);
+    close(sdesc->sock);
+    tmpuser_remove_tcp_client(sdesc);
+    free(sdesc);
+  }
+}
+
+/**
+ * \brief Wait messages and process it (pselect() backend).
+ *
+ * The descriptor sets are rebuilt at each call from all the listen sockets,
+ * allocations, TCP relays and remote TCP clients.
+ * \param sockets all listen sockets
+ * \param tcp_socket_list list of TCP sockets
+ * \param allocation_list list of allocations
+ * \param account_list list of accounts
+ */
+static void turnserver_main(struct listen_sockets* sockets,
+    struct list_head* tcp_socket_list, struct list_head* allocation_list,
+    struct list_head* account_list)
+{
+  struct list_head* n = NULL;
+  struct list_head* get = NULL;
+  struct timespec tv;
+  long timeout = 0;
+  int nsock = -1;
+  int ret = -1;
+  sfd_set fdsr;
+  sfd_set fdsw;
+  long max_fd = 0;
+  char error_str[1024];
+  sigset_t mask;
+
+  max_fd = NET_SFD_SETSIZE;
+
+  if(max_fd <= 0)
+  {
+    /* should not happen on a POSIX.1 compliant-system */
+    g_run = 0;
+    debug(DBG_ATTR, "Cannot determine max open files for this system!\n");
+    return;
+  }
+
+  NET_SFD_ZERO(&fdsr);
+  NET_SFD_ZERO(&fdsw);
+
+  /* ensure that FD_SET will not overflow */
+  if(sockets->sock_udp >= max_fd || sockets->sock_tcp >= max_fd ||
+     (sockets->sock_tls && (sockets->sock_tls->sock >= max_fd)))
+  {
+    g_run = 0;
+    debug(DBG_ATTR, "Listen sockets cannot be set for select() (FD_SETSIZE "
+        "overflow)\n");
+    return;
   }
 
-  /* fprintf(stderr, "Received: %u, Have: %u\n", tmp_nb, tmp_nb); */
+  /* UDP and TCP listen socket (TCP one may be owned by another worker) */
+  NET_SFD_SET(sockets->sock_udp, &fdsr);
+  nsock = sockets->sock_udp;
 
-  while(tmp_nb)
+  if(sockets->sock_tcp > 0)
   {
-    if(tmp_nb < 4)
-    {
-      /* message too small, maybe
-       * incomplete ones
-       */
-      sock->buf_pos = tmp_nb;
+    NET_SFD_SET(sockets->sock_tcp, &fdsr);
+    nsock = SYS_MAX(nsock, sockets->sock_tcp);
+  }
 
-      if(sock->buf != tmp_buf)
-      {
-        memcpy(sock->buf, tmp_buf, sock->buf_pos);
-      }
-      break;
+  /* TLS socket */
+  if(turnserver_cfg_tls() && sockets->sock_tls)
+  {
+    NET_SFD_SET(sockets->sock_tls->sock, &fdsr);
+    nsock = SYS_MAX(nsock, sockets->sock_tls->sock);
+  }
+
+  /* DTLS socket */
+  if(turnserver_cfg_dtls() && sockets->sock_dtls)
+  {
+    NET_SFD_SET(sockets->sock_dtls->sock, &fdsr);
+    nsock = SYS_MAX(nsock, sockets->sock_dtls->sock);
+  }
+
+  /* TLS/DTLS handshakes finished by the threads */
+  if(tls_peer_handshake_fd() != -1)
+  {
+    NET_SFD_SET(tls_peer_handshake_fd(), &fdsr);
+    nsock = SYS_MAX(nsock, tls_peer_handshake_fd());
+  }
+
+  /* RFC6062 (TURN-TCP) */
+  /* remove TCP relays that timeout or exceed buffering limit */
+  turnserver_check_tcp_relays(sockets, allocation_list);
+
+  /* add UDP and TCP relayed sockets */
+  list_head_iterate_safe(allocation_list, get, n)
+  {
+    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+    struct list_head* get2 = NULL;
+    struct list_head* n2 = NULL;
+
+    /* paced relayed sockets are not read until their delay elapses */
+    if(tmp->relayed_sock < max_fd && !tmp->paced_until)
+    {
+      NET_SFD_SET(tmp->relayed_sock, &fdsr);
+      nsock = SYS_MAX(nsock, tmp->relayed_sock);
     }
 
-    if(!sock->msg_len)
+    /* RFC6062 (TURN-TCP) */
+    /* add peer and client data connection sockets */
+    list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
     {
-      uint16_t type = 0;
-      memcpy(&type, tmp_buf, 2);
-      type = ntohs(type);
+      struct allocation_tcp_relay* tmp2 = list_head_get(get2,
+          struct allocation_tcp_relay, list);
 
-      if(TURN_IS_CHANNELDATA(type))
+      if(tmp2->peer_sock > 0 && tmp2->peer_sock < max_fd)
       {
-        struct turn_channel_data* cdata = (struct turn_channel_data*)tmp_buf;
-        tmp_len = ntohs(cdata->turn_channel_len);
-
-        /* TCP, so padding mandatory */
-        if(ntohs(cdata->turn_channel_len) % 4)
+        /* if asynchronous connect() has not succeed yet,
+         * check again and send a Connect success
+         * response if socket is connected
+         */
+        if(tmp2->ready != 1)
         {
-          tmp_len += 4 - (tmp_len % 4);
+          /* add to select for write operations */
+          NET_SFD_SET(tmp2->peer_sock, &fdsw);
+          nsock = SYS_MAX(nsock, tmp2->peer_sock);
         }
 
-        /* size of ChannelData header */
-        tmp_len += 4;
-      }
-      else if(STUN_IS_REQUEST(type) || STUN_IS_INDICATION(type))
-      {
-        struct turn_msg_hdr* hdr = (struct turn_msg_hdr*)tmp_buf;
-        /* size of STUN header */
-        tmp_len = ntohs(hdr->turn_msg_len) + 20;
+        /* if client has not send its ConnectionBind yet, or if userspace
+         * buffering is not enable, OS will perform buffering
+         */
+        if(tmp2->client_sock != -1 || turnserver_cfg_tcp_buffer_userspace())
+        {
+          NET_SFD_SET(tmp2->peer_sock, &fdsr);
+          nsock = SYS_MAX(nsock, tmp2->peer_sock);
+        }
       }
-      else
+
+      if(tmp2->client_sock > 0 && tmp2->client_sock < max_fd)
       {
-        debug(DBG_ATTR, "Not a STUN request or TURN ChannelData!\n");
-        sock->buf_pos = 0;
-        sock->msg_len = 0;
-        break;
+        NET_SFD_SET(tmp2->client_sock, &fdsr);
+        nsock = SYS_MAX(nsock, tmp2->client_sock);
       }
     }
-    else
-    {
-      /* next message length is already known */
-      tmp_len = sock->msg_len;
-    }
+  }
 
-    /* fprintf(stderr, "Received: %u, Need %u bytes, Have %u bytes\n", tmp_nb,
-         tmp_len, tmp_len);
-    */
+  /* add TCP remote sockets */
+  list_head_iterate_safe(tcp_socket_list, get, n)
+  {
+    struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
 
-    if(tmp_nb < tmp_len)
+    /* TCP remote socket */
+    if(tmp->sock < max_fd && tmp->sock > 0)
     {
-      /* incomplete message */
-      debug(DBG_ATTR, "Incomplete message\n");
-
-      sock->msg_len = tmp_len;
-      sock->buf_pos = SYS_MIN(sizeof(sock->buf), tmp_nb);
-      if(sock->buf != tmp_buf)
-      {
-        memcpy(sock->buf, tmp_buf, sock->buf_pos);
-      }
-
-      /* fprintf(stderr, "State, msg_len: %u, buf_pos: %u\n", sock->msg_len,
-           sock->buf_pos);
-      */
-      break;
+      NET_SFD_SET(tmp->sock, &fdsr);
+      nsock = SYS_MAX(nsock, tmp->sock);
     }
-
-    if(turnserver_listen_recv(IPPROTO_TCP, sock->sock, tmp_buf, tmp_len, saddr,
-          daddr, saddr_size, allocation_list, account_list, speer) == -1)
+    else
     {
-      debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
+      /* TCP connection after ConnectionBind, must be removed */
+      list_head_remove(&tmp->list, &tmp->list);
+      turnserver_socket_desc_free(tmp);
     }
+  }
 
-    tmp_nb -= tmp_len;
-    tmp_buf += tmp_len;
-    sock->msg_len = 0;
+  /* mod_tmpuser */
+  if(turnserver_cfg_mod_tmpuser())
+  {
+    int tmpuser_sock = tmpuser_get_socket();
+    struct list_head* tmpuser_list = tmpuser_get_tcp_clients();
 
-    if(sock->buf_pos != 0)
+    /* listen socket */
+    if(tmpuser_sock < max_fd && tmpuser_sock > 0)
     {
-      /* decrement buffer position */
-      sock->buf_pos -= tmp_len;
+      NET_SFD_SET(tmpuser_sock, &fdsr);
+      nsock = SYS_MAX(nsock, tmpuser_sock);
     }
 
-    /*
-    fprintf(stderr, "tmp_nb: %u, sock->buf_pos: %u\n", tmp_nb, sock->buf_pos);
-    */
-  }
-}
+    /* add mod_tmpuser's TCP remote sockets */
+    list_head_iterate_safe(tmpuser_list, get, n)
+    {
+      struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
 
-/**
- * \brief Check if server can relay specific address with its current
- * configuration.
- *
- * For example if IPv6 is disabled, the server will drop immediately packets
- * coming from an IPv6-only client.
- * \param listen_address IPv4 listen address
- * \param listen_addressv6 IPv6 listen_address (could be NULL if IPv6 is
- * disabled)
- * \param saddr source address of client
- * \return 1 if the server can relay data for this client,
- * 0 otherwise
- */
-static int turnserver_check_relay_address(char* listen_address,
-    char* listen_addressv6, struct sockaddr_storage* saddr)
-{
-  if((!listen_addressv6 && (saddr->ss_family == AF_INET6 && !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))) ||
-     (!listen_address && (saddr->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)saddr)->sin6_addr))) ||
-     (!listen_address && saddr->ss_family == AF_INET))
-  {
-    return 0;
+      if(tmp->sock < max_fd && tmp->sock > 0)
+      {
+        NET_SFD_SET(tmp->sock, &fdsr);
+        nsock = SYS_MAX(nsock, tmp->sock);
+      }
+    }
   }
 
-  return 1;
-}
-
-/**
- * \brief Handle state of remote peer asynchronous TCP connect() (RFC6062).
- * \param sock TCP socket
- * \param relay TCP relay descriptor
- * \param desc allocation descriptor
- * \param speer TLS peer, if not NULL send data in TLS
- * \return -1 if timeout or error which means that server have to send
- * a 447 error, -2 if system error happens and 0 if connect() succeed
- */
-static int turnserver_handle_tcp_connect(int sock,
-    struct allocation_tcp_relay* relay, struct allocation_desc* desc,
-    struct tls_peer* speer)
-{
-  int err = 0;
-  socklen_t err_size = sizeof(int);
-  struct iovec iov[8];
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  struct sockaddr* saddr = (struct sockaddr*)&desc->tuple.client_addr;
-  socklen_t saddr_size = sockaddr_get_size(&desc->tuple.client_addr);
-  long flags = 0;
-  int ret = 0;
+  nsock++;
 
-  if(getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_size) == -1)
-  {
-    return -2;
-  }
+  /* timeout */
+  timeout = turnserver_pacing_timeout(1000);
+  tv.tv_sec = timeout / 1000;
+  tv.tv_nsec = (timeout % 1000) * 1000000;
 
-  if(err != 0)
-  {
-    return -1;
-  }
+  /* signal blocked */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGPIPE);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
 
-  if(!(hdr = turn_msg_connect_response_create(0, relay->connect_msg_id,
-          &iov[idx])))
-  {
-    return -2;
-  }
-  idx++;
+  ret = pselect(nsock, (fd_set*)(void*)&fdsr, (void*)&fdsw, NULL, &tv, &mask);
+  turnserver_clock_update();
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+  if(ret > 0)
   {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
-  }
+    /* main UDP listen socket */
+    if(net_sfd_has_data(sockets->sock_udp, max_fd, &fdsr))
+    {
+      turnserver_handle_udp_read(sockets, allocation_list, account_list);
+    }
 
-  if(!(attr = turn_attr_connection_id_create(relay->connection_id,
-          &iov[idx])))
-  {
-    net_iovec_free_data(iov, idx);
-    return -2;
-  }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
+    /* main DTLS listen socket */
+    if(sockets->sock_dtls && net_sfd_has_data(sockets->sock_dtls->sock, max_fd,
+          &fdsr))
+    {
+      turnserver_handle_dtls_read(sockets, allocation_list, account_list);
+    }
 
-  if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-      == -1)
-  {
-    net_iovec_free_data(iov, idx);
-    return -2;
-  }
+    /* TLS/DTLS handshakes finished by the threads */
+    if(tls_peer_handshake_fd() != -1 &&
+       net_sfd_has_data(tls_peer_handshake_fd(), max_fd, &fdsr))
+    {
+      turnserver_handle_handshakes(sockets, tcp_socket_list, allocation_list,
+          account_list);
+    }
 
-  /* send message */
-  ret = turn_send_message(IPPROTO_TCP, desc->tuple_sock, speer, saddr,
-      saddr_size, ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov,
-      idx);
+    /* remote TCP sockets */
+    list_head_iterate_safe(tcp_socket_list, get, n)
+    {
+      struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
 
-  net_iovec_free_data(iov, idx);
+      if(net_sfd_has_data(tmp->sock, max_fd, &fdsr))
+      {
+        turnserver_handle_tcp_read(tmp, sockets, allocation_list,
+            account_list);
+      }
+    }
 
-  if(ret == -1)
-  {
-    debug(DBG_ATTR, "turn_send_message failed\n");
-    return -2;
-  }
-  else
-  {
-    /* back to blocking mode */
-    if((flags = fcntl(sock, F_GETFL, NULL)) == -1)
+    /* main TCP listen socket */
+    if(net_sfd_has_data(sockets->sock_tcp, max_fd, &fdsr))
     {
-      return -2;
+      debug(DBG_ATTR, "Received TCP on listening address\n");
+      turnserver_handle_tcp_accept(sockets->sock_tcp, tcp_socket_list, 0);
     }
 
-    flags &= (~O_NONBLOCK);
-
-    if(fcntl(sock, F_SETFL, flags) == -1)
+    /* main TLS listen socket */
+    if(sockets->sock_tls && net_sfd_has_data(sockets->sock_tls->sock, max_fd,
+          &fdsr))
     {
-      return -2;
+      debug(DBG_ATTR, "Received TLS on listening address\n");
+      turnserver_handle_tcp_accept(sockets->sock_tls->sock, tcp_socket_list, 1);
     }
 
-    /* connect() succeed, mark as ready */
-    relay->ready = 1;
-  }
-
-  return 0;
-}
+    /* relayed UDP-based addresses and TCP-based relayed listen addresses */
+    list_head_iterate_safe(allocation_list, get, n)
+    {
+      struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
+      struct list_head* get2 = NULL;
+      struct list_head* n2 = NULL;
 
-/**
- * \brief Handle incoming TCP connection (RFC6062).
- * \param sock TCP listen socket
- * \param desc allocation descriptor
- * \param speer TLS peer, if not NULL send data in TLS
- */
-static void turnserver_handle_tcp_incoming_connection(int sock,
-    struct allocation_desc* desc, struct tls_peer* speer)
-{
-  int family = 0;
-  uint8_t peer_addr[16];
-  uint16_t peer_port = 0;
-  uint32_t id = 0;
-  uint8_t msg_id[12]; /* for ConnectionAttempt message ID */
-  size_t idx = 0;
-  struct turn_msg_hdr* hdr = NULL;
-  struct turn_attr_hdr* attr = NULL;
-  struct iovec iov[8];
-  int rsock = -1;
-  struct sockaddr_storage saddr;
-  socklen_t saddr_size = sizeof(struct sockaddr_storage);
-  size_t buffer_size = turnserver_cfg_tcp_buffer_userspace() ?
-    turnserver_cfg_tcp_buffer_size() : 0;
+      /* relayed address */
+      if(net_sfd_has_data(tmp->relayed_sock, max_fd, &fdsr))
+      {
+        turnserver_handle_relayed_read(tmp, sockets, allocation_list);
+      }
 
-  rsock = accept(sock, (struct sockaddr*)&saddr, &saddr_size);
+      /* RFC6062 (TURN-TCP) */
+      /* relayed TCP-based addresses */
+      list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
+      {
+        struct allocation_tcp_relay* tmp2 = list_head_get(get2,
+            struct allocation_tcp_relay, list);
 
-  if(rsock == -1)
-  {
-    debug(DBG_ATTR,
-        "Cannot process incoming TCP connection on listening socket.\n");
-    return;
-  }
+        if(!tmp2->ready && net_sfd_has_data(tmp2->peer_sock, max_fd, &fdsw))
+        {
+          turnserver_handle_tcp_relay_connect(tmp, tmp2, sockets);
+        }
+        else if(net_sfd_has_data(tmp2->peer_sock, max_fd, &fdsr))
+        {
+          if(turnserver_handle_tcp_relay_peer_read(tmp, tmp2) == -1 ||
+             tmp2->client_sock == -1)
+          {
+            /* relay removed or client_sock is not set so process next TCP
+             * relay
+             */
+            continue;
+          }
+        }
 
-  if(!allocation_desc_find_permission_sockaddr(desc, (struct sockaddr*)&saddr))
-  {
-    /* no permission installed so close socket */
-    close(rsock);
-    return;
-  }
+        if(net_sfd_has_data(tmp2->client_sock, max_fd, &fdsr))
+        {
+          turnserver_handle_tcp_relay_client_read(tmp, tmp2);
+        }
+      }
+    }
 
-  /* generate unique ID */
-  crypto_random_bytes_generate((uint8_t*)&id, 4);
+    /* mod_tmpuser */
+    if(turnserver_cfg_mod_tmpuser())
+    {
+      /* listen socket */
+      if(net_sfd_has_data(tmpuser_get_socket(), max_fd, &fdsr))
+      {
+        turnserver_handle_tmpuser_accept();
+      }
 
-  turn_generate_transaction_id(msg_id);
+      /* remote TCP client */
+      list_head_iterate_safe(tmpuser_get_tcp_clients(), get, n)
+      {
+        struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
 
-  switch(saddr.ss_family)
-  {
-    case AF_INET:
-      family = AF_INET;
-      memcpy(peer_addr, &((struct sockaddr_in*)&saddr)->sin_addr, 4);
-      peer_port = ntohs(((struct sockaddr_in*)&saddr)->sin_port);
-      break;
-    case AF_INET6:
-      family = AF_INET6;
-      memcpy(peer_addr, &((struct sockaddr_in6*)&saddr)->sin6_addr, 16);
-      peer_port = ntohs(((struct sockaddr_in6*)&saddr)->sin6_port);
-      break;
-    default:
-      return;
-      break;
+        if(net_sfd_has_data(tmp->sock, max_fd, &fdsr))
+        {
+          turnserver_handle_tmpuser_read(tmp);
+        }
+      }
+    }
   }
-
-  /* add it to allocation */
-  if(allocation_desc_add_tcp_relay(desc, id, rsock, family, peer_addr,
-        peer_port, TURN_DEFAULT_TCP_RELAY_TIMEOUT, buffer_size, NULL) == -1)
+  else if(ret == -1)
   {
-    close(rsock);
-    return;
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "select() failed: %s\n", error_str);
   }
+}
 
-  /* now send ConnectionAttempt to client */
-  if(!(hdr = turn_msg_connectionattempt_indication_create(0, msg_id,
-          &iov[idx])))
+/**
+ * \brief Register listen sockets in the event loop (epoll backend).
+ * \param sockets all listen sockets
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_event_listen(struct listen_sockets* sockets)
+{
+  if(turnserver_event_set(sockets->sock_udp, EVENT_READ, EVENT_LISTEN_UDP,
+        NULL, NULL) == -1)
   {
-    /* ignore ? */
-    close(rsock);
-    return;
+    return -1;
   }
-  idx++;
 
-  /* software (not fatal if it cannot be allocated) */
-  if((attr = turn_attr_software_create(SOFTWARE_DESCRIPTION,
-          sizeof(SOFTWARE_DESCRIPTION) - 1, &iov[idx])))
+  if(sockets->sock_tcp > 0 && turnserver_event_set(sockets->sock_tcp,
+        EVENT_READ, EVENT_LISTEN_TCP, NULL, NULL) == -1)
   {
-    hdr->turn_msg_len += iov[idx].iov_len;
-    idx++;
+    return -1;
   }
 
-  if(!(attr = turn_attr_connection_id_create(id, &iov[idx])))
+  if(sockets->sock_tls && turnserver_event_set(sockets->sock_tls->sock,
+        EVENT_READ, EVENT_LISTEN_TLS, NULL, NULL) == -1)
   {
-    close(rsock);
-    net_iovec_free_data(iov, idx);
-    return;
+    return -1;
   }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
 
-  if(!(attr = turn_attr_xor_peer_address_create((struct sockaddr*)&saddr,
-          STUN_MAGIC_COOKIE, msg_id, &iov[idx])))
+  if(sockets->sock_dtls && turnserver_event_set(sockets->sock_dtls->sock,
+        EVENT_READ, EVENT_LISTEN_DTLS, NULL, NULL) == -1)
   {
-    close(rsock);
-    net_iovec_free_data(iov, idx);
-    return;
+    return -1;
   }
-  hdr->turn_msg_len += iov[idx].iov_len;
-  idx++;
 
-  if(turn_add_message_integrity(iov, &idx, desc->key, sizeof(desc->key), 1)
-      == -1)
+  if(tls_peer_handshake_fd() != -1 && turnserver_event_set(
+        tls_peer_handshake_fd(), EVENT_READ, EVENT_HANDSHAKE, NULL, NULL) == -1)
   {
-    close(rsock);
-    net_iovec_free_data(iov, idx);
-    return;
+    return -1;
   }
 
-  /* send message */
-  if(turn_send_message(IPPROTO_TCP, desc->tuple_sock, speer,
-        (struct sockaddr*)&desc->tuple.client_addr,
-        sockaddr_get_size(&desc->tuple.client_addr),
-        ntohs(hdr->turn_msg_len) + sizeof(struct turn_msg_hdr), iov, idx)
-      == -1)
+  if(turnserver_cfg_mod_tmpuser() && tmpuser_get_socket() > 0 &&
+     turnserver_event_set(tmpuser_get_socket(), EVENT_READ,
+       EVENT_TMPUSER_LISTEN, NULL, NULL) == -1)
   {
-    debug(DBG_ATTR, "turn_send_message failed\n");
+    return -1;
   }
 
-  net_iovec_free_data(iov, idx);
-  return;
-}
-
-/**
- * \brief Handle TCP or TLS over TCP accept().
- * \param sock listen TCP or TLS socket
- * \param tcp_socket_list list of remote TCP sockets
- * \param tls if socket use TLS (connect on TLS port)
- */
-static void turnserver_handle_tcp_accept(int sock,
-    struct list_head* tcp_socket_list, int tls)
-{
-  struct socket_desc* sdesc = NULL;
-  struct sockaddr_storage saddr;
-  socklen_t saddr_size = 0;
-  char* listen_address = turnserver_cfg_listen_address();
-  char* listen_addressv6 = turnserver_cfg_listen_addressv6();
-  char* proto = NULL;
-  int rsock = accept(sock, (struct sockaddr*)&saddr, &saddr_size);
-
-  (void)proto; /* avoid compilation warning in release mode */
-
-  if(rsock > 0)
-  {
-    if(!turnserver_check_relay_address(listen_address, listen_addressv6,
-          &saddr))
-    {
-      /* don't relay the specified address family so close connection */
-      proto = (saddr.ss_family == AF_INET6 &&
-          !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)&saddr)->sin6_addr))
-        ? "IPv6" : "IPv4";
-      debug(DBG_ATTR, "Do not relay family: %s\n", proto);
-      close(rsock);
-    }
-    else
-    {
-      if(!(sdesc = malloc(sizeof(struct socket_desc))))
-      {
-        close(rsock);
-      }
-      else
-      {
-        /* initialize */
-        sdesc->buf_pos = 0;
-        sdesc->msg_len = 0;
-        sdesc->tls = tls;
-        sdesc->sock = rsock;
-
-        /* add it to the list */
-        list_head_add(tcp_socket_list, &sdesc->list);
-      }
-    }
-  }
+  return 0;
 }
 
 /**
- * \brief Wait messages and process it.
+ * \brief Wait messages and process it (epoll backend).
+ *
+ * Sockets are registered once when they are created so only the ready ones
+ * are processed, whatever the number of allocations.
  * \param sockets all listen sockets
  * \param tcp_socket_list list of TCP sockets
  * \param allocation_list list of allocations
  * \param account_list list of accounts
  */
-static void turnserver_main(struct listen_sockets* sockets,
+static void turnserver_main_epoll(struct listen_sockets* sockets,
     struct list_head* tcp_socket_list, struct list_head* allocation_list,
     struct list_head* account_list)
 {
-  struct list_head* n = NULL;
-  struct list_head* get = NULL;
-  struct timespec tv;
-  int nsock = -1;
-  int ret = -1;
-  sfd_set fdsr;
-  sfd_set fdsw;
-  long max_fd = 0;
+#ifdef HAVE_SYS_EPOLL_H
+  static time_t last_check = 0;
   char error_str[1024];
   sigset_t mask;
-  char buf[8192];
-  struct sockaddr_storage saddr;
-  socklen_t saddr_size = sizeof(struct sockaddr_storage);
-  struct sockaddr_storage daddr;
-  socklen_t daddr_size = sizeof(struct sockaddr_storage);
-  ssize_t nb = -1;
-  char* proto = NULL;
-  char* listen_address = turnserver_cfg_listen_address();
-  char* listen_addressv6 = turnserver_cfg_listen_addressv6();
-
-  (void)proto;
-
-  max_fd = NET_SFD_SETSIZE;
-
-  if(max_fd <= 0)
-  {
-    /* should not happen on a POSIX.1 compliant-system */
-    g_run = 0;
-    debug(DBG_ATTR, "Cannot determine max open files for this system!\n");
-    return;
-  }
-
-  NET_SFD_ZERO(&fdsr);
-  NET_SFD_ZERO(&fdsw);
-
-  /* ensure that FD_SET will not overflow */
-  if(sockets->sock_udp >= max_fd || sockets->sock_tcp >= max_fd ||
-     (sockets->sock_tls && (sockets->sock_tls->sock >= max_fd)))
-  {
-    g_run = 0;
-    debug(DBG_ATTR, "Listen sockets cannot be set for select() (FD_SETSIZE "
-        "overflow)\n");
-    return;
-  }
+  int ret = -1;
+  int i = 0;
 
-  /* UDP and TCP listen socket */
-  NET_SFD_SET(sockets->sock_udp, &fdsr);
-  NET_SFD_SET(sockets->sock_tcp, &fdsr);
+  /* signal blocked */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGPIPE);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
 
-  nsock = SYS_MAX(sockets->sock_udp, sockets->sock_tcp);
+  ret = epoll_pwait(g_epoll_fd, g_events_ready, EVENT_MAX_READY,
+      (int)turnserver_pacing_timeout(1000), &mask);
+  turnserver_clock_update();
 
-  /* TLS socket */
-  if(turnserver_cfg_tls() && sockets->sock_tls)
+  if(ret == -1)
   {
-    NET_SFD_SET(sockets->sock_tls->sock, &fdsr);
-    nsock = SYS_MAX(nsock, sockets->sock_tls->sock);
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "epoll_pwait() failed: %s\n", error_str);
   }
 
-  /* DTLS socket */
-  if(turnserver_cfg_dtls() && sockets->sock_dtls)
-  {
-    NET_SFD_SET(sockets->sock_dtls->sock, &fdsr);
-    nsock = SYS_MAX(nsock, sockets->sock_dtls->sock);
-  }
+  g_events_ready_nb = ret > 0 ? ret : 0;
 
-  /* add UDP and TCP relayed sockets */
-  list_head_iterate_safe(allocation_list, get, n)
+  for(i = 0 ; i < g_events_ready_nb ; i++)
   {
-    struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
-    struct list_head* get2 = NULL;
-    struct list_head* n2 = NULL;
+    int sock = g_events_ready[i].data.fd;
+    struct turnserver_event ev;
 
-    if(tmp->relayed_sock < max_fd)
+    /* removed while processing a previous ready socket */
+    if(sock == -1)
     {
-      NET_SFD_SET(tmp->relayed_sock, &fdsr);
-      nsock = SYS_MAX(nsock, tmp->relayed_sock);
+      continue;
     }
 
-    /* RFC6062 (TURN-TCP) */
-    /* add peer and client data connection sockets */
-    list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
-    {
-      struct allocation_tcp_relay* tmp2 = list_head_get(get2,
-          struct allocation_tcp_relay, list);
+    /* copy it, g_events may be reallocated by handlers */
+    ev = g_events[sock];
 
-      if(tmp2->peer_sock > 0 && tmp2->peer_sock < max_fd)
-      {
-        /* if asynchronous connect() has not succeed yet,
-         * check again and send a Connect success
-         * response if socket is connected
-         */
-        if(tmp2->peer_sock != -1 && tmp2->ready != 1)
+    switch(ev.type)
+    {
+      case EVENT_LISTEN_UDP:
+        turnserver_handle_udp_read(sockets, allocation_list, account_list);
+        break;
+      case EVENT_LISTEN_DTLS:
+        turnserver_handle_dtls_read(sockets, allocation_list, account_list);
+        break;
+      case EVENT_DTLS_CLIENT:
+        turnserver_handle_dtls_client_read(sockets, ev.data, allocation_list,
+            account_list);
+        break;
+      case EVENT_HANDSHAKE:
+        turnserver_handle_handshakes(sockets, tcp_socket_list,
+            allocation_list, account_list);
+        break;
+      case EVENT_LISTEN_TCP:
+        debug(DBG_ATTR, "Received TCP on listening address\n");
+        turnserver_handle_tcp_accept(sock, tcp_socket_list, 0);
+        break;
+      case EVENT_LISTEN_TLS:
+        debug(DBG_ATTR, "Received TLS on listening address\n");
+        turnserver_handle_tcp_accept(sock, tcp_socket_list, 1);
+        break;
+      case EVENT_TCP_CLIENT:
         {
-          /* check if connect() timeout (with value define in RFC6062) */
-          if((tmp2->created + TURN_DEFAULT_TCP_CONNECT_TIMEOUT) <= time(NULL))
-          {
-            debug(DBG_ATTR, "TCP connect() timeout\n");
-
-            /* send error and remove relay */
-            turnserver_send_error(IPPROTO_TCP, tmp->tuple_sock,
-                TURN_METHOD_CONNECT, tmp2->connect_msg_id, 447,
-                (struct sockaddr*)&tmp->tuple.client_addr,
-                sockaddr_get_size(&tmp->tuple.client_addr), sockets->sock_tls,
-                NULL);
-
-            /* protect the removing of the expired list if any */
-            turnserver_block_realtime_signal();
-            allocation_tcp_relay_set_timer(tmp2, 0); /* stop timeout */
-            /* in case TCP relay has expired during this statement */
-            list_head_remove(&tmp2->list2, &tmp2->list2);
-            turnserver_unblock_realtime_signal();
-            allocation_tcp_relay_list_remove(&tmp->tcp_relays, tmp2);
-            continue;
-          }
-          else
+          struct socket_desc* sdesc = ev.data;
+
+          if(turnserver_handle_tcp_read(sdesc, sockets, allocation_list,
+                account_list) == 0 && sdesc->sock == -1)
           {
-            /* add to select for write operations */
-            NET_SFD_SET(tmp2->peer_sock, &fdsw);
-            nsock = SYS_MAX(nsock, tmp2->peer_sock);
+            /* TCP connection after ConnectionBind, the socket now belongs to
+             * a TCP relay
+             */
+            list_head_remove(&sdesc->list, &sdesc->list);
+            turnserver_socket_desc_free(sdesc);
           }
         }
-
-        /* if client has not send its ConnectionBind yet, or if userspace
-         * buffering is not enable, OS will perform buffering
-         */
-        if(tmp2->client_sock != -1 || turnserver_cfg_tcp_buffer_userspace())
+        break;
+      case EVENT_RELAYED:
+        turnserver_handle_relayed_read(ev.desc, sockets, allocation_list);
+        break;
+      case EVENT_TCP_RELAY_PEER:
+        if(!((struct allocation_tcp_relay*)ev.data)->ready)
         {
-          NET_SFD_SET(tmp2->peer_sock, &fdsr);
-          nsock = SYS_MAX(nsock, tmp2->peer_sock);
+          turnserver_handle_tcp_relay_connect(ev.desc, ev.data, sockets);
         }
         else
         {
-          /* here, buffering is done in OS
-           * but see if TCP receive buffer size does
-           * not exceed the limit.
-           */
-          uint32_t val = 0;
-
-          /* use FIONREAD (same as SIOCINQ) to see how much
-           * ready-to-read bytes are in TCP receive queue
-           */
-          if(ioctl(tmp2->peer_sock, FIONREAD, &val) >= 0)
-          {
-            if(val > turnserver_cfg_tcp_buffer_size())
-            {
-              /* limit exceeded, remove TCP relay */
-              debug(DBG_ATTR, "Exceed TCP buffer size limit (OS buffering)!\n");
-
-              /* protect the removing of the expired list if any */
-              turnserver_block_realtime_signal();
-              allocation_tcp_relay_set_timer(tmp2, 0); /* stop timeout */
-              /* in case TCP relay has expired during this statement */
-              list_head_remove(&tmp2->list2, &tmp2->list2);
-              turnserver_unblock_realtime_signal();
-              allocation_tcp_relay_list_remove(&tmp->tcp_relays, tmp2);
-              continue;
-            }
-          }
+          turnserver_handle_tcp_relay_peer_read(ev.desc, ev.data);
         }
-      }
+        break;
+      case EVENT_TCP_RELAY_CLIENT:
+        turnserver_handle_tcp_relay_client_read(ev.desc, ev.data);
+        break;
+      case EVENT_TMPUSER_LISTEN:
+        turnserver_handle_tmpuser_accept();
+        break;
+      case EVENT_TMPUSER_CLIENT:
+        turnserver_handle_tmpuser_read(ev.data);
+        break;
+      default:
+        break;
+    }
+  }
+
+  g_events_ready_nb = 0;
+
+  /* RFC6062 (TURN-TCP) */
+  /* timeouts are expressed in seconds, check TCP relays once per second */
+  if(g_now != last_check)
+  {
+    last_check = g_now;
+    turnserver_check_tcp_relays(sockets, allocation_list);
+  }
+#else
+  (void)sockets;
+  (void)tcp_socket_list;
+  (void)allocation_list;
+  (void)account_list;
+#endif
+}
+
+/**
+ * \brief Close a set of listen sockets.
+ * \param sockets listen sockets
+ */
+static void turnserver_listen_sockets_close(struct listen_sockets* sockets)
+{
+  if(sockets->sock_udp > 0)
+  {
+    close(sockets->sock_udp);
+    sockets->sock_udp = -1;
+  }
 
-      if(tmp2->client_sock > 0 && tmp2->client_sock < max_fd)
-      {
-        NET_SFD_SET(tmp2->client_sock, &fdsr);
-        nsock = SYS_MAX(nsock, tmp2->client_sock);
-      }
-    }
+  if(sockets->sock_tcp > 0)
+  {
+    close(sockets->sock_tcp);
+    sockets->sock_tcp = -1;
   }
 
-  /* add TCP remote sockets */
-  list_head_iterate_safe(tcp_socket_list, get, n)
+  if(sockets->sock_tls)
   {
-    struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
+    tls_peer_free(&sockets->sock_tls);
+  }
 
-    /* TCP remote socket */
-    if(tmp->sock < max_fd && tmp->sock > 0)
-    {
-      NET_SFD_SET(tmp->sock, &fdsr);
-      nsock = SYS_MAX(nsock, tmp->sock);
-    }
-    else
-    {
-      /* TCP connection after ConnectionBind, must be removed */
-      list_head_remove(&tmp->list, &tmp->list);
-      free(tmp);
-    }
+  if(sockets->sock_dtls)
+  {
+    tls_peer_free(&sockets->sock_dtls);
   }
+}
 
-  /* mod_tmpuser */
-  if(turnserver_cfg_mod_tmpuser())
+/**
+ * \brief Create the listen sockets of the workers.
+ *
+ * The first worker uses the listen sockets already created. The other ones
+ * get their own UDP socket bound on the same port with SO_REUSEPORT so the
+ * kernel always dispatches the packets of a client 5-tuple to the same
+ * worker. The TCP socket is shared the same way only if TURN-TCP is disabled
+ * because the data connection of a ConnectionBind has to reach the worker that
+ * owns the allocation. TLS and DTLS are handled by the first worker only.
+ * \param sockets listen sockets of the first worker
+ * \param listen_addr listen address
+ * \param nb number of workers
+ * \return 0 if success, -1 otherwise
+ */
+static int turnserver_workers_init(struct listen_sockets* sockets,
+    const char* listen_addr, size_t nb)
+{
+  size_t i = 0;
+
+  if(!(g_workers = calloc(nb, sizeof(struct turnserver_worker))))
   {
-    int tmpuser_sock = tmpuser_get_socket();
-    struct list_head* tmpuser_list = tmpuser_get_tcp_clients();
+    return -1;
+  }
 
-    /* listen socket */
-    if(tmpuser_sock < max_fd && tmpuser_sock > 0)
+  g_workers_nb = nb;
+  memcpy(&g_workers[0].sockets, sockets, sizeof(struct listen_sockets));
+
+  for(i = 1 ; i < nb ; i++)
+  {
+    struct listen_sockets* s = &g_workers[i].sockets;
+
+    s->sock_tcp = -1;
+    s->sock_tls = NULL;
+    s->sock_dtls = NULL;
+
+    s->sock_udp = net_socket_create(IPPROTO_UDP, listen_addr,
+        turnserver_cfg_udp_port(), NET_REUSE_PORT, 0);
+
+    if(s->sock_udp == -1)
     {
-      NET_SFD_SET(tmpuser_sock, &fdsr);
-      nsock = SYS_MAX(nsock, tmpuser_sock);
+      return -1;
     }
 
-    /* add mod_tmpuser's TCP remote sockets */
-    list_head_iterate_safe(tmpuser_list, get, n)
+    turnserver_listen_udp_init(s->sock_udp, &s->addr_udp);
+
+    if(!turnserver_cfg_turn_tcp())
     {
-      struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
+      s->sock_tcp = net_socket_create(IPPROTO_TCP, listen_addr,
+          turnserver_cfg_tcp_port(), NET_REUSE_ADDR | NET_REUSE_PORT, 1);
 
-      if(tmp->sock < max_fd && tmp->sock > 0)
+      if(s->sock_tcp == -1 || listen(s->sock_tcp, 5) == -1)
       {
-        NET_SFD_SET(tmp->sock, &fdsr);
-        nsock = SYS_MAX(nsock, tmp->sock);
+        return -1;
       }
     }
   }
 
-  nsock++;
+  return 0;
+}
 
-  /* timeout */
-  tv.tv_sec = 1;
-  tv.tv_nsec = 0;
+/**
+ * \brief Close the listen sockets of the workers and free them.
+ * \param keep index of the worker which keeps its sockets
+ */
+static void turnserver_workers_free(size_t keep)
+{
+  size_t i = 0;
 
-  /* signal blocked */
+  for(i = 0 ; i < g_workers_nb ; i++)
+  {
+    if(i != keep)
+    {
+      turnserver_listen_sockets_close(&g_workers[i].sockets);
+    }
+  }
+
+  free(g_workers);
+  g_workers = NULL;
+  g_workers_nb = 0;
+}
+
+/**
+ * \brief Start a worker process.
+ *
+ * In the worker, the signal mask is restored, the listen sockets of the other
+ * workers are closed and sockets is set to the worker ones.
+ * \param index index of the worker
+ * \param sockets listen sockets, modified in the worker process
+ * \param mask signal mask to restore in the worker process
+ * \return PID of the worker in the supervisor, 0 in the worker, -1 if error
+ */
+static pid_t turnserver_worker_start(size_t index,
+    struct listen_sockets* sockets, const sigset_t* mask)
+{
+  pid_t pid = fork();
+
+  if(pid == -1)
+  {
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "fork() failed: %s\n", error_str);
+    syslog(LOG_ERR, "Cannot start worker %u: %s", (unsigned int)index,
+        error_str);
+    return -1;
+  }
+
+  if(pid == 0)
+  {
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+
+    memcpy(sockets, &g_workers[index].sockets, sizeof(struct listen_sockets));
+    turnserver_workers_free(index);
+
+    /* each worker has its own slice of relayed ports */
+    g_worker_index = index;
+    srand(time(NULL) + getpid());
+
+    debug(DBG_ATTR, "Worker %u started\n", (unsigned int)index);
+    return 0;
+  }
+
+  g_workers[index].pid = pid;
+  g_workers[index].start = time(NULL);
+  return pid;
+}
+
+/**
+ * \brief Start the workers and supervise them.
+ *
+ * The supervisor forwards SIGHUP and SIGUSR1 to the workers, restarts a worker that dies
+ * unexpectedly and stops them when it receives SIGINT or SIGTERM.
+ * \param sockets listen sockets, set to the worker ones in a worker process
+ * \return 0 in a worker process, 1 in the supervisor when it has to exit
+ */
+static int turnserver_workers_run(struct listen_sockets* sockets)
+{
+  struct sigaction sa;
+  sigset_t mask;
+  sigset_t oldmask;
+  size_t i = 0;
+  size_t running = 0;
+
+  sa.sa_handler = signal_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+
+  if(sigaction(SIGCHLD, &sa, NULL) == -1)
+  {
+    debug(DBG_ATTR, "SIGCHLD will not be catched\n");
+  }
+
+  /* signals are only handled in sigsuspend() to avoid race conditions */
   sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGHUP);
   sigaddset(&mask, SIGINT);
   sigaddset(&mask, SIGTERM);
-  sigaddset(&mask, SIGPIPE);
-  sigaddset(&mask, SIGHUP);
   sigaddset(&mask, SIGUSR1);
-  sigaddset(&mask, SIGUSR2);
-  sigaddset(&mask, SIGRT_EXPIRE_ALLOCATION);
-  sigaddset(&mask, SIGRT_EXPIRE_PERMISSION);
-  sigaddset(&mask, SIGRT_EXPIRE_CHANNEL);
-  sigaddset(&mask, SIGRT_EXPIRE_TOKEN);
-
-  ret = pselect(nsock, (fd_set*)(void*)&fdsr, (void*)&fdsw, NULL, &tv, &mask);
+  sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-  if(ret > 0)
+  for(i = 0 ; i < g_workers_nb ; i++)
   {
-    /* main UDP listen socket */
-    if(net_sfd_has_data(sockets->sock_udp, max_fd, &fdsr))
+    pid_t pid = turnserver_worker_start(i, sockets, &oldmask);
+
+    if(pid == 0)
+    {
+      return 0;
+    }
+    else if(pid > 0)
     {
-      debug(DBG_ATTR, "Received UDP on listening address\n");
-      saddr_size = sizeof(struct sockaddr_storage);
-      daddr_size = sizeof(struct sockaddr_storage);
+      running++;
+    }
+  }
 
-      getsockname(sockets->sock_udp, (struct sockaddr*)&daddr, &daddr_size);
-      nb = recvfrom(sockets->sock_udp, buf, sizeof(buf), 0,
-          (struct sockaddr*)&saddr, &saddr_size);
+  syslog(LOG_NOTICE, "%u workers started", (unsigned int)running);
 
-      if(nb > 0)
+  while(g_run && running > 0)
+  {
+    pid_t pid = 0;
+    int status = 0;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+      for(i = 0 ; i < g_workers_nb ; i++)
       {
-        if(!turnserver_check_relay_address(listen_address, listen_addressv6,
-              &saddr))
-        {
-          proto = (saddr.ss_family == AF_INET6 &&
-              !IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6*)&saddr)->sin6_addr))
-            ? "IPv6" : "IPv4";
-          debug(DBG_ATTR, "Do not relay family: %s\n", proto);
-        }
-        else if(turnserver_listen_recv(IPPROTO_UDP, sockets->sock_udp, buf, nb,
-                (struct sockaddr*)&saddr, (struct sockaddr*)&daddr,
-                saddr_size, allocation_list, account_list, NULL) == -1)
+        if(g_workers[i].pid != pid)
         {
-          debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
+          continue;
         }
-      }
-      else
-      {
-        sys_get_error(errno, error_str, sizeof(error_str));
-        debug(DBG_ATTR, "Error: %s\n", error_str);
-      }
-    }
-
-    /* main DTLS listen socket */
-    if(sockets->sock_dtls && net_sfd_has_data(sockets->sock_dtls->sock, max_fd,
-          &fdsr))
-    {
-      debug(DBG_ATTR, "Received DTLS on listening address\n");
-      saddr_size = sizeof(struct sockaddr_storage);
-      daddr_size = sizeof(struct sockaddr_storage);
 
-      getsockname(sockets->sock_dtls->sock, (struct sockaddr*)&daddr,
-          &daddr_size);
-      nb = recvfrom(sockets->sock_dtls->sock, buf, sizeof(buf), 0,
-          (struct sockaddr*)&saddr, &saddr_size);
-
-      if(nb > 0 && tls_peer_is_encrypted(buf, nb))
-      {
-        char buf2[1500];
-        ssize_t nb2 = -1;
+        g_workers[i].pid = 0;
+        running--;
+        debug(DBG_ATTR, "Worker %u exited (status %d)\n", (unsigned int)i,
+            status);
+        syslog(LOG_ERR, "Worker %u exited (status %d)", (unsigned int)i,
+            status);
 
-        if((nb2 = tls_peer_udp_read(sockets->sock_dtls, buf, nb, buf2,
-                sizeof(buf2), (struct sockaddr*)&saddr, saddr_size)) > 0)
+        /* do not restart a worker that fails at startup */
+        if(g_run && time(NULL) - g_workers[i].start > 1)
         {
-          if(!turnserver_check_relay_address(listen_address, listen_addressv6,
-                &saddr))
+          pid = turnserver_worker_start(i, sockets, &oldmask);
+
+          if(pid == 0)
           {
-            proto = (saddr.ss_family == AF_INET6 &&
-                !IN6_IS_ADDR_V4MAPPED(
-                  &((struct sockaddr_in6*)&saddr)->sin6_addr))
-              ? "IPv6" : "IPv4";
-            debug(DBG_ATTR, "Do not relay family: %s\n", proto);
+            return 0;
           }
-          else if(turnserver_listen_recv(IPPROTO_UDP, sockets->sock_dtls->sock,
-                buf2, nb2, (struct sockaddr*)&saddr, (struct sockaddr*)&daddr,
-                saddr_size, allocation_list, account_list, sockets->sock_dtls)
-              == -1)
+          else if(pid > 0)
           {
-            debug(DBG_ATTR, "Bad STUN/TURN message or permission problem\n");
+            running++;
           }
         }
-      }
-      else
-      {
-        sys_get_error(errno, error_str, sizeof(error_str));
-        debug(DBG_ATTR, "Error: %s\n", error_str);
+        break;
       }
     }
 
-    /* remote TCP sockets */
-    list_head_iterate_safe(tcp_socket_list, get, n)
+    if(g_reinit || g_print_stats)
     {
-      struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
-
-      if(net_sfd_has_data(tmp->sock, max_fd, &fdsr))
+      for(i = 0 ; i < g_workers_nb ; i++)
       {
-        debug(DBG_ATTR, "Received data from %s client\n", !tmp->tls
-            ? "TCP" : "TLS");
-
-        if((getpeername(tmp->sock, (struct sockaddr*)&saddr,
-                &saddr_size) == -1) ||
-           (getsockname(tmp->sock, (struct sockaddr*)&daddr,
-                        &daddr_size) == -1))
+        if(g_workers[i].pid > 0 && g_reinit)
         {
-          close(tmp->sock);
-          list_head_remove(&tmp->list, &tmp->list);
-          free(tmp);
-          continue;
+          kill(g_workers[i].pid, SIGHUP);
         }
 
-        nb = recv(tmp->sock, buf, sizeof(buf), 0);
-
-        if(nb > 0)
+        if(g_workers[i].pid > 0 && g_print_stats)
         {
-          if(tmp->tls && sockets->sock_tls && tls_peer_is_encrypted(buf, nb))
-          {
-            char buf2[1500];
-            ssize_t nb2 = -1;
-
-            /* decode TLS data */
-            if((nb2 = tls_peer_tcp_read(sockets->sock_tls, buf, nb, buf2,
-                    sizeof(buf2), (struct sockaddr*)&saddr, saddr_size,
-                    tmp->sock)) > 0)
-            {
-              /* TLS over TCP stream may contain multiple STUN/TURN messages */
-              turnserver_process_tcp_stream(buf2, nb2, tmp,
-                  (struct sockaddr*)&saddr, (struct sockaddr*)&daddr,
-                  saddr_size, allocation_list, account_list, sockets->sock_tls);
-            }
-            else
-            {
-              sys_get_error(errno, error_str, sizeof(error_str));
-              debug(DBG_ATTR, "Error: %s\n", error_str);
-            }
-          }
-          else /* non-encrypted TCP data */
-          {
-            /* TCP stream may contain multiple STUN/TURN messages */
-            turnserver_process_tcp_stream(buf, nb, tmp,
-                (struct sockaddr*)&saddr, (struct sockaddr*)&daddr, saddr_size,
-                allocation_list, account_list, NULL);
-          }
-        }
-        else
-        {
-          /* 0: disconnection case
-           * -1: error
-           */
-          sys_get_error(errno, error_str, sizeof(error_str));
-          debug(DBG_ATTR, "Error: %s\n", error_str);
-          close(tmp->sock);
-          tmp->sock = -1;
-          list_head_remove(&tmp->list, &tmp->list);
-          free(tmp);
+          kill(g_workers[i].pid, SIGUSR1);
         }
       }
+      g_reinit = 0;
+      g_print_stats = 0;
     }
 
-    /* main TCP listen socket */
-    if(net_sfd_has_data(sockets->sock_tcp, max_fd, &fdsr))
+    if(g_run && running > 0)
     {
-      debug(DBG_ATTR, "Received TCP on listening address\n");
-      turnserver_handle_tcp_accept(sockets->sock_tcp, tcp_socket_list, 0);
+      sigsuspend(&oldmask);
     }
+  }
 
-    /* main TLS listen socket */
-    if(sockets->sock_tls && net_sfd_has_data(sockets->sock_tls->sock, max_fd,
-          &fdsr))
+  /* stop the workers */
+  for(i = 0 ; i < g_workers_nb ; i++)
+  {
+    if(g_workers[i].pid > 0)
     {
-      debug(DBG_ATTR, "Received TLS on listening address\n");
-      turnserver_handle_tcp_accept(sockets->sock_tls->sock, tcp_socket_list, 1);
+      kill(g_workers[i].pid, SIGTERM);
     }
+  }
 
-    /* relayed UDP-based addresses and TCP-based relayed listen addresses */
-    list_head_iterate_safe(allocation_list, get, n)
+  for(i = 0 ; i < g_workers_nb ; i++)
+  {
+    if(g_workers[i].pid > 0)
     {
-      struct allocation_desc* tmp = list_head_get(get, struct allocation_desc, list);
-      struct list_head* get2 = NULL;
-      struct list_head* n2 = NULL;
+      waitpid(g_workers[i].pid, NULL, 0);
+      g_workers[i].pid = 0;
+    }
+  }
 
-      /* relayed address */
-      if(net_sfd_has_data(tmp->relayed_sock, max_fd, &fdsr))
-      {
-        /* UDP relay is described in RFC 5766
-         * and TCP relay is described in RFC6062
-         */
-        if(tmp->relayed_transport_protocol == IPPROTO_UDP)
-        {
-          debug(DBG_ATTR, "Received UDP on a relayed address\n");
-          saddr_size = sizeof(struct sockaddr_storage);
-          daddr_size = sizeof(struct sockaddr_storage);
+  sigprocmask(SIG_SETMASK, &oldmask, NULL);
+  return 1;
+}
 
-          getsockname(tmp->relayed_sock, (struct sockaddr*)&daddr, &daddr_size);
-          nb = recvfrom(tmp->relayed_sock, buf, sizeof(buf), 0,
-              (struct sockaddr*)&saddr, &saddr_size);
+/**
+ * \brief Read again the nonce key from the configuration file.
+ *
+ * The previous key still verifies the nonces it has issued until they expire.
+ * \param file configuration file
+ */
+static void turnserver_nonce_key_reload(const char* file)
+{
+  char* key = turnserver_cfg_reload_nonce_key(file);
+  int ret = -1;
 
-          if(nb > 0)
-          {
-            struct tls_peer* speer = NULL;
-
-            if(tmp->relayed_tls)
-            {
-              speer = sockets->sock_tls;
-            }
-            else if(tmp->relayed_dtls)
-            {
-              speer = sockets->sock_dtls;
-            }
-
-            turnserver_relayed_recv(buf, nb, (struct sockaddr*)&saddr,
-                (struct sockaddr*)&daddr, saddr_size, allocation_list, speer);
-          }
-          else
-          {
-            sys_get_error(errno, error_str, sizeof(error_str));
-          }
-        }
-        else if(tmp->relayed_transport_protocol == IPPROTO_TCP)
-        {
-          /* RFC6062 (TURN-TCP) */
-          /* handle incoming TCP connection on relayed address */
-          debug(DBG_ATTR, "Received incoming connection on a listening TCP "
-              "relayed address\n");
-          turnserver_handle_tcp_incoming_connection(tmp->relayed_sock, tmp,
-              tmp->relayed_tls ? sockets->sock_tls : NULL);
-        }
-      }
+  if(key)
+  {
+    ret = nonce_ctx_set_key(&g_nonce_ctx, (unsigned char*)key, strlen(key));
+    free(key);
+  }
 
-      /* RFC6062 (TURN-TCP) */
-      /* relayed TCP-based addresses */
-      list_head_iterate_safe(&tmp->tcp_relays, get2, n2)
-      {
-        struct allocation_tcp_relay* tmp2 = list_head_get(get2,
-            struct allocation_tcp_relay, list);
+  if(ret == -1)
+  {
+    debug(DBG_ATTR, "Reload nonce key failed!\n");
+    syslog(LOG_ERR, "Reload nonce key failed!");
+  }
+  else if(ret == 1)
+  {
+    debug(DBG_ATTR, "Nonce key changed\n");
+    syslog(LOG_INFO, "Nonce key changed");
+  }
+}
 
-        if(!tmp2->ready && net_sfd_has_data(tmp2->peer_sock, max_fd, &fdsw))
-        {
-          int ret_connect = turnserver_handle_tcp_connect(tmp2->peer_sock, tmp2,
-              tmp, tmp->relayed_tls ? sockets->sock_tls : NULL);
+/**
+ * \brief Thread function which parses the account file.
+ * \param arg reload descriptor
+ * \return NULL
+ */
+static void* turnserver_account_reload_thread(void* arg)
+{
+  struct turnserver_account_reload* reload = arg;
+  sigset_t mask;
+  int ret = 0;
 
-          if(ret_connect == -1)
-          {
-            /* connect() failed */
-            debug(DBG_ATTR, "connect() failed!\n");
+  /* signals are handled by the event loop */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  ret = account_parse_file(&reload->list, reload->file);
+
+  pthread_mutex_lock(&reload->mutex);
+  reload->ret = ret;
+  reload->done = 1;
+  pthread_mutex_unlock(&reload->mutex);
+
+  return NULL;
+}
+
+/**
+ * \brief Start to parse again the account file.
+ *
+ * Parsing and computing the keys of a large file is done by a thread so that
+ * relaying is not stopped, turnserver_account_reload_apply() merges the result
+ * once it is done. If the thread cannot be created, the file is parsed now.
+ * \param file account file
+ */
+static void turnserver_account_reload_start(const char* file)
+{
+  struct turnserver_account_reload* reload = &g_account_reload;
+
+  if(reload->running)
+  {
+    /* the file may have changed since the thread has read it */
+    debug(DBG_ATTR, "Reload of account file already in progress\n");
+    reload->pending = 1;
+    return;
+  }
+
+  list_head_init(&reload->list);
+  reload->file = file;
+  reload->done = 0;
+  reload->ret = 0;
+  reload->running = 1;
+  reload->thread_created = 0;
 
-            turnserver_send_error(IPPROTO_TCP, tmp->tuple_sock,
-                TURN_METHOD_CONNECT, tmp2->connect_msg_id, 447,
-                (struct sockaddr*)&tmp->tuple.client_addr,
-                sockaddr_get_size(&tmp->tuple.client_addr),
-                tmp->relayed_tls ? sockets->sock_tls : NULL, tmp->key);
+  if(pthread_create(&reload->thread, NULL, turnserver_account_reload_thread,
+        reload) == 0)
+  {
+    reload->thread_created = 1;
+    return;
+  }
+
+  reload->ret = account_parse_file(&reload->list, file);
+  reload->done = 1;
+}
+
+/**
+ * \brief Merge the accounts parsed again and close the TURN sessions of the
+ * removed ones.
+ *
+ * Nothing is done if the file is still being parsed. If a reload has been
+ * requested meanwhile, the file is parsed again.
+ * \param account_list list of accounts
+ * \param allocation_list list of allocations
+ */
+static void turnserver_account_reload_apply(struct list_head* account_list,
+    struct list_head* allocation_list)
+{
+  struct turnserver_account_reload* reload = &g_account_reload;
+  struct list_head removed;
+  struct list_head* get = NULL;
+  struct list_head* n = NULL;
+  int done = 0;
 
-            /* bring back relayed_tcp_sock to permit again TCP connect
-             * request
-             */
-            tmp->relayed_sock_tcp = tmp2->peer_sock;
-            tmp2->peer_sock = -1;
-          }
-          else if(ret_connect == -2)
-          {
-            /* a system error happens */
-            debug(DBG_ATTR, "connect() success but system error!\n");
+  if(!reload->running)
+  {
+    return;
+  }
 
-            turnserver_send_error(IPPROTO_TCP, tmp->tuple_sock,
-                TURN_METHOD_CONNECT, tmp2->connect_msg_id, 500,
-                (struct sockaddr*)&tmp->tuple.client_addr,
-                sockaddr_get_size(&tmp->tuple.client_addr),
-                tmp->relayed_tls ? sockets->sock_tls : NULL, tmp->key);
+  pthread_mutex_lock(&reload->mutex);
+  done = reload->done;
+  pthread_mutex_unlock(&reload->mutex);
 
-            /* bring back relayed_tcp_sock to permit again TCP connect
-             * request
-             */
-            tmp->relayed_sock_tcp = tmp2->peer_sock;
-            tmp2->peer_sock = -1;
-          }
-        }
-        else if(net_sfd_has_data(tmp2->peer_sock, max_fd, &fdsr))
-        {
-          debug(DBG_ATTR, "Receive data from TCP peer\n");
+  if(!done)
+  {
+    return;
+  }
 
-          /* relay data from peer to client */
-          nb = recv(tmp2->peer_sock, buf, sizeof(buf), 0);
+  if(reload->thread_created)
+  {
+    pthread_join(reload->thread, NULL);
+    reload->thread_created = 0;
+  }
 
-          if(nb > 0)
-          {
-            /* client has not send ConnectionBind yet,
-             * buffer data
-             */
-            if(tmp2->client_sock == -1)
-            {
-              debug(DBG_ATTR, "Buffer data from peer (TURN-TCP)\n");
-              if((size_t)nb <= (tmp2->buf_size - tmp2->buf_len))
-              {
-                memcpy(tmp2->buf + tmp2->buf_len, buf, nb);
-                tmp2->buf_len += nb;
-              }
-              else
-              {
-                /* limit exceeded, remove TCP relay */
-                debug(DBG_ATTR, "Exceed TCP buffer size limit (userspace "
-                    "buffering)!\n");
-
-                /* protect the removing of the expired list if any */
-                turnserver_block_realtime_signal();
-                allocation_tcp_relay_set_timer(tmp2, 0); /* stop timeout */
-                /* in case TCP relay has expired during this statement */
-                list_head_remove(&tmp2->list2, &tmp2->list2);
-                turnserver_unblock_realtime_signal();
-                allocation_tcp_relay_list_remove(&tmp->tcp_relays, tmp2);
-              }
-
-              /* client_sock is not set so process next TCP relay */
-              continue;
-            }
-
-            /* send just received data to client */
-            if(send(tmp2->client_sock, buf, nb, 0) == -1)
-            {
-              debug(DBG_ATTR, "Error sending data from peer to client "
-                  "(TURN-TCP)\n");
-            }
-          }
-          else
-          {
-            /* problem on the socket, remove relay */
-            debug(DBG_ATTR, "Error TCP relay: %s\n",
-                sys_get_error(errno, error_str, sizeof(error_str)));
-
-            /* protect the removing of the expired list if any */
-            turnserver_block_realtime_signal();
-            allocation_tcp_relay_set_timer(tmp2, 0); /* stop timeout */
-            /* in case TCP relay has expired during this statement */
-            list_head_remove(&tmp2->list2, &tmp2->list2);
-            turnserver_unblock_realtime_signal();
-            allocation_tcp_relay_list_remove(&tmp->tcp_relays, tmp2);
-
-            /* if relay is removed no need to test client_sock
-             * since it is removed!
-             */
-            continue;
-          }
-        }
+  reload->running = 0;
 
-        if(net_sfd_has_data(tmp2->client_sock, max_fd, &fdsr))
-        {
-          /* case when peer connect first */
-          if(tmp2->new)
-          {
-            tmp2->new = 0;
-            continue;
-          }
+  if(reload->pending)
+  {
+    reload->pending = 0;
+    account_list_free(&reload->list);
+    turnserver_account_reload_start(reload->file);
+    return;
+  }
 
-          debug(DBG_ATTR, "Receive data from TCP client to TCP peer\n");
+  if(reload->ret == -1)
+  {
+    account_list_free(&reload->list);
+    debug(DBG_ATTR, "Reload account file failed!\n");
+    syslog(LOG_ERR, "Reload account file failed!");
+    return;
+  }
 
-          /* relay data from client to peer */
-          nb = recv(tmp2->client_sock, buf, sizeof(buf), 0);
+  list_head_init(&removed);
+  account_list_merge(account_list, &reload->list, &removed);
 
-          if(nb > 0)
-          {
-            /* send just received data to peer */
-            if(send(tmp2->peer_sock, buf, nb, 0) == -1)
-            {
-              debug(DBG_ATTR, "Error sending data from client to peer "
-                  "(TURN-TCP)\n");
-            }
-          }
-          else
-          {
-            /* problem on the socket, remove relay */
-            debug(DBG_ATTR, "Error TCP relay: %s\n",
-                sys_get_error(errno, error_str, sizeof(error_str)));
-
-            /* protect the removing of the expired list if any */
-            turnserver_block_realtime_signal();
-            allocation_tcp_relay_set_timer(tmp2, 0); /* stop timeout */
-            /* in case TCP relay has expired during this statement */
-            list_head_remove(&tmp2->list2, &tmp2->list2);
-            turnserver_unblock_realtime_signal();
-            allocation_tcp_relay_list_remove(&tmp->tcp_relays, tmp2);
-          }
-        }
-      }
-    }
+  /* close TURN sessions of the removed accounts */
+  list_head_iterate_safe(&removed, get, n)
+  {
+    struct account_desc* tmp = list_head_get(get, struct account_desc, list);
+    struct allocation_desc* allocation = NULL;
 
-    /* mod_tmpuser */
-    if(turnserver_cfg_mod_tmpuser())
+    /* many allocation can used same username */
+    while((allocation = allocation_list_find_username(allocation_list,
+            tmp->username, tmp->realm)))
     {
-      /* listen socket */
-      if(net_sfd_has_data(tmpuser_get_socket(), max_fd, &fdsr))
-      {
-        int fd = accept(tmpuser_get_socket(), NULL, NULL);
-
-        if(fd > 0)
-        {
-          struct socket_desc* desc = malloc(sizeof(struct socket_desc));
+      turnserver_event_del_allocation(allocation);
+      turnserver_relay_port_release(
+          (struct sockaddr*)&allocation->relayed_addr);
+      allocation_list_remove(allocation_list, allocation);
+    }
 
-          if(desc)
-          {
-            desc->sock = fd;
-            tmpuser_add_tcp_client(desc);
-          }
-        }
-      }
+    list_head_remove(&removed, &tmp->list);
+    account_desc_free(&tmp);
+  }
 
-      /* remote TCP client */
-      list_head_iterate_safe(tmpuser_get_tcp_clients(), get, n)
-      {
-        struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
+  debug(DBG_ATTR, "Reload account file successful!\n");
+  syslog(LOG_INFO, "Reload account file successful");
+}
 
-        if(net_sfd_has_data(tmp->sock, max_fd, &fdsr))
-        {
-          nb = recv(tmp->sock, buf, sizeof(buf), 0);
+/**
+ * \brief Wait for the thread which parses the account file and discard its
+ * result.
+ */
+static void turnserver_account_reload_stop(void)
+{
+  struct turnserver_account_reload* reload = &g_account_reload;
 
-          if(nb > 0)
-          {
-            int r = tmpuser_process_msg(buf, nb);
-
-            if(!r)
-            {
-              send(tmp->sock, "success", sizeof("success"), 0);
-            }
-            else
-            {
-              send(tmp->sock, "error", sizeof("error"), 0);
-            }
-          }
-          else
-          {
-            close(tmp->sock);
-            list_head_remove(&tmp->list, &tmp->list);
-            free(tmp);
-          }
-        }
-      }
-    }
+  if(!reload->running)
+  {
+    return;
   }
-  else if(ret == -1)
+
+  if(reload->thread_created)
   {
-    sys_get_error(errno, error_str, sizeof(error_str));
-    debug(DBG_ATTR, "select() failed: %s\n", error_str);
+    pthread_join(reload->thread, NULL);
+    reload->thread_created = 0;
   }
+
+  account_list_free(&reload->list);
+  reload->running = 0;
+  reload->pending = 0;
 }
 
 /**
@@ -4964,6 +7103,11 @@ static void turnserver_cleanup(void* arg)
     list_head_remove(&tmp->list, &tmp->list);
     free(tmp);
   }
+
+  if(g_denied_address_trie)
+  {
+    prefix_trie_free(&g_denied_address_trie);
+  }
 }
 
 /**
@@ -5010,12 +7154,16 @@ int main(int argc, char** argv)
 {
   struct list_head allocation_list;
   struct list_head account_list;
+  struct list_head tmp_list;
   struct list_head* n = NULL;
   struct list_head* get = NULL;
   struct listen_sockets sockets;
   char* configuration_file = NULL;
   char* pid_file = NULL;
   char* listen_addr = NULL;
+  int reuse = 0;
+  uint32_t hash_seed = 0;
+  uint32_t rate = 0;
   struct sigaction sa;
 
   /* initialize cryptographic seed for systems which do not have /dev/urandom */
@@ -5024,12 +7172,23 @@ int main(int argc, char** argv)
     debug(DBG_ATTR, "Warning cryptographic seed not strong\n");
   }
 
+  /* CRC-32 engine for FINGERPRINT (before any worker is forked) */
+  debug(DBG_ATTR, "CRC-32 engine: %s\n",
+      crypto_crc32_engine_name(crypto_crc32_init()));
+
+  /* unpredictable distribution of allocations in indexes */
+  crypto_random_bytes_generate((uint8_t*)&hash_seed, sizeof(hash_seed));
+  allocation_set_hash_seed(hash_seed);
+  account_set_hash_seed(hash_seed);
+
   /* initialize lists */
   list_head_init(&allocation_list);
   list_head_init(&account_list);
+  list_head_init(&tmp_list);
   list_head_init(&g_tcp_socket_list);
   list_head_init(&g_token_list);
   list_head_init(&g_denied_address_list);
+  list_head_init(&g_relay_ports_list);
 
   /* initialize expired lists */
   list_head_init(&g_expired_allocation_list);
@@ -5037,6 +7196,13 @@ int main(int argc, char** argv)
   list_head_init(&g_expired_channel_list);
   list_head_init(&g_expired_token_list);
   list_head_init(&g_expired_tcp_relay_list);
+  list_head_init(&g_expired_dtls_client_list);
+
+  /* initialize expiration timers */
+  turnserver_clock_update();
+  timer_wheel_init(&g_timer_wheel, g_now_ms, TIMER_TICK_MS,
+      turnserver_timer_expired);
+  allocation_set_timer_wheel(&g_timer_wheel);
 
   /* initialize sockets */
   sockets.sock_udp = -1;
@@ -5093,44 +7259,6 @@ int main(int argc, char** argv)
     debug(DBG_ATTR, "SIGUSR2 will not be catched\n");
   }
 
-  /* realtime handler */
-  sa.sa_handler = NULL;
-  sa.sa_sigaction = realtime_signal_handler;
-  sa.sa_flags = SA_SIGINFO;
-
-  /* as TurnServer uses these signals for expiration
-   * stuff, exit if they cannot be handled by signal handler
-   */
-  if(sigaction(SIGRT_EXPIRE_ALLOCATION, &sa, NULL) == -1)
-  {
-    debug(DBG_ATTR, "SIGRT_EXPIRE_ALLOCATION will not be catched\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if(sigaction(SIGRT_EXPIRE_PERMISSION, &sa, NULL) == -1)
-  {
-    debug(DBG_ATTR, "SIGRT_EXPIRE_PERMISSION will not be catched\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if(sigaction(SIGRT_EXPIRE_CHANNEL, &sa, NULL) == -1)
-  {
-    debug(DBG_ATTR, "SIGRT_EXPIRE_CHANNEL will not be catched\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if(sigaction(SIGRT_EXPIRE_TOKEN, &sa, NULL) == -1)
-  {
-    debug(DBG_ATTR, "SIGRT_EXPIRE_TOKEN will not be catched\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if(sigaction(SIGRT_EXPIRE_TCP_RELAY, &sa, NULL) == -1)
-  {
-    debug(DBG_ATTR, "SIGRT_EXPIRE_TCP_RELAY will not be catched\n");
-    exit(EXIT_FAILURE);
-  }
-
   /* parse the arguments */
   turnserver_parse_cmdline(argc, argv, &configuration_file, &pid_file);
 
@@ -5147,6 +7275,13 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
 
+  if(turnserver_denied_address_init() == -1)
+  {
+    fprintf(stderr, "Cannot build denied address list, exiting...\n");
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
 #ifndef NDEBUG
   turnserver_cfg_print();
 #endif
@@ -5179,6 +7314,52 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
 
+  if(strcmp(turnserver_cfg_event_backend(), "epoll") != 0 &&
+     strcmp(turnserver_cfg_event_backend(), "select") != 0)
+  {
+    fprintf(stderr, "Configuration error: event_backend \"%s\" unknown, "
+        "exiting...\n", turnserver_cfg_event_backend());
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  if(strcmp(turnserver_cfg_relay_address_policy(), "least_loaded") != 0 &&
+     strcmp(turnserver_cfg_relay_address_policy(), "hash") != 0)
+  {
+    fprintf(stderr, "Configuration error: relay_address_policy \"%s\" "
+        "unknown, exiting...\n", turnserver_cfg_relay_address_policy());
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  if(turnserver_cfg_workers() == 0)
+  {
+    fprintf(stderr, "Configuration error: workers must be greater than 0.\n");
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  /* each client needs a few file descriptors */
+  turnserver_set_file_limit();
+
+  if(turnserver_cfg_udp_batch_size() == 0 ||
+     turnserver_cfg_udp_batch_size() > NET_DATAGRAM_BATCH_MAX)
+  {
+    fprintf(stderr, "Configuration error: udp_batch_size must be between 1 "
+        "and %u.\n", NET_DATAGRAM_BATCH_MAX);
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  if(turnserver_cfg_workers() > 1 && turnserver_cfg_mod_tmpuser())
+  {
+    /* temporary accounts would only be known by one worker */
+    fprintf(stderr, "Configuration error: mod_tmpuser cannot be used with "
+        "more than one worker.\n");
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
   /* check if certificates and key stuff are in configuration file
    * if TLS is used
    */
@@ -5199,14 +7380,35 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
 
+  crypto_random_bytes_generate((uint8_t*)&hash_seed, sizeof(hash_seed));
+  if(nonce_ctx_init(&g_nonce_ctx, (unsigned char*)turnserver_cfg_nonce_key(),
+        strlen(turnserver_cfg_nonce_key()), TURN_DEFAULT_NONCE_LIFETIME,
+        hash_seed) == -1)
+  {
+    fprintf(stderr, "Failed to initialize nonce key, exiting...\n");
+    turnserver_cleanup(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  /* bandwidth limits of the server, shared by the workers */
+  list_head_init(&g_bandwidth.paced);
+  g_bandwidth.pacing = turnserver_cfg_bandwidth_pacing();
+  rate = turnserver_cfg_bandwidth_total() * 1000 / turnserver_cfg_workers();
+  token_bucket_init(&g_bandwidth.up, rate, 0, NULL, g_now_ms);
+  token_bucket_init(&g_bandwidth.down, rate, 0, NULL, g_now_ms);
+
   /* map the account in memory */
-  if(account_parse_file(&account_list, turnserver_cfg_account_file()) == -1)
+  if(account_parse_file(&tmp_list, turnserver_cfg_account_file()) == -1)
   {
     fprintf(stderr, "Failed to parse account file, exiting...\n");
+    account_list_free(&tmp_list);
     turnserver_cleanup(NULL);
     exit(EXIT_FAILURE);
   }
 
+  /* index the accounts, none is removed from the empty list */
+  account_list_merge(&account_list, &tmp_list, &tmp_list);
+
 #if 0
   /* print account information */
   list_head_iterate_safe(&account_list, get, n)
@@ -5238,6 +7440,19 @@ int main(int argc, char** argv)
   openlog("TurnServer", LOG_PID, LOG_DAEMON);
   syslog(LOG_NOTICE, "TurnServer start");
 
+  if(turnserver_cfg_workers() > 1)
+  {
+    /* a reserved port would only be known by one worker whereas the Allocate
+     * with the RESERVATION-TOKEN comes from another client port, so
+     * SO_REUSEPORT usually gives it to another worker
+     */
+    g_supported_even_port_flags &= ~0x80;
+    debug(DBG_ATTR, "Port reservation (EVEN-PORT R flag) disabled with "
+        "several workers\n");
+    syslog(LOG_WARNING, "Port reservation (EVEN-PORT R flag) disabled with "
+        "several workers");
+  }
+
   /* mod_tmpuser */
   if(turnserver_cfg_mod_tmpuser())
   {
@@ -5257,20 +7472,32 @@ int main(int argc, char** argv)
    */
   listen_addr = turnserver_cfg_listen_addressv6() ? "::" : "0.0.0.0";
 
-  /* initialize listen sockets */
+  /* initialize listen sockets, they are shared by workers with SO_REUSEPORT
+   * (except TCP one when TURN-TCP is enabled)
+   */
+  if(turnserver_cfg_workers() > 1)
+  {
+    reuse = NET_REUSE_PORT;
+  }
+
   /* UDP socket */
   sockets.sock_udp = net_socket_create(IPPROTO_UDP, listen_addr,
-      turnserver_cfg_udp_port(), 0, 0);
+      turnserver_cfg_udp_port(), reuse, 0);
 
   if(sockets.sock_udp == -1)
   {
     debug(DBG_ATTR, "UDP socket creation failed\n");
     syslog(LOG_ERR, "UDP socket creation failed");
   }
+  else
+  {
+    turnserver_listen_udp_init(sockets.sock_udp, &sockets.addr_udp);
+  }
 
   /* TCP socket */
   sockets.sock_tcp = net_socket_create(IPPROTO_TCP, listen_addr,
-      turnserver_cfg_tcp_port(), 1, 1);
+      turnserver_cfg_tcp_port(),
+      NET_REUSE_ADDR | (turnserver_cfg_turn_tcp() ? 0 : reuse), 1);
 
   if(sockets.sock_tcp > 0)
   {
@@ -5318,6 +7545,16 @@ int main(int argc, char** argv)
           tls_peer_free(&speer);
           speer = NULL;
         }
+        else if(turnserver_tls_session_setup(speer) == -1)
+        {
+          tls_peer_free(&speer);
+          speer = NULL;
+        }
+        else if(turnserver_cfg_ktls() && tls_peer_enable_ktls(speer) == -1)
+        {
+          debug(DBG_ATTR, "Kernel TLS not supported, use userspace TLS\n");
+          syslog(LOG_WARNING, "Kernel TLS not supported, use userspace TLS");
+        }
 
         sockets.sock_tls = speer;
       }
@@ -5334,9 +7571,17 @@ int main(int argc, char** argv)
           turnserver_cfg_ca_file(), turnserver_cfg_cert_file(),
           turnserver_cfg_private_key_file(), NULL);
 
+      if(speer && turnserver_tls_session_setup(speer) == -1)
+      {
+        tls_peer_free(&speer);
+        speer = NULL;
+      }
+
       if(speer)
       {
+        speer->close_callback = turnserver_dtls_client_close;
         sockets.sock_dtls = speer;
+        turnserver_listen_udp_init(speer->sock, &sockets.addr_dtls);
       }
       else
       {
@@ -5359,6 +7604,19 @@ int main(int argc, char** argv)
     g_run = 1;
   }
 
+  /* listen sockets of the other workers */
+  if(g_run && turnserver_cfg_workers() > 1 &&
+     turnserver_workers_init(&sockets, listen_addr,
+       turnserver_cfg_workers()) == -1)
+  {
+    char error_str[256];
+    sys_get_error(errno, error_str, sizeof(error_str));
+    debug(DBG_ATTR, "Problem creating workers listen sockets: %s\n",
+        error_str);
+    syslog(LOG_ERR, "Problem creating workers listen sockets: %s", error_str);
+    g_run = 0;
+  }
+
   /* initialize rand() */
   srand(time(NULL) + getpid());
 
@@ -5372,6 +7630,66 @@ int main(int argc, char** argv)
   debug(DBG_ATTR, "Run with uid_real=%u gid_real=%u uid_eff=%u gid_eff=%u\n",
       getuid(), getgid(), geteuid(), getegid());
 
+  /* start the workers, this process only supervises them */
+  if(g_run && g_workers_nb > 1)
+  {
+    if(turnserver_workers_run(&sockets) == 0)
+    {
+      /* worker, the supervisor manages the pidfile */
+      pid_file = NULL;
+    }
+    else
+    {
+      g_run = 0;
+    }
+  }
+
+  /* batched UDP I/O */
+  if(g_run && turnserver_udp_batch_init(turnserver_cfg_udp_batch_size()) == -1)
+  {
+    debug(DBG_ATTR, "Cannot allocate UDP buffers\n");
+    syslog(LOG_ERR, "Cannot allocate UDP buffers");
+    g_run = 0;
+  }
+
+  /* pools of objects */
+  if(g_run && turnserver_pool_init() == -1)
+  {
+    debug(DBG_ATTR, "Cannot preallocate objects\n");
+    syslog(LOG_ERR, "Cannot preallocate objects");
+    g_run = 0;
+  }
+
+  /* TLS/DTLS handshakes, threads do not survive the fork of the workers */
+  if(g_run && (sockets.sock_tls || sockets.sock_dtls) &&
+     turnserver_cfg_tls_handshake_threads() > 0)
+  {
+    if(tls_peer_handshake_start(turnserver_cfg_tls_handshake_threads()) == -1)
+    {
+      debug(DBG_ATTR, "Cannot start handshake threads, handshakes are done "
+          "by the event loop\n");
+      syslog(LOG_ERR, "Cannot start handshake threads, handshakes are done "
+          "by the event loop");
+    }
+    else
+    {
+      debug(DBG_ATTR, "TLS/DTLS handshake threads: %u\n",
+          turnserver_cfg_tls_handshake_threads());
+    }
+  }
+
+  /* event loop backend */
+  if(g_run && turnserver_event_init() == 0 &&
+     turnserver_event_listen(&sockets) == -1)
+  {
+    debug(DBG_ATTR, "Cannot register listen sockets, use select()\n");
+    syslog(LOG_ERR, "Cannot register listen sockets, use select()");
+    turnserver_event_cleanup();
+  }
+
+  debug(DBG_ATTR, "Event backend: %s\n",
+      g_epoll_fd != -1 ? "epoll" : "select");
+
   while(g_run)
   {
     if(!g_run)
@@ -5379,82 +7697,45 @@ int main(int argc, char** argv)
       break;
     }
 
+    if(g_print_stats)
+    {
+      turnserver_print_stats();
+      g_print_stats = 0;
+    }
+
     if(g_reinit)
     {
-      struct list_head tmp_list;
-      list_head_init(&tmp_list);
+      /* parse again the account file */
+      turnserver_account_reload_start(turnserver_cfg_account_file());
 
-      /* map the account in memory */
-      if(account_parse_file(&tmp_list, turnserver_cfg_account_file()) == -1)
-      {
-        debug(DBG_ATTR, "Reload account file failed!\n");
-        syslog(LOG_ERR, "Reload account file failed!");
-      }
-      else
-      {
-        struct list_head* n2 = NULL;
-        struct list_head* get2 = NULL;
-        struct allocation_desc* allocation = NULL;
+      /* changed nonce key */
+      turnserver_nonce_key_reload(configuration_file);
 
-        /* find the removed account and close TURN sessions */
-        list_head_iterate_safe(&account_list, get, n)
+      /* rotated ticket keys */
+      if(turnserver_cfg_tls_ticket_key_file())
+      {
+        if(sockets.sock_tls)
         {
-          struct account_desc* tmp = list_head_get(get, struct account_desc, list);
-          int found = 0;
-
-          list_head_iterate_safe(&tmp_list, get2, n2)
-          {
-            struct account_desc* tmp2 = list_head_get(get2, struct account_desc,
-                list);
-
-            if(!strcmp(tmp->username, tmp2->username) && !strcmp(tmp->realm, tmp2->realm))
-            {
-              /* found it, try next iteration of account_list */
-              found = 1;
-              break;
-            }
-          }
-
-          /* many allocation can used same username */
-          if(!found)
-          {
-            while((allocation = allocation_list_find_username(&allocation_list,
-                    tmp->username, tmp->realm)))
-            {
-              allocation_list_remove(&allocation_list, allocation);
-            }
-          }
+          turnserver_tls_session_setup(sockets.sock_tls);
         }
 
-        /* reload successful */
-        /* free the account list and copy new list of accounts */
-        account_list_free(&account_list);
-
-        memcpy(&account_list, &tmp_list, sizeof(struct list_head));
-        /* specific to list_head implementation:
-         * The extremities of a list MUST be its pointer
-         */
-        account_list.next->prev = &account_list;
-        account_list.prev->next = &account_list;
-
-        debug(DBG_ATTR, "Reload account file successful!\n");
-        syslog(LOG_INFO, "Reload account file successful");
-
-#if 0
-        /* print account information */
-        list_head_iterate_safe(&account_list, get, n)
+        if(sockets.sock_dtls)
         {
-          struct account_desc* tmp = list_head_get(get, struct account_desc, list);
-          fprintf(stdout, "%s %s\n", tmp->username, tmp->realm);
+          turnserver_tls_session_setup(sockets.sock_dtls);
         }
-#endif
       }
 
       g_reinit = 0;
     }
 
-    /* avoid signal handling during purge */
-    turnserver_block_realtime_signal();
+    /* merge the accounts parsed again */
+    turnserver_account_reload_apply(&account_list, &allocation_list);
+
+    /* fill the expired lists with timers that have expired */
+    timer_wheel_run(&g_timer_wheel, g_now_ms);
+
+    /* read again paced relayed sockets */
+    turnserver_pacing_run();
 
     /* purge lists if needed */
     if(g_expired_allocation_list.next)
@@ -5484,6 +7765,8 @@ int main(int argc, char** argv)
         debug(DBG_ATTR, "Free an allocation_desc\n");
         list_head_remove(&tmp->list, &tmp->list);
         list_head_remove(&tmp->list2, &tmp->list2);
+        turnserver_event_del_allocation(tmp);
+        turnserver_relay_port_release((struct sockaddr*)&tmp->relayed_addr);
         allocation_desc_free(&tmp);
       }
     }
@@ -5496,11 +7779,9 @@ int main(int argc, char** argv)
           list_head_get(get, struct allocation_permission, list2);
 
         /* remove it from the list of valid permissions */
-        list_head_remove(&tmp->list, &tmp->list);
         list_head_remove(&tmp->list2, &tmp->list2);
         debug(DBG_ATTR, "Free an allocation_permission\n");
-        timer_delete(tmp->expire_timer);
-        free(tmp);
+        allocation_permission_free(&tmp);
       }
     }
 
@@ -5512,11 +7793,9 @@ int main(int argc, char** argv)
           list_head_get(get, struct allocation_channel, list2);
 
         /* remove it from the list of valid channels */
-        list_head_remove(&tmp->list, &tmp->list);
         list_head_remove(&tmp->list2, &tmp->list2);
         debug(DBG_ATTR, "Free an allocation_channel\n");
-        timer_delete(tmp->expire_timer);
-        free(tmp);
+        allocation_channel_free(&tmp);
       }
     }
 
@@ -5533,6 +7812,7 @@ int main(int argc, char** argv)
         debug(DBG_ATTR, "Free an allocation_token\n");
         if(tmp->sock > 0)
         {
+          turnserver_token_port_release(tmp);
           close(tmp->sock);
         }
         allocation_token_free(&tmp);
@@ -5543,15 +7823,34 @@ int main(int argc, char** argv)
     {
       struct allocation_tcp_relay* tmp =
         list_head_get(get, struct allocation_tcp_relay, list2);
+      turnserver_event_del_tcp_relay(tmp);
       allocation_tcp_relay_list_remove(&g_expired_tcp_relay_list, tmp);
     }
 
-    /* re-enable realtime signal */
-    turnserver_unblock_realtime_signal();
+    list_head_iterate_safe(&g_expired_dtls_client_list, get, n)
+    {
+      struct turnserver_dtls_client* tmp =
+        list_head_get(get, struct turnserver_dtls_client, list2);
+
+      /* close callback frees tmp */
+      debug(DBG_ATTR, "Remove idle DTLS client\n");
+      tls_peer_connection_remove(sockets.sock_dtls, tmp->conn);
+    }
 
     /* wait messages and processing */
-    turnserver_main(&sockets, &g_tcp_socket_list, &allocation_list,
-        &account_list);
+    if(g_epoll_fd != -1)
+    {
+      turnserver_main_epoll(&sockets, &g_tcp_socket_list, &allocation_list,
+          &account_list);
+    }
+    else
+    {
+      turnserver_main(&sockets, &g_tcp_socket_list, &allocation_list,
+          &account_list);
+    }
+
+    /* send the datagrams relayed during this loop */
+    turnserver_udp_flush();
   }
 
   fprintf(stderr, "\n");
@@ -5560,9 +7859,6 @@ int main(int argc, char** argv)
   syslog(LOG_NOTICE, "TurnServer stop");
   closelog();
 
-  /* avoid signal handling during cleanup */
-  turnserver_block_realtime_signal();
-
   /* free the expired allocation list (warning: special version use ->list2) */
   list_head_iterate_safe(&g_expired_allocation_list, get, n)
   {
@@ -5594,6 +7890,12 @@ int main(int argc, char** argv)
     allocation_tcp_relay_list_remove(&g_expired_tcp_relay_list, tmp);
   }
 
+  /* handshake threads write to the TLS and DTLS sockets */
+  tls_peer_handshake_stop();
+
+  /* close listen sockets of the other workers (supervisor) */
+  turnserver_workers_free(0);
+
   /* close UDP and TCP sockets */
   if(sockets.sock_udp > 0)
   {
@@ -5611,7 +7913,7 @@ int main(int argc, char** argv)
     struct socket_desc* tmp = list_head_get(get, struct socket_desc, list);
     close(tmp->sock);
     list_head_remove(&tmp->list, &tmp->list);
-    free(tmp);
+    turnserver_socket_desc_free(tmp);
   }
 
   /* close TLS and DTLS sockets */
@@ -5636,6 +7938,7 @@ int main(int argc, char** argv)
   allocation_list_free(&allocation_list);
 
   /* free the account list */
+  turnserver_account_reload_stop();
   account_list_free(&account_list);
 
   /* free mod_tmpuser */
@@ -5647,6 +7950,18 @@ int main(int argc, char** argv)
   /* free the token list */
   allocation_token_list_free(&g_token_list);
 
+  /* free relayed port allocators */
+  turnserver_relay_ports_cleanup();
+
+  /* free event loop */
+  turnserver_event_cleanup();
+
+  /* free batched UDP I/O buffers */
+  turnserver_udp_batch_free();
+
+  /* free pools, all objects have been released */
+  turnserver_pool_cleanup();
+
   /* free the denied address list */
   list_head_iterate_safe(&g_denied_address_list, get, n)
   {
@@ -5655,6 +7970,11 @@ int main(int argc, char** argv)
     free(tmp);
   }
 
+  if(g_denied_address_trie)
+  {
+    prefix_trie_free(&g_denied_address_trie);
+  }
+
   if(turnserver_cfg_daemon())
   {
     turnserver_remove_pidfile(pid_file);
@@ -43,41 +43,10 @@
 #include <unistd.h>
 #include <signal.h>
 
-#include "list.h"
-
-#ifndef _POSIX_REALTIME_SIGNALS
-#error "POSIX realtime signals not supported!"
-#endif
-
-/**
- * \def SIGRT_EXPIRE_ALLOCATION
- * \brief Signal value when an allocation expires.
- */
-#define SIGRT_EXPIRE_ALLOCATION (SIGRTMIN)
+#include <sys/socket.h>
 
-/**
- * \def SIGRT_EXPIRE_PERMISSION
- * \brief Signal value when a permission expires.
- */
-#define SIGRT_EXPIRE_PERMISSION (SIGRTMIN + 1)
-
-/**
- * \def SIGRT_EXPIRE_CHANNEL
- * \brief Signal value when channel expires.
- */
-#define SIGRT_EXPIRE_CHANNEL (SIGRTMIN + 2)
-
-/**
- * \def SIGRT_EXPIRE_TOKEN
- * \brief Signal value when token expires.
- */
-#define SIGRT_EXPIRE_TOKEN (SIGRTMIN + 3)
-
-/**
- * \def SIGRT_EXPIRE_TCP_RELAY
- * \brief Signal value when TCP relay expires (no ConnectionBind received).
- */
-#define SIGRT_EXPIRE_TCP_RELAY (SIGRTMIN + 4)
+#include "list.h"
+#include "stream_buf.h"
 
 /**
  * \struct denied_address
@@ -101,10 +70,12 @@ struct denied_address
 struct socket_desc
 {
   int sock; /**< Socket descriptor */
-  char buf[1500]; /**< Internal buffer for TCP stream reconstruction */
-  size_t buf_pos; /**< Position in the internal buffer */
-  size_t msg_len; /**< Message length that is not complete */
+  struct stream_buf stream; /**< Buffer for TCP stream reconstruction */
+  size_t msg_len; /**< Length of the incomplete message (0 if not known) */
   int tls; /**< If socket uses TLS */
+  struct sockaddr_storage saddr; /**< Remote address (client) */
+  socklen_t saddr_size; /**< Size of saddr */
+  struct sockaddr_storage daddr; /**< Local address (TURN server) */
   struct list_head list; /**< For list management */
 };
 
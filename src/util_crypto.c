@@ -62,6 +62,7 @@
 #include <unistd.h>
 #endif
 
+#include <string.h>
 #include <time.h>
 #include <errno.h>
 
@@ -72,6 +73,16 @@
 
 #include "util_crypto.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/**
+ * \def CRYPTO_CRC32_HAVE_PCLMUL
+ * \brief PCLMULQDQ CRC-32 engine is compiled (selected at runtime if the CPU
+ * supports it).
+ */
+#define CRYPTO_CRC32_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+
 #ifdef __cplusplus
 extern "C"
 { /* } */
@@ -155,6 +166,89 @@ int crypto_hmac_sha1_generate(unsigned char* hash, const unsigned char* text,
   return 0;
 }
 
+int crypto_hmac_sha1_key_init(struct crypto_hmac_sha1_key* hkey,
+    const unsigned char* key, size_t key_len)
+{
+  unsigned char key_hash[SHA_DIGEST_LENGTH];
+  unsigned char ipad[SHA_CBLOCK];
+  unsigned char opad[SHA_CBLOCK];
+  size_t i = 0;
+
+  /* RFC 2104: keys longer than the block size are hashed first */
+  if(key_len > SHA_CBLOCK)
+  {
+    if(!SHA1(key, key_len, key_hash))
+    {
+      return -1;
+    }
+    key = key_hash;
+    key_len = SHA_DIGEST_LENGTH;
+  }
+
+  memset(ipad, 0x36, sizeof(ipad));
+  memset(opad, 0x5c, sizeof(opad));
+
+  for(i = 0 ; i < key_len ; i++)
+  {
+    ipad[i] ^= key[i];
+    opad[i] ^= key[i];
+  }
+
+  if(!SHA1_Init(&hkey->inner) || !SHA1_Update(&hkey->inner, ipad,
+        sizeof(ipad)) ||
+     !SHA1_Init(&hkey->outer) || !SHA1_Update(&hkey->outer, opad,
+       sizeof(opad)))
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+int crypto_hmac_sha1_key_generate(unsigned char* hash,
+    const unsigned char* text, size_t text_len,
+    const struct crypto_hmac_sha1_key* hkey)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void*)text;
+  iov.iov_len = text_len;
+
+  return crypto_hmac_sha1_key_generate_iov(hash, &iov, 1, hkey);
+}
+
+int crypto_hmac_sha1_key_generate_iov(unsigned char* hash,
+    const struct iovec* iov, size_t iovlen,
+    const struct crypto_hmac_sha1_key* hkey)
+{
+  SHA_CTX ctx = hkey->inner;
+  unsigned char inner_hash[SHA_DIGEST_LENGTH];
+  size_t i = 0;
+
+  for(i = 0 ; i < iovlen ; i++)
+  {
+    if(!SHA1_Update(&ctx, iov[i].iov_base, iov[i].iov_len))
+    {
+      return -1;
+    }
+  }
+
+  if(!SHA1_Final(inner_hash, &ctx))
+  {
+    return -1;
+  }
+
+  ctx = hkey->outer;
+
+  if(!SHA1_Update(&ctx, inner_hash, sizeof(inner_hash)) ||
+     !SHA1_Final(hash, &ctx))
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
 int crypto_hmac_md5_generate(unsigned char* hash, const unsigned char* text,
     size_t text_len, const unsigned char* key, size_t key_len)
 {
@@ -168,78 +262,374 @@ int crypto_hmac_md5_generate(unsigned char* hash, const unsigned char* text,
   return 0;
 }
 
-uint32_t crypto_crc32_generate(const uint8_t* data, size_t len, uint32_t prev)
+/**
+ * \var g_crc32_table
+ * \brief CRC-32 lookup table (one byte at a time).
+ *
+ * http://fxr.watson.org/fxr/source/libkern/crc32.c?v=DFBSD
+ * formal specification http://www.itu.int/rec/T-REC-V.42-200203-I/en
+ */
+static const uint32_t g_crc32_table[256] = {
+  0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
+  0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
+  0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
+  0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
+  0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
+  0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
+  0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
+  0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
+  0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
+  0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
+  0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
+  0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
+  0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
+  0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
+  0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
+  0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
+  0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
+  0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
+  0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
+  0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
+  0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
+  0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
+  0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
+  0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
+  0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
+  0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
+  0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
+  0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
+  0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
+  0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
+  0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
+  0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
+  0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
+  0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
+  0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
+  0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
+  0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
+  0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
+  0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
+  0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
+  0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
+  0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
+  0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
+  0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
+  0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
+  0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
+  0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
+  0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
+  0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
+  0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
+  0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
+  0x2d02ef8dL
+};
+
+/**
+ * \var g_crc32_slice
+ * \brief Lookup tables to process 8 bytes at a time (slice-by-8), built by
+ * crypto_crc32_slice_init().
+ *
+ * g_crc32_slice[k][i] is the CRC of byte i followed by k zero bytes.
+ */
+static uint32_t g_crc32_slice[8][256];
+
+/**
+ * \var g_crc32_slice_ready
+ * \brief If g_crc32_slice is built.
+ */
+static int g_crc32_slice_ready = 0;
+
+/**
+ * \brief Update a CRC-32 one byte at a time.
+ * \param crc current (inverted) CRC.
+ * \param c data.
+ * \param len length of data.
+ * \return updated (inverted) CRC.
+ */
+static uint32_t crypto_crc32_update_table(uint32_t crc, const uint8_t* c,
+    size_t len)
 {
-  /* http://fxr.watson.org/fxr/source/libkern/crc32.c?v=DFBSD
-   * formal specification http://www.itu.int/rec/T-REC-V.42-200203-I/en
-   */
-  static uint32_t crc32_tab[] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-  };
-
-  uint32_t crc = ~prev;
   size_t i = 0;
-  const unsigned char* c = NULL;
-
-  c = data;
 
   for(i = 0 ; i < len ; i++, c++)
   {
-    crc = crc32_tab[((uint32_t)crc ^ (*c)) & 0xff] ^ ( crc >> 8);
+    crc = g_crc32_table[(crc ^ (*c)) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+/**
+ * \brief Build the slice-by-8 lookup tables.
+ */
+static void crypto_crc32_slice_init(void)
+{
+  size_t i = 0;
+  size_t k = 0;
+
+  if(g_crc32_slice_ready)
+  {
+    return;
+  }
+
+  for(i = 0 ; i < 256 ; i++)
+  {
+    g_crc32_slice[0][i] = g_crc32_table[i];
   }
 
-  return crc ^ 0xffffffff;
+  for(k = 1 ; k < 8 ; k++)
+  {
+    for(i = 0 ; i < 256 ; i++)
+    {
+      uint32_t crc = g_crc32_slice[k - 1][i];
+      g_crc32_slice[k][i] = (crc >> 8) ^ g_crc32_table[crc & 0xff];
+    }
+  }
+
+  g_crc32_slice_ready = 1;
+}
+
+/**
+ * \brief Update a CRC-32 eight bytes at a time (slice-by-8).
+ * \param crc current (inverted) CRC.
+ * \param c data.
+ * \param len length of data.
+ * \return updated (inverted) CRC.
+ * \note crypto_crc32_slice_init() must have been called.
+ */
+static uint32_t crypto_crc32_update_slice8(uint32_t crc, const uint8_t* c,
+    size_t len)
+{
+  while(len >= 8)
+  {
+    /* bytes are assembled one by one so that it does not depend on
+     * alignment and endianness
+     */
+    uint32_t one = crc ^ ((uint32_t)c[0] | ((uint32_t)c[1] << 8) |
+        ((uint32_t)c[2] << 16) | ((uint32_t)c[3] << 24));
+    uint32_t two = (uint32_t)c[4] | ((uint32_t)c[5] << 8) |
+        ((uint32_t)c[6] << 16) | ((uint32_t)c[7] << 24);
+
+    crc = g_crc32_slice[7][one & 0xff] ^
+          g_crc32_slice[6][(one >> 8) & 0xff] ^
+          g_crc32_slice[5][(one >> 16) & 0xff] ^
+          g_crc32_slice[4][one >> 24] ^
+          g_crc32_slice[3][two & 0xff] ^
+          g_crc32_slice[2][(two >> 8) & 0xff] ^
+          g_crc32_slice[1][(two >> 16) & 0xff] ^
+          g_crc32_slice[0][two >> 24];
+
+    c += 8;
+    len -= 8;
+  }
+
+  return crypto_crc32_update_table(crc, c, len);
+}
+
+#ifdef CRYPTO_CRC32_HAVE_PCLMUL
+
+/**
+ * \brief Update a CRC-32 with carry-less multiplications (PCLMULQDQ).
+ *
+ * Four 128-bit lanes are folded 64 bytes at a time, then folded into one lane,
+ * reduced to 64 bits and Barrett reduced to 32 bits (Intel white paper "Fast
+ * CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction").
+ * \param crc current (inverted) CRC.
+ * \param c data.
+ * \param len length of data, at least 64 and multiple of 16.
+ * \return updated (inverted) CRC.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crypto_crc32_fold_pclmul(uint32_t crc, const uint8_t* c,
+    size_t len)
+{
+  /* x^(4*128+32) mod P and x^(4*128-32) mod P (bit-reflected) */
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+  /* x^(128+32) mod P and x^(128-32) mod P */
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+  /* x^64 mod P */
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124LL);
+  /* P and floor(x^64 / P) */
+  const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(c + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(c + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(c + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(c + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  c += 64;
+  len -= 64;
+
+  /* fold 4 x 128 bits */
+  while(len >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+        _mm_loadu_si128((const __m128i*)(c + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+        _mm_loadu_si128((const __m128i*)(c + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+        _mm_loadu_si128((const __m128i*)(c + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+        _mm_loadu_si128((const __m128i*)(c + 0x30)));
+
+    c += 64;
+    len -= 64;
+  }
+
+  /* fold the 4 lanes into one */
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /* fold remaining 128-bit blocks */
+  while(len >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+        _mm_loadu_si128((const __m128i*)c));
+
+    c += 16;
+    len -= 16;
+  }
+
+  /* 128 bits to 64 bits */
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+/**
+ * \brief Update a CRC-32 with PCLMULQDQ for large data.
+ * \param crc current (inverted) CRC.
+ * \param c data.
+ * \param len length of data.
+ * \return updated (inverted) CRC.
+ * \note crypto_crc32_slice_init() must have been called.
+ */
+static uint32_t crypto_crc32_update_pclmul(uint32_t crc, const uint8_t* c,
+    size_t len)
+{
+  if(len >= 64)
+  {
+    size_t nb = len & ~(size_t)15;
+
+    crc = crypto_crc32_fold_pclmul(crc, c, nb);
+    c += nb;
+    len -= nb;
+  }
+
+  return crypto_crc32_update_slice8(crc, c, len);
+}
+
+#endif
+
+/**
+ * \var g_crc32_engine
+ * \brief CRC-32 engine in use.
+ */
+static enum crypto_crc32_engine g_crc32_engine = CRYPTO_CRC32_TABLE;
+
+/**
+ * \var g_crc32_update
+ * \brief Function of the CRC-32 engine in use.
+ */
+static uint32_t (*g_crc32_update)(uint32_t, const uint8_t*, size_t) =
+  crypto_crc32_update_table;
+
+int crypto_crc32_engine_set(enum crypto_crc32_engine engine)
+{
+  switch(engine)
+  {
+    case CRYPTO_CRC32_TABLE:
+      g_crc32_update = crypto_crc32_update_table;
+      break;
+    case CRYPTO_CRC32_SLICE8:
+      crypto_crc32_slice_init();
+      g_crc32_update = crypto_crc32_update_slice8;
+      break;
+    case CRYPTO_CRC32_PCLMUL:
+#ifdef CRYPTO_CRC32_HAVE_PCLMUL
+      if(!__builtin_cpu_supports("pclmul") ||
+         !__builtin_cpu_supports("sse4.1"))
+      {
+        return -1;
+      }
+      crypto_crc32_slice_init();
+      g_crc32_update = crypto_crc32_update_pclmul;
+      break;
+#else
+      return -1;
+#endif
+    default:
+      return -1;
+  }
+
+  g_crc32_engine = engine;
+  return 0;
+}
+
+enum crypto_crc32_engine crypto_crc32_init(void)
+{
+  if(crypto_crc32_engine_set(CRYPTO_CRC32_PCLMUL) == -1)
+  {
+    crypto_crc32_engine_set(CRYPTO_CRC32_SLICE8);
+  }
+
+  return g_crc32_engine;
+}
+
+const char* crypto_crc32_engine_name(enum crypto_crc32_engine engine)
+{
+  switch(engine)
+  {
+    case CRYPTO_CRC32_TABLE:
+      return "table";
+    case CRYPTO_CRC32_SLICE8:
+      return "slice-by-8";
+    case CRYPTO_CRC32_PCLMUL:
+      return "pclmul";
+    default:
+      return "unknown";
+  }
+}
+
+uint32_t crypto_crc32_generate(const uint8_t* data, size_t len, uint32_t prev)
+{
+  return ~g_crc32_update(~prev, data, len);
 }
 
 void crypto_digest_print(const unsigned char* buf, size_t len)
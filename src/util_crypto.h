@@ -64,11 +64,42 @@
 
 #include <stdint.h>
 
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
+
+#include <openssl/sha.h>
+
 #ifdef __cplusplus
 extern "C"
 { /* } */
 #endif
 
+/**
+ * \enum crypto_crc32_engine
+ * \brief CRC-32 implementations.
+ */
+enum crypto_crc32_engine
+{
+  CRYPTO_CRC32_TABLE, /**< One byte at a time, always available. */
+  CRYPTO_CRC32_SLICE8, /**< Eight bytes at a time (slice-by-8). */
+  CRYPTO_CRC32_PCLMUL /**< Carry-less multiplication folding (x86). */
+};
+
+/**
+ * \struct crypto_hmac_sha1_key
+ * \brief HMAC-SHA1 key with precomputed inner and outer pads.
+ *
+ * The SHA1 states are copied for each message, so the key is hashed only
+ * once.
+ */
+struct crypto_hmac_sha1_key
+{
+  SHA_CTX inner; /**< SHA1 state after (key XOR ipad). */
+  SHA_CTX outer; /**< SHA1 state after (key XOR opad). */
+};
+
 /**
  * \brief Initialize the PRNG.
  * \return 0 if successfull, -1 if seed is cryptographically weak.
@@ -119,6 +150,40 @@ int crypto_md5_generate(unsigned char* hash, const unsigned char* text, size_t l
 int crypto_hmac_sha1_generate(unsigned char* hash, const unsigned char* text,
     size_t text_len, const unsigned char* key, size_t key_len);
 
+/**
+ * \brief Precompute the inner and outer pads of a HMAC-SHA1 key.
+ * \param hkey key descriptor to initialize.
+ * \param key key used for HMAC.
+ * \param key_len key length.
+ * \return 0 if success, -1 otherwise.
+ */
+int crypto_hmac_sha1_key_init(struct crypto_hmac_sha1_key* hkey,
+    const unsigned char* key, size_t key_len);
+
+/**
+ * \brief Generate a HMAC-SHA1 hash with a precomputed key.
+ * \param hash buffer with at least 20 bytes length.
+ * \param text text to hash.
+ * \param text_len text length.
+ * \param hkey key initialized with crypto_hmac_sha1_key_init().
+ * \return 0 if success, -1 otherwise.
+ */
+int crypto_hmac_sha1_key_generate(unsigned char* hash,
+    const unsigned char* text, size_t text_len,
+    const struct crypto_hmac_sha1_key* hkey);
+
+/**
+ * \brief Generate a HMAC-SHA1 hash of several buffers with a precomputed key.
+ * \param hash buffer with at least 20 bytes length.
+ * \param iov vector of data.
+ * \param iovlen number of elements of iov.
+ * \param hkey key initialized with crypto_hmac_sha1_key_init().
+ * \return 0 if success, -1 otherwise.
+ */
+int crypto_hmac_sha1_key_generate_iov(unsigned char* hash,
+    const struct iovec* iov, size_t iovlen,
+    const struct crypto_hmac_sha1_key* hkey);
+
 /**
  * \brief Generate a HMAC-MD5 hash.
  * \param hash buffer with at least 16 bytes length.
@@ -140,6 +205,28 @@ int crypto_hmac_md5_generate(unsigned char* hash, const unsigned char* text,
  */
 uint32_t crypto_crc32_generate(const uint8_t* data, size_t len, uint32_t prev);
 
+/**
+ * \brief Select the fastest CRC-32 engine supported by the CPU.
+ * \return engine used by crypto_crc32_generate().
+ * \note Until it is called, the one byte at a time engine is used. It has to
+ * be called at startup, before any thread is created.
+ */
+enum crypto_crc32_engine crypto_crc32_init(void);
+
+/**
+ * \brief Select a CRC-32 engine (for tests and benchmarks).
+ * \param engine engine to use.
+ * \return 0 if success, -1 if the engine is not supported.
+ */
+int crypto_crc32_engine_set(enum crypto_crc32_engine engine);
+
+/**
+ * \brief Get the name of a CRC-32 engine.
+ * \param engine engine.
+ * \return name of the engine.
+ */
+const char* crypto_crc32_engine_name(enum crypto_crc32_engine engine);
+
 /**
  * \brief Print a digest.
  * \param buf buffer.
@@ -56,6 +56,11 @@
 #include <config.h>
 #endif
 
+#if !defined(_WIN32) && !defined(_WIN64)
+/* recvmmsg(), sendmmsg() and struct in6_pktinfo are GNU extensions */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -342,11 +347,24 @@ int net_socket_create(enum protocol_type type, const char* addr, uint16_t port,
       continue;
     }
 
-    if(reuse)
+    if(reuse & NET_REUSE_ADDR)
     {
       setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
     }
 
+    if(reuse & NET_REUSE_PORT)
+    {
+#ifdef SO_REUSEPORT
+      if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) == -1)
+#endif
+      {
+        /* port cannot be shared */
+        close(sock);
+        sock = -1;
+        continue;
+      }
+    }
+
     if (type == TCP && nodelay)
     {
       setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int));
@@ -457,6 +475,399 @@ int net_ipv6_address_is_tunneled(const struct in6_addr* addr)
   return 0;
 }
 
+#if !defined(_WIN32) && !defined(_WIN64)
+/**
+ * \def NET_PKTINFO_SPACE
+ * \brief Size of the ancillary data buffer of a datagram.
+ */
+#define NET_PKTINFO_SPACE 64
+
+/**
+ * \union net_pktinfo_control
+ * \brief Ancillary data buffer of a datagram (aligned for struct cmsghdr).
+ */
+union net_pktinfo_control
+{
+  char buf[NET_PKTINFO_SPACE]; /**< Data */
+  size_t align; /**< Alignment for struct cmsghdr */
+};
+
+int net_udp_set_pktinfo(int sock)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_size = sizeof(struct sockaddr_storage);
+  int on = 1;
+
+  if(getsockname(sock, (struct sockaddr*)&addr, &addr_size) == -1)
+  {
+    return -1;
+  }
+
+#ifdef IPV6_RECVPKTINFO
+  /* also reported for IPv4 datagrams of dual-stack sockets (mapped address) */
+  if(addr.ss_family == AF_INET6)
+  {
+    return setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(int));
+  }
+#endif
+#ifdef IP_PKTINFO
+  if(addr.ss_family == AF_INET)
+  {
+    return setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &on, sizeof(int));
+  }
+#endif
+
+  (void)on;
+  return -1;
+}
+
+int net_udp_connect(int sock, const struct sockaddr* local,
+    socklen_t local_size, const struct sockaddr* remote,
+    socklen_t remote_size)
+{
+#ifdef SO_REUSEPORT
+  int csock = -1;
+  int on = 1;
+
+  if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) == -1)
+  {
+    return -1;
+  }
+
+  csock = socket(local->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+  if(csock == -1)
+  {
+    return -1;
+  }
+
+  setsockopt(csock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+
+  if(setsockopt(csock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(int)) == -1)
+  {
+    close(csock);
+    return -1;
+  }
+
+  if(local->sa_family == AF_INET6)
+  {
+    /* remote may be an IPv4-mapped address */
+    on = 0;
+    setsockopt(csock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(int));
+  }
+
+  if(bind(csock, local, local_size) == -1 ||
+     connect(csock, remote, remote_size) == -1)
+  {
+    close(csock);
+    return -1;
+  }
+
+  return csock;
+#else
+  (void)sock;
+  (void)local;
+  (void)local_size;
+  (void)remote;
+  (void)remote_size;
+  return -1;
+#endif
+}
+
+/**
+ * \brief Get the destination address of a received datagram from the
+ * ancillary data.
+ * \param msg message received
+ * \param local address to fill (port is set to 0)
+ * \return size of local, 0 if the message does not contain it
+ */
+static socklen_t net_udp_msg_get_local(struct msghdr* msg,
+    struct sockaddr_storage* local)
+{
+  struct cmsghdr* cmsg = NULL;
+
+  if(!msg->msg_controllen)
+  {
+    return 0;
+  }
+
+  for(cmsg = CMSG_FIRSTHDR(msg) ; cmsg ; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+#ifdef IPV6_RECVPKTINFO
+    if(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+    {
+      struct sockaddr_in6* sin6 = (struct sockaddr_in6*)local;
+      struct in6_pktinfo info;
+
+      memcpy(&info, CMSG_DATA(cmsg), sizeof(struct in6_pktinfo));
+      memset(sin6, 0x00, sizeof(struct sockaddr_in6));
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_addr = info.ipi6_addr;
+      return sizeof(struct sockaddr_in6);
+    }
+#endif
+#ifdef IP_PKTINFO
+    if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+    {
+      struct sockaddr_in* sin = (struct sockaddr_in*)local;
+      struct in_pktinfo info;
+
+      memcpy(&info, CMSG_DATA(cmsg), sizeof(struct in_pktinfo));
+      memset(sin, 0x00, sizeof(struct sockaddr_in));
+      sin->sin_family = AF_INET;
+      sin->sin_addr = info.ipi_addr;
+      return sizeof(struct sockaddr_in);
+    }
+#endif
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Add the source address of a datagram to send in the ancillary data.
+ * \param msg message to send, msg_control is set if needed
+ * \param local source address, ignored if NULL or wildcard
+ * \param control buffer for ancillary data (NET_PKTINFO_SPACE bytes)
+ */
+static void net_udp_msg_set_local(struct msghdr* msg,
+    const struct sockaddr_storage* local, char* control)
+{
+  struct cmsghdr* cmsg = NULL;
+
+  msg->msg_control = NULL;
+  msg->msg_controllen = 0;
+
+  if(!local)
+  {
+    return;
+  }
+
+  memset(control, 0x00, NET_PKTINFO_SPACE);
+  msg->msg_control = control;
+
+#ifdef IPV6_RECVPKTINFO
+  if(local->ss_family == AF_INET6 &&
+     !IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*)local)->sin6_addr))
+  {
+    struct in6_pktinfo info;
+
+    memset(&info, 0x00, sizeof(struct in6_pktinfo));
+    info.ipi6_addr = ((struct sockaddr_in6*)local)->sin6_addr;
+    msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(struct in6_pktinfo));
+    return;
+  }
+#endif
+#ifdef IP_PKTINFO
+  if(local->ss_family == AF_INET &&
+     ((struct sockaddr_in*)local)->sin_addr.s_addr != htonl(INADDR_ANY))
+  {
+    struct in_pktinfo info;
+
+    memset(&info, 0x00, sizeof(struct in_pktinfo));
+    info.ipi_spec_dst = ((struct sockaddr_in*)local)->sin_addr;
+    msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    memcpy(CMSG_DATA(cmsg), &info, sizeof(struct in_pktinfo));
+    return;
+  }
+#endif
+
+  (void)cmsg;
+  msg->msg_control = NULL;
+}
+
+int net_udp_recv_batch(int sock, struct net_datagram* dgrams, size_t nb)
+{
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[NET_DATAGRAM_BATCH_MAX];
+  struct iovec iov[NET_DATAGRAM_BATCH_MAX];
+  union net_pktinfo_control control[NET_DATAGRAM_BATCH_MAX];
+  int ret = -1;
+  size_t i = 0;
+
+  if(nb > NET_DATAGRAM_BATCH_MAX)
+  {
+    nb = NET_DATAGRAM_BATCH_MAX;
+  }
+
+  memset(msgs, 0x00, nb * sizeof(struct mmsghdr));
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    iov[i].iov_base = dgrams[i].buf;
+    iov[i].iov_len = dgrams[i].size;
+    msgs[i].msg_hdr.msg_name = &dgrams[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i].buf;
+    msgs[i].msg_hdr.msg_controllen = NET_PKTINFO_SPACE;
+  }
+
+  ret = recvmmsg(sock, msgs, nb, MSG_DONTWAIT, NULL);
+
+  for(i = 0 ; ret > 0 && i < (size_t)ret ; i++)
+  {
+    dgrams[i].len = msgs[i].msg_len;
+    dgrams[i].addr_size = msgs[i].msg_hdr.msg_namelen;
+    dgrams[i].local_size = net_udp_msg_get_local(&msgs[i].msg_hdr,
+        &dgrams[i].local);
+  }
+
+  return ret;
+#else
+  union net_pktinfo_control control;
+  size_t i = 0;
+
+#ifndef MSG_DONTWAIT
+  /* cannot drain the socket without blocking */
+  nb = nb ? 1 : 0;
+#endif
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t len = -1;
+
+    iov.iov_base = dgrams[i].buf;
+    iov.iov_len = dgrams[i].size;
+    memset(&msg, 0x00, sizeof(struct msghdr));
+    msg.msg_name = &dgrams[i].addr;
+    msg.msg_namelen = sizeof(struct sockaddr_storage);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_DONTWAIT
+    len = recvmsg(sock, &msg, MSG_DONTWAIT);
+#else
+    len = recvmsg(sock, &msg, 0);
+#endif
+
+    if(len < 0)
+    {
+      break;
+    }
+
+    dgrams[i].len = len;
+    dgrams[i].addr_size = msg.msg_namelen;
+    dgrams[i].local_size = net_udp_msg_get_local(&msg, &dgrams[i].local);
+  }
+
+  return (i == 0 && nb > 0) ? -1 : (int)i;
+#endif
+}
+
+size_t net_udp_send_batch(int sock, const struct net_datagram* dgrams,
+    size_t nb, unsigned long* calls)
+{
+  size_t sent = 0;
+  size_t i = 0;
+
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[NET_DATAGRAM_BATCH_MAX];
+  struct iovec iov[NET_DATAGRAM_BATCH_MAX];
+  union net_pktinfo_control control[NET_DATAGRAM_BATCH_MAX];
+
+  while(i < nb)
+  {
+    size_t n = nb - i;
+    size_t j = 0;
+    int ret = -1;
+
+    if(n > NET_DATAGRAM_BATCH_MAX)
+    {
+      n = NET_DATAGRAM_BATCH_MAX;
+    }
+
+    memset(msgs, 0x00, n * sizeof(struct mmsghdr));
+
+    for(j = 0 ; j < n ; j++)
+    {
+      const struct net_datagram* dgram = &dgrams[i + j];
+
+      iov[j].iov_base = dgram->buf;
+      iov[j].iov_len = dgram->len;
+      msgs[j].msg_hdr.msg_name = (void*)&dgram->addr;
+      msgs[j].msg_hdr.msg_namelen = dgram->addr_size;
+      msgs[j].msg_hdr.msg_iov = &iov[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+      net_udp_msg_set_local(&msgs[j].msg_hdr,
+          dgram->local_size ? &dgram->local : NULL, control[j].buf);
+    }
+
+    ret = sendmmsg(sock, msgs, n, 0);
+
+    if(calls)
+    {
+      (*calls)++;
+    }
+
+    if(ret > 0)
+    {
+      sent += ret;
+      i += ret;
+    }
+
+    if(ret < (int)n)
+    {
+      /* skip the datagram in error */
+      i++;
+    }
+  }
+#else
+  for(i = 0 ; i < nb ; i++)
+  {
+    struct iovec iov;
+
+    iov.iov_base = dgrams[i].buf;
+    iov.iov_len = dgrams[i].len;
+
+    if(net_udp_sendv(sock, &iov, 1, (const struct sockaddr*)&dgrams[i].addr,
+          dgrams[i].addr_size,
+          dgrams[i].local_size ? &dgrams[i].local : NULL) != -1)
+    {
+      sent++;
+    }
+
+    if(calls)
+    {
+      (*calls)++;
+    }
+  }
+#endif
+
+  return sent;
+}
+
+ssize_t net_udp_sendv(int sock, const struct iovec* iov, size_t iovlen,
+    const struct sockaddr* addr, socklen_t addr_size,
+    const struct sockaddr_storage* local)
+{
+  union net_pktinfo_control control;
+  struct msghdr msg;
+
+  memset(&msg, 0x00, sizeof(struct msghdr));
+  msg.msg_name = (void*)addr;
+  msg.msg_namelen = addr_size;
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovlen;
+  net_udp_msg_set_local(&msg, local, control.buf);
+
+  return sendmsg(sock, &msg, 0);
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
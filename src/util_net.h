@@ -162,12 +162,26 @@ typedef struct net_sfd_set sfd_set;
  */
 #define NET_SFD_CLR(fd, set) FD_CLR((fd), (set))
 
+/**
+ * \def NET_REUSE_ADDR
+ * \brief Allow socket to reuse transport address (SO_REUSEADDR).
+ */
+#define NET_REUSE_ADDR 0x01
+
+/**
+ * \def NET_REUSE_PORT
+ * \brief Allow several sockets to be bound on the same transport address, the
+ * kernel balances packets and connections between them (SO_REUSEPORT).
+ */
+#define NET_REUSE_PORT 0x02
+
 /**
  * \brief Create and bind socket.
  * \param type transport protocol used.
  * \param addr address or FQDN name.
  * \param port to bind.
- * \param reuse allow socket to reuse transport address (SO_REUSE).
+ * \param reuse allow socket to reuse transport address (NET_REUSE_ADDR) and/or
+ * to share it with other sockets (NET_REUSE_PORT).
  * \param nodelay disable naggle algorithm for TCP sockets only (TCP_NODELAY).
  * \return socket descriptor, -1 otherwise.
  */
@@ -274,6 +288,105 @@ int net_ipv6_address_is_valid(const char* address);
  */
 int net_ipv6_address_is_tunneled(const struct in6_addr* addr);
 
+#if !defined(_WIN32) && !defined(_WIN64)
+/**
+ * \def NET_DATAGRAM_BATCH_MAX
+ * \brief Maximum number of datagrams received or sent by one system call.
+ */
+#define NET_DATAGRAM_BATCH_MAX 256
+
+/**
+ * \struct net_datagram
+ * \brief UDP datagram for batched I/O.
+ */
+struct net_datagram
+{
+  char* buf; /**< Data */
+  size_t size; /**< Capacity of buf */
+  size_t len; /**< Length of data */
+  struct sockaddr_storage addr; /**< Source or destination address */
+  socklen_t addr_size; /**< Size of addr */
+  struct sockaddr_storage local; /**< Local address the datagram has been
+                                   received on or has to be sent from (port
+                                   is not used) */
+  socklen_t local_size; /**< Size of local, 0 if unknown or if the system
+                          chooses the source address */
+};
+
+/**
+ * \brief Enable the reception of the destination address of datagrams
+ * (IP_PKTINFO / IPV6_RECVPKTINFO) on an UDP socket.
+ *
+ * It allows a socket bound to a wildcard address to know on which local
+ * address each datagram has been received.
+ * \param sock UDP socket.
+ * \return 0 if success, -1 if not supported.
+ */
+int net_udp_set_pktinfo(int sock);
+
+/**
+ * \brief Create an UDP socket connected to a remote address on the local
+ * address of an unconnected socket.
+ *
+ * Both sockets share the local address with SO_REUSEPORT, the kernel then
+ * delivers the datagrams of the remote address to the connected socket.
+ * \param sock unconnected UDP socket bound to local (SO_REUSEPORT is enabled
+ * on it).
+ * \param local local address and port.
+ * \param local_size sizeof local.
+ * \param remote remote address and port.
+ * \param remote_size sizeof remote.
+ * \return socket descriptor or -1 if error (or SO_REUSEPORT not supported).
+ */
+int net_udp_connect(int sock, const struct sockaddr* local,
+    socklen_t local_size, const struct sockaddr* remote,
+    socklen_t remote_size);
+
+/**
+ * \brief Receive the datagrams waiting on a socket without blocking.
+ *
+ * Use recvmmsg() if available, recvmsg() otherwise. If net_udp_set_pktinfo()
+ * has been called on the socket, the local field of each datagram is set to
+ * its destination address (with port 0).
+ * \param sock UDP socket.
+ * \param dgrams array of datagrams to fill, buf and size have to be set.
+ * \param nb number of elements of dgrams (at most NET_DATAGRAM_BATCH_MAX are
+ * used).
+ * \return number of datagrams received, -1 if error.
+ */
+int net_udp_recv_batch(int sock, struct net_datagram* dgrams, size_t nb);
+
+/**
+ * \brief Send datagrams on a socket.
+ *
+ * Use sendmmsg() if available, sendmsg() otherwise. A datagram that cannot be
+ * sent is skipped. If the local field of a datagram is set to a non-wildcard
+ * address, it is used as source address.
+ * \param sock UDP socket.
+ * \param dgrams array of datagrams to send.
+ * \param nb number of elements of dgrams.
+ * \param calls if not NULL, incremented by the number of system calls made.
+ * \return number of datagrams sent.
+ */
+size_t net_udp_send_batch(int sock, const struct net_datagram* dgrams,
+    size_t nb, unsigned long* calls);
+
+/**
+ * \brief Send a datagram from a local address.
+ * \param sock UDP socket.
+ * \param iov vector of data.
+ * \param iovlen number of elements of iov.
+ * \param addr destination address.
+ * \param addr_size sizeof addr.
+ * \param local source address, if NULL or a wildcard address the system
+ * chooses it.
+ * \return number of bytes sent, -1 if error.
+ */
+ssize_t net_udp_sendv(int sock, const struct iovec* iov, size_t iovlen,
+    const struct sockaddr* addr, socklen_t addr_size,
+    const struct sockaddr_storage* local);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -119,6 +119,25 @@ long sys_get_dtablesize(void)
 #endif
 }
 
+uint64_t sys_clock_ms(void)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  if(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+  {
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+  }
+#endif
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#else /* Windows */
+  return 0;
+#endif
+}
+
 int sys_is_big_endian(void)
 {
   long one = 1;
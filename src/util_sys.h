@@ -112,6 +112,15 @@ int sys_microsleep(unsigned long usec);
  */
 long sys_get_dtablesize(void);
 
+/**
+ * \brief Get the time of the monotonic clock in milliseconds.
+ *
+ * The coarse clock is used if available, it is cheaper to read and its
+ * resolution (the kernel tick) is enough for timers and rate limiting.
+ * \return time in milliseconds, 0 if not supported
+ */
+uint64_t sys_clock_ms(void);
+
 /**
  * \brief Return if host machine is big endian.
  * \return 1 if big endian.
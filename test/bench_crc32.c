@@ -0,0 +1,122 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file bench_crc32.c
+ * \brief Microbenchmark of CRC-32 engines used for FINGERPRINT.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/util_crypto.h"
+
+/**
+ * \def BENCH_BYTES
+ * \brief Number of bytes processed per engine and message size.
+ */
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+/**
+ * \brief Get current monotonic time.
+ * \return time in seconds.
+ */
+static double bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Entry point of the benchmark.
+ * \param argc number of arguments.
+ * \param argv arguments.
+ * \return EXIT_SUCCESS.
+ */
+int main(int argc, char** argv)
+{
+  enum crypto_crc32_engine engines[] = {CRYPTO_CRC32_TABLE,
+    CRYPTO_CRC32_SLICE8, CRYPTO_CRC32_PCLMUL};
+  /* typical STUN/TURN messages up to MTU-sized Data indications */
+  size_t sizes[] = {20, 100, 548, 1500, 65536};
+  static uint8_t buf[65536];
+  size_t i = 0;
+  size_t j = 0;
+
+  (void)argc;
+  (void)argv;
+
+  for(i = 0 ; i < sizeof(buf) ; i++)
+  {
+    buf[i] = (uint8_t)(i * 31 + 7);
+  }
+
+  printf("%-12s %8s %12s %10s\n", "engine", "size", "ns/message", "MB/s");
+
+  for(i = 0 ; i < sizeof(engines) / sizeof(engines[0]) ; i++)
+  {
+    if(crypto_crc32_engine_set(engines[i]) == -1)
+    {
+      printf("%-12s not supported\n", crypto_crc32_engine_name(engines[i]));
+      continue;
+    }
+
+    for(j = 0 ; j < sizeof(sizes) / sizeof(sizes[0]) ; j++)
+    {
+      size_t nb = BENCH_BYTES / sizes[j];
+      volatile uint32_t crc = 0;
+      double start = 0;
+      double elapsed = 0;
+      size_t k = 0;
+
+      start = bench_now();
+      for(k = 0 ; k < nb ; k++)
+      {
+        crc = crypto_crc32_generate(buf, sizes[j], crc);
+      }
+      elapsed = bench_now() - start;
+
+      printf("%-12s %8lu %12.1f %10.1f\n", crypto_crc32_engine_name(engines[i]),
+          (unsigned long)sizes[j], elapsed * 1e9 / nb,
+          nb * sizes[j] / elapsed / 1e6);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
@@ -112,6 +112,61 @@ START_TEST(test_account_list)
 }
 END_TEST
 
+START_TEST(test_account_list_merge)
+{
+  struct list_head account_list;
+  struct list_head reload;
+  struct list_head removed;
+  struct account_desc* ret = NULL;
+  struct account_desc* ret2 = NULL;
+  struct account_desc* ret3 = NULL;
+  unsigned char key[16];
+
+  list_head_init(&account_list);
+  list_head_init(&reload);
+  list_head_init(&removed);
+
+  ret = account_desc_new("login", "password", "domain.org", AUTHORIZED);
+  fail_unless(ret != NULL, "Invalid parameter or memory problem");
+  ret2 = account_desc_new("login2", "password2", "domain.org", AUTHORIZED);
+  fail_unless(ret2 != NULL, "Invalid parameter or memory problem");
+  account_list_add(&account_list, ret);
+  account_list_add(&account_list, ret2);
+
+  /* login has a new password, login2 is removed and login3 is added */
+  ret3 = account_desc_new("login", "password3", "domain.org", RESTRICTED);
+  fail_unless(ret3 != NULL, "Invalid parameter or memory problem");
+  memcpy(key, ret3->key, sizeof(key));
+  list_head_add(&reload, &ret3->list);
+  ret3 = account_desc_new("login3", "password", "domain.org", AUTHORIZED);
+  fail_unless(ret3 != NULL, "Invalid parameter or memory problem");
+  list_head_add(&reload, &ret3->list);
+
+  account_list_merge(&account_list, &reload, &removed);
+  fail_unless(list_head_is_empty(&reload), "Reload list is not empty");
+
+  /* descriptor of login is kept and updated */
+  ret3 = account_list_find(&account_list, "login", "domain.org");
+  fail_unless(ret3 == ret, "Account descriptor not kept");
+  fail_unless(ret3->state == RESTRICTED, "Account state not updated");
+  fail_unless(!memcmp(ret3->key, key, sizeof(key)), "Account key not updated");
+
+  ret3 = account_list_find(&account_list, "login3", "domain.org");
+  fail_unless(ret3 != NULL, "New account not added");
+
+  /* login2 is moved to the removed list */
+  ret3 = account_list_find(&account_list, "login2", "domain.org");
+  fail_unless(ret3 == NULL, "Removed account still found");
+  fail_unless(list_head_size(&removed) == 1 && removed.next == &ret2->list,
+      "Removed account not in removed list");
+  fail_unless(list_head_size(&account_list) == 2, "Wrong number of accounts");
+
+  list_head_remove(&removed, &ret2->list);
+  account_desc_free(&ret2);
+  account_list_free(&account_list);
+}
+END_TEST
+
 Suite* turn_msg_suite(void)
 {
   Suite* s = suite_create("Account management tests");
@@ -120,6 +175,7 @@ Suite* turn_msg_suite(void)
   TCase* tc_core = tcase_create("Core");
   tcase_add_test(tc_core, test_account_create);
   tcase_add_test(tc_core, test_account_list);
+  tcase_add_test(tc_core, test_account_list_merge);
   suite_add_tcase(s, tc_core);
 
   return s;
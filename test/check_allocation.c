@@ -113,6 +113,32 @@ START_TEST(test_allocation_list)
   ret = allocation_list_find_id(&allocation_list, id);
   fail_unless(ret == NULL, "Allocation found (id match)");
 
+  ret = allocation_list_find_tuple(&allocation_list, IPPROTO_UDP,
+      (struct sockaddr*)&server_addr, (struct sockaddr*)&client_addr2,
+      sizeof(client_addr2));
+  fail_unless(ret == ret2, "Allocation not found (5-tuple not match)");
+
+  ret = allocation_list_find_tuple(&allocation_list, IPPROTO_TCP,
+      (struct sockaddr*)&server_addr, (struct sockaddr*)&client_addr2,
+      sizeof(client_addr2));
+  fail_unless(ret == NULL, "Allocation found (5-tuple match)");
+
+  ret = allocation_list_find_relayed(&allocation_list,
+      (struct sockaddr*)&relayed_addr2, sizeof(relayed_addr2));
+  fail_unless(ret == ret2, "Allocation not found (relayed not match)");
+
+  ret = allocation_list_find_username(&allocation_list, "login2", realm);
+  fail_unless(ret == ret2, "Allocation not found (username not match)");
+
+  ret = allocation_list_find_username(&allocation_list, "login2", "realm");
+  fail_unless(ret == NULL, "Allocation found (username match)");
+
+  /* removed allocation is no more indexed */
+  allocation_list_remove(&allocation_list, ret2);
+  ret = allocation_list_find_relayed(&allocation_list,
+      (struct sockaddr*)&relayed_addr2, sizeof(relayed_addr2));
+  fail_unless(ret == NULL, "Allocation found after removal");
+
   /* free the list */
   allocation_list_free(&allocation_list);
 
@@ -240,6 +266,204 @@ START_TEST(test_allocation_create)
 }
 END_TEST
 
+START_TEST(test_allocation_index)
+{
+  struct list_head allocation_list;
+  struct allocation_desc* ret = NULL;
+  struct sockaddr_in6 client_addr;
+  struct sockaddr_in6 server_addr;
+  struct sockaddr_in6 relayed_addr;
+  struct sockaddr_in client_addr4;
+  struct sockaddr_in server_addr4;
+  uint8_t id[12];
+  unsigned char key[16];
+  unsigned char nonce[48];
+  char* realm = "domain.org";
+  uint16_t i = 0;
+
+  memset(id, 0x00, 12);
+  memset(key, 0x00, 16);
+  memset(nonce, 0x00, 48);
+  list_head_init(&allocation_list);
+
+  /* IPv6 socket which receives IPv4 traffic */
+  memset(&client_addr, 0x00, sizeof(client_addr));
+  client_addr.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "::ffff:10.9.91.1", &client_addr.sin6_addr);
+
+  memset(&server_addr, 0x00, sizeof(server_addr));
+  server_addr.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "::ffff:192.168.0.1", &server_addr.sin6_addr);
+  server_addr.sin6_port = htons(3478);
+
+  memset(&relayed_addr, 0x00, sizeof(relayed_addr));
+  relayed_addr.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, "2001:db8::1", &relayed_addr.sin6_addr);
+
+  /* enough allocations to grow the indexes */
+  for(i = 0 ; i < 1000 ; i++)
+  {
+    id[0] = i & 0xff;
+    id[1] = i >> 8;
+    client_addr.sin6_port = htons(10000 + i);
+    relayed_addr.sin6_port = htons(50000 + i);
+
+    ret = allocation_desc_new(id, IPPROTO_UDP, "login", key, realm, nonce,
+        (struct sockaddr*)&relayed_addr, (struct sockaddr*)&server_addr,
+        (struct sockaddr*)&client_addr, sizeof(client_addr), 3600);
+    fail_unless(ret != NULL, "Invalid parameter or memory problem");
+    allocation_list_add(&allocation_list, ret);
+  }
+
+  for(i = 0 ; i < 1000 ; i++)
+  {
+    id[0] = i & 0xff;
+    id[1] = i >> 8;
+    relayed_addr.sin6_port = htons(50000 + i);
+
+    ret = allocation_list_find_relayed(&allocation_list,
+        (struct sockaddr*)&relayed_addr, sizeof(relayed_addr));
+    fail_unless(ret != NULL && !memcmp(ret->transaction_id, id, 12),
+        "Allocation not found (relayed not match)");
+    fail_unless(allocation_list_find_id(&allocation_list, id) == ret,
+        "Allocation not found (id not match)");
+  }
+
+  /* IPv4-mapped IPv6 addresses match the IPv4 ones */
+  memset(&client_addr4, 0x00, sizeof(client_addr4));
+  client_addr4.sin_family = AF_INET;
+  inet_pton(AF_INET, "10.9.91.1", &client_addr4.sin_addr);
+  client_addr4.sin_port = htons(10042);
+
+  memset(&server_addr4, 0x00, sizeof(server_addr4));
+  server_addr4.sin_family = AF_INET;
+  inet_pton(AF_INET, "192.168.0.1", &server_addr4.sin_addr);
+  server_addr4.sin_port = htons(3478);
+
+  ret = allocation_list_find_tuple(&allocation_list, IPPROTO_UDP,
+      (struct sockaddr*)&server_addr4, (struct sockaddr*)&client_addr4,
+      sizeof(client_addr4));
+  fail_unless(ret != NULL && ret->transaction_id[0] == 42,
+      "Allocation not found (5-tuple not match)");
+
+  allocation_list_free(&allocation_list);
+  ret = allocation_list_find_username(&allocation_list, "login", realm);
+  fail_unless(ret == NULL, "Allocation found after free");
+}
+END_TEST
+
+START_TEST(test_allocation_channel)
+{
+  struct allocation_desc* ret = NULL;
+  struct allocation_channel* alloc_channel = NULL;
+  struct allocation_permission* permission = NULL;
+  struct sockaddr_in client_addr;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in peer_addr;
+  uint8_t id[12];
+  unsigned char key[16];
+  unsigned char nonce[48];
+  uint8_t mapped[16];
+  char* realm = "domain.org";
+  uint16_t i = 0;
+  uint32_t addr = 0;
+
+  memset(id, 0xAB, 12);
+  memset(key, 0x00, 16);
+  memset(nonce, 0x00, 48);
+
+  memset(&client_addr, 0x00, sizeof(client_addr));
+  client_addr.sin_family = AF_INET;
+  inet_pton(AF_INET, "10.9.91.1", &client_addr.sin_addr);
+  client_addr.sin_port = htons(3560);
+  memcpy(&server_addr, &client_addr, sizeof(client_addr));
+  server_addr.sin_port = htons(3478);
+
+  ret = allocation_desc_new(id, IPPROTO_UDP, "login", key, realm, nonce,
+      (struct sockaddr*)&server_addr, (struct sockaddr*)&server_addr,
+      (struct sockaddr*)&client_addr, sizeof(client_addr), 3600);
+  fail_unless(ret != NULL, "Invalid parameter or memory problem");
+
+  /* conference bridge: hundreds of peers with permission and channel */
+  for(i = 0 ; i < 500 ; i++)
+  {
+    addr = htonl(0x62020000 + i);
+
+    fail_unless(allocation_desc_add_permission(ret, 300, AF_INET,
+          (uint8_t*)&addr) == 0, "add permission failed");
+    fail_unless(allocation_desc_add_channel(ret, 0x4000 + i * 31, 600,
+          AF_INET, (uint8_t*)&addr, 5000 + i) == 0, "add channel failed");
+  }
+
+  for(i = 0 ; i < 500 ; i++)
+  {
+    addr = htonl(0x62020000 + i);
+
+    alloc_channel = allocation_desc_find_channel_number(ret, 0x4000 + i * 31);
+    fail_unless(alloc_channel != NULL && alloc_channel->peer_port == 5000 + i,
+        "Find channel number failed");
+    memcpy(&peer_addr, &alloc_channel->peer_saddr, sizeof(peer_addr));
+    fail_unless(alloc_channel->peer_saddr_size == sizeof(peer_addr) &&
+        peer_addr.sin_family == AF_INET && peer_addr.sin_addr.s_addr == addr &&
+        peer_addr.sin_port == htons(5000 + i), "Bad channel peer address");
+    fail_unless(allocation_desc_find_channel(ret, AF_INET, (uint8_t*)&addr,
+          5000 + i) == 0x4000 + i * 31u, "Find channel failed");
+    fail_unless(allocation_desc_find_channel(ret, AF_INET, (uint8_t*)&addr,
+          5001 + i) == 0, "Find channel success (bad port)");
+  }
+
+  fail_unless(allocation_desc_find_channel_number(ret, 0x4001) == NULL,
+      "Find channel number success");
+
+  /* remove half of them, others must still be found */
+  for(i = 0 ; i < 500 ; i += 2)
+  {
+    addr = htonl(0x62020000 + i);
+
+    permission = allocation_desc_find_permission(ret, AF_INET,
+        (uint8_t*)&addr);
+    fail_unless(permission != NULL, "Find permission failed");
+    allocation_permission_free(&permission);
+    fail_unless(permission == NULL, "allocation_permission_free does not set "
+        "to NULL!");
+
+    alloc_channel = allocation_desc_find_channel_number(ret, 0x4000 + i * 31);
+    allocation_channel_free(&alloc_channel);
+  }
+
+  for(i = 0 ; i < 500 ; i++)
+  {
+    addr = htonl(0x62020000 + i);
+
+    permission = allocation_desc_find_permission(ret, AF_INET,
+        (uint8_t*)&addr);
+    fail_unless((permission != NULL) == (i % 2 == 1),
+        "Bad permission after removal");
+    fail_unless((allocation_desc_find_channel(ret, AF_INET, (uint8_t*)&addr,
+            5000 + i) != 0) == (i % 2 == 1), "Bad channel after removal");
+  }
+
+  /* IPv4-mapped IPv6 peer matches IPv4 permission */
+  addr = htonl(0x62020001);
+  memset(mapped, 0x00, 16);
+  mapped[10] = 0xff;
+  mapped[11] = 0xff;
+  memcpy(mapped + 12, &addr, 4);
+  fail_unless(allocation_desc_find_permission(ret, AF_INET6, mapped) != NULL,
+      "Find permission failed (IPv4-mapped address)");
+
+  memset(&peer_addr, 0x00, sizeof(peer_addr));
+  peer_addr.sin_family = AF_INET;
+  memcpy(&peer_addr.sin_addr, &addr, 4);
+  peer_addr.sin_port = htons(4242);
+  fail_unless(allocation_desc_find_permission_sockaddr(ret,
+        (struct sockaddr*)&peer_addr) != NULL,
+      "Find permission failed (sockaddr)");
+
+  allocation_desc_free(&ret);
+}
+END_TEST
+
 Suite* turn_msg_suite(void)
 {
   Suite* s = suite_create("Allocation management tests");
@@ -249,6 +473,8 @@ Suite* turn_msg_suite(void)
   tcase_add_test(tc_core, test_allocation_create);
   tcase_add_test(tc_core, test_allocation_add);
   tcase_add_test(tc_core, test_allocation_list);
+  tcase_add_test(tc_core, test_allocation_index);
+  tcase_add_test(tc_core, test_allocation_channel);
   suite_add_tcase(s, tc_core);
 
   return s;
@@ -0,0 +1,277 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file check_nonce.c
+ * \brief Unit tests for nonce generation and verification.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../src/nonce.h"
+
+/**
+ * \brief Fill an IPv4 address.
+ * \param addr address to fill
+ * \param port port
+ */
+static void set_addr(struct sockaddr_in* addr, uint16_t port)
+{
+  memset(addr, 0x00, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = inet_addr("192.168.0.1");
+  addr->sin_port = htons(port);
+}
+
+START_TEST(test_nonce_generate)
+{
+  struct nonce_ctx* ctx = malloc(sizeof(struct nonce_ctx));
+  struct sockaddr_in addr;
+  uint8_t nonce[NONCE_LEN];
+  uint8_t nonce2[NONCE_LEN];
+  time_t now = 1356998400;
+  size_t i = 0;
+
+  fail_unless(ctx != NULL, "Allocation failed");
+  fail_unless(nonce_ctx_init(ctx, (const unsigned char*)"key", 3, 3600, 0) == 0,
+      "Initialization failed");
+  set_addr(&addr, 4444);
+
+  fail_unless(nonce_generate(ctx, now, nonce, sizeof(nonce) - 1) == -1,
+      "Too small buffer not detected");
+  fail_unless(nonce_generate(ctx, now, nonce, sizeof(nonce)) == NONCE_LEN,
+      "Generation failed");
+  fail_unless(nonce[0] == NONCE_VERSION, "Bad version");
+
+  /* printable (RFC5389 qdtext) */
+  for(i = 0 ; i < NONCE_LEN ; i++)
+  {
+    fail_unless(nonce[i] > 0x20 && nonce[i] < 0x7f && nonce[i] != '"',
+        "Nonce not printable");
+  }
+
+  /* same second, same nonce */
+  nonce_generate(ctx, now, nonce2, sizeof(nonce2));
+  fail_unless(memcmp(nonce, nonce2, NONCE_LEN) == 0, "Nonce differs");
+  nonce_generate(ctx, now + 1, nonce2, sizeof(nonce2));
+  fail_unless(memcmp(nonce, nonce2, NONCE_LEN) != 0, "Nonce not changed");
+
+  fail_unless(nonce_verify(ctx, now, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0, "Valid nonce refused");
+  fail_unless(nonce_verify(ctx, now + 3600, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0, "Valid nonce refused");
+  fail_unless(nonce_verify(ctx, now + 3601, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Stale nonce accepted");
+  fail_unless(nonce_verify(ctx, now, nonce, NONCE_LEN - 1,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Bad length accepted");
+
+  /* tampered version, expiration time and MAC */
+  memcpy(nonce2, nonce, NONCE_LEN);
+  nonce2[0] = '1';
+  fail_unless(nonce_verify(ctx, now, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Bad version accepted");
+
+  memcpy(nonce2, nonce, NONCE_LEN);
+  nonce2[8] = (nonce2[8] == 'f') ? 'e' : 'f';
+  fail_unless(nonce_verify(ctx, now, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1,
+      "Modified expiration accepted");
+
+  memcpy(nonce2, nonce, NONCE_LEN);
+  nonce2[NONCE_LEN - 1] = (nonce2[NONCE_LEN - 1] == '0') ? '1' : '0';
+  fail_unless(nonce_verify(ctx, now, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Bad MAC accepted");
+
+  nonce2[NONCE_LEN - 1] = 'z';
+  fail_unless(nonce_verify(ctx, now, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1,
+      "Non hexadecimal nonce accepted");
+
+  /* another server key */
+  nonce_ctx_init(ctx, (const unsigned char*)"other", 5, 3600, 0);
+  fail_unless(nonce_verify(ctx, now, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1,
+      "Nonce of another key accepted");
+
+  free(ctx);
+}
+END_TEST
+
+START_TEST(test_nonce_key_change)
+{
+  struct nonce_ctx* ctx = malloc(sizeof(struct nonce_ctx));
+  struct nonce_ctx* ctx2 = malloc(sizeof(struct nonce_ctx));
+  struct sockaddr_in addr;
+  uint8_t nonce[NONCE_LEN];
+  uint8_t nonce2[NONCE_LEN];
+  uint8_t nonce3[NONCE_LEN];
+  time_t now = 1356998400;
+
+  fail_unless(ctx != NULL && ctx2 != NULL, "Allocation failed");
+  set_addr(&addr, 4444);
+
+  nonce_ctx_init(ctx, (const unsigned char*)"key", 3, 100, 0);
+  nonce_generate(ctx, now, nonce, NONCE_LEN);
+
+  /* another process with the same key (different cache seed) */
+  nonce_ctx_init(ctx2, (const unsigned char*)"key", 3, 100, 1234);
+  fail_unless(nonce_verify(ctx2, now, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0,
+      "Nonce refused by other process");
+
+  /* same key again */
+  fail_unless(nonce_ctx_set_key(ctx, (const unsigned char*)"key", 3) == 0,
+      "Same key detected as a new one");
+
+  /* new key, nonces of the previous key remain valid */
+  fail_unless(nonce_ctx_set_key(ctx, (const unsigned char*)"key2", 4) == 1,
+      "New key not set");
+  nonce_generate(ctx, now, nonce2, NONCE_LEN);
+  fail_unless(memcmp(nonce, nonce2, NONCE_LEN) != 0, "Nonce not changed");
+  fail_unless(memcmp(nonce + 1, nonce2 + 1, 2) != 0, "Key ID not changed");
+
+  fail_unless(nonce_verify(ctx, now + 50, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0,
+      "Nonce of previous key refused");
+  fail_unless(nonce_verify(ctx, now + 50, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0,
+      "Nonce of current key refused");
+  fail_unless(nonce_verify(ctx2, now + 50, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1,
+      "Nonce of unknown key accepted");
+
+  /* the key ID selects the key */
+  memcpy(nonce3, nonce, NONCE_LEN);
+  memcpy(nonce3 + 1, nonce2 + 1, 2);
+  fail_unless(nonce_verify(ctx, now, nonce3, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Forged nonce accepted");
+
+  /* the oldest key is dropped, even if its nonce is in the cache */
+  fail_unless(nonce_verify(ctx, now + 50, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0,
+      "Nonce of previous key refused");
+  fail_unless(nonce_ctx_set_key(ctx, (const unsigned char*)"key3", 4) == 1,
+      "New key not set");
+  fail_unless(nonce_verify(ctx, now + 50, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1,
+      "Nonce of dropped key accepted");
+  fail_unless(nonce_verify(ctx, now + 50, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0,
+      "Nonce of previous key refused");
+  fail_unless(nonce_verify(ctx, now + 101, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Stale nonce accepted");
+
+  free(ctx);
+  free(ctx2);
+}
+END_TEST
+
+START_TEST(test_nonce_cache)
+{
+  struct nonce_ctx* ctx = malloc(sizeof(struct nonce_ctx));
+  struct sockaddr_in addr;
+  struct sockaddr_in addr2;
+  uint8_t nonce[NONCE_LEN];
+  uint8_t nonce2[NONCE_LEN];
+  time_t now = 1356998400;
+
+  fail_unless(ctx != NULL, "Allocation failed");
+  nonce_ctx_init(ctx, (const unsigned char*)"key", 3, 3600, 42);
+  set_addr(&addr, 4444);
+  set_addr(&addr2, 4445);
+
+  nonce_generate(ctx, now, nonce, sizeof(nonce));
+
+  /* first verification computes the MAC, next ones use the cache */
+  fail_unless(nonce_verify(ctx, now, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0, "Valid nonce refused");
+  fail_unless(nonce_verify(ctx, now + 10, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0, "Valid nonce refused");
+  fail_unless(nonce_verify(ctx, now + 20, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == 0, "Valid nonce refused");
+  fail_unless(ctx->verified == 1, "MAC computed again");
+  fail_unless(ctx->cache_hits == 2, "Cache not used");
+
+  /* cached nonce becomes stale */
+  fail_unless(nonce_verify(ctx, now + 3601, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Stale nonce accepted");
+
+  /* a modified nonce does not match the cache */
+  memcpy(nonce2, nonce, NONCE_LEN);
+  nonce2[NONCE_LEN - 1] = (nonce2[NONCE_LEN - 1] == '0') ? '1' : '0';
+  fail_unless(nonce_verify(ctx, now, nonce2, NONCE_LEN,
+        (struct sockaddr*)&addr, sizeof(addr)) == -1, "Bad MAC accepted");
+
+  /* other client */
+  fail_unless(nonce_verify(ctx, now, nonce, NONCE_LEN,
+        (struct sockaddr*)&addr2, sizeof(addr2)) == 0, "Valid nonce refused");
+
+  free(ctx);
+}
+END_TEST
+
+Suite* nonce_suite(void)
+{
+  Suite* s = suite_create("Nonce tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_nonce_generate);
+  tcase_add_test(tc_core, test_nonce_key_change);
+  tcase_add_test(tc_core, test_nonce_cache);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = nonce_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
@@ -0,0 +1,184 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file check_pool.c
+ * \brief Unit tests for object pool.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "../src/pool.h"
+
+/**
+ * \struct object
+ * \brief Object used for the tests.
+ */
+struct object
+{
+  uint64_t id; /**< Identifier */
+  char data[40]; /**< Payload */
+};
+
+START_TEST(test_pool_alloc)
+{
+  struct pool pool;
+  struct object* objects[100];
+  struct object* obj = NULL;
+  size_t i = 0;
+
+  pool_init(&pool, "test", sizeof(struct object), 8);
+
+  for(i = 0 ; i < 100 ; i++)
+  {
+    objects[i] = pool_alloc(&pool);
+    fail_unless(objects[i] != NULL, "Allocation failed");
+    fail_unless(((uintptr_t)objects[i] % sizeof(uint64_t)) == 0,
+        "Object not aligned");
+    objects[i]->id = i;
+    memset(objects[i]->data, (int)i, sizeof(objects[i]->data));
+  }
+
+  /* 100 objects by slabs of 8 */
+  fail_unless(pool.used == 100, "Bad number of used objects");
+  fail_unless(pool.total == 104, "Bad number of objects");
+  fail_unless(pool.high_water == 100, "Bad high-water mark");
+
+  /* objects do not overlap */
+  for(i = 0 ; i < 100 ; i++)
+  {
+    fail_unless(objects[i]->id == i, "Object overwritten");
+    fail_unless(objects[i]->data[39] == (char)i, "Object overwritten");
+  }
+
+  for(i = 0 ; i < 50 ; i++)
+  {
+    pool_free(&pool, objects[i]);
+  }
+  pool_free(&pool, NULL);
+
+  fail_unless(pool.used == 50, "Bad number of used objects");
+  fail_unless(pool.high_water == 100, "Bad high-water mark");
+
+  /* freed objects are recycled */
+  obj = pool_alloc(&pool);
+  fail_unless(obj == objects[49], "Object not recycled");
+  fail_unless(pool.total == 104, "Pool has grown");
+
+  pool_destroy(&pool);
+  fail_unless(pool.used == 0 && pool.total == 0 && pool.high_water == 0,
+      "Pool not reset");
+
+  /* pool can be used after destroy */
+  obj = pool_alloc(&pool);
+  fail_unless(obj != NULL, "Allocation failed");
+  pool_free(&pool, obj);
+  pool_destroy(&pool);
+}
+END_TEST
+
+START_TEST(test_pool_reserve)
+{
+  struct pool pool = POOL_INITIALIZER("test", 1);
+  void* objects[POOL_SLAB_OBJECTS];
+  size_t i = 0;
+
+  fail_unless(pool_reserve(&pool, 10) == 0, "Reserve failed");
+  fail_unless(pool.total == 10, "Bad number of objects");
+
+  /* already enough free objects */
+  fail_unless(pool_reserve(&pool, 5) == 0, "Reserve failed");
+  fail_unless(pool.total == 10, "Bad number of objects");
+
+  for(i = 0 ; i < 10 ; i++)
+  {
+    objects[i] = pool_alloc(&pool);
+  }
+  fail_unless(pool.total == 10, "Pool has grown");
+
+  /* objects are given in address order */
+  for(i = 1 ; i < 10 ; i++)
+  {
+    fail_unless((char*)objects[i] > (char*)objects[i - 1],
+        "Objects not contiguous");
+  }
+
+  /* reserve counts free objects only */
+  fail_unless(pool_reserve(&pool, 4) == 0, "Reserve failed");
+  fail_unless(pool.total == 14, "Bad number of objects");
+
+  /* small objects can hold the free list link */
+  objects[10] = pool_alloc(&pool);
+  fail_unless(objects[10] != NULL, "Allocation failed");
+
+  for(i = 0 ; i < 11 ; i++)
+  {
+    pool_free(&pool, objects[i]);
+  }
+
+  fail_unless(pool.used == 0, "Bad number of used objects");
+  fail_unless(pool.high_water == 11, "Bad high-water mark");
+  pool_destroy(&pool);
+}
+END_TEST
+
+Suite* pool_suite(void)
+{
+  Suite* s = suite_create("Pool tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_pool_alloc);
+  tcase_add_test(tc_core, test_pool_reserve);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = pool_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
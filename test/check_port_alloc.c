@@ -0,0 +1,147 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file check_port_alloc.c
+ * \brief Unit tests for relayed port allocator.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <check.h>
+
+#include "../src/port_alloc.h"
+
+START_TEST(test_port_alloc_range)
+{
+  struct port_alloc pa;
+  uint16_t port = 0;
+  size_t i = 0;
+  char seen[21] = {0};
+
+  /* range not aligned on a word */
+  fail_unless(port_alloc_init(&pa, 49155, 49175) == 0, "Init failed");
+  fail_unless(port_alloc_available(&pa) == 21, "Bad number of ports");
+
+  for(i = 0 ; i < 21 ; i++)
+  {
+    port = port_alloc_get(&pa, 0);
+    fail_unless(port >= 49155 && port <= 49175, "Port out of range");
+    fail_unless(!seen[port - 49155], "Port allocated twice");
+    seen[port - 49155] = 1;
+  }
+
+  /* exhaustion */
+  fail_unless(port_alloc_available(&pa) == 0, "Bad number of ports");
+  fail_unless(port_alloc_get(&pa, 0) == 0, "Range not exhausted");
+
+  port_alloc_release(&pa, 49160);
+  port_alloc_release(&pa, 49160);
+  port_alloc_release(&pa, 40000);
+  fail_unless(port_alloc_available(&pa) == 1, "Bad release");
+  fail_unless(port_alloc_get(&pa, 0) == 49160, "Released port not reused");
+
+  port_alloc_destroy(&pa);
+
+  /* top of the port space */
+  fail_unless(port_alloc_init(&pa, 65534, 65535) == 0, "Init failed");
+  fail_unless(port_alloc_get(&pa, PORT_ALLOC_PAIR) == 65534, "Bad pair");
+  fail_unless(port_alloc_get(&pa, 0) == 0, "Range not exhausted");
+  port_alloc_destroy(&pa);
+
+  fail_unless(port_alloc_init(&pa, 2000, 1000) == -1, "Bad range accepted");
+}
+END_TEST
+
+START_TEST(test_port_alloc_even)
+{
+  struct port_alloc pa;
+  uint16_t port = 0;
+
+  fail_unless(port_alloc_init(&pa, 49153, 49160) == 0, "Init failed");
+
+  /* use 49154 and 49157, free pairs are 49158/49159 only */
+  fail_unless(port_alloc_take(&pa, 49154) == 0, "Take failed");
+  fail_unless(port_alloc_take(&pa, 49154) == -1, "Port taken twice");
+  fail_unless(port_alloc_take(&pa, 49157) == 0, "Take failed");
+  fail_unless(port_alloc_take(&pa, 49161) == -1, "Out of range taken");
+
+  port = port_alloc_get(&pa, PORT_ALLOC_PAIR);
+  fail_unless(port == 49158, "Bad pair");
+  fail_unless(port_alloc_available(&pa) == 4, "Bad number of ports");
+  fail_unless(port_alloc_get(&pa, PORT_ALLOC_PAIR) == 0, "No pair expected");
+
+  /* 49156 is the last even port, 49160 has no odd port in range */
+  port = port_alloc_get(&pa, PORT_ALLOC_EVEN);
+  fail_unless(port == 49156 || port == 49160, "Bad even port");
+  port = port_alloc_get(&pa, PORT_ALLOC_EVEN);
+  fail_unless(port == 49156 || port == 49160, "Bad even port");
+  fail_unless(port_alloc_get(&pa, PORT_ALLOC_EVEN) == 0, "No even expected");
+
+  /* the odd ports are still free */
+  fail_unless(port_alloc_get(&pa, 0) == 49153, "Bad port");
+  fail_unless(port_alloc_get(&pa, 0) == 49155, "Bad port");
+  fail_unless(port_alloc_get(&pa, 0) == 0, "Range not exhausted");
+
+  port_alloc_destroy(&pa);
+}
+END_TEST
+
+Suite* port_alloc_suite(void)
+{
+  Suite* s = suite_create("Port allocator tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_port_alloc_range);
+  tcase_add_test(tc_core, test_port_alloc_even);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = port_alloc_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
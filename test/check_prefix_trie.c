@@ -0,0 +1,246 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file check_prefix_trie.c
+ * \brief Unit tests for prefix trie.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../src/prefix_trie.h"
+
+/**
+ * \struct prefix
+ * \brief Prefix for the reference matching.
+ */
+struct prefix
+{
+  int family; /**< AF_INET or AF_INET6 */
+  uint8_t addr[16]; /**< Network address */
+  uint8_t len; /**< Prefix length */
+  uint16_t port; /**< Port (0 for all) */
+};
+
+/**
+ * \brief Reference matching (linear scan).
+ * \param prefixes prefixes
+ * \param nb number of prefixes
+ * \param addr address
+ * \param addrlen address length
+ * \param port port
+ * \return 1 if address matches, 0 otherwise
+ */
+static int prefix_match(const struct prefix* prefixes, size_t nb,
+    const uint8_t* addr, size_t addrlen, uint16_t port)
+{
+  size_t i = 0;
+
+  for(i = 0 ; i < nb ; i++)
+  {
+    size_t bit = 0;
+    int diff = 0;
+
+    if((prefixes[i].family == AF_INET) != (addrlen == 4))
+    {
+      continue;
+    }
+
+    for(bit = 0 ; bit < prefixes[i].len ; bit++)
+    {
+      uint8_t mask = 0x80 >> (bit % 8);
+
+      if((prefixes[i].addr[bit / 8] & mask) != (addr[bit / 8] & mask))
+      {
+        diff = 1;
+        break;
+      }
+    }
+
+    if(!diff && (prefixes[i].port == 0 || prefixes[i].port == port))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+START_TEST(test_prefix_trie_match)
+{
+  struct prefix_trie* trie = NULL;
+  uint8_t addr[16];
+
+  trie = prefix_trie_new();
+  fail_unless(trie != NULL, "Memory problem");
+
+  inet_pton(AF_INET, "10.0.0.0", addr);
+  fail_unless(prefix_trie_add(trie, AF_INET, addr, 8, 0) == 0, "Add failed");
+  inet_pton(AF_INET, "192.168.1.7", addr);
+  fail_unless(prefix_trie_add(trie, AF_INET, addr, 32, 5060) == 0,
+      "Add failed");
+  inet_pton(AF_INET6, "2001:db8::", addr);
+  fail_unless(prefix_trie_add(trie, AF_INET6, addr, 33, 0) == 0,
+      "Add failed");
+  fail_unless(prefix_trie_add(trie, AF_INET, addr, 33, 0) == -1,
+      "Add success with bad prefix length");
+
+  inet_pton(AF_INET, "10.42.1.2", addr);
+  fail_unless(prefix_trie_match(trie, addr, 4, 1234), "10.0.0.0/8 no match");
+  inet_pton(AF_INET, "11.42.1.2", addr);
+  fail_unless(!prefix_trie_match(trie, addr, 4, 1234), "11.42.1.2 match");
+
+  inet_pton(AF_INET, "192.168.1.7", addr);
+  fail_unless(prefix_trie_match(trie, addr, 4, 5060), "Port no match");
+  fail_unless(!prefix_trie_match(trie, addr, 4, 5061), "Other port match");
+
+  inet_pton(AF_INET6, "2001:db8:7fff::1", addr);
+  fail_unless(prefix_trie_match(trie, addr, 16, 0), "2001:db8::/33 no match");
+  inet_pton(AF_INET6, "2001:db8:8000::1", addr);
+  fail_unless(!prefix_trie_match(trie, addr, 16, 0), "2001:db8:8000:: match");
+
+  /* IPv4 prefix does not match IPv6 address */
+  memset(addr, 0x00, 16);
+  addr[0] = 10;
+  fail_unless(!prefix_trie_match(trie, addr, 16, 0), "IPv6 address match");
+
+  prefix_trie_free(&trie);
+  fail_unless(trie == NULL, "prefix_trie_free does not set to NULL!");
+}
+END_TEST
+
+START_TEST(test_prefix_trie_random)
+{
+  struct prefix prefixes[2000];
+  struct prefix_trie* trie = NULL;
+  size_t i = 0;
+  size_t j = 0;
+
+  srand(42);
+  trie = prefix_trie_new();
+  fail_unless(trie != NULL, "Memory problem");
+
+  for(i = 0 ; i < 2000 ; i++)
+  {
+    struct prefix* p = &prefixes[i];
+
+    p->family = (i % 3) ? AF_INET : AF_INET6;
+    p->len = rand() % (p->family == AF_INET ? 33 : 129);
+    p->port = (i % 7) ? 0 : (uint16_t)(1 + rand() % 4);
+
+    /* avoid short prefixes which would match nearly everything */
+    if(p->len < 12)
+    {
+      p->len += 12;
+    }
+
+    /* keep prefixes in a small part of the space so that they overlap */
+    for(j = 0 ; j < 16 ; j++)
+    {
+      p->addr[j] = (uint8_t)rand();
+    }
+    p->addr[0] &= 0x0f;
+
+    fail_unless(prefix_trie_add(trie, p->family, p->addr, p->len, p->port) ==
+        0, "Add failed");
+  }
+
+  for(i = 0 ; i < 200000 ; i++)
+  {
+    uint8_t addr[16];
+    size_t addrlen = (i % 2) ? 4 : 16;
+    uint16_t port = (uint16_t)(rand() % 5);
+
+    if(i % 4 < 2)
+    {
+      /* random address */
+      for(j = 0 ; j < 16 ; j++)
+      {
+        addr[j] = (uint8_t)rand();
+      }
+      addr[0] &= 0x0f;
+    }
+    else
+    {
+      /* address near a prefix */
+      const struct prefix* p = &prefixes[rand() % 2000];
+
+      memcpy(addr, p->addr, 16);
+      addrlen = p->family == AF_INET ? 4 : 16;
+      addr[rand() % addrlen] ^= (uint8_t)(1 << (rand() % 8));
+    }
+
+    fail_unless(prefix_trie_match(trie, addr, addrlen, port) ==
+        prefix_match(prefixes, 2000, addr, addrlen, port),
+        "Trie and linear matching differ");
+  }
+
+  prefix_trie_free(&trie);
+}
+END_TEST
+
+Suite* prefix_trie_suite(void)
+{
+  Suite* s = suite_create("Prefix trie tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_prefix_trie_match);
+  tcase_add_test(tc_core, test_prefix_trie_random);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = prefix_trie_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
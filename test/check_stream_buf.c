@@ -0,0 +1,172 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file check_stream_buf.c
+ * \brief Unit tests for stream buffer.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "../src/stream_buf.h"
+
+START_TEST(test_stream_buf_inplace)
+{
+  struct pool pool = POOL_INITIALIZER("test", 64);
+  struct stream_buf buf;
+  size_t avail = 0;
+  char* space = NULL;
+
+  memset(&buf, 0x00, sizeof(struct stream_buf));
+
+  /* a chunk is taken from the pool */
+  space = stream_buf_reserve(&buf, &pool, 1, &avail);
+  fail_unless(space != NULL && avail == 64, "Bad reserve");
+  fail_unless(pool.used == 1, "Chunk not taken from the pool");
+
+  /* two frames and the beginning of a third one received at once */
+  memset(space, 'a', 20);
+  memset(space + 20, 'b', 20);
+  memset(space + 40, 'c', 10);
+  stream_buf_commit(&buf, 50);
+  fail_unless(stream_buf_len(&buf) == 50, "Bad length");
+
+  stream_buf_consume(&buf, 20);
+  fail_unless(stream_buf_data(&buf)[0] == 'b', "Bad data");
+  stream_buf_consume(&buf, 20);
+  fail_unless(stream_buf_data(&buf) == space + 40, "Data moved");
+
+  /* enough room at the end, data is not moved */
+  space = stream_buf_reserve(&buf, &pool, 10, &avail);
+  fail_unless(space == buf.data + 50 && avail == 14, "Bad reserve");
+
+  /* the incomplete frame is moved to the beginning */
+  space = stream_buf_reserve(&buf, &pool, 20, &avail);
+  fail_unless(space == buf.data + 10 && avail == 54, "Bad reserve");
+  fail_unless(stream_buf_data(&buf) == buf.data && buf.data[9] == 'c',
+      "Bad data");
+  memset(space, 'c', 10);
+  stream_buf_commit(&buf, 10);
+  stream_buf_consume(&buf, 20);
+  fail_unless(stream_buf_len(&buf) == 0 && buf.end == 0, "Not empty");
+
+  /* empty buffer is given back */
+  stream_buf_shrink(&buf, &pool);
+  fail_unless(buf.data == NULL && pool.used == 0, "Chunk not given back");
+
+  pool_destroy(&pool);
+}
+END_TEST
+
+START_TEST(test_stream_buf_grow)
+{
+  struct pool pool = POOL_INITIALIZER("test", 64);
+  struct stream_buf buf;
+  char frame[1000];
+  size_t avail = 0;
+  char* space = NULL;
+  size_t i = 0;
+
+  memset(&buf, 0x00, sizeof(struct stream_buf));
+
+  for(i = 0 ; i < sizeof(frame) ; i++)
+  {
+    frame[i] = (char)i;
+  }
+
+  /* beginning of a large frame */
+  fail_unless(stream_buf_append(&buf, &pool, frame, 30) == 0, "Append failed");
+  stream_buf_consume(&buf, 10);
+
+  /* buffer grows for the rest of the frame, pending data is kept */
+  space = stream_buf_reserve(&buf, &pool, sizeof(frame) - 30, &avail);
+  fail_unless(space != NULL && avail >= sizeof(frame) - 30, "Bad reserve");
+  fail_unless(buf.size == 1024 && pool.used == 0, "Bad size");
+  fail_unless(memcmp(stream_buf_data(&buf), frame + 10, 20) == 0,
+      "Data lost");
+
+  fail_unless(stream_buf_append(&buf, &pool, frame + 30, sizeof(frame) - 30)
+      == 0, "Append failed");
+  fail_unless(stream_buf_len(&buf) == sizeof(frame) - 10, "Bad length");
+  fail_unless(memcmp(stream_buf_data(&buf), frame + 10, sizeof(frame) - 10)
+      == 0, "Bad data");
+
+  /* large buffer released when empty */
+  stream_buf_consume(&buf, sizeof(frame) - 10);
+  stream_buf_shrink(&buf, &pool);
+  fail_unless(buf.data == NULL, "Buffer not released");
+
+  /* maximum size */
+  fail_unless(stream_buf_reserve(&buf, &pool, STREAM_BUF_MAX_SIZE, &avail)
+      != NULL && avail == STREAM_BUF_MAX_SIZE, "Bad reserve");
+  stream_buf_commit(&buf, 1);
+  fail_unless(stream_buf_reserve(&buf, &pool, STREAM_BUF_MAX_SIZE, &avail)
+      == NULL, "Maximum size exceeded");
+
+  stream_buf_free(&buf, &pool);
+  fail_unless(buf.data == NULL && stream_buf_len(&buf) == 0, "Not freed");
+  pool_destroy(&pool);
+}
+END_TEST
+
+Suite* stream_buf_suite(void)
+{
+  Suite* s = suite_create("Stream buffer tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_stream_buf_inplace);
+  tcase_add_test(tc_core, test_stream_buf_grow);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = stream_buf_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
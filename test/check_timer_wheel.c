@@ -0,0 +1,214 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+/**
+ * \file check_timer_wheel.c
+ * \brief Unit tests for timer wheel.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "../src/timer_wheel.h"
+
+/**
+ * \var g_expired
+ * \brief Timers expired in order.
+ */
+static struct timer_entry* g_expired[16];
+
+/**
+ * \var g_expired_nb
+ * \brief Number of expired timers.
+ */
+static size_t g_expired_nb = 0;
+
+/**
+ * \brief Record expired timers.
+ * \param entry timer
+ */
+static void timer_expired(struct timer_entry* entry)
+{
+  if(g_expired_nb < sizeof(g_expired) / sizeof(g_expired[0]))
+  {
+    g_expired[g_expired_nb] = entry;
+  }
+  g_expired_nb++;
+}
+
+START_TEST(test_timer_wheel_add)
+{
+  struct timer_wheel wheel;
+  struct timer_entry t1;
+  struct timer_entry t2;
+  struct timer_entry t3;
+  int data = 0;
+
+  g_expired_nb = 0;
+  timer_wheel_init(&wheel, 100000, 100, timer_expired);
+
+  timer_entry_init(&t1, 1, &data);
+  timer_entry_init(&t2, 2, NULL);
+  timer_entry_init(&t3, 3, NULL);
+  fail_unless(!timer_entry_is_pending(&t1), "Timer pending after init");
+  fail_unless(t1.type == 1 && t1.data == &data, "Bad timer initialization");
+
+  timer_wheel_add(&wheel, &t1, 1000);
+  timer_wheel_add(&wheel, &t2, 250);
+  timer_wheel_add(&wheel, &t3, 500);
+  fail_unless(timer_entry_is_pending(&t1), "Timer not pending");
+  fail_unless(wheel.count == 3, "Bad number of pending timers");
+  fail_unless(timer_wheel_remaining(&wheel, &t1) == 1000, "Bad remaining");
+  /* rounded up to tick */
+  fail_unless(timer_wheel_remaining(&wheel, &t2) == 300, "Bad remaining");
+
+  /* nothing expires too early */
+  fail_unless(timer_wheel_run(&wheel, 100299) == 0, "Timer expires early");
+
+  /* remove one timer */
+  timer_wheel_del(&wheel, &t3);
+  fail_unless(!timer_entry_is_pending(&t3), "Timer pending after removal");
+  timer_wheel_del(&wheel, &t3);
+  fail_unless(wheel.count == 2, "Bad number of pending timers");
+
+  fail_unless(timer_wheel_run(&wheel, 100300) == 1, "Timer does not expire");
+  fail_unless(g_expired[0] == &t2, "Bad expired timer");
+  fail_unless(!timer_entry_is_pending(&t2), "Timer pending after expiration");
+
+  /* change expiration */
+  timer_wheel_add(&wheel, &t1, 5000);
+  fail_unless(wheel.count == 1, "Bad number of pending timers");
+  fail_unless(timer_wheel_run(&wheel, 101500) == 0, "Timer expires early");
+  fail_unless(timer_wheel_run(&wheel, 105400) == 1, "Timer does not expire");
+  fail_unless(g_expired[1] == &t1, "Bad expired timer");
+  fail_unless(wheel.count == 0, "Bad number of pending timers");
+}
+END_TEST
+
+START_TEST(test_timer_wheel_cascade)
+{
+  struct timer_wheel wheel;
+  struct timer_entry t[4];
+  /* timeouts (in ticks) that use the different wheels */
+  uint64_t timeouts[4] = {1000000, 7, 70000, 300};
+  uint64_t now = 0;
+  size_t i = 0;
+
+  g_expired_nb = 0;
+  timer_wheel_init(&wheel, 0, 1, timer_expired);
+
+  for(i = 0 ; i < 4 ; i++)
+  {
+    timer_entry_init(&t[i], 0, NULL);
+    timer_wheel_add(&wheel, &t[i], timeouts[i]);
+  }
+
+  /* run tick per tick until last timer expires */
+  for(now = 0 ; now <= 1000000 ; now++)
+  {
+    size_t nb = g_expired_nb;
+
+    timer_wheel_run(&wheel, now);
+
+    for(i = 0 ; i < 4 ; i++)
+    {
+      if(now == timeouts[i])
+      {
+        fail_unless(g_expired_nb == nb + 1 && g_expired[nb] == &t[i],
+            "Timer does not expire at the right tick");
+      }
+    }
+  }
+
+  fail_unless(g_expired_nb == 4, "Bad number of expired timers");
+  fail_unless(wheel.count == 0, "Bad number of pending timers");
+}
+END_TEST
+
+START_TEST(test_timer_wheel_jump)
+{
+  struct timer_wheel wheel;
+  struct timer_entry t1;
+  struct timer_entry t2;
+
+  g_expired_nb = 0;
+  timer_wheel_init(&wheel, 0, 100, timer_expired);
+
+  timer_entry_init(&t1, 0, NULL);
+  timer_entry_init(&t2, 0, NULL);
+  timer_wheel_add(&wheel, &t1, 3600 * 1000);
+  timer_wheel_add(&wheel, &t2, 600 * 1000);
+
+  /* event loop did not run for a long time */
+  fail_unless(timer_wheel_run(&wheel, 7200 * 1000) == 2,
+      "Timers do not expire");
+  fail_unless(g_expired[0] == &t2 && g_expired[1] == &t1,
+      "Bad order of expiration");
+
+  /* timer longer than the wheels is truncated */
+  timer_wheel_add(&wheel, &t1, (uint64_t)-1 / 2);
+  fail_unless(timer_entry_is_pending(&t1), "Timer not pending");
+  timer_wheel_del(&wheel, &t1);
+  fail_unless(wheel.count == 0, "Bad number of pending timers");
+}
+END_TEST
+
+Suite* timer_wheel_suite(void)
+{
+  Suite* s = suite_create("Timer wheel tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_timer_wheel_add);
+  tcase_add_test(tc_core, test_timer_wheel_cascade);
+  tcase_add_test(tc_core, test_timer_wheel_jump);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = timer_wheel_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+/*
+ *  TurnServer - TURN server implementation.
+ *  Copyright (C) 2008-2009 Sebastien Vincent <sebastien.vincent@turnserver.org>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  In addition, as a special exception, the copyright holders give
+ *  permission to link the code of portions of this program with the
+ *  OpenSSL library under certain conditions as described in each
+ *  individual source file, and distribute linked combinations
+ *  including the two.
+ *  You must obey the GNU General Public License in all respects
+ *  for all of the code used other than OpenSSL.  If you modify
+ *  file(s) with this exception, you may extend this exception to your
+ *  version of the file(s), but you are not obligated to do so.  If you
+ *  do not wish to do so, delete this exception statement from your
+ *  version.  If you delete this exception statement from all source
+ *  files in the program, then also delete it here.
+ */
+
+
+/**
+ * \file check_token_bucket.c
+ * \brief Unit tests for token bucket.
+ * \author Sebastien Vincent
+ * \date 2013
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "../src/token_bucket.h"
+
+START_TEST(test_token_bucket_rate)
+{
+  struct token_bucket bucket;
+  uint64_t now = 1000;
+  size_t total = 0;
+  size_t i = 0;
+
+  /* 10000 bytes/s, burst of 1000 bytes */
+  token_bucket_init(&bucket, 10000, 1000, NULL, now);
+
+  fail_unless(token_bucket_consume(&bucket, 1000, now) == 0,
+      "Burst refused");
+  fail_unless(token_bucket_consume(&bucket, 1, now) == -1,
+      "Empty bucket accepted");
+
+  /* 10 bytes each millisecond */
+  fail_unless(token_bucket_delay(&bucket, 100, now) == 10, "Bad delay");
+  fail_unless(token_bucket_consume(&bucket, 100, now + 9) == -1,
+      "Tokens available too early");
+  fail_unless(token_bucket_consume(&bucket, 100, now + 10) == 0,
+      "Tokens not refilled");
+  fail_unless(token_bucket_delay(&bucket, 0, now + 10) == 0, "Bad delay");
+
+  /* clock goes backward: nothing is refilled */
+  fail_unless(token_bucket_consume(&bucket, 1, now) == -1,
+      "Tokens refilled");
+
+  /* capacity is not exceeded after a long idle time */
+  now += 1000000000;
+  fail_unless(token_bucket_consume(&bucket, 1001, now) == -1,
+      "Capacity exceeded");
+  fail_unless(token_bucket_consume(&bucket, 1000, now) == 0, "Burst refused");
+
+  /* one second of traffic sent in small packets */
+  for(i = 1 ; i <= 1000 ; i++)
+  {
+    if(token_bucket_consume(&bucket, 13, now + i) == 0)
+    {
+      total += 13;
+    }
+  }
+
+  fail_unless(total <= 10000 && total >= 10000 - 13, "Bad rate");
+}
+END_TEST
+
+START_TEST(test_token_bucket_fraction)
+{
+  struct token_bucket bucket;
+  size_t total = 0;
+  size_t i = 0;
+
+  /* 300 bytes/s is less than one byte each millisecond */
+  token_bucket_init(&bucket, 300, 0, NULL, 0);
+  fail_unless(token_bucket_consume(&bucket, 300, 0) == 0, "Burst refused");
+
+  for(i = 1 ; i <= 10000 ; i++)
+  {
+    if(token_bucket_consume(&bucket, 1, i) == 0)
+    {
+      total++;
+    }
+  }
+
+  /* fractions of token are not lost */
+  fail_unless(total >= 2990 && total <= 3000, "Bad rate for low rate");
+}
+END_TEST
+
+START_TEST(test_token_bucket_hierarchy)
+{
+  struct token_bucket server;
+  struct token_bucket account;
+  struct token_bucket alloc1;
+  struct token_bucket alloc2;
+
+  token_bucket_init(&server, 3000, 0, NULL, 0);
+  memset(&account, 0x00, sizeof(struct token_bucket));
+  account.parent = &server;
+  token_bucket_init(&alloc1, 2000, 0, &account, 0);
+  token_bucket_init(&alloc2, 2000, 0, &account, 0);
+
+  /* no limit for the account, the server one applies */
+  fail_unless(token_bucket_consume(&alloc1, 2000, 0) == 0, "Burst refused");
+  fail_unless(token_bucket_consume(&alloc2, 1500, 0) == -1,
+      "Server limit exceeded");
+  fail_unless(alloc2.tokens == alloc2.capacity,
+      "Tokens taken from a level while another is exceeded");
+  fail_unless(token_bucket_consume(&alloc2, 1000, 0) == 0, "Tokens refused");
+  fail_unless(token_bucket_delay(&alloc2, 1, 0) == 1, "Bad delay");
+
+  /* account limit shared by its allocations */
+  token_bucket_init(&server, 0, 0, NULL, 0);
+  token_bucket_init(&account, 1000, 0, &server, 0);
+  token_bucket_init(&alloc1, 2000, 0, &account, 0);
+  token_bucket_init(&alloc2, 2000, 0, &account, 0);
+  fail_unless(token_bucket_consume(&alloc1, 600, 0) == 0, "Tokens refused");
+  fail_unless(token_bucket_consume(&alloc2, 600, 0) == -1,
+      "Account limit exceeded");
+  fail_unless(token_bucket_consume(&alloc2, 400, 0) == 0, "Tokens refused");
+}
+END_TEST
+
+START_TEST(test_token_bucket_debt)
+{
+  struct token_bucket account;
+  struct token_bucket alloc;
+
+  token_bucket_init(&account, 1000, 0, NULL, 0);
+  token_bucket_init(&alloc, 10000, 0, &account, 0);
+
+  /* paced traffic goes beyond the tokens */
+  token_bucket_charge(&alloc, 1500, 0);
+  fail_unless(account.tokens < 0, "No debt");
+
+  /* debt is paid back before sending again */
+  fail_unless(token_bucket_delay(&alloc, 1, 0) == 501, "Bad delay");
+  fail_unless(token_bucket_delay(&alloc, 1, 500) == 1, "Bad delay");
+  fail_unless(token_bucket_available(&alloc, 500) == 0, "Bad available");
+  fail_unless(token_bucket_delay(&alloc, 1, 501) == 0, "Bad delay");
+  fail_unless(token_bucket_consume(&alloc, 1, 501) == 0, "Tokens refused");
+  fail_unless(token_bucket_available(&alloc, 600) == 99, "Bad available");
+
+  /* no limit */
+  memset(&alloc, 0x00, sizeof(struct token_bucket));
+  token_bucket_charge(&alloc, 100000, 0);
+  fail_unless(token_bucket_delay(&alloc, 100000, 0) == 0, "Bad delay");
+  fail_unless(token_bucket_consume(&alloc, 100000, 0) == 0, "Tokens refused");
+  fail_unless(token_bucket_available(&alloc, 0) == SIZE_MAX,
+      "Bad available");
+}
+END_TEST
+
+Suite* token_bucket_suite(void)
+{
+  Suite* s = suite_create("Token bucket tests");
+
+  /* Core test case */
+  TCase* tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_token_bucket_rate);
+  tcase_add_test(tc_core, test_token_bucket_fraction);
+  tcase_add_test(tc_core, test_token_bucket_hierarchy);
+  tcase_add_test(tc_core, test_token_bucket_debt);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
+
+int main(void)
+{
+  unsigned int number_failed = 0;
+
+  Suite* s = token_bucket_suite();
+  SRunner* sr = srunner_create(s);
+
+  srunner_run_all(sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed(sr);
+  srunner_free(sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
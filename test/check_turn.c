@@ -48,8 +48,10 @@
 #include <netinet/tcp.h>
 
 #include "../src/util_sys.h"
+#include "../src/util_crypto.h"
 #include "../src/turn.h"
 #include "../src/protocol.h"
+#include "../src/nonce.h"
 
 START_TEST(test_attr_create)
 {
@@ -126,10 +128,15 @@ START_TEST(test_attr_create)
   {
     unsigned char* key = "Calamar power";
     size_t len = strlen(key);
-    uint8_t nonce_value[48];
+    uint8_t nonce_value[NONCE_LEN];
+    struct nonce_ctx* ctx = malloc(sizeof(struct nonce_ctx));
 
-    nb = turn_generate_nonce(nonce_value, sizeof(nonce_value), key, len);
-    fail_unless(nb == 0, "generate nonce failed");
+    fail_unless(ctx != NULL, "nonce context allocation failed");
+    nb = nonce_ctx_init(ctx, key, len, 3600, 0);
+    fail_unless(nb == 0, "nonce context initialization failed");
+    nb = nonce_generate(ctx, time(NULL), nonce_value, sizeof(nonce_value));
+    fail_unless(nb == NONCE_LEN, "generate nonce failed");
+    free(ctx);
 
     attr = turn_attr_nonce_create(nonce_value, sizeof(nonce_value),
         &iov[index]);
@@ -689,6 +696,268 @@ START_TEST(test_message_parse)
 }
 END_TEST
 
+START_TEST(test_msg_builder)
+{
+  struct turn_message message;
+  struct turn_msg_builder builder;
+  struct sockaddr_in daddr;
+  uint8_t buf[TURN_MSG_BUILDER_SIZE];
+  uint8_t small_buf[32];
+  uint8_t id[12];
+  uint8_t hash[20];
+  uint16_t tab[16];
+  size_t tab_size = 16;
+  unsigned char md_buf[16];
+  uint16_t unknown[3] = {0x0002, 0x0001, 0x0003};
+  uint32_t crc = 0;
+  int nb = 0;
+
+  nb = turn_generate_transaction_id(id);
+  fail_unless(nb == 0, "Failed to generate transaction ID.");
+
+  daddr.sin_family = AF_INET;
+  daddr.sin_addr.s_addr = inet_addr("192.168.0.1");
+  daddr.sin_port = htons(444);
+  memset(daddr.sin_zero, 0x00, sizeof(daddr.sin_zero));
+
+  crypto_md5_generate(md_buf, "login:domain.org:password",
+      strlen("login:domain.org:password"));
+
+  nb = turn_msg_builder_init(&builder, buf, sizeof(buf),
+      TURN_METHOD_ALLOCATE | STUN_ERROR_RESP, id);
+  fail_unless(nb == 0, "builder initialization failed");
+  fail_unless(builder.len == sizeof(struct turn_msg_hdr), "bad header length");
+
+  nb = turn_msg_builder_add_xor_address(&builder, STUN_ATTR_XOR_MAPPED_ADDRESS,
+      (struct sockaddr*)&daddr);
+  fail_unless(nb == 0, "xor-mapped-address failed");
+  nb = turn_msg_builder_add_error(&builder, 420, STUN_ERROR_420,
+      sizeof(STUN_ERROR_420));
+  fail_unless(nb == 0, "error-code failed");
+  nb = turn_msg_builder_add_unknown_attributes(&builder, unknown,
+      sizeof(unknown) / sizeof(uint16_t));
+  fail_unless(nb == 0, "unknown-attributes failed");
+  nb = turn_msg_builder_add_realm(&builder, "heyrealm", strlen("heyrealm"));
+  fail_unless(nb == 0, "realm failed");
+  nb = turn_msg_builder_add_lifetime(&builder, 0xDEADBEEF);
+  fail_unless(nb == 0, "lifetime failed");
+  nb = turn_msg_builder_add_software(&builder, "Client TURN 0.1 test",
+      strlen("Client TURN 0.1 test"));
+  fail_unless(nb == 0, "software failed");
+  nb = turn_msg_builder_add_message_integrity(&builder, md_buf,
+      sizeof(md_buf));
+  fail_unless(nb == 0, "message-integrity failed");
+  nb = turn_msg_builder_add_fingerprint(&builder);
+  fail_unless(nb == 0, "fingerprint failed");
+
+  /* message length is kept in network byte order and up to date */
+  fail_unless(ntohs(builder.hdr->turn_msg_len) + sizeof(struct turn_msg_hdr)
+      == builder.len, "bad message length");
+  fail_unless((builder.len % 4) == 0, "message is not padded");
+
+  nb = turn_parse_message((char*)buf, builder.len, &message, tab, &tab_size);
+  fail_unless(nb == 0, "message parsing failed");
+  fail_unless(message.xor_mapped_addr != NULL,
+      "xor_mapped_addr must be present");
+  fail_unless(message.error_code != NULL, "error_code must be present");
+  fail_unless(message.unknown_attribute != NULL,
+      "unknown_attribute must be present");
+  fail_unless(ntohs(message.unknown_attribute->turn_attr_len) ==
+      sizeof(unknown), "unknown_attribute length must be in bytes");
+  fail_unless(message.realm != NULL, "realm must be present");
+  fail_unless(message.lifetime != NULL, "lifetime must be present");
+  fail_unless(ntohl(message.lifetime->turn_attr_lifetime) == 0xDEADBEEF,
+      "bad lifetime value");
+  fail_unless(message.software != NULL, "software must be present");
+  fail_unless(message.message_integrity != NULL,
+      "message_integrity must be present");
+  fail_unless(message.fingerprint != NULL, "fingerprint must be present");
+
+  /* check FINGERPRINT */
+  crc = crypto_crc32_generate(buf,
+      builder.len - sizeof(struct turn_attr_fingerprint), 0);
+  fail_unless(htonl(crc) == (message.fingerprint->turn_attr_crc ^
+        htonl(STUN_FINGERPRINT_XOR_VALUE)), "bad fingerprint");
+
+  /* check MESSAGE-INTEGRITY, length must not include FINGERPRINT */
+  builder.hdr->turn_msg_len = htons(ntohs(builder.hdr->turn_msg_len) -
+      sizeof(struct turn_attr_fingerprint));
+  turn_calculate_integrity_hmac(buf, builder.len -
+      sizeof(struct turn_attr_fingerprint) -
+      sizeof(struct turn_attr_message_integrity), md_buf, sizeof(md_buf),
+      hash);
+  fail_unless(memcmp(hash, message.message_integrity->turn_attr_hmac,
+        sizeof(hash)) == 0, "bad message-integrity");
+
+  /* too small buffer */
+  nb = turn_msg_builder_init(&builder, small_buf, sizeof(small_buf),
+      TURN_METHOD_REFRESH | STUN_SUCCESS_RESP, id);
+  fail_unless(nb == 0, "builder initialization failed");
+  nb = turn_msg_builder_add_software(&builder, "Client TURN 0.1 test",
+      strlen("Client TURN 0.1 test"));
+  fail_unless(nb == -1, "buffer overflow not detected");
+  fail_unless(builder.len == sizeof(struct turn_msg_hdr),
+      "failed attribute must not change the message");
+  fail_unless(ntohs(builder.hdr->turn_msg_len) == 0,
+      "failed attribute must not change the message length");
+}
+END_TEST
+
+START_TEST(test_crc32)
+{
+  enum crypto_crc32_engine engines[] = {CRYPTO_CRC32_TABLE,
+    CRYPTO_CRC32_SLICE8, CRYPTO_CRC32_PCLMUL};
+  uint8_t buf[1024];
+  uint32_t ref[sizeof(buf) + 1];
+  const char* check = "123456789";
+  uint32_t seed = 0x12345678;
+  size_t i = 0;
+  size_t j = 0;
+
+  /* reference values with the one byte at a time engine */
+  fail_unless(crypto_crc32_engine_set(CRYPTO_CRC32_TABLE) == 0,
+      "table engine must be available");
+
+  for(i = 0 ; i < sizeof(buf) ; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = (seed >> 16) & 0xff;
+  }
+
+  for(i = 0 ; i <= sizeof(buf) ; i++)
+  {
+    ref[i] = crypto_crc32_generate(buf, i, 0);
+  }
+
+  for(i = 0 ; i < sizeof(engines) / sizeof(engines[0]) ; i++)
+  {
+    if(crypto_crc32_engine_set(engines[i]) == -1)
+    {
+      /* not supported by this CPU */
+      fail_unless(engines[i] == CRYPTO_CRC32_PCLMUL,
+          "portable engine not available");
+      continue;
+    }
+
+    /* known answer (ITU-T V.42 check value) */
+    fail_unless(crypto_crc32_generate((const uint8_t*)check, strlen(check),
+          0) == 0xcbf43926, "bad check value");
+
+    /* all lengths and an unaligned start */
+    for(j = 0 ; j <= sizeof(buf) ; j++)
+    {
+      fail_unless(crypto_crc32_generate(buf, j, 0) == ref[j],
+          "CRC-32 differs from the table engine");
+    }
+
+    for(j = 1 ; j < 16 ; j++)
+    {
+      fail_unless(crypto_crc32_generate(buf + j, sizeof(buf) - j,
+            crypto_crc32_generate(buf, j, 0)) == ref[sizeof(buf)],
+          "CRC-32 continuation failed");
+    }
+  }
+
+  crypto_crc32_init();
+}
+END_TEST
+
+START_TEST(test_integrity_key)
+{
+  struct crypto_hmac_sha1_key hkey;
+  struct turn_msg_builder builder;
+  struct turn_integrity_check checks[3];
+  uint8_t msgs[3][TURN_MSG_BUILDER_SIZE];
+  size_t lens[3];
+  uint8_t id[12];
+  uint8_t hash[20];
+  uint8_t hash2[20];
+  unsigned char key[80];
+  unsigned char md_buf[16];
+  /* RFC 2202 test cases 1 and 6 */
+  const uint8_t hmac1[20] = {0xb6, 0x17, 0x31, 0x86, 0x55, 0x05, 0x72, 0x64,
+    0xe2, 0x8b, 0xc0, 0xb6, 0xfb, 0x37, 0x8c, 0x8e, 0xf1, 0x46, 0xbe, 0x00};
+  const uint8_t hmac6[20] = {0xaa, 0x4a, 0xe5, 0xe1, 0x52, 0x72, 0xd0, 0x0e,
+    0x95, 0x70, 0x56, 0x37, 0xce, 0x8a, 0x3b, 0x55, 0xed, 0x40, 0x21, 0x12};
+  const char* text6 = "Test Using Larger Than Block-Size Key - Hash Key First";
+  size_t i = 0;
+  int nb = 0;
+
+  memset(key, 0x0b, 20);
+  fail_unless(crypto_hmac_sha1_key_init(&hkey, key, 20) == 0,
+      "key initialization failed");
+  fail_unless(crypto_hmac_sha1_key_generate(hash,
+        (const unsigned char*)"Hi There", 8, &hkey) == 0, "HMAC failed");
+  fail_unless(memcmp(hash, hmac1, 20) == 0, "bad HMAC (short key)");
+
+  memset(key, 0xaa, 80);
+  fail_unless(crypto_hmac_sha1_key_init(&hkey, key, 80) == 0,
+      "key initialization failed");
+  fail_unless(crypto_hmac_sha1_key_generate(hash,
+        (const unsigned char*)text6, strlen(text6), &hkey) == 0,
+      "HMAC failed");
+  fail_unless(memcmp(hash, hmac6, 20) == 0, "bad HMAC (long key)");
+
+  /* same result as the HMAC computed from the raw key */
+  crypto_md5_generate(md_buf, "login:domain.org:password",
+      strlen("login:domain.org:password"));
+  fail_unless(crypto_hmac_sha1_key_init(&hkey, md_buf, sizeof(md_buf)) == 0,
+      "key initialization failed");
+  turn_calculate_integrity_hmac((const unsigned char*)text6, strlen(text6),
+      md_buf, sizeof(md_buf), hash);
+  crypto_hmac_sha1_key_generate(hash2, (const unsigned char*)text6,
+      strlen(text6), &hkey);
+  fail_unless(memcmp(hash, hash2, 20) == 0, "HMAC differs from raw key");
+
+  /* messages with MESSAGE-INTEGRITY (and FINGERPRINT for the first two) */
+  for(i = 0 ; i < 3 ; i++)
+  {
+    nb = turn_generate_transaction_id(id);
+    fail_unless(nb == 0, "Failed to generate transaction ID.");
+
+    turn_msg_builder_init(&builder, msgs[i], sizeof(msgs[i]),
+        TURN_METHOD_REFRESH | STUN_SUCCESS_RESP, id);
+    turn_msg_builder_add_lifetime(&builder, 600);
+    fail_unless(turn_msg_builder_add_message_integrity_key(&builder,
+          &hkey) == 0, "MESSAGE-INTEGRITY failed");
+
+    /* the precomputed key gives the same attribute as the raw key */
+    turn_calculate_integrity_hmac(msgs[i],
+        builder.len - sizeof(struct turn_attr_message_integrity), md_buf,
+        sizeof(md_buf), hash);
+    fail_unless(memcmp(hash, msgs[i] + builder.len - 20, 20) == 0,
+        "bad MESSAGE-INTEGRITY");
+
+    checks[i].buf = msgs[i];
+    checks[i].len = builder.len - sizeof(struct turn_attr_message_integrity);
+    checks[i].hkey = &hkey;
+    checks[i].hmac = msgs[i] + builder.len - 20;
+    checks[i].valid = -1;
+
+    if(i < 2)
+    {
+      turn_msg_builder_add_fingerprint(&builder);
+    }
+    lens[i] = builder.len;
+  }
+
+  fail_unless(turn_verify_integrity(checks[0].buf, checks[0].len, &hkey,
+        checks[0].hmac) == 0, "valid message not verified");
+
+  /* tamper with the LIFETIME value of the second message */
+  msgs[1][sizeof(struct turn_msg_hdr) + 4] ^= 0x01;
+
+  fail_unless(turn_verify_integrity_batch(checks, 3) == 2,
+      "bad number of authentic messages");
+  fail_unless(checks[0].valid == 1 && checks[1].valid == 0 &&
+      checks[2].valid == 1, "bad batch verification");
+
+  /* verification does not modify the messages */
+  fail_unless(ntohs(((struct turn_msg_hdr*)msgs[0])->turn_msg_len) ==
+      lens[0] - sizeof(struct turn_msg_hdr), "message modified");
+}
+END_TEST
+
 Suite* turn_msg_suite(void)
 {
   Suite* s = suite_create("TURN messages and attributes tests");
@@ -698,6 +967,9 @@ Suite* turn_msg_suite(void)
   tcase_add_test(tc_core, test_msg_create);
   tcase_add_test(tc_core, test_attr_create);
   tcase_add_test(tc_core, test_message_parse);
+  tcase_add_test(tc_core, test_msg_builder);
+  tcase_add_test(tc_core, test_crc32);
+  tcase_add_test(tc_core, test_integrity_key);
   suite_add_tcase(s, tc_core);
 
   return s;